@@ -31,18 +31,33 @@ sed '
   /^compression ZLIB_CEILING$/d
   /^compression ZLIB_UINT_MAX$/d
   /^connections cgs$/d
+  /^connections mgs$/d
   /^crypt bctx$/d
   /^crypt crypto_initialized$/d
   /^crypt crypto_errs_initialized$/d
+  /^latency latency_tracing$/d
+  /^latency ls$/d
   /^main allow_kq$/d
   /^main daemon_mode$/d
+  /^main metrics_address$/d
+  /^main latency_file$/d
   /^main handle_signal_cb(int, short, void\*)::got_sigint$/d
   /^main pidfile_name$/d
   /^main registration_helper$/d
+  /^main sync_logs$/d
   /^main the_event_base$/d
+  /^metrics metrics$/d
+  /^metrics ms$/d
+  /^network cps$/d
   /^network listeners$/d
+  /^packet_trace traces$/d
   /^rng rng$/d
+  /^steg live_stegs$/d
   /^subprocess-unix already_waited$/d
+  /^target_stats tss$/d
+  /^timer_wheel tws$/d
+  /^util las$/d
+  /^util log_active_sev$/d
   /^util log_dest$/d
   /^util log_min_sev$/d
   /^util log_timestamps$/d
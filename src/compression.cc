@@ -104,3 +104,142 @@ decompress(const uint8_t *source, size_t slen, uint8_t *dest, size_t dlen)
   inflateEnd(&strm);
   return strm.total_out;
 }
+
+deflater_pool::deflater_pool(int level, size_t max_idle)
+  : compression_level(Z_DEFAULT_COMPRESSION), max_idle_streams(max_idle)
+{
+  if (!set_level(level))
+    log_warn("invalid compression level %d, using zlib default", level);
+}
+
+deflater_pool::~deflater_pool()
+{
+  drain_idle();
+}
+
+bool
+deflater_pool::set_level(int level)
+{
+  if (level != Z_DEFAULT_COMPRESSION &&
+      (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION))
+    return false;
+
+  if (level != compression_level) {
+    drain_idle();
+    compression_level = level;
+  }
+  return true;
+}
+
+size_t
+deflater_pool::compress_bound(size_t slen, compression_format fmt)
+{
+  // deflateBound() without a stream gives the zlib-wrapper bound;
+  // the gzip wrapper is 18 bytes against zlib's 6.
+  size_t bound = ::compressBound(slen);
+  if (fmt == c_format_gzip)
+    bound += 18 - 6;
+  return bound;
+}
+
+z_stream_s *
+deflater_pool::acquire(compression_format fmt)
+{
+  if (!idle[fmt].empty()) {
+    z_stream *strm = idle[fmt].back();
+    idle[fmt].pop_back();
+    if (deflateReset(strm) == Z_OK)
+      return strm;
+
+    deflateEnd(strm);
+    delete strm;
+  }
+
+  z_stream *strm = new z_stream;
+  memset(strm, 0, sizeof *strm);
+
+  int wbits = MAX_WBITS;
+  if (fmt == c_format_gzip)
+    wbits |= 16; // magic number 16 = compress as gzip
+
+  int ret = deflateInit2(strm, compression_level, Z_DEFLATED,
+                         wbits, 8, Z_DEFAULT_STRATEGY);
+  if (ret != Z_OK) {
+    log_warn("compression failure (initialization): %s", strm->msg);
+    delete strm;
+    return NULL;
+  }
+
+  return strm;
+}
+
+void
+deflater_pool::release(z_stream_s *strm, compression_format fmt)
+{
+  if (idle[fmt].size() < max_idle_streams) {
+    idle[fmt].push_back(strm);
+    return;
+  }
+
+  deflateEnd(strm);
+  delete strm;
+}
+
+void
+deflater_pool::drain_idle()
+{
+  for (size_t fmt = 0; fmt < sizeof idle / sizeof idle[0]; fmt++) {
+    for (z_stream *strm : idle[fmt]) {
+      deflateEnd(strm);
+      delete strm;
+    }
+    idle[fmt].clear();
+  }
+}
+
+ssize_t
+deflater_pool::compress(const uint8_t *source, size_t slen,
+                        uint8_t *dest, size_t dlen,
+                        compression_format fmt)
+{
+  log_assert(fmt == c_format_zlib || fmt == c_format_gzip);
+
+  if (slen > ZLIB_CEILING || dlen > ZLIB_CEILING)
+    return -1;
+
+  z_stream *strm = acquire(fmt);
+  if (!strm)
+    return -1;
+
+  // deflateReset() drops the gzip header, so it has to be set on
+  // every use, not just at initialization.
+  gz_header gzh;
+  if (fmt == c_format_gzip) {
+    memset(&gzh, 0, sizeof gzh);
+    gzh.os = 0xFF; // "unknown"
+    if (deflateSetHeader(strm, &gzh) != Z_OK) {
+      log_warn("compression failure (initialization): %s", strm->msg);
+      deflateEnd(strm);
+      delete strm;
+      return -1;
+    }
+  }
+
+  strm->next_in = const_cast<Bytef*>(source);
+  strm->avail_in = slen;
+  strm->next_out = dest;
+  strm->avail_out = dlen;
+
+  int ret = deflate(strm, Z_FINISH);
+  if (ret != Z_STREAM_END) {
+    log_warn("compression failure: %s", strm->msg);
+    // a stream that didn't reach the end is still usable after a
+    // reset, so it can go back to the pool.
+    release(strm, fmt);
+    return -1;
+  }
+
+  ssize_t total_out = strm->total_out;
+  release(strm, fmt);
+  return total_out;
+}
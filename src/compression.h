@@ -4,6 +4,10 @@
 #ifndef _COMPRESSION_H
 #define _COMPRESSION_H
 
+#include <vector>
+
+struct z_stream_s;
+
 enum compression_format {
   c_format_zlib = 0,
   c_format_gzip = 1
@@ -32,4 +36,58 @@ ssize_t compress(const uint8_t *source, size_t slen,
 ssize_t decompress(const uint8_t *source, size_t slen,
                    uint8_t *dest, size_t dlen);
 
+/**
+ * A small pool of deflate streams, so that callers which compress
+ * many bodies in a row (e.g. re-gzipping cover payloads after
+ * embedding) pay for deflateInit2 once per stream rather than once
+ * per body.  Streams are reset, not torn down, between uses.  The
+ * pool is not thread safe; like everything else on the event loop it
+ * is meant to be used from one thread.
+ */
+class deflater_pool
+{
+ public:
+  /**
+   * LEVEL is a zlib compression level (0-9, or -1 for zlib's
+   * default). MAX_IDLE bounds the number of streams kept around per
+   * format between calls.
+   */
+  explicit deflater_pool(int level = -1, size_t max_idle = 4);
+  ~deflater_pool();
+
+  /**
+   * Same contract as compress() above, but draws the deflate state
+   * from the pool.
+   */
+  ssize_t compress(const uint8_t *source, size_t slen,
+                   uint8_t *dest, size_t dlen,
+                   compression_format fmt);
+
+  /**
+   * Change the compression level used for subsequent calls. Idle
+   * streams are released since their level no longer matches.
+   * Returns false if LEVEL is out of range.
+   */
+  bool set_level(int level);
+  int level() const { return compression_level; }
+
+  /**
+   * An upper bound on the size of the compressed form of SLEN bytes
+   * in format FMT.
+   */
+  static size_t compress_bound(size_t slen, compression_format fmt);
+
+ private:
+  z_stream_s *acquire(compression_format fmt);
+  void release(z_stream_s *strm, compression_format fmt);
+  void drain_idle();
+
+  int compression_level;
+  size_t max_idle_streams;
+  std::vector<z_stream_s *> idle[2]; /* indexed by compression_format */
+
+  deflater_pool(const deflater_pool&) DELETE_METHOD;
+  deflater_pool& operator=(const deflater_pool&) DELETE_METHOD;
+};
+
 #endif
@@ -7,15 +7,20 @@
 #include "connections.h"
 #include "protocol.h"
 #include "socks.h"
+#include "target_stats.h"
 
+#include <algorithm>
 #include <unordered_set>
+#include <vector>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
 
 using std::unordered_set;
+using std::vector;
 
 static void close_cleanup_cb(evutil_socket_t, short, void *);
+static void shed_victims_cb(evutil_socket_t, short, void *);
 
 namespace {
 struct conn_global_state
@@ -44,6 +49,10 @@ struct conn_global_state
       connections that have pending events. */
   struct event *close_cleanup;
 
+  /** Fires when the memory governor has picked circuits to shed, to
+      close them outside of whatever code path ran out of memory. */
+  struct event *shed_victims;
+
   /** Most recently assigned serial numbers for connections and circuits.
       Note that serial number 0 is never used. These are only used for
       debugging messages, so we don't worry about them wrapping around. */
@@ -62,6 +71,7 @@ struct conn_global_state
 conn_global_state::conn_global_state(struct event_base *evbase)
   : the_event_base(evbase),
     close_cleanup(0),
+    shed_victims(0),
     last_conn_serial(0), last_ckt_serial(0),
     shutting_down(false)
 {
@@ -69,6 +79,9 @@ conn_global_state::conn_global_state(struct event_base *evbase)
   log_assert(close_cleanup);
   if (event_priority_set(close_cleanup, 1))
     log_abort("failed to demote priority of close-cleanup event");
+
+  shed_victims = evtimer_new(evbase, shed_victims_cb, this);
+  log_assert(shed_victims);
 }
 
 conn_global_state::~conn_global_state()
@@ -80,14 +93,16 @@ conn_global_state::~conn_global_state()
   log_assert(closed_circuits.empty());
 
   event_free(close_cleanup);
+  event_free(shed_victims);
 }
 
 } // anonymous namespace
 
+static conn_global_state *cgs = NULL;
+
 static void
-close_cleanup_cb(evutil_socket_t, short, void *arg)
+close_cleanup_cb(evutil_socket_t, short, void *)
 {
-  conn_global_state *cgs = (conn_global_state *)arg;
 
   log_debug("cleaning up %lu circuits and %lu connections",
             (unsigned long)cgs->closed_circuits.size(),
@@ -119,7 +134,53 @@ close_cleanup_cb(evutil_socket_t, short, void *arg)
   cgs = 0;
 }
 
-static conn_global_state *cgs = NULL;
+namespace {
+struct memory_governor_state
+{
+  /** Global budget in bytes; 0 means unlimited. */
+  size_t budget;
+
+  /** Upstream input buffered per circuit before reads are paused. */
+  size_t circuit_upstream_limit;
+
+  /** Sum of circuit_t::memory over all live circuits. */
+  circuit_memory_usage in_use;
+  size_t peak;
+
+  /** Circuits whose upstream reads are currently disabled. */
+  unordered_set<circuit_t *> throttled;
+
+  /** Circuits picked for shedding, closed by shed_victims_cb.  What
+      they held is no longer counted in in_use. */
+  unordered_set<circuit_t *> shedding;
+
+  unsigned long throttle_events;
+  unsigned long circuits_shed;
+
+  memory_governor_state()
+    : budget(0), circuit_upstream_limit(4 * 1024 * 1024), peak(0),
+      throttle_events(0), circuits_shed(0)
+  {}
+
+  /** Reads resume once usage falls below this. */
+  size_t low_watermark() const { return low_watermark(budget); }
+  static size_t low_watermark(size_t budget) { return budget - budget / 4; }
+
+  bool over_budget() const { return budget && in_use.total() >= budget; }
+
+  /** Stops charging anything to CKT. */
+  void release(circuit_t *ckt)
+  {
+    in_use.upstream -= ckt->memory.upstream;
+    in_use.transmit_queue -= ckt->memory.transmit_queue;
+    in_use.reassembly_queue -= ckt->memory.reassembly_queue;
+    in_use.steg_buffers -= ckt->memory.steg_buffers;
+    ckt->memory = circuit_memory_usage();
+  }
+};
+} // anonymous namespace
+
+static memory_governor_state mgs;
 
 void
 conn_global_init(struct event_base *evbase)
@@ -159,13 +220,14 @@ conn_start_shutdown(int barbaric)
 size_t
 conn_count(void)
 {
-  return cgs->connections.size();
+  // metrics snapshots may be taken before conn_global_init
+  return cgs ? cgs->connections.size() : 0;
 }
 
 size_t
 circuit_count(void)
 {
-  return cgs->circuits.size();
+  return cgs ? cgs->circuits.size() : 0;
 }
 
 /**
@@ -210,6 +272,14 @@ conn_t::close()
   if (this->buffer)
     bufferevent_disable(this->buffer, EV_READ|EV_WRITE);
 
+  if (this->target) {
+    if (this->connected_at)
+      this->target->closed_after(this->connected_at, this->bytes_carried);
+    else
+      this->target->failed();
+    this->target = 0;
+  }
+
   bool need_event =
     cgs->closed_connections.empty() && cgs->closed_circuits.empty();
 
@@ -250,7 +320,7 @@ conn_send_eof(conn_t *dest)
    that can only send data in small chunks. */
 
 static void
-flush_timer_cb(evutil_socket_t, short, void *arg)
+flush_timer_cb(void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_debug(ckt, "flush timer expired, %lu bytes available",
@@ -264,7 +334,7 @@ flush_timer_cb(evutil_socket_t, short, void *arg)
    connections. */
 
 static void
-axe_timer_cb(evutil_socket_t, short, void *arg)
+axe_timer_cb(void *arg)
 {
   circuit_t *ckt = (circuit_t *)arg;
   log_warn(ckt, "timeout waiting for new connections");
@@ -298,10 +368,6 @@ circuit_t::~circuit_t()
     free((void *)this->up_peer);
   if (this->socks_state)
     socks_state_free(this->socks_state);
-  if (this->flush_timer)
-    event_free(this->flush_timer);
-  if (this->axe_timer)
-    event_free(this->axe_timer);
 }
 
 void
@@ -310,12 +376,15 @@ circuit_t::close()
   log_debug(this, "closing circuit; %lu remaining",
             (unsigned long)cgs->circuits.size());
 
+  /* release whatever the memory governor charged to us */
+  mgs.release(this);
+  mgs.throttled.erase(this);
+  mgs.shedding.erase(this);
+
   if (this->up_buffer)
     bufferevent_disable(this->up_buffer, EV_READ|EV_WRITE);
-  if (this->flush_timer)
-    event_del(this->flush_timer);
-  if (this->axe_timer)
-    event_del(this->axe_timer);
+  wheel_timer_disarm(&this->flush_timer);
+  wheel_timer_disarm(&this->axe_timer);
 
   bool need_event =
     cgs->closed_connections.empty() && cgs->closed_circuits.empty();
@@ -333,6 +402,14 @@ circuit_t::cfg() const
   return 0;
 }
 
+void
+circuit_t::account_memory(circuit_memory_usage &usage) const
+{
+  if (up_buffer)
+    usage.upstream = evbuffer_get_length(bufferevent_get_input(up_buffer)) +
+      evbuffer_get_length(bufferevent_get_output(up_buffer));
+}
+
 void
 circuit_add_upstream(circuit_t *ckt, struct bufferevent *buf, const char *peer)
 {
@@ -341,6 +418,8 @@ circuit_add_upstream(circuit_t *ckt, struct bufferevent *buf, const char *peer)
 
   ckt->up_buffer = buf;
   ckt->up_peer = peer;
+
+  circuit_apply_upstream_watermark(ckt);
 }
 
 /* circuit_open_upstream is in network.c */
@@ -405,21 +484,15 @@ circuit_arm_flush_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "flush within %u milliseconds", milliseconds);
 
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!ckt->flush_timer)
-    ckt->flush_timer = evtimer_new(ckt->cfg()->base, flush_timer_cb, ckt);
-
-  evtimer_add(ckt->flush_timer, &tv);
+  ckt->flush_timer.cb = flush_timer_cb;
+  ckt->flush_timer.arg = ckt;
+  wheel_timer_arm(&ckt->flush_timer, milliseconds);
 }
 
 void
 circuit_disarm_flush_timer(circuit_t *ckt)
 {
-  if (ckt->flush_timer)
-    evtimer_del(ckt->flush_timer);
+  wheel_timer_disarm(&ckt->flush_timer);
 }
 
 void
@@ -427,19 +500,202 @@ circuit_arm_axe_timer(circuit_t *ckt, unsigned int milliseconds)
 {
   log_debug(ckt, "axe after %u milliseconds", milliseconds);
 
-  struct timeval tv;
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
+  ckt->axe_timer.cb = axe_timer_cb;
+  ckt->axe_timer.arg = ckt;
+  wheel_timer_arm(&ckt->axe_timer, milliseconds);
+}
 
-  if (!ckt->axe_timer)
-    ckt->axe_timer = evtimer_new(ckt->cfg()->base, axe_timer_cb, ckt);
+void
+circuit_disarm_axe_timer(circuit_t *ckt)
+{
+  wheel_timer_disarm(&ckt->axe_timer);
+}
 
-  evtimer_add(ckt->axe_timer, &tv);
+/* Memory governor. */
+
+void
+memory_governor_configure(size_t budget, size_t circuit_upstream_limit)
+{
+  mgs.budget = budget;
+  mgs.circuit_upstream_limit = circuit_upstream_limit;
 }
 
 void
-circuit_disarm_axe_timer(circuit_t *ckt)
+circuit_apply_upstream_watermark(circuit_t *ckt)
+{
+  /* libevent stops reading from the upstream socket by itself once
+     this much input is waiting to be chopped, and resumes when the
+     circuit drains it below the mark. */
+  if (ckt->up_buffer)
+    bufferevent_setwatermark(ckt->up_buffer, EV_READ, 0,
+                             mgs.circuit_upstream_limit);
+}
+
+void
+circuit_set_upstream_low_watermark(circuit_t *ckt, size_t low)
+{
+  if (ckt->up_buffer)
+    bufferevent_setwatermark(ckt->up_buffer, EV_READ,
+                             std::min(low, mgs.circuit_upstream_limit),
+                             mgs.circuit_upstream_limit);
+}
+
+static void
+circuit_throttle_upstream(circuit_t *ckt)
+{
+  if (ckt->upstream_throttled || !ckt->up_buffer)
+    return;
+
+  log_debug(ckt, "pausing upstream reads (%lu bytes in use, %lu globally)",
+            (unsigned long)ckt->memory.total(),
+            (unsigned long)mgs.in_use.total());
+  bufferevent_disable(ckt->up_buffer, EV_READ);
+  ckt->upstream_throttled = true;
+  mgs.throttled.insert(ckt);
+  mgs.throttle_events++;
+}
+
+static void
+circuit_release_upstream(circuit_t *ckt)
+{
+  if (!ckt->upstream_throttled)
+    return;
+
+  log_debug(ckt, "resuming upstream reads");
+  ckt->upstream_throttled = false;
+  mgs.throttled.erase(ckt);
+  if (ckt->up_buffer && !ckt->read_eof)
+    bufferevent_enable(ckt->up_buffer, EV_READ);
+}
+
+static bool
+holds_more(const circuit_t *a, const circuit_t *b)
+{
+  return a->memory.total() > b->memory.total();
+}
+
+vector<circuit_t *>
+memory_governor_pick_victims(const vector<circuit_t *> &candidates,
+                             const circuit_t *spare,
+                             size_t in_use, size_t budget)
+{
+  vector<circuit_t *> victims;
+  if (!budget || in_use < budget)
+    return victims;
+
+  for (vector<circuit_t *>::const_iterator i = candidates.begin();
+       i != candidates.end(); i++)
+    if (*i != spare && (*i)->idle())
+      victims.push_back(*i);
+  std::stable_sort(victims.begin(), victims.end(), holds_more);
+
+  size_t target = memory_governor_state::low_watermark(budget);
+  size_t needed = 0;
+  while (needed < victims.size() && in_use > target)
+    in_use -= std::min(in_use, victims[needed++]->memory.total());
+  victims.resize(needed);
+  return victims;
+}
+
+/**
+   Picks the largest idle circuits, other than SPARE, to bring the
+   global usage back under the low watermark.  They stop counting
+   right away and are closed from the event loop: SPARE may be in the
+   middle of a send which uses them.
+*/
+static void
+memory_governor_shed(circuit_t *spare)
+{
+  vector<circuit_t *> candidates;
+  for (unordered_set<circuit_t *>::iterator i = cgs->circuits.begin();
+       i != cgs->circuits.end(); i++)
+    if (!mgs.shedding.count(*i))
+      candidates.push_back(*i);
+
+  vector<circuit_t *> victims =
+    memory_governor_pick_victims(candidates, spare, mgs.in_use.total(),
+                                 mgs.budget);
+  for (vector<circuit_t *>::iterator i = victims.begin();
+       i != victims.end(); i++) {
+    circuit_t *victim = *i;
+    log_warn(victim, "shedding idle circuit holding %lu bytes "
+             "(%lu of %lu bytes in use)",
+             (unsigned long)victim->memory.total(),
+             (unsigned long)mgs.in_use.total(), (unsigned long)mgs.budget);
+    mgs.circuits_shed++;
+    circuit_throttle_upstream(victim);
+    mgs.release(victim);
+    mgs.shedding.insert(victim);
+  }
+
+  if (!victims.empty())
+    event_active(cgs->shed_victims, 0, 0);
+}
+
+static void
+shed_victims_cb(evutil_socket_t, short, void *)
+{
+  // circuits closed meanwhile have left the set on their own
+  vector<circuit_t *> victims(mgs.shedding.begin(), mgs.shedding.end());
+  mgs.shedding.clear();
+  for (vector<circuit_t *>::iterator i = victims.begin();
+       i != victims.end(); i++)
+    (*i)->close();
+}
+
+void
+circuit_account_memory(circuit_t *ckt)
+{
+  // closed circuits have already given back what they were charged,
+  // and so have the ones about to be shed
+  if (!cgs->circuits.count(ckt) || mgs.shedding.count(ckt))
+    return;
+
+  circuit_memory_usage now;
+  ckt->account_memory(now);
+
+  mgs.in_use.upstream += now.upstream - ckt->memory.upstream;
+  mgs.in_use.transmit_queue += now.transmit_queue - ckt->memory.transmit_queue;
+  mgs.in_use.reassembly_queue +=
+    now.reassembly_queue - ckt->memory.reassembly_queue;
+  mgs.in_use.steg_buffers += now.steg_buffers - ckt->memory.steg_buffers;
+  ckt->memory = now;
+
+  size_t total = mgs.in_use.total();
+  if (total > mgs.peak)
+    mgs.peak = total;
+
+  if (mgs.over_budget()) {
+    memory_governor_shed(ckt);
+  }
+
+  if (ckt->transmit_window_full() || mgs.over_budget()) {
+    circuit_throttle_upstream(ckt);
+  } else if (ckt->upstream_throttled && !mgs.budget) {
+    circuit_release_upstream(ckt);
+  }
+
+  /* once we are comfortably under budget, everybody may read again,
+     except for circuits whose own window is still full */
+  if (mgs.budget && !mgs.throttled.empty() &&
+      mgs.in_use.total() < mgs.low_watermark()) {
+    vector<circuit_t *> waiting(mgs.throttled.begin(), mgs.throttled.end());
+    for (vector<circuit_t *>::iterator i = waiting.begin();
+         i != waiting.end(); i++)
+      if (!(*i)->transmit_window_full())
+        circuit_release_upstream(*i);
+  }
+}
+
+void
+memory_governor_get_stats(memory_governor_stats *stats)
 {
-  if (ckt->axe_timer)
-    evtimer_del(ckt->axe_timer);
+  stats->budget = mgs.budget;
+  stats->circuit_upstream_limit = mgs.circuit_upstream_limit;
+  stats->in_use = mgs.in_use.total();
+  stats->peak = mgs.peak;
+  stats->breakdown = mgs.in_use;
+  stats->circuits_throttled = mgs.throttled.size();
+  stats->throttle_events = mgs.throttle_events;
+  stats->circuits_shed = mgs.circuits_shed;
 }
@@ -9,12 +9,17 @@
 #include <event2/bufferevent.h>
 
 #include <time.h> //Keeping track of life length of a connection for debug reason
+#include <vector>
+
+#include "timer_wheel.h"
 
 #define MAX_GLOBAL_CONN_COUNT 256 //To prevent the total number of connections
                                   //created by this instance exceed this number. 
                                   //I am not sure if it is the best place to 
                                   //to define this
 
+struct target_stats;
+
 void conn_send_eof(conn_t *conn);
 void conn_do_flush(conn_t *conn);
 
@@ -37,6 +42,15 @@ struct conn_t {
   //for debug reason: we want to keep track of connection life length 
   time_t creation_time;
 
+  /* Outbound connections only: the statistics of the target this
+     connection goes to, see target_stats.h.  The times are
+     latency_now(); the protocol adds the covert data bytes it moves
+     over this connection, in either direction, to bytes_carried. */
+  target_stats       *target;
+  uint64_t            connect_start;
+  uint64_t            connected_at;
+  unsigned long long  bytes_carried;
+
   conn_t()
     : peername(0)
     , buffer(0)
@@ -46,6 +60,10 @@ struct conn_t {
     , read_eof(false)
     , write_eof(false)
     , pending_write_eof(false)
+    , target(0)
+    , connect_start(0)
+    , connected_at(0)
+    , bytes_carried(0)
   {}
 
   /** Deallocate a connection.  Normally should not be invoked directly,
@@ -157,9 +175,25 @@ size_t conn_count(void);
    this structure, and will certainly add at least one conn_t pointer.
  */
 
+/** Bytes held on behalf of one circuit, broken down by where they
+    sit.  Filled in by circuit_t::account_memory. */
+struct circuit_memory_usage {
+  size_t upstream;          /* upstream bufferevent, both directions */
+  size_t transmit_queue;    /* blocks sent but not yet acknowledged */
+  size_t reassembly_queue;  /* blocks received out of order */
+  size_t steg_buffers;      /* downstream connection buffers */
+
+  circuit_memory_usage()
+    : upstream(0), transmit_queue(0), reassembly_queue(0), steg_buffers(0)
+  {}
+
+  size_t total() const
+  { return upstream + transmit_queue + reassembly_queue + steg_buffers; }
+};
+
 struct circuit_t {
-  struct event       *flush_timer;
-  struct event       *axe_timer;
+  wheel_timer         flush_timer;
+  wheel_timer         axe_timer;
   struct bufferevent *up_buffer;
   const char         *up_peer;
   socks_state_t      *socks_state;
@@ -170,11 +204,13 @@ struct circuit_t {
   bool                write_eof : 1;
   bool                pending_read_eof : 1;
   bool                pending_write_eof : 1;
+  bool                upstream_throttled : 1;
+
+  /* what the memory governor last charged to this circuit */
+  circuit_memory_usage memory;
 
   circuit_t()
-    : flush_timer(0)
-    , axe_timer(0)
-    , up_buffer(0)
+    : up_buffer(0)
     , up_peer(0)
     , socks_state(0)
     , serial(0)
@@ -183,6 +219,7 @@ struct circuit_t {
     , write_eof(false)
     , pending_read_eof(false)
     , pending_write_eof(false)
+    , upstream_throttled(false)
   {}
 
   /** Deallocate a circuit.  Normally should not be invoked directly,
@@ -212,6 +249,19 @@ struct circuit_t {
       periodic "can we flush more data now?" callbacks, and |conn_t::recv|
       events won't do it, you have to set them up yourself. */
   virtual int send_eof() = 0;
+
+  /** Report the bytes held on behalf of this circuit.  The default
+      only knows about the upstream buffers; protocols with queues of
+      their own should add them. */
+  virtual void account_memory(circuit_memory_usage &usage) const;
+
+  /** True if the protocol cannot accept more upstream data right now
+      regardless of memory, e.g. its transmit window is full. */
+  virtual bool transmit_window_full() const { return false; }
+
+  /** True if the circuit is making no forward progress, which makes
+      it a candidate for shedding under memory pressure. */
+  virtual bool idle() const { return false; }
 };
 
 circuit_t *circuit_create(config_t *cfg, size_t index);
@@ -237,4 +287,90 @@ void circuit_do_flush(circuit_t *ckt);
 
 size_t circuit_count(void);
 
+/* Memory governor.  Every circuit's memory usage is tallied into a
+   global total.  Upstream reads of a circuit are paused (via the read
+   high-watermark of its upstream bufferevent, and by disabling reads
+   outright while its transmit window is full or the global budget is
+   exhausted) and resumed once the pressure is gone.  When the global
+   budget is exceeded, the largest idle circuits are shed. */
+
+struct memory_governor_stats {
+  size_t budget;                /* 0 means unlimited */
+  size_t circuit_upstream_limit;
+  size_t in_use;
+  size_t peak;
+  circuit_memory_usage breakdown; /* sum over all circuits */
+  size_t circuits_throttled;    /* currently throttled */
+  unsigned long throttle_events;
+  unsigned long circuits_shed;
+};
+
+/** Set the global memory budget and the per-circuit cap on buffered
+    upstream input, both in bytes.  A budget of 0 disables the global
+    limit.  May be called before conn_global_init. */
+void memory_governor_configure(size_t budget, size_t circuit_upstream_limit);
+
+/** Recompute the memory charged to CKT and apply backpressure or
+    relief accordingly.  Protocols call this whenever their queues
+    change substantially (after sending, after processing input). */
+void circuit_account_memory(circuit_t *ckt);
+
+/** Set the read watermark on a freshly attached upstream buffer. */
+void circuit_apply_upstream_watermark(circuit_t *ckt);
+
+/** Do not wake CKT up for upstream reads until at least LOW bytes are
+    waiting (0 to wake it up for every read).  The per-circuit cap
+    stays in force. */
+void circuit_set_upstream_low_watermark(circuit_t *ckt, size_t low);
+
+void memory_governor_get_stats(memory_governor_stats *stats);
+
+/** Of CANDIDATES, the idle circuits other than SPARE to shed, largest
+    first, so that IN_USE bytes fall under the low watermark of BUDGET
+    (3/4 of it).  Nothing is picked while IN_USE is within BUDGET or
+    when there is no budget.  The circuits are closed from the event
+    loop, not by the caller, which may be in the middle of using them. */
+std::vector<circuit_t *>
+memory_governor_pick_victims(const std::vector<circuit_t *> &candidates,
+                             const circuit_t *spare,
+                             size_t in_use, size_t budget);
+
+/* Client-side pool of pre-connected downstream connections.  Opening
+   a downstream connection costs at least one round trip before a
+   circuit can use it, and with one-shot steg modules circuits need new
+   connections all the time.  When a client configuration sets
+   conn_pool_size, connections to each of its target addresses are
+   opened ahead of time and kept idle (steg module created, nothing
+   sent) until create_outbound_connections hands them to a circuit.
+   Pools are refilled from the event loop.  Each target keeps enough
+   connections to cover what circuits take from it during one connect
+   time, as measured, but at least one and at most conn_pool_size, and
+   no pool grows while the process holds three quarters of
+   MAX_GLOBAL_CONN_COUNT connections. */
+
+struct conn_pool_stats {
+  size_t idle;
+  size_t connecting;
+  size_t wanted;            /* sum of the current per-target sizes */
+  unsigned long hits;       /* pooled connections handed to circuits */
+  unsigned long misses;     /* a circuit found its target's pool empty */
+  unsigned long discarded;  /* idle connections closed unused */
+};
+
+/** Start keeping a pool of connections for CFG, if it is a client
+    configuration that asks for one.  Called by listener_open. */
+void conn_pool_open(config_t *cfg);
+
+/** Close every pooled connection and stop refilling.  Called at
+    shutdown, before conn_start_shutdown. */
+void conn_pool_close_all(void);
+
+/** Do the once-a-second upkeep of every pool as if it were NOW:
+    resize, close the idle connections that are surplus or have waited
+    too long, and refill.  The pools' own timers do this; it is here
+    for the unit tests. */
+void conn_pool_maintain_all(time_t now);
+
+void conn_pool_get_stats(conn_pool_stats *stats);
+
 #endif
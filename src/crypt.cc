@@ -831,6 +831,64 @@ sha256(const uint8_t* buffer, size_t n, uint8_t* md)
   return md;
 }
 
+sha256_stream::sha256_stream()
+  : ctx(EVP_MD_CTX_new())
+{
+  if (!ctx)
+    log_crypto_abort("sha256_stream::construction");
+  reset();
+}
+
+sha256_stream::sha256_stream(const sha256_stream& other)
+  : ctx(EVP_MD_CTX_new())
+{
+  if (!ctx || !EVP_MD_CTX_copy_ex(ctx, other.ctx))
+    log_crypto_abort("sha256_stream::copy");
+}
+
+sha256_stream&
+sha256_stream::operator=(const sha256_stream& other)
+{
+  if (this != &other && !EVP_MD_CTX_copy_ex(ctx, other.ctx))
+    log_crypto_abort("sha256_stream::copy");
+  return *this;
+}
+
+sha256_stream::~sha256_stream()
+{ EVP_MD_CTX_free(ctx); }
+
+void
+sha256_stream::reset()
+{
+  if (!EVP_DigestInit_ex(ctx, EVP_sha256(), 0))
+    log_crypto_abort("sha256_stream::reset");
+}
+
+void
+sha256_stream::update(const void* buffer, size_t n)
+{
+  if (!EVP_DigestUpdate(ctx, buffer, n))
+    log_crypto_abort("sha256_stream::update");
+}
+
+void
+sha256_stream::digest(uint8_t* md) const
+{
+  // finalizing ends the stream, so take the hash of a copy
+  EVP_MD_CTX* fed = EVP_MD_CTX_new();
+  if (!fed || !EVP_MD_CTX_copy_ex(fed, ctx) || !EVP_DigestFinal_ex(fed, md, 0))
+    log_crypto_abort("sha256_stream::digest");
+  EVP_MD_CTX_free(fed);
+}
+
+void
+sha256_stream::swap(sha256_stream& other)
+{
+  evp_md_ctx_st* mine = ctx;
+  ctx = other.ctx;
+  other.ctx = mine;
+}
+
 uint8_t* 
 sha1(const uint8_t* buffer, size_t n, uint8_t* md)
 {
@@ -365,6 +365,35 @@ private:
 */
 uint8_t* sha256(const uint8_t* buffer, size_t n, uint8_t* md);
 
+struct evp_md_ctx_st;
+
+/**
+    SHA256 of data fed to it a piece at a time. The hash of what has
+    been fed so far can be taken at any time, and more fed after it.
+*/
+struct sha256_stream
+{
+  sha256_stream();
+  sha256_stream(const sha256_stream& other);
+  sha256_stream& operator=(const sha256_stream& other);
+  ~sha256_stream();
+
+  /** Start over, as if nothing had been fed.  */
+  void reset();
+
+  /** Feed the n bytes at buffer.  */
+  void update(const void* buffer, size_t n);
+
+  /** Write the SHA256 of everything fed since the last reset to md,
+      which must hold SHA256_LEN bytes.  */
+  void digest(uint8_t* md) const;
+
+  void swap(sha256_stream& other);
+
+private:
+  struct evp_md_ctx_st* ctx;
+};
+
 /** 
     Computes sha2 of buffer of size n and stores the result 
     in md. If md == NULL it allocates the memory.
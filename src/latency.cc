@@ -0,0 +1,253 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <set>
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <yaml-cpp/yaml.h>
+
+#include "util.h"
+#include "latency.h"
+#include "metrics.h"
+#include "steg.h"
+
+using std::set;
+using std::string;
+
+bool latency_tracing = false;
+
+namespace {
+  struct latency_state {
+    set<latency_profile *> profiles;
+    latency_profile total;
+
+    latency_state() : total("total") {}
+  };
+}
+
+static latency_state *ls = NULL;
+
+static latency_state *
+get_latency_state()
+{
+  if (!ls)
+    ls = new latency_state;
+  return ls;
+}
+
+uint64_t
+latency_now()
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+  struct timeval tv;
+  evutil_gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+unsigned int
+latency_histogram::bucket_index(uint64_t usec)
+{
+  if (usec > c_MAX_VALUE)
+    usec = c_MAX_VALUE;
+  if (usec < 2 * c_SUB_BUCKETS)
+    return usec;
+
+  unsigned int shift = ui64_log2(usec) - c_SUB_BUCKET_BITS;
+  return shift * c_SUB_BUCKETS + (usec >> shift);
+}
+
+uint64_t
+latency_histogram::bucket_high(unsigned int index)
+{
+  if (index < 2 * c_SUB_BUCKETS)
+    return index;
+
+  unsigned int shift = index / c_SUB_BUCKETS - 1;
+  uint64_t sub = index % c_SUB_BUCKETS + c_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void
+latency_histogram::record(uint64_t usec)
+{
+  _counts[bucket_index(usec)]++;
+  _count++;
+  _sum += usec;
+  if (usec < _min)
+    _min = usec;
+  if (usec > _max)
+    _max = usec;
+}
+
+void
+latency_histogram::merge(const latency_histogram &other)
+{
+  if (!other._count)
+    return;
+
+  for (unsigned int i = 0; i < c_N_BUCKETS; i++)
+    _counts[i] += other._counts[i];
+  _count += other._count;
+  _sum += other._sum;
+  if (other._min < _min)
+    _min = other._min;
+  if (other._max > _max)
+    _max = other._max;
+}
+
+void
+latency_histogram::clear()
+{
+  memset(_counts, 0, sizeof _counts);
+  _count = 0;
+  _sum = 0;
+  _min = UINT64_MAX;
+  _max = 0;
+}
+
+uint64_t
+latency_histogram::value_at_percentile(double percentile) const
+{
+  if (!_count)
+    return 0;
+
+  uint64_t wanted = (uint64_t)ceil(percentile / 100.0 * _count);
+  if (wanted == 0)
+    wanted = 1;
+
+  uint64_t seen = 0;
+  for (unsigned int i = 0; i < c_N_BUCKETS; i++) {
+    seen += _counts[i];
+    if (seen >= wanted)
+      return std::min(bucket_high(i), _max);
+  }
+  return _max;
+}
+
+latency_profile *
+latency_profile_new(const string &label)
+{
+  latency_profile *profile = new latency_profile(label);
+  get_latency_state()->profiles.insert(profile);
+  return profile;
+}
+
+void
+latency_profile_free(latency_profile *profile)
+{
+  if (!profile)
+    return;
+  get_latency_state()->profiles.erase(profile);
+  delete profile;
+}
+
+latency_profile *
+latency_profile_for_steg(steg_config_t *steg_cfg)
+{
+  steg_metrics *m = steg_cfg->metrics();
+  if (!m->latency)
+    m->latency = latency_profile_new(string("steg ") + steg_cfg->name());
+  return m->latency;
+}
+
+void
+latency_record(latency_profile *ckt, latency_profile *steg,
+               latency_stage stage, uint64_t since, uint64_t now)
+{
+  if (!since)
+    return;
+
+  uint64_t elapsed = now > since ? now - since : 0;
+  if (ckt)
+    ckt->stages[stage].record(elapsed);
+  if (steg)
+    steg->stages[stage].record(elapsed);
+  get_latency_state()->total.stages[stage].record(elapsed);
+}
+
+static const char *const stage_names[LAT_N_STAGES] = {
+  "upstream-wait",
+  "encode",
+  "wire",
+  "ack",
+  "decode",
+  "reassembly"
+};
+
+static void
+report_profile(string &out, const latency_profile &profile)
+{
+  char buf[256];
+  xsnprintf(buf, sizeof buf, "%s\n", profile.label.c_str());
+  out += buf;
+
+  for (int i = 0; i < LAT_N_STAGES; i++) {
+    const latency_histogram &h = profile.stages[i];
+    if (!h.count())
+      continue;
+    xsnprintf(buf, sizeof buf,
+              "  %-14s n=%-8llu min=%-8llu p50=%-8llu p90=%-8llu "
+              "p99=%-8llu p99.9=%-8llu max=%-8llu mean=%.1f\n",
+              stage_names[i],
+              (unsigned long long)h.count(),
+              (unsigned long long)h.min(),
+              (unsigned long long)h.value_at_percentile(50),
+              (unsigned long long)h.value_at_percentile(90),
+              (unsigned long long)h.value_at_percentile(99),
+              (unsigned long long)h.value_at_percentile(99.9),
+              (unsigned long long)h.max(),
+              h.mean());
+    out += buf;
+  }
+}
+
+void
+latency_report(string &out)
+{
+  latency_state *st = get_latency_state();
+
+  out += "# block latency in microseconds\n";
+  report_profile(out, st->total);
+
+  /* steg profiles live for the whole run, circuits come and go */
+  for (set<latency_profile *>::const_iterator i = st->profiles.begin();
+       i != st->profiles.end(); ++i)
+    if (!(*i)->label.compare(0, 5, "steg "))
+      report_profile(out, **i);
+  for (set<latency_profile *>::const_iterator i = st->profiles.begin();
+       i != st->profiles.end(); ++i)
+    if ((*i)->label.compare(0, 5, "steg "))
+      report_profile(out, **i);
+}
+
+int
+latency_dump(const char *path)
+{
+  string report;
+  latency_report(report);
+
+  FILE *f = fopen(path, "a");
+  if (!f) {
+    log_warn("failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  char header[64];
+  xsnprintf(header, sizeof header, "# dumped at %.3f\n", log_get_timestamp());
+  fputs(header, f);
+  fputs(report.c_str(), f);
+  if (fclose(f)) {
+    log_warn("failed to write %s: %s", path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,106 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <string>
+
+#include <stdint.h>
+
+/* Per-block latency tracing.  When enabled (--latency-histograms),
+   chop timestamps each block at a few points of its life and records
+   the elapsed time of every stage into HDR-style histograms, kept per
+   circuit, per steg module and for the process as a whole.  When it
+   is disabled circuits carry no profile and every hook reduces to a
+   NULL pointer test. */
+
+enum latency_stage {
+  LAT_UPSTREAM_WAIT,  /* upstream read -> enqueued in the transmit queue */
+  LAT_ENCODE,         /* handed to the steg module -> encoded */
+  LAT_WIRE,           /* encoded -> first byte written to the socket */
+  LAT_ACK,            /* enqueued -> acknowledged by the peer */
+  LAT_DECODE,         /* downstream readable -> block header decrypted */
+  LAT_REASSEMBLY,     /* inserted in the reassembly queue -> written upstream */
+  LAT_N_STAGES
+};
+
+extern bool latency_tracing;
+
+/** Monotonic clock in microseconds. */
+uint64_t latency_now();
+
+/**
+   A histogram of durations in microseconds with a bounded relative
+   error (one bucket per 1/8th of a power of two, so about 6%), in the
+   spirit of HdrHistogram.  Values above c_MAX_VALUE are clamped.
+*/
+class latency_histogram
+{
+ public:
+  static const unsigned int c_SUB_BUCKET_BITS = 3;
+  static const unsigned int c_SUB_BUCKETS = 1 << c_SUB_BUCKET_BITS;
+  static const uint64_t c_MAX_VALUE = ((uint64_t)1 << 32) - 1;
+  static const unsigned int c_N_BUCKETS =
+    (32 - c_SUB_BUCKET_BITS + 1) * c_SUB_BUCKETS;
+
+  latency_histogram() { clear(); }
+
+  void record(uint64_t usec);
+  void merge(const latency_histogram &other);
+  void clear();
+
+  uint64_t count() const { return _count; }
+  uint64_t min() const { return _count ? _min : 0; }
+  uint64_t max() const { return _max; }
+  double mean() const { return _count ? (double)_sum / _count : 0; }
+
+  /** The smallest value such that PERCENTILE percent of the recorded
+      values are equivalent to or below it. */
+  uint64_t value_at_percentile(double percentile) const;
+
+  static unsigned int bucket_index(uint64_t usec);
+  /** highest value which falls in bucket INDEX */
+  static uint64_t bucket_high(unsigned int index);
+
+ private:
+  uint32_t _counts[c_N_BUCKETS];
+  uint64_t _count;
+  uint64_t _sum;
+  uint64_t _min;
+  uint64_t _max;
+};
+
+struct latency_profile
+{
+  std::string label;
+  latency_histogram stages[LAT_N_STAGES];
+
+  latency_profile(const std::string &l) : label(l) {}
+};
+
+/** Create a profile labelled LABEL and register it so it shows up in
+    dumps until it is freed. */
+latency_profile *latency_profile_new(const std::string &label);
+void latency_profile_free(latency_profile *profile);
+
+/** The profile aggregating every block carried by steg module
+    STEG_CFG, created on first use. */
+latency_profile *latency_profile_for_steg(struct steg_config_t *steg_cfg);
+
+/** Record NOW - SINCE for STAGE in the circuit profile CKT, the steg
+    profile STEG (may be NULL) and the process wide profile.  A zero
+    SINCE means the start of the stage was never seen (the block
+    predates tracing) and is ignored. */
+void latency_record(latency_profile *ckt, latency_profile *steg,
+                    latency_stage stage, uint64_t since, uint64_t now);
+
+/** Appends a table of every registered profile to OUT. */
+void latency_report(std::string &out);
+
+/** Appends latency_report to the file at PATH. Returns 0 on success,
+    -1 on failure. */
+int latency_dump(const char *path);
+
+#endif
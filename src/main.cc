@@ -8,7 +8,9 @@
 
 #include "connections.h"
 #include "crypt.h"
+#include "latency.h"
 #include "listener.h"
+#include "metrics.h"
 #include "modus_operandi.h"
 #include "protocol.h"
 #include "steg.h"
@@ -40,8 +42,31 @@ using std::string;
 
 static bool allow_kq = false;
 static bool daemon_mode = false;
+static bool sync_logs = false;
 static string pidfile_name;
 static string registration_helper;
+static string metrics_address;
+static string latency_file;
+
+/**
+   Parses a strictly positive size given in units of UNIT bytes for
+   option NAME. Exits the program on bad input.
+
+   Note: this function should NOT use log_* to print diagnostics.
+*/
+static size_t
+parse_size_option(const char *name, const string& value, size_t unit)
+{
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(value.c_str(), &end, 10);
+  if (errno || end == value.c_str() || *end || n == 0 ||
+      n > SIZE_MAX / unit) {
+    fprintf(stderr, "invalid value '%s' for --%s\n", value.c_str(), name);
+    exit(1);
+  }
+  return n * unit;
+}
 
 /**
    Puts stegotorus's networking subsystem on "closing time" mode. This
@@ -64,6 +89,8 @@ start_shutdown(int barbaric, const char *label)
            barbaric ? "will be broken" : "remain");
 
   listener_close_all();          /* prevent further connections */
+  metrics_listener_close();
+  conn_pool_close_all();
   conn_start_shutdown(barbaric); /* possibly break existing connections */
 }
 
@@ -89,6 +116,27 @@ handle_signal_cb(evutil_socket_t fd, short, void *)
   start_shutdown(1, signum == SIGINT ? "SIGINT" : "SIGTERM");
 }
 
+/**
+   Reloads the covers and dictionaries of the steg modules (SIGHUP).
+*/
+static void
+reload_stegs_cb(evutil_socket_t, short, void *)
+{
+  log_info("SIGHUP: reloading the steg modules");
+  steg_reload_all();
+}
+
+/**
+   Appends the latency histograms to the file given with
+   --latency-histograms (SIGUSR1).
+*/
+static void
+dump_latency_cb(evutil_socket_t, short, void *)
+{
+  if (!latency_dump(latency_file.c_str()))
+    log_info("latency histograms written to %s", latency_file.c_str());
+}
+
 /**
    This is called when we receive a synchronous signal that indicates
    a fatal programming error (SIGSEGV and friends). Unlike the above,
@@ -105,7 +153,9 @@ lethal_signal(int signum, siginfo_t *si, void *)
   void *backtracebuf[256];
 #endif
 
-  /* Print a basic diagnostic first. */
+  /* Get out the log messages that led up to it, then a basic
+     diagnostic. */
+  log_flush_from_signal();
   xsnprintf(faultmsg, sizeof faultmsg,
             sizeof(unsigned long) == 4
             ? "\n[error] %s at %08lx\n"
@@ -240,6 +290,8 @@ static int
 handle_generic_args(int argc, const char *const *argv,  modus_operandi_t &mo)
 {
   int protocol_arg_index = mo.process_command_line_config(argv, argc);;
+  size_t memory_budget = 0;
+  size_t circuit_upstream_limit = 4 * 1024 * 1024;
 
   for(auto cur_option = mo.top_level_confs_dict.begin();
       cur_option != mo.top_level_confs_dict.end(); cur_option++) {
@@ -265,6 +317,8 @@ handle_generic_args(int argc, const char *const *argv,  modus_operandi_t &mo)
       log_set_method(LOG_METHOD_NULL, NULL);
     } else if ((cur_option->first == "timestamp-logs") && (cur_option->second == true_string)) {
       log_enable_timestamps();
+    } else if ((cur_option->first == "sync-logs") && (cur_option->second == true_string)) {
+      sync_logs = true;
     } else if ((cur_option->first == "allow-kqueue") && (cur_option->second == true_string)) {
       allow_kq = true;
     } else if (cur_option->first == "registration-helper") {
@@ -276,6 +330,17 @@ handle_generic_args(int argc, const char *const *argv,  modus_operandi_t &mo)
     } else if (cur_option->first == "version") {
       print_version();
       exit(0);
+    } else if (cur_option->first == "memory-budget") {
+      memory_budget = parse_size_option("memory-budget", cur_option->second,
+                                        1024 * 1024);
+    } else if (cur_option->first == "circuit-upstream-limit") {
+      circuit_upstream_limit = parse_size_option("circuit-upstream-limit",
+                                                 cur_option->second, 1024);
+    } else if (cur_option->first == "metrics-address") {
+      metrics_address = cur_option->second;
+    } else if (cur_option->first == "latency-histograms") {
+      latency_file = cur_option->second;
+      latency_tracing = true;
     } else {
       //this should never happen cause modus_operandi should have already aborted
       fprintf(stderr, "unrecognizable argument '%s'\n", cur_option->first.c_str());
@@ -289,6 +354,8 @@ handle_generic_args(int argc, const char *const *argv,  modus_operandi_t &mo)
     log_set_method(LOG_METHOD_NULL, NULL);
   }
 
+  memory_governor_configure(memory_budget, circuit_upstream_limit);
+
   return protocol_arg_index;
 }
 
@@ -298,6 +365,8 @@ main(int argc, const char *const *argv)
   struct event_config *evcfg;
   struct event *sig_int;
   struct event *sig_term;
+  struct event *sig_usr1 = NULL;
+  struct event *sig_hup = NULL;
   struct event *stdin_eof;
   vector<config_t *> configs;
   modus_operandi_t mo;
@@ -380,6 +449,10 @@ main(int argc, const char *const *argv)
   if (daemon_mode)
     daemonize();
 
+  /* After daemonize, which would leave the writer thread behind. */
+  if (!sync_logs && log_start_async())
+    log_warn("failed to start the log writer; logging synchronously");
+
 #ifndef _WIN32
   pidfile pf(pidfile_name);
   if (!pf)
@@ -428,6 +501,7 @@ main(int argc, const char *const *argv)
     log_abort("failed to initialize networking (priority queues)");
 
   conn_global_init(the_event_base);
+  timer_wheel_start(the_event_base);
 
   log_debug("initialize evdns");
   /* ASN should this happen only when SOCKS is enabled? */
@@ -444,6 +518,18 @@ main(int argc, const char *const *argv)
                           handle_signal_cb, NULL);
   if (event_add(sig_int, NULL) || event_add(sig_term, NULL))
     log_abort("failed to initialize signal handling");
+#ifdef SIGHUP
+  sig_hup = evsignal_new(the_event_base, SIGHUP, reload_stegs_cb, NULL);
+  if (event_add(sig_hup, NULL))
+    log_abort("failed to initialize signal handling");
+#endif
+#ifdef SIGUSR1
+  if (latency_tracing) {
+    sig_usr1 = evsignal_new(the_event_base, SIGUSR1, dump_latency_cb, NULL);
+    if (event_add(sig_usr1, NULL))
+      log_abort("failed to initialize signal handling");
+  }
+#endif
 
 #ifndef _WIN32
   /* trap and diagnose fatal signals */
@@ -493,6 +579,14 @@ main(int argc, const char *const *argv)
                 (unsigned long)(i - configs.begin()) + 1);
   }
 
+  /* With the event base recorded in the configurations. */
+  steg_start_all();
+
+  if (!metrics_address.empty() &&
+      metrics_listener_open(the_event_base, metrics_address))
+    log_abort("failed to open metrics listener on %s",
+              metrics_address.c_str());
+
   if (!registration_helper.empty()) {
     call_registration_helper(registration_helper);
   }
@@ -521,6 +615,11 @@ main(int argc, const char *const *argv)
   log_debug("cleaning up events");
   event_free(sig_int);
   event_free(sig_term);
+  if (sig_usr1)
+    event_free(sig_usr1);
+  if (sig_hup)
+    event_free(sig_hup);
+  timer_wheel_stop();
 
   // Free evdns base after that
   evdns_base_free(get_evdns_base(), 0);
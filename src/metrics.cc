@@ -0,0 +1,272 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "connections.h"
+#include "metrics.h"
+#include "target_stats.h"
+
+#include <map>
+
+#include <errno.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+using std::map;
+using std::string;
+
+metrics_counters metrics;
+
+namespace {
+  struct metrics_state {
+    map<string, steg_metrics> stegs;
+    struct evconnlistener *listener;
+    string unix_path;
+
+    metrics_state() : listener(NULL) {}
+  };
+}
+
+static metrics_state *ms = NULL;
+
+static metrics_state *
+get_metrics_state()
+{
+  if (!ms)
+    ms = new metrics_state;
+  return ms;
+}
+
+steg_metrics *
+metrics_for_steg(const char *name)
+{
+  map<string, steg_metrics> &stegs = get_metrics_state()->stegs;
+  map<string, steg_metrics>::iterator i = stegs.find(name);
+  if (i == stegs.end()) {
+    steg_metrics zero = steg_metrics();
+    i = stegs.insert(std::make_pair(string(name), zero)).first;
+  }
+  return &i->second;
+}
+
+static void
+append_metric(string &out, const char *name, unsigned long long value)
+{
+  char buf[128];
+  xsnprintf(buf, sizeof buf, "%s %llu\n", name, value);
+  out += buf;
+}
+
+static void
+append_steg_metric(string &out, const char *name, const string &steg,
+                   unsigned long long value)
+{
+  char buf[192];
+  xsnprintf(buf, sizeof buf, "%s{steg=\"%s\"} %llu\n",
+            name, steg.c_str(), value);
+  out += buf;
+}
+
+void
+metrics_snapshot(string &out)
+{
+  memory_governor_stats mem;
+  memory_governor_get_stats(&mem);
+  conn_pool_stats pool;
+  conn_pool_get_stats(&pool);
+
+  append_metric(out, "circuits_active", circuit_count());
+  append_metric(out, "connections_active", conn_count());
+
+  append_metric(out, "blocks_sent", metrics.blocks_sent);
+  append_metric(out, "blocks_received", metrics.blocks_received);
+  append_metric(out, "blocks_retransmitted", metrics.blocks_retransmitted);
+  append_metric(out, "dead_cycles", metrics.dead_cycles);
+  append_metric(out, "handshake_failures", metrics.handshake_failures);
+  append_metric(out, "connections_adopted", metrics.conns_adopted);
+  append_metric(out, "streams_opened", metrics.streams_opened);
+
+  append_metric(out, "payload_cache_hits", metrics.payload_cache_hits);
+  append_metric(out, "payload_cache_misses", metrics.payload_cache_misses);
+  append_metric(out, "gzip_cover_cache_hits", metrics.gzip_cover_hits);
+  append_metric(out, "gzip_cover_cache_misses", metrics.gzip_cover_misses);
+  append_metric(out, "covers_served_warm", metrics.covers_served_warm);
+  append_metric(out, "covers_served_fetched", metrics.covers_served_fetched);
+  if (metrics.covers_served_warm + metrics.covers_served_fetched)
+    append_metric(out, "covers_served_warm_percent",
+                  100 * metrics.covers_served_warm /
+                  (metrics.covers_served_warm + metrics.covers_served_fetched));
+  append_metric(out, "cover_prefetches", metrics.cover_prefetches);
+  append_metric(out, "payload_database_reloads", metrics.payload_database_reloads);
+
+  append_metric(out, "room_requests", metrics.room_requests);
+  append_metric(out, "room_desired_bytes", metrics.room_desired_bytes);
+  append_metric(out, "room_offered_bytes", metrics.room_offered_bytes);
+  append_metric(out, "block_data_bytes", metrics.block_data_bytes);
+  append_metric(out, "block_padding_bytes", metrics.block_padding_bytes);
+  append_metric(out, "upstream_coalesce_holds", metrics.coalesce_holds);
+  append_metric(out, "upstream_coalesce_wait_ms", metrics.coalesce_wait_ms);
+  append_metric(out, "fec_parity_blocks_sent", metrics.fec_parity_sent);
+  append_metric(out, "fec_blocks_recovered", metrics.fec_blocks_recovered);
+  append_metric(out, "hedged_blocks_sent", metrics.hedge_blocks_sent);
+  append_metric(out, "duplicate_blocks_received",
+                metrics.duplicate_blocks_received);
+  append_metric(out, "cover_fetch_failures", metrics.cover_fetch_failures);
+  append_metric(out, "cover_fetch_failovers", metrics.cover_fetch_failovers);
+  append_metric(out, "cover_server_ejections", metrics.cover_server_ejections);
+
+  append_metric(out, "queue_upstream_bytes", mem.breakdown.upstream);
+  append_metric(out, "queue_transmit_bytes", mem.breakdown.transmit_queue);
+  append_metric(out, "queue_reassembly_bytes",
+                mem.breakdown.reassembly_queue);
+  append_metric(out, "queue_steg_buffer_bytes", mem.breakdown.steg_buffers);
+  append_metric(out, "memory_in_use_bytes", mem.in_use);
+  append_metric(out, "memory_peak_bytes", mem.peak);
+  append_metric(out, "circuits_throttled", mem.circuits_throttled);
+  append_metric(out, "circuits_shed", mem.circuits_shed);
+
+  append_metric(out, "conn_pool_idle", pool.idle);
+  append_metric(out, "conn_pool_connecting", pool.connecting);
+  append_metric(out, "conn_pool_wanted", pool.wanted);
+  append_metric(out, "conn_pool_hits", pool.hits);
+  append_metric(out, "conn_pool_misses", pool.misses);
+  append_metric(out, "conn_pool_discarded", pool.discarded);
+
+  target_stats_snapshot(out);
+
+  const map<string, steg_metrics> &stegs = get_metrics_state()->stegs;
+  for (map<string, steg_metrics>::const_iterator i = stegs.begin();
+       i != stegs.end(); ++i) {
+    const steg_metrics &s = i->second;
+    append_steg_metric(out, "steg_blocks_sent", i->first, s.blocks_sent);
+    append_steg_metric(out, "steg_blocks_received", i->first,
+                       s.blocks_received);
+    append_steg_metric(out, "steg_data_bytes_sent", i->first,
+                       s.data_bytes_sent);
+    append_steg_metric(out, "steg_cover_bytes_sent", i->first,
+                       s.cover_bytes_sent);
+    append_steg_metric(out, "steg_data_bytes_received", i->first,
+                       s.data_bytes_received);
+    append_steg_metric(out, "steg_cover_bytes_received", i->first,
+                       s.cover_bytes_received);
+  }
+}
+
+/* The client gets the snapshot and the connection is closed once it
+   has been flushed; nothing the client sends is ever read. */
+
+static void
+metrics_flush_cb(struct bufferevent *bev, void *)
+{
+  bufferevent_free(bev);
+}
+
+static void
+metrics_event_cb(struct bufferevent *bev, short what, void *)
+{
+  if (what & (BEV_EVENT_ERROR|BEV_EVENT_EOF))
+    bufferevent_free(bev);
+}
+
+static void
+metrics_accept_cb(struct evconnlistener *evcl, evutil_socket_t fd,
+                  struct sockaddr *, int, void *)
+{
+  struct event_base *base = evconnlistener_get_base(evcl);
+  struct bufferevent *bev =
+    bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    log_warn("metrics: failed to set up client connection");
+    evutil_closesocket(fd);
+    return;
+  }
+
+  string snapshot;
+  metrics_snapshot(snapshot);
+
+  bufferevent_setcb(bev, NULL, metrics_flush_cb, metrics_event_cb, NULL);
+  if (bufferevent_write(bev, snapshot.data(), snapshot.size()) ||
+      bufferevent_enable(bev, EV_WRITE)) {
+    log_warn("metrics: failed to queue snapshot");
+    bufferevent_free(bev);
+  }
+}
+
+int
+metrics_listener_open(struct event_base *base, const string &address)
+{
+  const unsigned flags =
+    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_CLOSE_ON_EXEC|LEV_OPT_REUSEABLE;
+  metrics_state *st = get_metrics_state();
+
+  log_assert(!st->listener);
+
+  if (address.compare(0, 5, "unix:") == 0) {
+#ifdef _WIN32
+    log_warn("metrics: unix sockets are not supported on this platform");
+    return -1;
+#else
+    struct sockaddr_un sun;
+    string path = address.substr(5);
+    if (path.empty() || path.size() >= sizeof sun.sun_path) {
+      log_warn("metrics: bad unix socket path '%s'", path.c_str());
+      return -1;
+    }
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    memcpy(sun.sun_path, path.c_str(), path.size());
+
+    /* a stale socket from a previous run would make bind fail */
+    unlink(path.c_str());
+    st->listener = evconnlistener_new_bind(base, metrics_accept_cb, NULL,
+                                           flags, -1,
+                                           (struct sockaddr *)&sun,
+                                           sizeof sun);
+    if (st->listener)
+      st->unix_path = path;
+#endif
+  } else {
+    struct evutil_addrinfo *addrs =
+      resolve_address_port(address.c_str(), 1, 1, NULL);
+    if (!addrs)
+      return -1;
+    st->listener = evconnlistener_new_bind(base, metrics_accept_cb, NULL,
+                                           flags, -1,
+                                           addrs->ai_addr, addrs->ai_addrlen);
+    evutil_freeaddrinfo(addrs);
+  }
+
+  if (!st->listener) {
+    log_warn("metrics: failed to open listening socket on %s: %s",
+             address.c_str(),
+             evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    return -1;
+  }
+
+  log_info("metrics available on %s", address.c_str());
+  return 0;
+}
+
+void
+metrics_listener_close(void)
+{
+  if (!ms || !ms->listener)
+    return;
+
+  evconnlistener_free(ms->listener);
+  ms->listener = NULL;
+#ifndef _WIN32
+  if (!ms->unix_path.empty()) {
+    unlink(ms->unix_path.c_str());
+    ms->unix_path.clear();
+  }
+#endif
+}
@@ -0,0 +1,101 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+
+/* Always-on counters describing what the process has been doing.
+   They are plain integers bumped on the hot paths (no locking, we are
+   single threaded) and are only formatted when someone asks for a
+   snapshot, either through the metrics listener or a test. */
+
+struct metrics_counters {
+  unsigned long blocks_sent;
+  unsigned long blocks_received;
+  unsigned long blocks_retransmitted;
+  unsigned long dead_cycles;
+  unsigned long handshake_failures;
+  unsigned long conns_adopted;
+  unsigned long streams_opened;
+
+  unsigned long payload_cache_hits;
+  unsigned long payload_cache_misses;
+  unsigned long gzip_cover_hits;
+  unsigned long gzip_cover_misses;
+
+  /* covers served straight from the payload cache against those which
+     had to be fetched first, and covers fetched ahead of demand */
+  unsigned long covers_served_warm;
+  unsigned long covers_served_fetched;
+  unsigned long cover_prefetches;
+  unsigned long payload_database_reloads;
+
+  /* block packing: what chop asked the steg modules for, what they
+     offered, and how much of the blocks actually sent was data */
+  unsigned long room_requests;
+  unsigned long long room_desired_bytes;
+  unsigned long long room_offered_bytes;
+  unsigned long long block_data_bytes;
+  unsigned long long block_padding_bytes;
+
+  /* upstream coalescing: sends held back waiting for more upstream
+     data, and how long the held data waited in total */
+  unsigned long coalesce_holds;
+  unsigned long long coalesce_wait_ms;
+
+  /* forward error correction: parity blocks sent, and blocks rebuilt
+     from parity instead of waiting for a retransmission */
+  unsigned long fec_parity_sent;
+  unsigned long fec_blocks_recovered;
+
+  /* hedging: blocks sent again on a second connection, and blocks
+     received more than once (from hedging or retransmission) */
+  unsigned long hedge_blocks_sent;
+  unsigned long duplicate_blocks_received;
+
+  /* cover server pool: failed fetches and probes, fetches retried on
+     another server, and servers left out for failing too often */
+  unsigned long cover_fetch_failures;
+  unsigned long cover_fetch_failovers;
+  unsigned long cover_server_ejections;
+};
+
+extern metrics_counters metrics;
+
+/* Per steg module counters.  "data" bytes are the covert payload
+   carried in chop blocks, "cover" bytes are what actually went over
+   (or came off) the wire once the steg module wrapped them. */
+struct steg_metrics {
+  unsigned long blocks_sent;
+  unsigned long blocks_received;
+  unsigned long long data_bytes_sent;
+  unsigned long long cover_bytes_sent;
+  unsigned long long data_bytes_received;
+  unsigned long long cover_bytes_received;
+
+  /* only allocated while latency tracing is on, see latency.h */
+  struct latency_profile *latency;
+};
+
+/** Returns the counters for the steg module called NAME, creating
+    them on first use.  The returned pointer stays valid for the life
+    of the process, so callers should look it up once and keep it. */
+steg_metrics *metrics_for_steg(const char *name);
+
+/** Appends a text snapshot of every counter, the live circuit and
+    connection counts and the memory governor figures to OUT, one
+    "name{label} value" pair per line. */
+void metrics_snapshot(std::string &out);
+
+/** Open a listener on ADDRESS ("host:port" or "unix:/path") which
+    writes a snapshot to every client that connects and then hangs
+    up.  Returns 0 on success, -1 on failure. */
+int metrics_listener_open(struct event_base *base, const std::string &address);
+
+/** Close the metrics listener, if any. */
+void metrics_listener_close(void);
+
+#endif
@@ -32,11 +32,16 @@ const struct option modus_operandi_t::long_options[] = {
     { "log-min-severity", required_argument, NULL, 's' },
     { "no-log", no_argument,NULL, 'n' },
     { "timestamp-logs", no_argument, NULL, 't' },
+    { "sync-logs", no_argument, NULL, 'S' },
     { "allow-kqueue", no_argument, NULL, 'k' },
     { "registration-helper", required_argument, NULL, 'r' },
     { "pid-file", required_argument, NULL, 'p' },
     { "daemon", no_argument, NULL, 'd' },
     { "version", no_argument, NULL, 'v' },
+    { "memory-budget", required_argument, NULL, 'M' },
+    { "circuit-upstream-limit", required_argument, NULL, 'U' },
+    { "metrics-address", required_argument, NULL, 'm' },
+    { "latency-histograms", required_argument, NULL, 'L' },
     { NULL, 0, NULL, 0 }
   };
 
@@ -238,12 +243,22 @@ modus_operandi_t::usage(void)
           "--log-min-severity=warn|info|debug ~ set minimum logging severity\n"
           "--no-log ~ disable logging\n"
           "--timestamp-logs ~ add timestamps to all log messages\n"
+          "--sync-logs ~ write log messages from the event loop rather "
+          "than from a background thread\n"
           "--allow-kqueue ~ allow use of kqueue(2) (may be buggy)\n"
           "--registration-helper=<helper> ~ use <helper> to register with "
           "a relay database\n"
           "--pid-file=<file> ~ write process ID to <file> after startup\n"
           "--daemon ~ run as a daemon\n"
-          "--version ~ show version details and exit\n");
+          "--version ~ show version details and exit\n"
+          "--memory-budget=<MB> ~ shed idle circuits and pause upstream "
+          "reads beyond this much buffered data\n"
+          "--circuit-upstream-limit=<KB> ~ pause reading from an upstream "
+          "once this much of its data awaits transmission\n"
+          "--metrics-address=<host:port>|unix:<path> ~ serve a snapshot "
+          "of the runtime counters to whoever connects there\n"
+          "--latency-histograms=<file> ~ trace per-block latency and "
+          "append the histograms to <file> on SIGUSR1\n");
 
     exit(1);
 }
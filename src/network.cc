@@ -7,12 +7,17 @@
 #include "listener.h"
 
 #include "connections.h"
+#include "latency.h"
 #include "socks.h"
 #include "protocol.h"
+#include "target_stats.h"
 
+#include <algorithm>
+#include <unordered_set>
 #include <vector>
 
 #include <errno.h>
+#include <math.h>
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -21,6 +26,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 
+using std::unordered_set;
 using std::vector;
 
 /** All our listeners. */
@@ -49,6 +55,9 @@ static void downstream_event_cb(struct bufferevent *bev, short what, void *arg);
 static void create_outbound_connections(circuit_t *ckt, bool is_socks);
 static void create_outbound_connections_socks(circuit_t *ckt);
 
+static conn_t *conn_pool_take(config_t *cfg, size_t index);
+static conn_t *conn_pool_take_any(config_t *cfg);
+
 vector<listener_t *> const& get_all_listeners()
 {
   return listeners;
@@ -102,6 +111,7 @@ listener_open(struct event_base *base, config_t *cfg)
     } while (addrs);
   }
 
+  conn_pool_open(cfg);
   return 1;
 }
 
@@ -179,6 +189,8 @@ client_listener_cb(struct evconnlistener *, evutil_socket_t fd,
   } else {
     bufferevent_setcb(buf, upstream_read_cb, upstream_flush_cb,
                       upstream_event_cb, ckt);
+    if (lsn->cfg->adopt_upstream(ckt))
+      return;
     create_outbound_connections(ckt, false);
     /* Don't enable reading or writing till the outbound connection(s) are
        established. */
@@ -486,6 +498,18 @@ upstream_connect_cb(struct bufferevent *bev, short what, void *arg)
   upstream_event_cb(bev, what, arg);
 }
 
+/**
+   Tell the statistics of CONN's target that it is now usable.
+*/
+static void
+note_connected(conn_t *conn)
+{
+  if (conn->target && !conn->connected_at) {
+    conn->target->connected(conn->connect_start);
+    conn->connected_at = latency_now();
+  }
+}
+
 /**
    Called when a downstream connection has just been established, or
    failed to establish.
@@ -500,6 +524,7 @@ downstream_connect_cb(struct bufferevent *bev, short what, void *arg)
      connection, and replace this callback with the regular event_cb */
   if (what & BEV_EVENT_CONNECTED) {
     circuit_t *ckt = conn->circuit();
+    note_connected(conn);
     if ((!ckt) || conn->write_eof) {
       // This can happen if the 3-way handshake for a new connection
       // began while the circuit was still active but ended after the
@@ -510,6 +535,7 @@ downstream_connect_cb(struct bufferevent *bev, short what, void *arg)
       // proceed as writing in the connection buffer will result in
       // broken pipe error.
       log_debug(conn, "successful connection for stale circuit");
+      conn->target = 0; // not the target's fault
       conn->close();
       return;
     }
@@ -591,6 +617,7 @@ downstream_socks_connect_cb(struct bufferevent *bev, short what, void *arg)
      protocol handlers. */
   if (what & BEV_EVENT_CONNECTED) {
     struct sockaddr_storage ss;
+    note_connected(conn);
     struct sockaddr *sa = (struct sockaddr*)&ss;
     socklen_t slen = sizeof(&ss);
 
@@ -729,6 +756,8 @@ create_one_outbound_connection(circuit_t *ckt, struct evutil_addrinfo *addr,
 
  success:
   conn = conn_create(cfg, index, buf, peername);
+  conn->target = target_stats_get(cfg, index);
+  conn->connect_start = latency_now();
   ckt->add_downstream(conn);
   bufferevent_setcb(buf, downstream_read_cb, downstream_flush_cb,
                     is_socks ? downstream_socks_connect_cb
@@ -742,9 +771,17 @@ create_outbound_connections(circuit_t *ckt, bool is_socks)
   struct evutil_addrinfo *addr;
   size_t n = 0;
   bool any_successes = false;
+  vector<conn_t *> pooled;
 
   while ((addr = ckt->cfg()->get_target_addrs(n))) {
-    any_successes |= create_one_outbound_connection(ckt, addr, n, is_socks);
+    conn_t *conn = conn_pool_take(ckt->cfg(), n);
+    if (conn) {
+      ckt->add_downstream(conn);
+      pooled.push_back(conn);
+      any_successes = true;
+    } else {
+      any_successes |= create_one_outbound_connection(ckt, addr, n, is_socks);
+    }
     n++;
   }
 
@@ -756,18 +793,68 @@ create_outbound_connections(circuit_t *ckt, bool is_socks)
     log_warn(ckt, "no outbound connections were successful");
     ckt->close();
   }
+
+  /* Pooled connections are already established; go through the
+     connect callback for them now that the circuit has all of its new
+     connections, since it may transmit right away.  */
+  for (vector<conn_t *>::iterator i = pooled.begin(); i != pooled.end(); ++i) {
+    conn_t *conn = *i;
+    if (is_socks && conn->circuit())
+      downstream_socks_connect_cb(conn->buffer, BEV_EVENT_CONNECTED, conn);
+    else
+      downstream_connect_cb(conn->buffer, BEV_EVENT_CONNECTED, conn);
+  }
+}
+
+/**
+   Open one more connection for CKT, to the target picked by
+   target_select, rather than one to every target.  Falls back on
+   connecting to every target if that fails straight away.
+*/
+static void
+reopen_selected_downstream(circuit_t *ckt)
+{
+  config_t *cfg = ckt->cfg();
+  size_t n = 0;
+  while (cfg->get_target_addrs(n))
+    n++;
+
+  if (n > 1) {
+    size_t index = target_select(cfg);
+    log_debug(ckt, "reopening to target %lu of %lu",
+              (unsigned long)index, (unsigned long)n);
+
+    conn_t *conn = conn_pool_take(cfg, index);
+    if (conn) {
+      ckt->add_downstream(conn);
+      downstream_connect_cb(conn->buffer, BEV_EVENT_CONNECTED, conn);
+      return;
+    }
+    if (create_one_outbound_connection(ckt, cfg->get_target_addrs(index),
+                                       index, false))
+      return;
+  }
+
+  create_outbound_connections(ckt, false);
 }
 
 void
 circuit_reopen_downstreams(circuit_t *ckt)
 {
+  // A pooled connection is open already, so taking one adds nothing
+  // to the count; a new one has to fit under the limit.
   if (conn_count() >= MAX_GLOBAL_CONN_COUNT) {
+    conn_t *conn = conn_pool_take_any(ckt->cfg());
+    if (conn) {
+      ckt->add_downstream(conn);
+      downstream_connect_cb(conn->buffer, BEV_EVENT_CONNECTED, conn);
+      return;
+    }
     //maybe we just need to wait a bit
-      log_warn(ckt, "global maximum number of connection is reached. global number of conn: %zu. unable to create more connection", conn_count());
-      
+    log_warn(ckt, "global maximum number of connection is reached. global number of conn: %zu. unable to create more connection", conn_count());
   }
   else
-    create_outbound_connections(ckt, false);
+    reopen_selected_downstream(ckt);
 }
 
 static void
@@ -789,7 +876,8 @@ create_outbound_connections_socks(circuit_t *ckt)
   /* XXXX Feed socks state through the protocol and get a connection set.
      This is a stopgap. */
   if (ckt->cfg()->ignore_socks_destination) {
-    create_outbound_connections(ckt, true);
+    if (!cfg->adopt_upstream(ckt))
+      create_outbound_connections(ckt, true);
     return;
   }
 
@@ -820,6 +908,404 @@ create_outbound_connections_socks(circuit_t *ckt)
     bufferevent_free(buf);
 }
 
+/* Pre-warmed downstream connections, see connections.h.  A pooled
+   connection belongs to no circuit; the pool installs its own
+   bufferevent callbacks on it, so that one the peer gives up on while
+   it is idle gets noticed and replaced, until conn_pool_take gives it
+   away. */
+
+namespace {
+  const unsigned int c_POOL_TICK_MS = 1000;
+  /* Idle connections older than this are replaced with fresh ones;
+     the peer may not be willing to wait forever for a request. */
+  const time_t c_POOL_IDLE_LIMIT_SECS = 30;
+  const double c_POOL_EWMA_WEIGHT = 0.3;
+  /* seconds; used until the first pooled connect completes */
+  const double c_POOL_INITIAL_CONNECT_TIME = 0.2;
+
+  struct conn_pool;
+
+  struct pooled_conn {
+    conn_pool *pool;
+    size_t index;
+    conn_t *conn;
+    uint64_t connect_start;     /* latency_now() */
+  };
+
+  struct conn_pool_target {
+    vector<pooled_conn *> idle; /* in the order they connected */
+    unordered_set<pooled_conn *> connecting;
+    size_t wanted;
+    unsigned int taken;         /* since the last tick */
+    double take_rate;           /* connections per second */
+    double connect_time;        /* seconds */
+
+    conn_pool_target()
+      : wanted(1), taken(0), take_rate(0),
+        connect_time(c_POOL_INITIAL_CONNECT_TIME)
+    {}
+  };
+
+  struct conn_pool {
+    config_t *cfg;
+    vector<conn_pool_target> targets;
+    struct event *tick;
+    struct event *refill;
+  };
+
+  struct conn_pool_state {
+    vector<conn_pool *> pools;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long discarded;
+
+    conn_pool_state() : hits(0), misses(0), discarded(0) {}
+  };
+}
+
+static conn_pool_state *cps = NULL;
+
+static conn_pool *
+conn_pool_find(config_t *cfg)
+{
+  if (!cps)
+    return NULL;
+
+  for (vector<conn_pool *>::iterator i = cps->pools.begin();
+       i != cps->pools.end(); ++i)
+    if ((*i)->cfg == cfg)
+      return *i;
+  return NULL;
+}
+
+/** Forget about PC and close its connection. */
+static void
+conn_pool_discard(pooled_conn *pc)
+{
+  conn_pool_target &t = pc->pool->targets[pc->index];
+  vector<pooled_conn *>::iterator i =
+    std::find(t.idle.begin(), t.idle.end(), pc);
+  if (i != t.idle.end())
+    t.idle.erase(i);
+  t.connecting.erase(pc);
+
+  pc->conn->close();
+  delete pc;
+}
+
+static void
+pool_idle_read_cb(struct bufferevent *, void *arg)
+{
+  pooled_conn *pc = (pooled_conn *)arg;
+  log_info(pc->conn, "unexpected data on idle pooled connection");
+  cps->discarded++;
+  conn_pool_discard(pc);
+}
+
+static void
+pool_idle_event_cb(struct bufferevent *, short what, void *arg)
+{
+  pooled_conn *pc = (pooled_conn *)arg;
+  conn_pool *pool = pc->pool;
+  log_debug(pc->conn, "idle pooled connection lost: what=%04hx", what);
+  cps->discarded++;
+  conn_pool_discard(pc);
+  event_active(pool->refill, EV_TIMEOUT, 0);
+}
+
+static void
+pool_connect_cb(struct bufferevent *bev, short what, void *arg)
+{
+  pooled_conn *pc = (pooled_conn *)arg;
+  conn_pool_target &t = pc->pool->targets[pc->index];
+
+  target_stats *stats = target_stats_get(pc->pool->cfg, pc->index);
+  if (!(what & BEV_EVENT_CONNECTED)) {
+    /* the next tick tries again */
+    log_info(pc->conn, "pooled connection failed: %s",
+             evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    stats->failed();
+    conn_pool_discard(pc);
+    return;
+  }
+  stats->connected(pc->connect_start);
+
+  double elapsed = (latency_now() - pc->connect_start) / 1e6;
+  t.connect_time += c_POOL_EWMA_WEIGHT * (elapsed - t.connect_time);
+
+  t.connecting.erase(pc);
+  t.idle.push_back(pc);
+  pc->conn->connected = 1;
+
+  /* Keep reading, so that we see the peer closing the connection. */
+  bufferevent_setcb(bev, pool_idle_read_cb, NULL, pool_idle_event_cb, pc);
+  bufferevent_disable(bev, EV_WRITE);
+  bufferevent_enable(bev, EV_READ);
+  log_debug(pc->conn, "pooled connection ready after %.3fs", elapsed);
+}
+
+static bool
+conn_pool_connect(conn_pool *pool, size_t index)
+{
+  config_t *cfg = pool->cfg;
+  struct evutil_addrinfo *addr = cfg->get_target_addrs(index);
+  struct bufferevent *buf;
+  char *peername;
+
+  buf = bufferevent_socket_new(cfg->base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (!buf) {
+    log_warn("unable to create outbound socket buffer");
+    return false;
+  }
+
+  for (; addr; addr = addr->ai_next) {
+    peername = printable_address(addr->ai_addr, addr->ai_addrlen);
+    if (bufferevent_socket_connect(buf,
+                                   addr->ai_addr,
+                                   addr->ai_addrlen) >= 0) {
+      pooled_conn *pc = new pooled_conn;
+      pc->pool = pool;
+      pc->index = index;
+      pc->conn = conn_create(cfg, index, buf, peername);
+      pc->connect_start = latency_now();
+      pool->targets[index].connecting.insert(pc);
+      bufferevent_setcb(buf, NULL, NULL, pool_connect_cb, pc);
+      log_debug(pc->conn, "opening pooled connection to %s", peername);
+      return true;
+    }
+
+    log_info("pooled connection to %s failed: %s", peername,
+             evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    free(peername);
+  }
+
+  bufferevent_free(buf);
+  return false;
+}
+
+static void
+conn_pool_refill(conn_pool *pool)
+{
+  for (size_t i = 0; i < pool->targets.size(); i++) {
+    conn_pool_target &t = pool->targets[i];
+    while (t.idle.size() + t.connecting.size() < t.wanted) {
+      // leave a quarter of the connections to the circuits
+      if (conn_count() >= MAX_GLOBAL_CONN_COUNT - MAX_GLOBAL_CONN_COUNT / 4) {
+        log_debug("not refilling connection pool, %zu connections open",
+                  conn_count());
+        return;
+      }
+      if (!conn_pool_connect(pool, i))
+        break;
+    }
+  }
+}
+
+static void
+conn_pool_refill_cb(evutil_socket_t, short, void *arg)
+{
+  conn_pool_refill((conn_pool *)arg);
+}
+
+/**
+   Once a second: update each target's consumption rate and pool size
+   from it, close idle connections that are surplus or have been
+   waiting too long as of NOW, and refill.
+*/
+static void
+conn_pool_maintain(conn_pool *pool, time_t now)
+{
+
+  for (size_t i = 0; i < pool->targets.size(); i++) {
+    conn_pool_target &t = pool->targets[i];
+
+    t.take_rate += c_POOL_EWMA_WEIGHT *
+      (t.taken * 1000.0 / c_POOL_TICK_MS - t.take_rate);
+    t.taken = 0;
+
+    // enough to cover what circuits take while we reconnect, with
+    // room for bursts
+    size_t wanted = (size_t)ceil(2 * t.take_rate * t.connect_time);
+    t.wanted = std::max<size_t>(1, std::min<size_t>(wanted,
+                                                    pool->cfg->conn_pool_size));
+
+    while (!t.idle.empty() &&
+           (t.idle.size() > t.wanted ||
+            now - t.idle.front()->conn->creation_time >
+            c_POOL_IDLE_LIMIT_SECS)) {
+      log_debug(t.idle.front()->conn, "closing idle pooled connection");
+      cps->discarded++;
+      conn_pool_discard(t.idle.front());
+    }
+  }
+
+  conn_pool_refill(pool);
+}
+
+static void
+conn_pool_tick_cb(evutil_socket_t, short, void *arg)
+{
+  conn_pool_maintain((conn_pool *)arg, time(NULL));
+}
+
+/**
+   Hand a pooled connection to target INDEX of CFG over to the caller,
+   with the regular downstream callbacks installed, or return NULL if
+   there is none.  Either way the pool is refilled soon.
+*/
+static conn_t *
+conn_pool_take(config_t *cfg, size_t index)
+{
+  conn_pool *pool = conn_pool_find(cfg);
+  if (!pool || index >= pool->targets.size())
+    return NULL;
+
+  conn_pool_target &t = pool->targets[index];
+  t.taken++;
+  event_active(pool->refill, EV_TIMEOUT, 0);
+
+  if (t.idle.empty()) {
+    cps->misses++;
+    return NULL;
+  }
+
+  // the most recent one is the least likely to have been given up on
+  pooled_conn *pc = t.idle.back();
+  t.idle.pop_back();
+  conn_t *conn = pc->conn;
+  delete pc;
+  cps->hits++;
+
+  /* The connect time went into the target's statistics already, what
+     the connection carries from now on is the circuit's doing. */
+  conn->target = target_stats_get(cfg, index);
+  conn->connected_at = latency_now();
+
+  bufferevent_setcb(conn->buffer, downstream_read_cb, downstream_flush_cb,
+                    downstream_event_cb, conn);
+  log_debug(conn, "taken from the connection pool");
+  return conn;
+}
+
+/**
+   Like conn_pool_take, for whichever target of CFG has an idle
+   connection, trying the one target_select picks first.
+*/
+static conn_t *
+conn_pool_take_any(config_t *cfg)
+{
+  conn_pool *pool = conn_pool_find(cfg);
+  if (!pool || pool->targets.empty())
+    return NULL;
+
+  size_t n = pool->targets.size();
+  size_t first = n > 1 ? target_select(cfg) : 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t index = (first + i) % n;
+    if (!pool->targets[index].idle.empty())
+      return conn_pool_take(cfg, index);
+  }
+  return NULL;
+}
+
+void
+conn_pool_open(config_t *cfg)
+{
+  // A SOCKS client that honors the destination has no fixed targets.
+  if (!cfg->conn_pool_size || cfg->mode == LSN_SIMPLE_SERVER ||
+      (cfg->mode == LSN_SOCKS_CLIENT && !cfg->ignore_socks_destination))
+    return;
+
+  if (!cps)
+    cps = new conn_pool_state;
+
+  conn_pool *pool = new conn_pool;
+  pool->cfg = cfg;
+  size_t n = 0;
+  while (cfg->get_target_addrs(n))
+    n++;
+  pool->targets.resize(n);
+
+  pool->tick = event_new(cfg->base, -1, EV_PERSIST, conn_pool_tick_cb, pool);
+  pool->refill = event_new(cfg->base, -1, 0, conn_pool_refill_cb, pool);
+  if (!pool->tick || !pool->refill)
+    log_abort("failed to create connection pool events");
+
+  struct timeval tv;
+  tv.tv_sec = c_POOL_TICK_MS / 1000;
+  tv.tv_usec = (c_POOL_TICK_MS % 1000) * 1000;
+  if (event_add(pool->tick, &tv))
+    log_abort("failed to schedule connection pool maintenance");
+
+  cps->pools.push_back(pool);
+  log_info("keeping up to %u connections per target ready for %s",
+           cfg->conn_pool_size, cfg->name());
+  event_active(pool->refill, EV_TIMEOUT, 0);
+}
+
+void
+conn_pool_close_all(void)
+{
+  if (!cps)
+    return;
+
+  for (vector<conn_pool *>::iterator i = cps->pools.begin();
+       i != cps->pools.end(); ++i) {
+    conn_pool *pool = *i;
+    event_free(pool->tick);
+    event_free(pool->refill);
+
+    for (vector<conn_pool_target>::iterator t = pool->targets.begin();
+         t != pool->targets.end(); ++t) {
+      for (vector<pooled_conn *>::iterator j = t->idle.begin();
+           j != t->idle.end(); ++j) {
+        (*j)->conn->close();
+        delete *j;
+      }
+      for (unordered_set<pooled_conn *>::iterator j = t->connecting.begin();
+           j != t->connecting.end(); ++j) {
+        (*j)->conn->close();
+        delete *j;
+      }
+    }
+    delete pool;
+  }
+
+  delete cps;
+  cps = NULL;
+}
+
+void
+conn_pool_maintain_all(time_t now)
+{
+  if (!cps)
+    return;
+
+  for (vector<conn_pool *>::iterator i = cps->pools.begin();
+       i != cps->pools.end(); ++i)
+    conn_pool_maintain(*i, now);
+}
+
+void
+conn_pool_get_stats(conn_pool_stats *stats)
+{
+  memset(stats, 0, sizeof *stats);
+  if (!cps)
+    return;
+
+  stats->hits = cps->hits;
+  stats->misses = cps->misses;
+  stats->discarded = cps->discarded;
+  for (vector<conn_pool *>::iterator i = cps->pools.begin();
+       i != cps->pools.end(); ++i)
+    for (vector<conn_pool_target>::iterator t = (*i)->targets.begin();
+         t != (*i)->targets.end(); ++t) {
+      stats->idle += t->idle.size();
+      stats->connecting += t->connecting.size();
+      stats->wanted += t->wanted;
+    }
+}
+
 void
 circuit_do_flush(circuit_t *ckt)
 {
@@ -0,0 +1,295 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "packet_trace.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+using std::map;
+using std::string;
+
+namespace {
+  /* 64k records (2.5MB).  The ring only has to absorb the records
+     produced while the writer thread is busy writing. */
+  const uint32_t c_RING_SIZE = 1 << 16;
+  const uint32_t c_RING_MASK = c_RING_SIZE - 1;
+}
+
+/* The ring has a single producer, the event loop, and a single
+   consumer, the writer thread: only the producer moves 'head' and only
+   the writer moves 'tail', so the ring itself needs no lock.  The
+   writer sleeps on 'wake' until there is something in the ring or it
+   is told to stop; the producer only takes the lock to wake it when it
+   has said it is going to sleep ('idle'). */
+struct packet_trace
+{
+  int fd;
+  string path;
+  unsigned int refs;
+  trace_record *ring;
+  std::atomic<uint32_t> head;    // records ever put in the ring
+  std::atomic<uint32_t> tail;    // records ever written out
+  std::atomic<unsigned long> dropped;
+  std::atomic<bool> idle;
+  std::atomic<bool> stop;
+  bool writer_failed;            // don't try to start it again
+  std::thread writer;
+  std::mutex sleep_lock;
+  std::condition_variable wake;
+
+  packet_trace()
+    : fd(-1), refs(1), ring(new trace_record[c_RING_SIZE]),
+      head(0), tail(0), dropped(0), idle(false), stop(false),
+      writer_failed(false) {}
+  ~packet_trace() { delete [] ring; }
+};
+
+/* Open traces by path.  Only the event loop thread opens and closes
+   them. */
+static map<string, packet_trace *> *traces = NULL;
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = (const char *)buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/** Helper: write out everything in the ring of T, then a
+    TRACE_DROPPED record if anything was lost.  Only the writer thread
+    calls this while it runs. */
+static void
+packet_trace_drain(packet_trace *t)
+{
+  uint32_t tail = t->tail.load(std::memory_order_relaxed);
+  uint32_t head = t->head.load(std::memory_order_acquire);
+  while (tail != head) {
+    uint32_t start = tail & c_RING_MASK;
+    uint32_t n = std::min(head - tail, c_RING_SIZE - start);
+    if (write_all(t->fd, &t->ring[start], n * sizeof(trace_record))) {
+      log_warn("failed to write packet trace to %s: %s",
+               t->path.c_str(), strerror(errno));
+      t->dropped.fetch_add(head - tail);
+      tail = head;
+      t->tail.store(tail, std::memory_order_release);
+      break;
+    }
+    tail += n;
+    t->tail.store(tail, std::memory_order_release);
+  }
+
+  unsigned long dropped = t->dropped.exchange(0);
+  if (dropped) {
+    trace_record r;
+    memset(&r, 0, sizeof r);
+    r.timestamp = log_get_timestamp();
+    r.kind = TRACE_DROPPED;
+    r.seqno = dropped > UINT32_MAX ? UINT32_MAX : dropped;
+    if (write_all(t->fd, &r, sizeof r))
+      t->dropped.fetch_add(dropped);
+  }
+}
+
+/** The writer thread: write out the ring of T until told to stop. */
+static void
+packet_trace_writer(packet_trace *t)
+{
+  for (;;) {
+    packet_trace_drain(t);
+    if (t->stop.load())
+      return;
+
+    std::unique_lock<std::mutex> guard(t->sleep_lock);
+    t->idle.store(true);
+    while (!t->stop.load() &&
+           t->head.load() == t->tail.load(std::memory_order_relaxed))
+      t->wake.wait(guard);
+    t->idle.store(false);
+  }
+}
+
+packet_trace *
+packet_trace_open(const char *path)
+{
+  if (!traces)
+    traces = new map<string, packet_trace *>;
+
+  map<string, packet_trace *>::iterator i = traces->find(path);
+  if (i != traces->end()) {
+    i->second->refs++;
+    return i->second;
+  }
+
+  int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    log_warn("failed to open packet trace %s: %s", path, strerror(errno));
+    return NULL;
+  }
+
+  trace_file_header hdr;
+  memcpy(hdr.magic, c_TRACE_MAGIC, sizeof hdr.magic);
+  hdr.version = c_TRACE_VERSION;
+  hdr.record_size = sizeof(trace_record);
+  if (write_all(fd, &hdr, sizeof hdr)) {
+    log_warn("failed to write packet trace %s: %s", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  packet_trace *t = new packet_trace;
+  t->fd = fd;
+  t->path = path;
+  (*traces)[path] = t;
+  log_info("tracing packets to %s", path);
+  return t;
+}
+
+void
+packet_trace_close(packet_trace *t)
+{
+  if (!t || --t->refs > 0)
+    return;
+
+  if (t->writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(t->sleep_lock);
+      t->stop.store(true);
+      t->wake.notify_one();
+    }
+    t->writer.join();
+  } else {
+    // nothing was recorded, or the writer failed to start: all there
+    // may be to write is the count of the records dropped
+    packet_trace_drain(t);
+  }
+  close(t->fd);
+
+  traces->erase(t->path);
+  if (traces->empty()) {
+    delete traces;
+    traces = NULL;
+  }
+  delete t;
+}
+
+/** Helper: start the writer thread of T.  It is started with the
+    first record rather than by packet_trace_open, which runs before
+    daemonize and would leave the thread behind in the parent. */
+static bool
+packet_trace_start_writer(packet_trace *t)
+{
+  if (t->writer_failed)
+    return false;
+  try {
+    t->writer = std::thread(packet_trace_writer, t);
+  } catch (const std::system_error &) {
+    log_warn("failed to start the packet trace writer for %s",
+             t->path.c_str());
+    t->writer_failed = true;
+    return false;
+  }
+  return true;
+}
+
+static trace_record *
+next_record(packet_trace *t)
+{
+  if (!t->writer.joinable() && !packet_trace_start_writer(t)) {
+    t->dropped.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+
+  uint32_t head = t->head.load(std::memory_order_relaxed);
+  if (head - t->tail.load(std::memory_order_acquire) == c_RING_SIZE) {
+    t->dropped.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+  return &t->ring[head & c_RING_MASK];
+}
+
+/** Helper: hand the record next_record returned to the writer. */
+static void
+publish_record(packet_trace *t)
+{
+  t->head.fetch_add(1);
+  if (t->idle.load()) {
+    std::lock_guard<std::mutex> guard(t->sleep_lock);
+    t->wake.notify_one();
+  }
+}
+
+void
+packet_trace_block(packet_trace *t, trace_kind kind, uint32_t circuit,
+                   uint32_t window, size_t outq, uint32_t seqno,
+                   size_t dlen, size_t plen,
+                   unsigned int opcode, unsigned int rcount)
+{
+  trace_record *r = next_record(t);
+  if (!r)
+    return;
+
+  r->timestamp = log_get_timestamp();
+  r->circuit = circuit;
+  r->window = window;
+  r->outq = outq > UINT32_MAX ? UINT32_MAX : outq;
+  r->seqno = seqno;
+  r->dlen = dlen;
+  r->plen = plen;
+  r->opcode = opcode;
+  r->rcount = rcount;
+  r->kind = kind;
+  memset(r->check, 0, sizeof r->check);
+  memset(r->unused, 0, sizeof r->unused);
+  publish_record(t);
+}
+
+void
+packet_trace_bad_header(packet_trace *t, uint32_t circuit, uint32_t window,
+                        size_t outq, const uint8_t *hdr)
+{
+  trace_record *r = next_record(t);
+  if (!r)
+    return;
+
+  /* same layout as chop_blk::header */
+  r->timestamp = log_get_timestamp();
+  r->circuit = circuit;
+  r->window = window;
+  r->outq = outq > UINT32_MAX ? UINT32_MAX : outq;
+  r->seqno = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+             ((uint32_t)hdr[2] << 8) | hdr[3];
+  r->dlen = ((uint16_t)hdr[4] << 8) | hdr[5];
+  r->plen = ((uint16_t)hdr[6] << 8) | hdr[7];
+  r->opcode = hdr[8];
+  r->rcount = hdr[9];
+  r->kind = TRACE_RECV_ERROR;
+  memcpy(r->check, hdr + 10, sizeof r->check);
+  memset(r->unused, 0, sizeof r->unused);
+  publish_record(t);
+}
@@ -0,0 +1,79 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef PACKET_TRACE_H
+#define PACKET_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary packet trace.  Chop's trace-packets option used to fprintf a
+   line per block to stderr, which slowed the process down so much
+   that the traces did not reflect its real behaviour.  Now every
+   block event is stored as a fixed size record in an in-memory ring,
+   and a writer thread writes the ring out to the trace file, so the
+   event loop never waits on the disk.  trace_decode turns the file
+   back into the old text format or into CSV. */
+
+enum trace_kind {
+  TRACE_SEND = 0,
+  TRACE_RESEND,
+  TRACE_RECV,
+  TRACE_RECV_ERROR,  /* bad header, the raw decrypted header is kept */
+  TRACE_DROPPED      /* the ring overflowed; seqno holds the count */
+};
+
+/* All fields are in host byte order. */
+struct trace_record {
+  double timestamp;   /* log_get_timestamp() */
+  uint32_t circuit;   /* circuit serial */
+  uint32_t window;    /* receive window (next seqno to process) */
+  uint32_t outq;      /* bytes waiting in the upstream buffer */
+  uint32_t seqno;
+  uint16_t dlen;
+  uint16_t plen;
+  uint8_t opcode;
+  uint8_t rcount;
+  uint8_t kind;       /* trace_kind */
+  uint8_t check[6];   /* TRACE_RECV_ERROR only: header check bytes */
+  uint8_t unused[3];
+};
+
+struct trace_file_header {
+  char magic[8];          /* c_TRACE_MAGIC, not nul terminated */
+  uint32_t version;       /* c_TRACE_VERSION, also tells the byte order */
+  uint32_t record_size;   /* sizeof(trace_record) */
+};
+
+const char c_TRACE_MAGIC[8] = { 'S', 'T', 'G', 'T', 'R', 'A', 'C', 'E' };
+const uint32_t c_TRACE_VERSION = 1;
+
+struct packet_trace;
+
+/** Open (truncate) the trace file at PATH.  Its writer thread only
+    starts with the first record, so that a trace opened with the
+    configuration, before daemonize forks, is written by the daemon.
+    Chop configurations tracing to the same path share the trace; a
+    path already open only gets another reference.  Returns NULL on
+    failure. */
+packet_trace *packet_trace_open(const char *path);
+
+/** Drop a reference to TRACE.  The last one writes out whatever is in
+    the ring, stops the writer thread if it was started and closes the
+    trace file. */
+void packet_trace_close(packet_trace *trace);
+
+/** Record a block event in TRACE.  Only the thread that opened the
+    trace may record in it. */
+void packet_trace_block(packet_trace *trace, trace_kind kind,
+                        uint32_t circuit, uint32_t window, size_t outq,
+                        uint32_t seqno, size_t dlen, size_t plen,
+                        unsigned int opcode, unsigned int rcount);
+
+/** Record a block whose decrypted header HDR (16 bytes) was invalid. */
+void packet_trace_bad_header(packet_trace *trace, uint32_t circuit,
+                             uint32_t window, size_t outq,
+                             const uint8_t *hdr);
+
+#endif
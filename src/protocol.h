@@ -38,10 +38,13 @@ struct config_t
   enum listen_mode           mode;
   /* stopgap, see create_outbound_connections_socks */
   bool ignore_socks_destination : 1;
+  /* client only: upper bound on the idle connections kept per target
+     address, see conn_pool_open; 0 disables the pool */
+  unsigned int conn_pool_size;
 
   std::map<std::string, user_config_dict_t> steg_mod_user_configs;
 
-  config_t() : base(0), mode((enum listen_mode)-1) {}
+  config_t() : base(0), mode((enum listen_mode)-1), conn_pool_size(0) {}
   virtual ~config_t();
 
     DISALLOW_COPY_AND_ASSIGN(config_t);
@@ -94,6 +97,12 @@ struct config_t
       argument to get_listen_addrs or get_target_addrs that retrieved
       the address to which the socket is bound.  */
   virtual conn_t *conn_create(size_t index) = 0;
+
+  /** Offer the upstream connection of CKT, a new client circuit that
+      has no downstream connections yet, to an existing circuit that
+      can carry it alongside its own.  Returns true if one took it;
+      CKT has then been closed.  By default no circuit does. */
+  virtual bool adopt_upstream(circuit_t *) { return false; }
 };
 
 int config_is_supported(const char *name);
@@ -26,8 +26,13 @@
 #include "chop_blk.h"
 #include "chop_handshaker.h"
 #include "connections.h"
+#include "latency.h"
+#include "metrics.h"
+#include "packet_trace.h"
+#include "target_stats.h"
 #include "protocol.h"
 #include "rng.h"
+#include "socks.h"
 #include "steg.h"
 
 #include "transparent_proxy.h"
@@ -37,12 +42,21 @@
    being implemented, and may change incompatibly.  */
 
 #define MAX_CONN_PER_CIRCUIT 8
+/* server side cap on the multiplexed streams of a circuit */
+/* transmit queue slots that stream data (and data protected by
+   parity, which takes slots of its own) leaves free for ACKs */
+#define STREAM_QUEUE_RESERVE 16
+/* ms without more data before a short parity group is closed */
+#define FEC_FLUSH_DELAY 20
+/* data bytes up to which a block counts as small enough to hedge */
+#define HEDGE_DEFAULT_SIZE 256
 
 using std::unordered_map;
 using std::unordered_set;
 using std::vector;
 using std::make_pair;
 using std::min;
+using std::map;
 
 using namespace chop_blk;
 
@@ -54,6 +68,30 @@ struct chop_config_t;
 
 typedef unordered_map<uint32_t, chop_circuit_t *> chop_circuit_table;
 
+/* An upstream connection carried by a circuit besides its own
+   up_buffer (multiplex-streams).  The client opens them; the server
+   connects each one to its up-address.  EOF flags are relative to
+   upstream, as for circuits. */
+struct chop_stream : stream_state
+{
+  chop_circuit_t *ckt;
+  uint16_t id;
+  struct bufferevent *buf;
+  const char *peername;
+
+  chop_stream(chop_circuit_t *c, uint16_t i)
+    : ckt(c), id(i), buf(NULL), peername(NULL) {}
+
+  /* true if the stream has a block to send */
+  bool pending() const
+  {
+    return !sent_open || (!sent_fin && (read_eof ||
+      evbuffer_get_length(bufferevent_get_input(buf)) > 0));
+  }
+
+  DISALLOW_COPY_AND_ASSIGN(chop_stream);
+};
+
 struct chop_conn_t : conn_t
 {
   chop_config_t *config;
@@ -63,18 +101,26 @@ struct chop_conn_t : conn_t
   uint8_t *originally_received; //Keep a copy of pending in case we need 
   size_t received_length;
   //to become a transparent proxy
-  struct event *must_send_timer;
+  wheel_timer must_send_timer;
   bool sent_handshake : 1;
   bool no_more_transmissions : 1;
 
+  // latency tracing: when the oldest block not yet reported as on
+  // the wire was handed to the connection
+  uint64_t wire_since;
+  struct evbuffer_cb_entry *wire_watch;
+
   CONN_DECLARE_METHODS(chop);
 
   int recv_handshake();
   int send(struct evbuffer *block);
+  void watch_wire(uint64_t now);
+  static void wire_drained_cb(struct evbuffer *, const struct evbuffer_cb_info *info,
+                              void *arg);
 
   void send();
   bool must_send_p() const;
-  static void must_send_timeout(evutil_socket_t, short, void *arg);
+  static void must_send_timeout(void *arg);
 
   /**
    In case the connection is transparentized or needed to be closed
@@ -104,11 +150,45 @@ struct chop_circuit_t : circuit_t
   bool sent_fin : 1;
   bool upstream_eof : 1;
 
-  //For debug and tracking performance we keep track of average room
-  //desirable and offered size
-  double avg_desirable_size;
-  double avg_available_size;
-  unsigned long number_of_room_requests;
+  // latency tracing, NULL/0 unless it is enabled
+  latency_profile *latency;
+  uint64_t upstream_since; // upstream data waiting since
+
+  // upstream coalescing (coalesce-max-delay): how fast upstream data
+  // has been arriving, how big a block the connections usually take,
+  // and since when we have been holding data back, or 0
+  double upstream_rate;    // bytes per second, smoothed
+  size_t upstream_seen;    // upstream bytes waiting when last looked at
+  uint64_t upstream_seen_at;
+  size_t room_estimate;    // whole block, smoothed
+  uint64_t coalesce_since;
+
+  // multiplexed streams (multiplex-streams) by id; up_buffer is
+  // stream 0.  send serves them in turn, starting after stream_turn.
+  map<uint16_t, chop_stream *> streams;
+  uint16_t next_stream_id;
+  uint16_t stream_turn;
+
+  // forward error correction (fec): parity over the blocks we send,
+  // NULL unless configured, with the serials of the connections that
+  // carried blocks since the last parity went out; and the blocks we
+  // received, once our peer's first parity block shows up
+  fec_encoder *fec_tx;
+  unordered_set<unsigned int> fec_conns;
+  wheel_timer fec_timer;
+  fec_decoder fec_rx;
+
+  // hedging (hedge-delay): the urgent and small blocks sent, each to
+  // go out again on another connection once it is due, unless it has
+  // been acknowledged by then
+  struct hedged_block {
+    uint32_t seqno;
+    unsigned int conn;         // serial of the connection that sent it
+    steg_config_t *steg_cfg;   // for op_STEG0 and op_STEG_FIN
+    uint64_t due;
+  };
+  std::deque<hedged_block> hedges;
+  wheel_timer hedge_timer;
   CIRCUIT_DECLARE_METHODS(chop);
 
   //override the constructor so we can initialize the transmit queue
@@ -124,12 +204,41 @@ struct chop_circuit_t : circuit_t
                     struct evbuffer *payload);
   int maybe_send_ack();
   int retransmit();
+  /** Send the parity blocks that are due.  A group that has not
+      filled up is closed after FEC_FLUSH_DELAY ms with nothing more
+      to send, by fec_timeout. */
+  int send_parity();
+  static void fec_timeout(void *arg);
+  /** True if the transmit queue takes no more data for now.  With
+      parity on, data stops short of the end, as stream data does, so
+      that both ends filling their queues cannot leave neither with a
+      slot for the ACK that would drain the other's. */
+  bool data_window_full() const
+  {
+    return tx_queue.nearly_full(fec_tx ? STREAM_QUEUE_RESERVE : 0);
+  }
+  chop_conn_t *pick_parity_connection(size_t d, size_t *blocksize);
+  /** Note block SEQNO <D, F>, just sent on CONN, for hedge_timeout
+      to send again if it is urgent or small. */
+  void hedge(chop_conn_t *conn, uint32_t seqno, size_t d, opcode_t f);
+  static void hedge_timeout(void *arg);
+  int send_hedge(const hedged_block &h);
 
   /** 
       check all conn for steg protocol data and send them
       if there's any
   */
   int send_all_steg_data();
+  /** Send as much pending upstream data as the connections take right
+      now, packed by plan_blocks; sets *BLOCKS to the blocks sent. */
+  int send_packed(size_t *blocks);
+  /** Send a block of BLOCKSIZE bytes on CONN carrying D bytes of
+      pending upstream data, or all of it if there is less, and
+      padding for the rest. */
+  int send_planned(chop_conn_t *conn, size_t blocksize, size_t d);
+  void gather_offers(size_t avail, bool spare, vector<chop_conn_t *> &conns,
+                     vector<block_offer> &offers);
+  bool adopt_spare_connection();
   /** the same as send targeted but it reads the data from
       conn->steg->cfg()->protocol_data and set opcode = op_STEG0
   */
@@ -142,13 +251,66 @@ struct chop_circuit_t : circuit_t
      @return the first connection whose steg has data to send
   */
   chop_conn_t* check_for_steg_protocol_data();
+
+  /** True if any of our connections has sent its handshake. */
+  bool bound_downstream() const
+  {
+    for (unordered_set<chop_conn_t *>::const_iterator i = downstreams.begin();
+         i != downstreams.end(); ++i)
+      if ((*i)->sent_handshake)
+        return true;
+    return false;
+  }
   chop_conn_t* pick_connection(size_t desired, size_t minimum,
                                size_t *blocksize);
+  size_t offered_room(chop_conn_t *conn, size_t desired, size_t minimum);
+  /** How long to hold back the AVAIL bytes of upstream data waiting,
+      in milliseconds, or 0 to send them now. */
+  unsigned int coalesce_hold(size_t avail);
+  void stop_coalescing(uint64_t now);
+  /** Fold a block of ROOM bytes, not counting a handshake, just sent
+      from the upstream buffer into room_estimate.  If the data FILLED
+      it with more left over, ROOM is what the connection could take;
+      otherwise it could take at least that much. */
+  void note_block_room(size_t room, bool filled);
+
+  /** Our FIN waits until up_buffer is at EOF and all the streams are
+      gone, since nothing can be sent after it. */
+  bool may_send_fin() const
+  {
+    return upstream_eof && !sent_fin && streams.empty();
+  }
+  /** True if a FIN, or a stream block that may carry no data (SOPEN,
+      SFIN), is waiting to be sent. */
+  bool fin_pending() const;
+  size_t stream_bytes() const;
+  chop_stream *next_stream() const;
+  /** Carry BUF, the upstream connection of another circuit, as a new
+      stream (client side). */
+  void open_stream(struct bufferevent *buf, const char *peername);
+  /** Connect a new stream ID to the up-address (server side). */
+  int accept_stream(uint16_t id);
+  void drop_stream(chop_stream *s);
+  bool reap_streams();
+  void stream_write_eof(chop_stream *s);
+  int send_streams(size_t *blocks);
+  int send_stream_block(chop_stream *s, chop_conn_t *conn, size_t blocksize);
+  int send_stream_reset(uint16_t id);
+  int recv_stream_block(opcode_t op, evbuffer *data);
 
   int recv_block(uint32_t seqno, opcode_t op, evbuffer *payload, steg_config_t *steg_cfg);
+  void recover_blocks();
+
+  void trace_block(trace_kind kind, uint32_t seqno, size_t d, size_t p,
+                   opcode_t f, unsigned int rcount = 0);
   int process_queue();
   int check_for_eof();
 
+  // memory governor hooks
+  virtual void account_memory(circuit_memory_usage &usage) const;
+  virtual bool transmit_window_full() const { return tx_queue.full(); }
+  virtual bool idle() const { return dead_cycles > 0 || downstreams.empty(); }
+
   uint32_t axe_interval() {
     // This function must always return a number which is larger than
     // the maximum possible number that *our peer's* flush_interval()
@@ -202,12 +364,18 @@ struct chop_config_t : config_t
   //the fact that they came from command line or from yaml config file
   const std::vector<std::string> arg_option_list = {"name", "mode", "up-address", "server-key",
                                                     "passphrase", "cover-server",
-                                                    "minimum-noise-to-signal"};
+                                                    "minimum-noise-to-signal",
+                                                    "trace-file", "conn-pool-size",
+                                                    "coalesce-max-delay",
+                                                    "multiplex-streams",
+                                                    "fec", "hedge-delay",
+                                                    "hedge-size"};
 
   const std::vector<std::string> binary_option_list = {"trace-packets",
                                                        "disable-encryption",
                                                        "disable-retransmit",
-                                                       "enable-retransmit"};
+                                                       "enable-retransmit",
+                                                       "share-connections"};
 
   config_dict_t chop_user_config;
   std::list<config_dict_t> steg_user_conf_list;
@@ -217,13 +385,21 @@ struct chop_config_t : config_t
   vector<steg_config_t *> steg_targets;
   chop_circuit_table circuits;
   bool trace_packets;
+  packet_trace *trace;
   bool trace_packet_data;
   bool encryption;
   bool retransmit;
-
-    /* Performance calculators */
-  unsigned long total_transmited_data_bytes;
-  unsigned long total_transmited_cover_bytes;
+  bool share_connections;
+  unsigned int coalesce_max_delay; // milliseconds, 0 = do not coalesce
+  unsigned int multiplex_streams;  // client, per circuit, 0 = do not
+  unsigned int fec_group;          // blocks per parity group, 0 = no fec
+  unsigned int fec_parity;         // parity blocks per group
+  unsigned int hedge_delay;        // milliseconds, 0 = do not hedge
+  size_t hedge_size;               // data bytes of a small block
+
+  /* client connections that are connected but have not sent their
+     handshake yet, which any circuit may take over (share-connections) */
+  unordered_set<chop_conn_t *> spare_conns;
 
   /*ecb encryptor and decryptor for the handshake*/
   ecb_encryptor* handshake_encryptor;
@@ -295,6 +471,7 @@ struct chop_config_t : config_t
   }
 
   CONFIG_DECLARE_METHODS(chop);
+  virtual bool adopt_upstream(circuit_t *ckt);
 
   DISALLOW_COPY_AND_ASSIGN(chop_config_t);
 };
@@ -302,23 +479,30 @@ struct chop_config_t : config_t
 // Configuration methods
 
 chop_config_t::chop_config_t()
-  : total_transmited_data_bytes(0),
-    total_transmited_cover_bytes(1),
-    handshake_encryptor(NULL),
+  : handshake_encryptor(NULL),
     handshake_decryptor(NULL),
     transparent_proxy(NULL)
-                                    //just to evade div by 0
 {
   ignore_socks_destination = true;
   trace_packets = false;
+  trace = NULL;
   trace_packet_data = true;
   encryption = true;
   retransmit = true;
+  share_connections = false;
+  coalesce_max_delay = 0;
+  multiplex_streams = 0;
+  fec_group = 0;
+  fec_parity = 0;
+  hedge_delay = 0;
+  hedge_size = HEDGE_DEFAULT_SIZE;
   noise2signal = 0;
 }
 
 chop_config_t::~chop_config_t()
 {
+  packet_trace_close(trace);
+
   if (up_address)
     evutil_freeaddrinfo(up_address);
   for (vector<struct evutil_addrinfo *>::iterator i = down_addresses.begin();
@@ -391,6 +575,15 @@ chop_config_t::init_from_protocol_config_dict() {
     log_enable_timestamps();
   }
 
+  if (trace_packets) {
+    std::string trace_file = "stegotorus.trace";
+    if (user_specified("trace-file"))
+      trace_file = chop_user_config["trace-file"];
+    trace = packet_trace_open(trace_file.c_str());
+    if (!trace)
+      return false;
+  }
+
   if (user_specified("disable-encryption")) {
     encryption = false;
   }
@@ -403,6 +596,87 @@ chop_config_t::init_from_protocol_config_dict() {
     retransmit = true;
   }
 
+  if (user_specified("conn-pool-size")) {
+    if (mode == LSN_SIMPLE_SERVER) {
+      log_warn("conn-pool-size option is not valid in server mode");
+      return false;
+    }
+    int size = atoi(chop_user_config["conn-pool-size"].c_str());
+    if (size < 0 || size > MAX_GLOBAL_CONN_COUNT / 4) {
+      log_warn("chop: invalid conn-pool-size %s",
+               chop_user_config["conn-pool-size"].c_str());
+      return false;
+    }
+    conn_pool_size = size;
+  }
+
+  if (user_specified("share-connections")) {
+    if (mode == LSN_SIMPLE_SERVER) {
+      log_warn("share-connections option is not valid in server mode");
+      return false;
+    }
+    share_connections = true;
+  }
+
+  if (user_specified("coalesce-max-delay")) {
+    int delay = atoi(chop_user_config["coalesce-max-delay"].c_str());
+    if (delay < 0 || delay > 1000) {
+      log_warn("chop: invalid coalesce-max-delay %s",
+               chop_user_config["coalesce-max-delay"].c_str());
+      return false;
+    }
+    coalesce_max_delay = delay;
+  }
+
+  if (user_specified("multiplex-streams")) {
+    if (mode == LSN_SIMPLE_SERVER) {
+      log_warn("multiplex-streams option is not valid in server mode");
+      return false;
+    }
+    int count = atoi(chop_user_config["multiplex-streams"].c_str());
+    if (count < 0 || (size_t)count > MAX_STREAMS_PER_CIRCUIT) {
+      log_warn("chop: invalid multiplex-streams %s",
+               chop_user_config["multiplex-streams"].c_str());
+      return false;
+    }
+    multiplex_streams = count;
+  }
+
+  if (user_specified("fec")) {
+    unsigned int k = 0, m = 1;
+    char junk;
+    const char *ratio = chop_user_config["fec"].c_str();
+    if ((sscanf(ratio, "%u:%u%c", &k, &m, &junk) != 2 &&
+         sscanf(ratio, "%u%c", &k, &junk) != 1) ||
+        k < 1 || k > FEC_MAX_GROUP ||
+        m < 1 || m > FEC_MAX_PARITY || m > k) {
+      log_warn("chop: invalid fec %s", ratio);
+      return false;
+    }
+    fec_group = k;
+    fec_parity = m;
+  }
+
+  if (user_specified("hedge-delay")) {
+    int delay = atoi(chop_user_config["hedge-delay"].c_str());
+    if (delay < 0 || delay > 1000) {
+      log_warn("chop: invalid hedge-delay %s",
+               chop_user_config["hedge-delay"].c_str());
+      return false;
+    }
+    hedge_delay = delay;
+  }
+
+  if (user_specified("hedge-size")) {
+    int size = atoi(chop_user_config["hedge-size"].c_str());
+    if (size < 0 || size > (int)SECTION_LEN) {
+      log_warn("chop: invalid hedge-size %s",
+               chop_user_config["hedge-size"].c_str());
+      return false;
+    }
+    hedge_size = size;
+  }
+
   if (user_specified("minimum-noise-to-signal")) {
     noise2signal = atoi(chop_user_config["minimum-noise-to-signal"].c_str());
   }
@@ -669,6 +943,12 @@ chop_config_t::circuit_create(size_t)
 {
   chop_circuit_t *ckt = new chop_circuit_t(retransmit);
   ckt->config = this;
+  if (fec_group) {
+    ckt->fec_tx = new fec_encoder(fec_group, fec_parity);
+    // Our peer is presumably configured alike; remember its blocks
+    // from the first, rather than from its first parity block.
+    ckt->fec_rx.activate(0);
+  }
 
   key_generator *kgen = 0;
 
@@ -728,13 +1008,20 @@ inline chop_circuit_t::chop_circuit_t()
 }
 
 chop_circuit_t::chop_circuit_t(bool retransmit)
-  : tx_queue(retransmit), avg_desirable_size(0), avg_available_size(0),
-    number_of_room_requests(0)
+  : tx_queue(retransmit), latency(NULL), upstream_since(0),
+    upstream_rate(0), upstream_seen(0), upstream_seen_at(0),
+    room_estimate(0), coalesce_since(0), next_stream_id(1), stream_turn(0),
+    fec_tx(NULL), fec_timer(fec_timeout, this),
+    hedge_timer(hedge_timeout, this)
 {
 }
 
 chop_circuit_t::~chop_circuit_t()
 {
+  while (!streams.empty())
+    drop_stream(streams.begin()->second);
+  latency_profile_free(latency);
+  delete fec_tx;
   delete send_crypt;
   delete send_hdr_crypt;
   delete recv_crypt;
@@ -751,6 +1038,12 @@ chop_circuit_t::close()
              (unsigned long)downstreams.size());
   }
 
+  while (!streams.empty())
+    drop_stream(streams.begin()->second);
+  wheel_timer_disarm(&fec_timer);
+  wheel_timer_disarm(&hedge_timer);
+  hedges.clear();
+
   for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
        i != downstreams.end(); i++) {
     chop_conn_t *conn = *i;
@@ -784,6 +1077,15 @@ chop_circuit_t::cfg() const
   return config;
 }
 
+void
+chop_circuit_t::trace_block(trace_kind kind, uint32_t seqno, size_t d,
+                            size_t p, opcode_t f, unsigned int rcount)
+{
+  packet_trace_block(config->trace, kind, serial, recv_queue.window(),
+                     evbuffer_get_length(bufferevent_get_input(up_buffer)),
+                     seqno, d, p, f, rcount);
+}
+
 void
 chop_circuit_t::add_downstream(chop_conn_t *conn)
 {
@@ -792,6 +1094,12 @@ chop_circuit_t::add_downstream(chop_conn_t *conn)
   conn->upstream = this;
   downstreams.insert(conn);
 
+  if (latency_tracing && !latency) {
+    char label[32];
+    xsnprintf(label, sizeof label, "circuit %u", serial);
+    latency = latency_profile_new(label);
+  }
+
   log_debug(this, "added connection <%d.%d> to %s, now %lu",
             serial, conn->serial, conn->peername,
             (unsigned long)downstreams.size());
@@ -846,6 +1154,10 @@ chop_circuit_t::send()
 {
   circuit_disarm_flush_timer(this);
 
+  if (latency && !upstream_since &&
+      evbuffer_get_length(bufferevent_get_input(up_buffer)) > 0)
+    upstream_since = latency_now();
+
   //First we check if there's steg data that we need to send
   if (send_all_steg_data())
     {
@@ -853,16 +1165,28 @@ chop_circuit_t::send()
     }
 
   struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
-  size_t avail = evbuffer_get_length(xmit_pending);
+  size_t avail = evbuffer_get_length(xmit_pending) + stream_bytes();
   size_t avail0 = avail;
   bool no_target_connection = false;
 
+  if (config->coalesce_max_delay && streams.empty()) {
+    unsigned int hold = coalesce_hold(avail);
+    if (hold) {
+      log_debug(this, "holding %lu bytes for %u ms", (unsigned long)avail,
+                hold);
+      metrics.coalesce_holds++;
+      circuit_arm_flush_timer(this, hold);
+      circuit_account_memory(this);
+      return 0;
+    }
+  }
+
   if (downstreams.empty()) {
     log_debug(this, "no downstream connections");
     no_target_connection = true;
   } else {
     bool did_retransmit = false;
-    if (avail == 0 && !(upstream_eof && !sent_fin) && config->retransmit) {
+    if (avail == 0 && !fin_pending() && config->retransmit) {
       // Consider retransmission.
       evbuffer *block = 0;
       for (transmit_queue::iterator i = tx_queue.begin();
@@ -871,7 +1195,8 @@ chop_circuit_t::send()
         transmit_elt &el = *i;
         size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen();
         size_t room;
-        chop_conn_t *conn = pick_connection(lo, lo, &room);
+        chop_conn_t *conn = pick_connection(el.hdr.dlen(), el.hdr.dlen(),
+                                            &room);
         if (!conn)
           continue;
         log_assert(lo <= room);
@@ -886,6 +1211,7 @@ chop_circuit_t::send()
           evbuffer_free(block);
           return -1;
         }
+        metrics.blocks_retransmitted++;
 
         char fallbackbuf[4];
         log_debug(conn, "retransmitted block %u <d=%lu p=%lu f=%s>",
@@ -895,17 +1221,8 @@ chop_circuit_t::send()
                   opname(el.hdr.opcode(), fallbackbuf));
 
         if (config->trace_packets)
-          fprintf(stderr,
-                  "T:%.4f: ckt %u <ntp %u outq %lu>: "
-                  "resend %lu <d=%lu p=%lu f=%s>\n",
-                  log_get_timestamp(), this->serial,
-                  this->recv_queue.window(),
-                  (unsigned long)evbuffer_get_length(
-                                bufferevent_get_input(this->up_buffer)),
-                  (unsigned long)el.hdr.seqno(),
-                  (unsigned long)el.hdr.dlen(),
-                  (unsigned long)el.hdr.plen(),
-                  opname(el.hdr.opcode(), fallbackbuf));
+          trace_block(TRACE_RESEND, el.hdr.seqno(), el.hdr.dlen(),
+                      el.hdr.plen(), el.hdr.opcode());
 
         evbuffer_free(block);
         did_retransmit = true;
@@ -913,13 +1230,27 @@ chop_circuit_t::send()
       }
     }
 
-    if (!did_retransmit && !tx_queue.full())
+    if (!did_retransmit && !streams.empty()) {
+      size_t blocks;
+      if (!tx_queue.nearly_full(STREAM_QUEUE_RESERVE)) {
+        if (send_streams(&blocks))
+          return -1;
+        if (!blocks) {
+          log_debug(this, "no target connection available");
+          no_target_connection = true;
+        }
+        avail = evbuffer_get_length(xmit_pending) + stream_bytes();
+      }
+    } else if (!did_retransmit && !data_window_full())
     // Send at least one block, even if there is no real data to send.
       do {
-        log_debug(this, "%lu bytes to send", (unsigned long)avail);
-        size_t blocksize;
-        chop_conn_t *target = pick_connection(avail, 0, &blocksize);
-        if (!target) {
+        size_t blocks;
+        if (send_packed(&blocks))
+          return -1;
+        if (!blocks && avail > 0 && config->share_connections &&
+            adopt_spare_connection())
+          continue;
+        if (!blocks) {
           // this is not an error; it can happen e.g. when the server has
           // something to send immediately and the client hasn't spoken yet
           log_debug(this, "no target connection available");
@@ -927,16 +1258,14 @@ chop_circuit_t::send()
           break;
         }
 
-        if (send_targeted(target, blocksize))
-          return -1;
-
         avail = evbuffer_get_length(xmit_pending);
-      } while (avail > 0);
+      } while (avail > 0 && !data_window_full());
   }
 
   if (avail0 == avail) { //no forward progress
     if (avail > 0) {//we have something new to send but we made no forward progress 
       dead_cycles++;
+      metrics.dead_cycles++;
       log_debug(this, "%u dead cycles", dead_cycles);
     }
     // If we're the client and we had no target connection, try
@@ -958,9 +1287,523 @@ chop_circuit_t::send()
     }
   }
 
+  if (config->coalesce_max_delay)
+    upstream_seen = evbuffer_get_length(xmit_pending);
+
+  if (send_parity())
+    return -1;
+
+  // The last streams may have finished with this round, letting the
+  // FIN go.
+  if (reap_streams() && may_send_fin())
+    return send();
+
+  circuit_account_memory(this);
   return check_for_eof();
 }
 
+unsigned int
+chop_circuit_t::coalesce_hold(size_t avail)
+{
+  uint64_t now = latency_now();
+  if (avail != upstream_seen) {
+    if (avail > upstream_seen && upstream_seen_at && now > upstream_seen_at) {
+      double rate = (avail - upstream_seen) * 1e6 / (now - upstream_seen_at);
+      upstream_rate = upstream_rate ? 0.75 * upstream_rate + 0.25 * rate
+                                    : rate;
+    }
+    upstream_seen = avail;
+    upstream_seen_at = now;
+  }
+
+  // Never hold back a FIN, or data nobody can take anyway.
+  if (avail == 0 || upstream_eof || downstreams.empty() || dead_cycles ||
+      tx_queue.full() || room_estimate <= MIN_BLOCK_SIZE) {
+    stop_coalescing(now);
+    return 0;
+  }
+
+  unsigned int waited = coalesce_since ? (now - coalesce_since) / 1000 : 0;
+  unsigned int budget = waited < config->coalesce_max_delay
+    ? config->coalesce_max_delay - waited : 0;
+  size_t target = min(room_estimate - MIN_BLOCK_SIZE, SECTION_LEN);
+  unsigned int hold = coalesce_delay(avail, target, upstream_rate, budget);
+  if (!hold) {
+    stop_coalescing(now);
+    return 0;
+  }
+
+  // Let libevent sit on the reads until the block would be full; the
+  // flush timer takes care of the rest.
+  if (!coalesce_since)
+    coalesce_since = now;
+  circuit_set_upstream_low_watermark(this, target);
+  return hold;
+}
+
+void
+chop_circuit_t::note_block_room(size_t room, bool filled)
+{
+  if (filled)
+    room_estimate = room_estimate ? (3 * room_estimate + room) / 4 : room;
+  else
+    room_estimate = std::max(room_estimate, room);
+}
+
+void
+chop_circuit_t::stop_coalescing(uint64_t now)
+{
+  if (!coalesce_since)
+    return;
+  metrics.coalesce_wait_ms += (now - coalesce_since) / 1000;
+  coalesce_since = 0;
+  circuit_set_upstream_low_watermark(this, 0);
+}
+
+// Multiplexed streams (multiplex-streams)
+
+void
+stream_read_cb(struct bufferevent *, void *arg)
+{
+  chop_stream *s = (chop_stream *)arg;
+  circuit_send(s->ckt);
+}
+
+void
+stream_flush_cb(struct bufferevent *, void *arg)
+{
+  chop_stream *s = (chop_stream *)arg;
+  chop_circuit_t *ckt = s->ckt;
+  ckt->stream_write_eof(s);
+  if (s->finished()) {
+    ckt->drop_stream(s);
+    circuit_send(ckt);
+  }
+}
+
+void
+stream_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+  chop_stream *s = (chop_stream *)arg;
+  chop_circuit_t *ckt = s->ckt;
+
+  if (what == (BEV_EVENT_EOF|BEV_EVENT_READING)) {
+    log_debug(ckt, "stream %u: EOF from upstream", s->id);
+    s->read_eof = true;
+    bufferevent_disable(bev, EV_READ);
+  } else if (what & (BEV_EVENT_ERROR|BEV_EVENT_EOF|BEV_EVENT_TIMEOUT)) {
+    log_info(ckt, "stream %u: %s", s->id,
+             (what & BEV_EVENT_ERROR)
+             ? evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR())
+             : "connection closed");
+    if (ckt->send_stream_reset(s->id))
+      log_info(ckt, "stream %u: could not send SRST", s->id);
+    ckt->drop_stream(s);
+  } else {
+    return;
+  }
+  circuit_send(ckt);
+}
+
+void
+stream_connect_cb(struct bufferevent *bev, short what, void *arg)
+{
+  chop_stream *s = (chop_stream *)arg;
+  chop_circuit_t *ckt = s->ckt;
+
+  if (!(what & BEV_EVENT_CONNECTED)) {
+    stream_event_cb(bev, what, arg);
+    return;
+  }
+
+  log_debug(ckt, "stream %u: connected to %s", s->id, s->peername);
+  memory_governor_stats mem;
+  memory_governor_get_stats(&mem);
+  s->connected = true;
+  bufferevent_setcb(bev, stream_read_cb, stream_flush_cb, stream_event_cb, s);
+  bufferevent_setwatermark(bev, EV_READ, 0, mem.circuit_upstream_limit);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+  // The whole stream may have arrived while we were connecting.
+  ckt->stream_write_eof(s);
+  if (s->finished())
+    ckt->drop_stream(s);
+  circuit_send(ckt);
+}
+
+bool
+chop_circuit_t::fin_pending() const
+{
+  if (may_send_fin())
+    return true;
+  for (map<uint16_t, chop_stream *>::const_iterator i = streams.begin();
+       i != streams.end(); ++i)
+    if (i->second->pending())
+      return true;
+  return false;
+}
+
+size_t
+chop_circuit_t::stream_bytes() const
+{
+  size_t bytes = 0;
+  for (map<uint16_t, chop_stream *>::const_iterator i = streams.begin();
+       i != streams.end(); ++i)
+    bytes += evbuffer_get_length(bufferevent_get_input(i->second->buf));
+  return bytes;
+}
+
+/* The first stream after stream_turn that has a block to send. */
+chop_stream *
+chop_circuit_t::next_stream() const
+{
+  map<uint16_t, chop_stream *>::const_iterator i =
+    streams.upper_bound(stream_turn);
+  for (size_t n = 0; n < streams.size(); n++, ++i) {
+    if (i == streams.end())
+      i = streams.begin();
+    if (i->second->pending())
+      return i->second;
+  }
+  return NULL;
+}
+
+void
+chop_circuit_t::open_stream(struct bufferevent *buf, const char *peername)
+{
+  while (!next_stream_id || streams.count(next_stream_id))
+    next_stream_id++;
+
+  chop_stream *s = new chop_stream(this, next_stream_id++);
+  s->buf = buf;
+  s->peername = peername;
+  s->connected = true;
+  streams[s->id] = s;
+  metrics.streams_opened++;
+  log_debug(this, "stream %u: carrying %s, %lu streams", s->id, peername,
+            (unsigned long)streams.size());
+
+  memory_governor_stats mem;
+  memory_governor_get_stats(&mem);
+  bufferevent_setcb(buf, stream_read_cb, stream_flush_cb, stream_event_cb, s);
+  bufferevent_setwatermark(buf, EV_READ, 0, mem.circuit_upstream_limit);
+  bufferevent_enable(buf, EV_READ|EV_WRITE);
+}
+
+int
+chop_circuit_t::accept_stream(uint16_t id)
+{
+  struct bufferevent *buf =
+    bufferevent_socket_new(config->base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (!buf) {
+    log_warn(this, "unable to create outbound socket buffer");
+    return send_stream_reset(id);
+  }
+
+  chop_stream *s = new chop_stream(this, id);
+  s->buf = buf;
+  s->sent_open = true; // only the client opens streams
+  streams[id] = s;
+  bufferevent_setcb(buf, stream_read_cb, stream_flush_cb, stream_connect_cb,
+                    s);
+
+  for (struct evutil_addrinfo *addr = config->get_target_addrs(0);
+       addr; addr = addr->ai_next) {
+    s->peername = printable_address(addr->ai_addr, addr->ai_addrlen);
+    if (bufferevent_socket_connect(buf, addr->ai_addr, addr->ai_addrlen) >= 0) {
+      metrics.streams_opened++;
+      log_debug(this, "stream %u: connecting to %s", id, s->peername);
+      return 0;
+    }
+    log_info(this, "stream %u: connection to %s failed: %s", id,
+             s->peername,
+             evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    free((void *)s->peername);
+    s->peername = NULL;
+  }
+
+  drop_stream(s);
+  return send_stream_reset(id);
+}
+
+void
+chop_circuit_t::drop_stream(chop_stream *s)
+{
+  log_debug(this, "stream %u: closing", s->id);
+  streams.erase(s->id);
+  if (s->buf)
+    bufferevent_free(s->buf);
+  free((void *)s->peername);
+  delete s;
+}
+
+/* Drop the streams that are done both ways; true if there were any. */
+bool
+chop_circuit_t::reap_streams()
+{
+  bool reaped = false;
+  for (map<uint16_t, chop_stream *>::iterator i = streams.begin();
+       i != streams.end(); ) {
+    chop_stream *s = i->second;
+    ++i;
+    if (s->finished()) {
+      drop_stream(s);
+      reaped = true;
+    }
+  }
+  return reaped;
+}
+
+/* Pass the peer's SFIN along once everything before it is written. */
+void
+chop_circuit_t::stream_write_eof(chop_stream *s)
+{
+  if (!s->received_fin || !s->connected || s->write_eof ||
+      evbuffer_get_length(bufferevent_get_output(s->buf)))
+    return;
+
+  log_debug(this, "stream %u: sending EOF upstream", s->id);
+  shutdown(bufferevent_getfd(s->buf), SHUT_WR);
+  s->write_eof = true;
+}
+
+/**
+   Transmit pending data from up_buffer and from the streams, one
+   block for each of them in turn for as long as they have something
+   to send and the connections take it, so that no stream can starve
+   the others.  With nothing to send, sends one chaff block.  Sets
+   *BLOCKS to the number of blocks sent.
+*/
+int
+chop_circuit_t::send_streams(size_t *blocks)
+{
+  struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
+  vector<uint16_t> order;
+  bool any_pending = false;
+  *blocks = 0;
+
+  order.push_back(0);
+  for (map<uint16_t, chop_stream *>::const_iterator i = streams.begin();
+       i != streams.end(); ++i)
+    order.push_back(i->first);
+  std::rotate(order.begin(),
+              std::upper_bound(order.begin(), order.end(), stream_turn),
+              order.end());
+
+  for (bool pending = true;
+       pending && !tx_queue.nearly_full(STREAM_QUEUE_RESERVE); ) {
+    pending = false;
+    for (vector<uint16_t>::const_iterator i = order.begin();
+         i != order.end() && !tx_queue.nearly_full(STREAM_QUEUE_RESERVE);
+         ++i) {
+      size_t blocksize;
+      chop_conn_t *conn;
+
+      if (*i == 0) {
+        size_t avail = evbuffer_get_length(xmit_pending);
+        if (!avail)
+          continue;
+        pending = any_pending = true;
+        if (!(conn = pick_connection(avail, 0, &blocksize)))
+          return 0;
+        stream_turn = 0;
+        if (send_targeted(conn, blocksize))
+          return -1;
+      } else {
+        // a stream may have gone since the round started
+        map<uint16_t, chop_stream *>::iterator found = streams.find(*i);
+        if (found == streams.end() || !found->second->pending())
+          continue;
+        chop_stream *s = found->second;
+        pending = any_pending = true;
+        size_t avail = STREAM_ID_LEN +
+          evbuffer_get_length(bufferevent_get_input(s->buf));
+        if (!(conn = pick_connection(avail, STREAM_ID_LEN, &blocksize)))
+          return 0;
+        if (send_stream_block(s, conn, blocksize))
+          return -1;
+      }
+      (*blocks)++;
+    }
+  }
+
+  if (!any_pending && !tx_queue.full()) {
+    size_t blocksize;
+    chop_conn_t *conn = pick_connection(0, 0, &blocksize);
+    if (conn) {
+      if (send_targeted(conn, blocksize))
+        return -1;
+      (*blocks)++;
+    }
+  }
+  return 0;
+}
+
+int
+chop_circuit_t::send_stream_block(chop_stream *s, chop_conn_t *conn,
+                                  size_t blocksize)
+{
+  size_t lo = MIN_BLOCK_SIZE + STREAM_ID_LEN;
+  if (!conn->sent_handshake)
+    lo += HANDSHAKE_LEN;
+  log_assert(blocksize >= lo);
+
+  struct evbuffer *input = bufferevent_get_input(s->buf);
+  size_t avail = evbuffer_get_length(input);
+  size_t room = min(blocksize - lo, SECTION_LEN - STREAM_ID_LEN);
+  opcode_t op = s->next_opcode(avail <= room);
+  if (avail > room)
+    avail = room;
+
+  struct evbuffer *payload = evbuffer_new();
+  if (!payload) {
+    log_warn(conn, "memory allocation failure");
+    return -1;
+  }
+  uint8_t id[STREAM_ID_LEN] = { uint8_t(s->id >> 8), uint8_t(s->id) };
+  if (evbuffer_add(payload, id, sizeof id) ||
+      evbuffer_remove_buffer(input, payload, avail) != (int)avail) {
+    log_warn(conn, "failed to extract payload");
+    evbuffer_free(payload);
+    return -1;
+  }
+
+  stream_turn = s->id;
+  int rv = send_targeted(conn, STREAM_ID_LEN + avail,
+                         (blocksize - lo) - avail, op, payload);
+  evbuffer_free(payload);
+  if (!rv && op == op_SOPEN)
+    s->sent_open = true;
+  if (!rv && op == op_SFIN)
+    s->sent_fin = true;
+  return rv;
+}
+
+int
+chop_circuit_t::send_stream_reset(uint16_t id)
+{
+  struct evbuffer *payload = evbuffer_new();
+  if (!payload) {
+    log_warn(this, "memory allocation failure");
+    return -1;
+  }
+  uint8_t buf[STREAM_ID_LEN] = { uint8_t(id >> 8), uint8_t(id) };
+  evbuffer_add(payload, buf, sizeof buf);
+  return send_special(op_SRST, payload);
+}
+
+int
+chop_circuit_t::recv_stream_block(opcode_t op, evbuffer *data)
+{
+  uint8_t buf[STREAM_ID_LEN];
+  char fallbackbuf[4];
+  if (evbuffer_remove(data, buf, sizeof buf) != (int)sizeof buf) {
+    log_info(this, "protocol error: %s block without a stream id",
+             opname(op, fallbackbuf));
+    return -1;
+  }
+  uint16_t id = (uint16_t(buf[0]) << 8) | buf[1];
+  map<uint16_t, chop_stream *>::iterator i = streams.find(id);
+  chop_stream *s = i == streams.end() ? NULL : i->second;
+
+  switch (check_stream_block(op, id, config->mode == LSN_SIMPLE_SERVER, s,
+                             streams.size())) {
+  case stream_reject:
+    log_info(this, "protocol error: unexpected %s for stream %u",
+             opname(op, fallbackbuf), id);
+    return -1;
+
+  case stream_refuse:
+    log_info(this, "stream %u: too many streams", id);
+    return send_stream_reset(id);
+
+  case stream_ignore:
+    log_debug(this, "%s for closed stream %u ignored",
+              opname(op, fallbackbuf), id);
+    return 0;
+
+  case stream_drop:
+    log_debug(this, "stream %u: reset by peer", id);
+    drop_stream(s);
+    return 0;
+
+  case stream_open:
+    if (accept_stream(id))
+      return -1;
+    i = streams.find(id);
+    if (i == streams.end())
+      return 0; // it could not connect, and we have reset it
+    s = i->second;
+    break;
+
+  case stream_deliver:
+    break;
+  }
+
+  if (evbuffer_get_length(data)) {
+    dead_cycles = 0;
+    circuit_disarm_axe_timer(this);
+    if (evbuffer_add_buffer(bufferevent_get_output(s->buf), data)) {
+      log_warn(this, "buffer transfer failure");
+      return -1;
+    }
+  }
+
+  if (op == op_SFIN) {
+    log_debug(this, "stream %u: received SFIN", id);
+    s->received_fin = true;
+    stream_write_eof(s);
+    if (s->finished())
+      drop_stream(s);
+  }
+  return 0;
+}
+
+/**
+   Carry CKT's upstream connection as a stream of the established
+   circuit with the fewest streams, if one has room for it.
+*/
+bool
+chop_config_t::adopt_upstream(circuit_t *c)
+{
+  chop_circuit_t *fresh = dynamic_cast<chop_circuit_t *>(c);
+  if (!multiplex_streams || mode == LSN_SIMPLE_SERVER || !fresh->up_buffer)
+    return false;
+
+  chop_circuit_t *host = NULL;
+  for (chop_circuit_table::iterator i = circuits.begin();
+       i != circuits.end(); ++i) {
+    chop_circuit_t *ckt = i->second;
+    if (!ckt || ckt == fresh || ckt->upstream_eof || ckt->sent_fin ||
+        ckt->received_fin || ckt->dead_cycles || !ckt->bound_downstream() ||
+        ckt->streams.size() >= multiplex_streams)
+      continue;
+    if (!host || ckt->streams.size() < host->streams.size())
+      host = ckt;
+  }
+  if (!host)
+    return false;
+
+  if (fresh->socks_state) {
+    socks_send_reply(fresh->socks_state,
+                     bufferevent_get_output(fresh->up_buffer), 0);
+    socks_state_free(fresh->socks_state);
+    fresh->socks_state = NULL;
+  }
+
+  log_debug(fresh, "handing upstream over to circuit %u", host->serial);
+  host->open_stream(fresh->up_buffer, fresh->up_peer);
+  fresh->up_buffer = NULL;
+  fresh->up_peer = NULL;
+
+  // It never carried anything, so it is done both ways.
+  fresh->sent_fin = fresh->received_fin = fresh->upstream_eof = true;
+  fresh->close();
+
+  circuit_send(host);
+  return true;
+}
+
 int
 chop_circuit_t::send_all_steg_data()
 {
@@ -970,110 +1813,194 @@ chop_circuit_t::send_all_steg_data()
       return 0;
   }
 
-  // you might think that it makes sense to check if there is any steg data to be sent
-  //otherwise we can just return. but we can't do that cause each connection has
-  //its own steg module and some of the steg module might have steg data and others might
-  //not
-
-  bool no_target_connection = true;
+  // Each steg configuration has a single queue of protocol data,
+  // shared by all the connections that use it, so plan each queue
+  // over those connections.  We don't send random blocks or
+  // retransmit from the transmit queue here because this->send, our
+  // caller, will do that anyway.
+  unordered_set<steg_config_t *> done;
+  vector<chop_conn_t *> conns;
+  vector<block_offer> offers;
+  vector<block_assignment> plan;
 
-  //TODO: Instead of re-implementing pick connection here I should 
-  //adopt it so it can works both for send and send steg.
   for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
        i != downstreams.end(); i++) {
-    chop_conn_t *target = *i;
-
     // We cannot transmit on a connection whose steganography module has
     // not yet been instantiated.  (This only ever happens server-side.)
-    if (!target->steg) {
-      log_debug(target, "offers 0 bytes (no steg)");
+    if (!(*i)->steg)
       continue;
-    }
 
-    // We must not transmit on a connection that has not completed its
-    // TCP handshake.  (This only ever happens client-side.  If we try
-    // it anyway, the transmission gets silently dropped on the floor.)
-    if (!target->connected) {
-      log_debug(target, "offers 0 bytes (not connected)");
+    steg_config_t *cfg = (*i)->steg->cfg();
+    if (!done.insert(cfg).second)
       continue;
-    }
 
-    size_t avail0;
+    size_t avail = evbuffer_get_length(cfg->protocol_data_out);
+    while (avail > 0 && !tx_queue.full()) {
+      log_debug(this, "%lu bytes of %s protocol data to send",
+                (unsigned long)avail, cfg->name());
+
+      conns.clear();
+      offers.clear();
+      for (unordered_set<chop_conn_t *>::iterator j = downstreams.begin();
+           j != downstreams.end(); j++) {
+        chop_conn_t *conn = *j;
+        if (!conn->steg || conn->steg->cfg() != cfg)
+          continue;
+        size_t room = offered_room(conn, avail, 1);
+        if (room) {
+          conns.push_back(conn);
+          offers.push_back(block_offer(room, MIN_BLOCK_SIZE +
+                                       (conn->sent_handshake ? 0
+                                        : HANDSHAKE_LEN)));
+        }
+      }
 
-    //Now we check if the protocol_data has any data
-    size_t avail = evbuffer_get_length(target->steg->cfg()->protocol_data_out);
-    //we try to send all data
-    //we don't send random block or retransmit from the transmit
-    //queue because we are called by the this->send which will
-    //send those anyways
-    while(avail > 0) {
-      size_t desired;
-      if (avail > SECTION_LEN)
-        desired = SECTION_LEN;
-      else
-        desired = avail;
-
-      desired += MIN_BLOCK_SIZE;
-
-      size_t lo = MIN_BLOCK_SIZE + (desired == MIN_BLOCK_SIZE ? 0 : 1);
-
-      log_debug(this, "target block size %lu bytes", (unsigned long)desired);
-
-      log_debug(this, "%lu bytes to send", (unsigned long)avail);
-      size_t shake = target->sent_handshake ? 0 : HANDSHAKE_LEN;
-      size_t room = target->steg->transmit_room(desired + shake, lo + shake,
-                                                  MAX_BLOCK_SIZE + shake);
-      if (room != 0) {
-        if (room < lo + shake || room >= MAX_BLOCK_SIZE + shake)
-          log_abort(target, "steg size request (%lu) out of range [%lu, %lu]",
-                    (unsigned long)room,
-                    (unsigned long)(lo + shake),
-                    (unsigned long)(MAX_BLOCK_SIZE + shake));
-
-        log_debug(target, "offers %lu bytes (%s)", (unsigned long)room,
-                  target->steg->cfg()->name());
-
-        if (send_targeted_steg_data(target, room))
+      plan_blocks(avail, offers, plan);
+      for (vector<block_assignment>::const_iterator k = plan.begin();
+           k != plan.end() && !tx_queue.full(); ++k)
+        if (send_targeted_steg_data(conns[k->offer], offers[k->offer].room))
           return -1;
+
+      size_t avail0 = avail;
+      avail = evbuffer_get_length(cfg->protocol_data_out);
+
+      if (avail0 == avail) { // no forward progress
+        dead_cycles++;
+        metrics.dead_cycles++;
+        log_debug(this, "%u dead cycles", dead_cycles);
+        break;
       }
-      else {
-        log_debug(target, "offers 0 bytes (%s)",
-                  target->steg->cfg()->name());
-      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+   Ask the connections for their rooms (see offered_room) and collect
+   the ones that offer any in CONNS and OFFERS.  Only the spare
+   connections (see chop_conn_t::handshake) are asked if SPARE is
+   true, only the others if it is false.
+*/
+void
+chop_circuit_t::gather_offers(size_t avail, bool spare,
+                              vector<chop_conn_t *> &conns,
+                              vector<block_offer> &offers)
+{
+  for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
+       i != downstreams.end(); i++) {
+    chop_conn_t *conn = *i;
+    if ((config->spare_conns.count(conn) != 0) != spare)
+      continue;
+    size_t room = offered_room(conn, avail, 0);
+    if (room) {
+      conns.push_back(conn);
+      offers.push_back(block_offer(room, MIN_BLOCK_SIZE +
+                                   (conn->sent_handshake ? 0
+                                    : HANDSHAKE_LEN)));
+    }
+  }
+}
+
+/**
+   Take over a spare connection from another circuit (see
+   chop_conn_t::handshake).  Only circuits that have no upstream data
+   waiting give theirs away.  Returns true if a connection was
+   adopted.
+*/
+bool
+chop_circuit_t::adopt_spare_connection()
+{
+  vector<chop_conn_t *> conns(config->spare_conns.begin(),
+                              config->spare_conns.end());
+  vector<spare_conn_state> spares(conns.size());
+  for (size_t i = 0; i < conns.size(); i++) {
+    chop_circuit_t *donor = conns[i]->upstream;
+    spares[i].ours = donor == this;
+    spares[i].ready = conns[i]->steg && conns[i]->connected;
+    spares[i].donor_pending = donor && donor->up_buffer
+      ? evbuffer_get_length(bufferevent_get_input(donor->up_buffer)) : 0;
+  }
+
+  int picked = pick_spare_conn(spares);
+  if (picked < 0)
+    return false;
+
+  chop_conn_t *conn = conns[picked];
+  chop_circuit_t *donor = conn->upstream;
+  config->spare_conns.erase(conn);
+  if (donor)
+    donor->drop_downstream(conn);
+  add_downstream(conn);
+  metrics.conns_adopted++;
+  log_debug(this, "adopted connection <%u> from circuit %u",
+            conn->serial, donor ? donor->serial : 0);
+  return true;
+}
+
+/**
+   Transmit as much of the pending upstream data as the connections
+   will take right now.  Every connection that can transmit is asked
+   for its room and plan_blocks decides which of them carry a block;
+   with no data pending that is a single block, which send wants to go
+   out anyway.  Sets *BLOCKS to the number of blocks sent, which is 0
+   if no connection could take one.
+*/
+int
+chop_circuit_t::send_packed(size_t *blocks)
+{
+  struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
+  size_t avail = evbuffer_get_length(xmit_pending);
+  vector<chop_conn_t *> conns;
+  vector<block_offer> offers;
+  vector<block_assignment> plan;
 
-      avail0 = avail;
-      avail = evbuffer_get_length(target->steg->cfg()->protocol_data_out);
+  log_debug(this, "%lu bytes to send", (unsigned long)avail);
+  *blocks = 0;
 
-      if (avail0 == avail) { // no forward progress
-        dead_cycles++;
-        log_debug(this, "%u dead cycles", dead_cycles);
-        break;
-      }
-      else {
-        no_target_connection = false;
-      }
-    } //while(avail > 0)
-  } //for all targets
-  
-  (void) no_target_connection;
-  // If we're the client and we had no target connection, try
-  // reopening new connections.  If we're the server, we have to
-  // just twiddle our thumbs and hope the client does that.
-  // if (no_target_connection) {
-  //   if (config->mode != LSN_SIMPLE_SERVER &&
-  //       downstreams.size() < 64) {
-  //     log_debug("number of open connections %u", (unsigned int) downstreams.size());
-  //     circuit_reopen_downstreams(this);
-  //   }
-  //   else {
-  //     log_debug("number of open connections %u", (unsigned int) downstreams.size());
-  //     circuit_arm_axe_timer(this, axe_interval());
-  //   }
-  // }
+  gather_offers(avail, false, conns, offers);
+  if (offer_on_spare_conns(avail, !offers.empty()))
+    gather_offers(avail, true, conns, offers);
+
+  plan_blocks(avail, offers, plan);
+  log_debug(this, "planned %lu blocks on %lu offers",
+            (unsigned long)plan.size(), (unsigned long)offers.size());
 
+  for (vector<block_assignment>::const_iterator k = plan.begin();
+       k != plan.end() && !data_window_full(); ++k) {
+    if (send_planned(conns[k->offer], offers[k->offer].room, k->data))
+      return -1;
+    (*blocks)++;
+  }
   return 0;
 }
 
+int
+chop_circuit_t::send_planned(chop_conn_t *conn, size_t blocksize, size_t d)
+{
+  size_t lo = MIN_BLOCK_SIZE, hi = MAX_BLOCK_SIZE;
+  if (!conn->sent_handshake) {
+    lo += HANDSHAKE_LEN;
+    hi += HANDSHAKE_LEN;
+  }
+  log_assert(blocksize >= lo && blocksize <= hi);
+  log_assert(d <= min(blocksize - lo, SECTION_LEN));
+
+  struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
+  size_t avail = evbuffer_get_length(xmit_pending);
+  opcode_t op = op_DAT;
+
+  if (d >= avail) {
+    d = avail;
+    if (may_send_fin())
+      // this block will carry the last byte of real data to be sent in
+      // this direction; mark it as such
+      op = op_FIN;
+  }
+
+  return send_targeted(conn, d, (blocksize - lo) - d, op, xmit_pending);
+}
+
 
 int
 chop_circuit_t::send_eof()
@@ -1121,10 +2048,14 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
   // enqueue the block for transmission when possible.
   // The transmit queue takes ownership of 'payload' at this point.
   uint32_t seqno = tx_queue.enqueue(f, payload, p);
+  if (fec_tx)
+    fec_tx->add(seqno, f, payload);
 
   // Not having a connection to use right now does not constitute a failure.
   if (!conn)
     return 0;
+  if (fec_tx && f != op_PARITY)
+    fec_conns.insert(conn->serial);
 
   struct evbuffer *block = evbuffer_new();
   if (!block) {
@@ -1149,17 +2080,8 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
             opname(f, fallbackbuf));
 
   if (config->trace_packets)
-    fprintf(stderr,
-            "T:%.4f: ckt %u <ntp %u outq %lu>: "
-            "send %lu <d=%lu p=%lu f=%s>\n",
-            log_get_timestamp(), this->serial,
-            this->recv_queue.window(),
-            (unsigned long)evbuffer_get_length(
-                              bufferevent_get_input(this->up_buffer)),
-            (unsigned long)seqno,
-            (unsigned long)d,
-            (unsigned long)p,
-            opname(f, fallbackbuf));
+    trace_block(TRACE_SEND, seqno, d, p, f);
+  hedge(conn, seqno, d, f);
 
   if (f == op_FIN) {
     sent_fin = true;
@@ -1177,18 +2099,236 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
   return 0;
 }
 
+int
+chop_circuit_t::send_parity()
+{
+  if (!fec_tx)
+    return 0;
+
+  // With nothing more to send, the blocks just sent may be the last
+  // for a while, and the ones a reader is waiting on; do not leave
+  // them uncovered until the group fills.
+  if (fec_tx->pending() && !fec_timer.pending() &&
+      evbuffer_get_length(bufferevent_get_input(up_buffer)) == 0 &&
+      stream_bytes() == 0)
+    wheel_timer_arm(&fec_timer, FEC_FLUSH_DELAY);
+
+  evbuffer *payload;
+  while ((payload = fec_tx->next_parity())) {
+    size_t d = evbuffer_get_length(payload);
+    size_t blocksize = 0;
+    chop_conn_t *conn = NULL;
+    // Parity is only worth having right away; if it cannot go out
+    // now, the blocks it covers will be retransmitted if need be.
+    if (!tx_queue.nearly_full(STREAM_QUEUE_RESERVE) && !sent_fin)
+      conn = pick_parity_connection(d, &blocksize);
+    if (!conn) {
+      log_debug(this, "no connection for parity block, dropped");
+      evbuffer_free(payload);
+      continue;
+    }
+
+    size_t lo = MIN_BLOCK_SIZE + (conn->sent_handshake ? 0 : HANDSHAKE_LEN);
+    fec_conns.insert(conn->serial);
+    int rv = send_targeted(conn, d, min(blocksize - lo - d, SECTION_LEN),
+                           op_PARITY, payload);
+    evbuffer_free(payload);
+    if (rv)
+      return -1;
+    metrics.fec_parity_sent++;
+  }
+  fec_conns.clear();
+  return 0;
+}
+
+void
+chop_circuit_t::fec_timeout(void *arg)
+{
+  chop_circuit_t *ckt = static_cast<chop_circuit_t *>(arg);
+  ckt->fec_tx->flush();
+  if (ckt->send_parity())
+    log_warn(ckt, "failed to send parity");
+}
+
+/* Like pick_connection, but for a parity block of D bytes, which
+   must fit whole and should not go out on the connections that
+   carried the blocks it covers: if one of those is lost, the parity
+   probably would be too. */
+chop_conn_t *
+chop_circuit_t::pick_parity_connection(size_t d, size_t *blocksize)
+{
+  chop_conn_t *best = NULL, *fallback = NULL;
+  size_t best_room = 0, fallback_room = 0;
+  for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
+       i != downstreams.end(); i++) {
+    chop_conn_t *conn = *i;
+    size_t room = offered_room(conn, d, d);
+    size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
+    if (room < d + MIN_BLOCK_SIZE + shake)
+      continue;
+
+    if (!fec_conns.count(conn->serial)) {
+      if (!best || room < best_room) {
+        best = conn;
+        best_room = room;
+      }
+    } else if (!fallback || room < fallback_room) {
+      fallback = conn;
+      fallback_room = room;
+    }
+  }
+
+  if (best) {
+    *blocksize = best_room;
+    return best;
+  }
+  *blocksize = fallback_room;
+  return fallback;
+}
+
+/* A block that the circuit stalls on if it is lost: acknowledgments,
+   the end of the data, stream control, and steg protocol data.  Small
+   data blocks are what interactive traffic waits on. */
+static bool
+hedge_urgent(opcode_t f)
+{
+  switch (f) {
+  case op_ACK:
+  case op_FIN:
+  case op_STEG0:
+  case op_STEG_FIN:
+  case op_SOPEN:
+  case op_SFIN:
+  case op_SRST:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void
+chop_circuit_t::hedge(chop_conn_t *conn, uint32_t seqno, size_t d,
+                      opcode_t f)
+{
+  if (!config->hedge_delay || !config->retransmit)
+    return;
+  if (!hedge_urgent(f)) {
+    size_t lo = f == op_SDAT ? STREAM_ID_LEN : 0;
+    if ((f != op_DAT && f != op_SDAT) || d <= lo ||
+        d > lo + config->hedge_size)
+      return;
+  }
+
+  hedged_block h;
+  h.seqno = seqno;
+  h.conn = conn->serial;
+  h.steg_cfg = conn->steg->cfg();
+  h.due = latency_now() + config->hedge_delay * 1000;
+  hedges.push_back(h);
+  if (!hedge_timer.pending())
+    wheel_timer_arm(&hedge_timer, config->hedge_delay);
+}
+
+void
+chop_circuit_t::hedge_timeout(void *arg)
+{
+  chop_circuit_t *ckt = static_cast<chop_circuit_t *>(arg);
+  uint64_t now = latency_now();
+  while (!ckt->hedges.empty() && ckt->hedges.front().due <= now) {
+    hedged_block h = ckt->hedges.front();
+    ckt->hedges.pop_front();
+    // the block is left to retransmission, the rest still get hedged
+    if (ckt->send_hedge(h))
+      log_warn(ckt, "failed to hedge block %u", h.seqno);
+  }
+  if (!ckt->hedges.empty())
+    wheel_timer_arm(&ckt->hedge_timer,
+                    (ckt->hedges.front().due - now + 999) / 1000);
+}
+
+/* Send the block of H again, on the connection with the least room
+   to spare for it other than the one that sent it.  Steg protocol
+   data is only understood by connections of the same steg module.
+   If no such connection takes the block right now, we leave it to
+   retransmission. */
+int
+chop_circuit_t::send_hedge(const hedged_block &h)
+{
+  transmit_elt *el = tx_queue.find(h.seqno);
+  if (!el)
+    return 0; // acknowledged meanwhile
+
+  opcode_t f = el->hdr.opcode();
+  bool steg = f == op_STEG0 || f == op_STEG_FIN;
+  size_t d = el->hdr.dlen();
+  chop_conn_t *target = NULL;
+  size_t target_room = 0;
+  for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
+       i != downstreams.end(); i++) {
+    chop_conn_t *conn = *i;
+    if (conn->serial == h.conn || (steg && conn->steg &&
+                                   conn->steg->cfg() != h.steg_cfg))
+      continue;
+    size_t room = offered_room(conn, d, d);
+    size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
+    if (room < d + MIN_BLOCK_SIZE + shake)
+      continue;
+    if (!target || room < target_room) {
+      target = conn;
+      target_room = room;
+    }
+  }
+  if (!target) {
+    log_debug(this, "no connection to hedge block %u on", h.seqno);
+    return 0;
+  }
+
+  size_t lo = MIN_BLOCK_SIZE + d +
+    (target->sent_handshake ? 0 : HANDSHAKE_LEN);
+  evbuffer *block = evbuffer_new();
+  if (!block)
+    log_abort("memory allocation failed");
+  if (tx_queue.retransmit(*el, min(target_room - lo, SECTION_LEN), block,
+                          *send_hdr_crypt, *send_crypt)) {
+    // too many times already; retransmission will give up on it too
+    evbuffer_free(block);
+    return 0;
+  }
+  if (target->send(block)) {
+    evbuffer_free(block);
+    return -1;
+  }
+  evbuffer_free(block);
+  metrics.hedge_blocks_sent++;
+
+  char fallbackbuf[4];
+  log_debug(target, "hedged block %u <d=%lu p=%lu f=%s>", h.seqno,
+            (unsigned long)d, (unsigned long)el->hdr.plen(),
+            opname(f, fallbackbuf));
+
+  if (config->trace_packets)
+    trace_block(TRACE_RESEND, h.seqno, d, el->hdr.plen(), f,
+                el->hdr.rcount());
+  return 0;
+}
+
 int
 chop_circuit_t::send_targeted(chop_conn_t *conn)
 {
   //Priority with steg data
   bool steg_data_available = false;
+  chop_stream *stream = NULL;
   size_t avail = evbuffer_get_length(conn->steg->cfg()->protocol_data_out);
   if (avail > 0)
     steg_data_available = true;
-  else
+  else {
     avail = evbuffer_get_length(bufferevent_get_input(up_buffer));
+    if (avail == 0 && (stream = next_stream()))
+      avail = STREAM_ID_LEN +
+        evbuffer_get_length(bufferevent_get_input(stream->buf));
+  }
 
-  if (avail == 0 && !(upstream_eof && !sent_fin) && config->retransmit) {
+  if (avail == 0 && !fin_pending() && config->retransmit) {
     // Consider retransmission if we have nothing new to send.
     evbuffer *block = evbuffer_new();
     if (!block)
@@ -1213,6 +2353,7 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
           return -1;
         }
         evbuffer_free(block);
+        metrics.blocks_retransmitted++;
 
         char fallbackbuf[4];
         log_debug(conn, "retransmitted block %u <d=%lu p=%lu f=%s>",
@@ -1222,17 +2363,8 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
                   opname(el.hdr.opcode(), fallbackbuf));
 
         if (config->trace_packets)
-          fprintf(stderr,
-                  "T:%.4f: ckt %u <ntp %u outq %lu>: "
-                  "resend %lu <d=%lu p=%lu f=%s>\n",
-                  log_get_timestamp(), this->serial,
-                  this->recv_queue.window(),
-                  (unsigned long)evbuffer_get_length(
-                              bufferevent_get_input(this->up_buffer)),
-                  (unsigned long)el.hdr.seqno(),
-                  (unsigned long)el.hdr.dlen(),
-                  (unsigned long)el.hdr.plen(),
-                  opname(el.hdr.opcode(), fallbackbuf));
+          trace_block(TRACE_RESEND, el.hdr.seqno(), el.hdr.dlen(),
+                      el.hdr.plen(), el.hdr.opcode());
 
         return 0;
       }
@@ -1246,6 +2378,8 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
   // If we have any data to transmit, ensure we do not send a block
   // that contains no data at all.
   size_t lo = MIN_BLOCK_SIZE + (avail == MIN_BLOCK_SIZE ? 0 : 1);
+  if (stream)
+    lo = MIN_BLOCK_SIZE + STREAM_ID_LEN;
 
   // If this connection has not yet sent a handshake, it will need to.
   size_t hi = MAX_BLOCK_SIZE;
@@ -1265,6 +2399,8 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
   log_debug(conn, "requests %lu bytes (%s)", (unsigned long)room,
             conn->steg->cfg()->name());
 
+  if (stream)
+    return send_stream_block(stream, conn, room);
   return steg_data_available ? 
     send_targeted_steg_data(conn, room) :
     send_targeted(conn, room);
@@ -1292,7 +2428,7 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t blocksize)
 
   if (avail > blocksize - lo || avail > SECTION_LEN)
     avail = min(blocksize - lo, SECTION_LEN);
-  else if (upstream_eof && !sent_fin)
+  else if (may_send_fin())
     // this block will carry the last byte of real data to be sent in
     // this direction; mark it as such
     op = op_FIN;
@@ -1316,7 +2452,7 @@ chop_circuit_t::send_targeted_steg_data(chop_conn_t *conn, size_t blocksize)
 
   if (avail > blocksize - lo || avail > SECTION_LEN)
     avail = min(blocksize - lo, SECTION_LEN);
-  else if (upstream_eof && !sent_fin)
+  else if (may_send_fin())
     // this block will carry the last byte of real data to be sent in
     // this direction; mark it as such
     op = op_STEG_FIN;
@@ -1352,6 +2488,20 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
 
   // The transmit queue takes ownership of 'data' at this point.
   uint32_t seqno = tx_queue.enqueue(f, data, p);
+  if (fec_tx) {
+    fec_tx->add(seqno, f, data);
+    if (f != op_PARITY)
+      fec_conns.insert(conn->serial);
+  }
+
+  if (latency && d > 0 && payload == bufferevent_get_input(up_buffer)) {
+    // Whatever is left in the upstream buffer arrived after
+    // upstream_since, so keeping it gives an upper bound.
+    latency_record(latency, latency_profile_for_steg(conn->steg->cfg()),
+                   LAT_UPSTREAM_WAIT, upstream_since, latency_now());
+    if (evbuffer_get_length(payload) == 0)
+      upstream_since = 0;
+  }
 
   struct evbuffer *block = evbuffer_new();
   if (!block) {
@@ -1369,6 +2519,12 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
     return -1;
   }
   evbuffer_free(block);
+  conn->steg->cfg()->metrics()->data_bytes_sent += d;
+  conn->bytes_carried += d;
+  metrics.block_data_bytes += d;
+  metrics.block_padding_bytes += p;
+  if (config->coalesce_max_delay && payload == bufferevent_get_input(up_buffer))
+    note_block_room(MIN_BLOCK_SIZE + d + p, evbuffer_get_length(payload) > 0);
 
   //if we don't do retransmit we need to remove the block
   //from the queue not make full. because the only way that
@@ -1379,27 +2535,16 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
             seqno, (unsigned long)d, (unsigned long)p,
             opname(f, fallbackbuf));
 
-  if (config->trace_packets) {
-    fprintf(stderr,
-            "T:%.4f: ckt %u <ntp %u outq %lu>: "
-            "send %lu <d=%lu p=%lu f=%s>\n",
-            log_get_timestamp(), this->serial,
-            this->recv_queue.window(),
-            (unsigned long)evbuffer_get_length(
-                              bufferevent_get_input(this->up_buffer)),
-            (unsigned long)seqno,
-            (unsigned long)d,
-            (unsigned long)p,
-            opname(f, fallbackbuf));
-    config->total_transmited_data_bytes += d;
-    log_debug(this, "efficiency: %f", config->total_transmited_data_bytes/(double)(config->total_transmited_cover_bytes));
-  }
+  if (config->trace_packets)
+    trace_block(TRACE_SEND, seqno, d, p, f);
+  hedge(conn, seqno, d, f);
   if (f == op_FIN || f == op_STEG_FIN) {
     sent_fin = true;
     read_eof = true;
   }
   if ((f == op_DAT && d > 0) || 
       (f == op_STEG0 && d > 0) ||
+      (f == op_SDAT && d > STREAM_ID_LEN) ||
       f == op_FIN ||
       f == op_STEG_FIN) {
     // We are making forward progress if we are _either_ sending or
@@ -1412,17 +2557,13 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
   return 0;
 }
 
-// N.B. 'desired' is the desired size of the _data section_, and
-// 'blocksize' on output is the size to make the _entire block_.
-chop_conn_t *
-chop_circuit_t::pick_connection(size_t desired, size_t minimum,
-                                size_t *blocksize)
+// N.B. 'desired' and 'minimum' are sizes of the _data section_; the
+// return value is the size of the _entire block_ CONN can take right
+// now, including the handshake if it still owes one, or 0.
+size_t
+chop_circuit_t::offered_room(chop_conn_t *conn, size_t desired,
+                             size_t minimum)
 {
-  size_t maxbelow = 0;
-  size_t minabove = MAX_BLOCK_SIZE + 1;
-  chop_conn_t *targbelow = 0;
-  chop_conn_t *targabove = 0;
-
   log_assert(minimum <= SECTION_LEN);
 
   if (desired > SECTION_LEN)
@@ -1436,62 +2577,75 @@ chop_circuit_t::pick_connection(size_t desired, size_t minimum,
   desired += MIN_BLOCK_SIZE;
   minimum += MIN_BLOCK_SIZE;
 
-  log_debug(this, "target block size %lu bytes", (unsigned long)desired);
+  //Keeping track of connection life length
+  log_debug(conn, "has been connected for %lu secs", (unsigned long)difftime(time(0), conn->creation_time));
+  // We cannot transmit on a connection whose steganography module has
+  // not yet been instantiated.  (This only ever happens server-side.)
+  if (!conn->steg) {
+    log_debug(conn, "offers 0 bytes (no steg)");
+    return 0;
+  }
+
+  // We must not transmit on a connection that has not completed its
+  // TCP handshake.  (This only ever happens client-side.  If we try
+  // it anyway, the transmission gets silently dropped on the floor.)
+  if (!conn->connected) {
+    log_debug(conn, "offers 0 bytes (not connected)");
+    return 0;
+  }
+
+  size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
+  size_t room = conn->steg->transmit_room(desired + shake,
+                                          minimum + shake,
+                                          MAX_BLOCK_SIZE + shake);
+  if (conn->target)
+    conn->target->offered(room);
+  metrics.room_requests++;
+  metrics.room_desired_bytes += desired + shake;
+  metrics.room_offered_bytes += room;
+  if (room == 0) {
+    log_debug(conn, "offers 0 bytes (%s)",
+      conn->steg->cfg()->name());
+    return 0;
+  }
+
+  if (room < minimum + shake || room >= MAX_BLOCK_SIZE + shake)
+    log_abort(conn, "steg size request (%lu) out of range [%lu, %lu]",
+              (unsigned long)room,
+              (unsigned long)(minimum + shake),
+              (unsigned long)(MAX_BLOCK_SIZE + shake));
+
+  log_debug(conn, "offers %lu bytes (%s)", (unsigned long)room,
+            conn->steg->cfg()->name());
+  return room;
+}
+
+// N.B. 'desired' is the desired size of the _data section_, and
+// 'blocksize' on output is the size to make the _entire block_.
+chop_conn_t *
+chop_circuit_t::pick_connection(size_t desired, size_t minimum,
+                                size_t *blocksize)
+{
+  size_t maxbelow = 0;
+  size_t minabove = MAX_BLOCK_SIZE + 1;
+  chop_conn_t *targbelow = 0;
+  chop_conn_t *targabove = 0;
+
+  desired = min(desired, SECTION_LEN);
+  log_debug(this, "target block size %lu bytes",
+            (unsigned long)(desired + MIN_BLOCK_SIZE));
 
   // Find the best fit for the desired transmission from all the
   // outbound connections' transmit rooms.
   for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
        i != downstreams.end(); i++) {
     chop_conn_t *conn = *i;
-
-    //Keeping track of connection life length
-    log_debug(conn, "has been connected for %lu secs", (unsigned long)difftime(time(0), conn->creation_time));
-    // We cannot transmit on a connection whose steganography module has
-    // not yet been instantiated.  (This only ever happens server-side.)
-    if (!conn->steg) {
-      log_debug(conn, "offers 0 bytes (no steg)");
-      continue;
-    }
-
-    // We must not transmit on a connection that has not completed its
-    // TCP handshake.  (This only ever happens client-side.  If we try
-    // it anyway, the transmission gets silently dropped on the floor.)
-    if (!conn->connected) {
-      log_debug(conn, "offers 0 bytes (not connected)");
+    size_t room = offered_room(conn, desired, minimum);
+    if (room == 0)
       continue;
-    }
 
     size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
-    size_t room = conn->steg->transmit_room(desired + shake,
-                                            minimum + shake,
-                                            MAX_BLOCK_SIZE + shake);
-    if (room == 0) {
-      log_debug(conn, "offers 0 bytes (%s)",
-        conn->steg->cfg()->name());
-      continue;
-    }
-
-    if (room < minimum + shake || room >= MAX_BLOCK_SIZE + shake)
-      log_abort(conn, "steg size request (%lu) out of range [%lu, %lu]",
-                (unsigned long)room,
-                (unsigned long)(minimum + shake),
-                (unsigned long)(MAX_BLOCK_SIZE + shake));
-
-    log_debug(conn, "offers %lu bytes (%s)", (unsigned long)room,
-              conn->steg->cfg()->name());
-
-    //When we are here it means that our offer went through
-    
-    //for debug reason only
-    if (config->trace_packets) {
-        avg_desirable_size += (-avg_desirable_size + (desired+shake))/((double)(number_of_room_requests+1));
-        avg_available_size += (-avg_available_size + (room))/((double)(number_of_room_requests+1));
-        number_of_room_requests++;
-
-        log_debug(this, "no req: %lu avg des: %f avg act: %f", number_of_room_requests, avg_desirable_size, avg_available_size);
-    }
-    
-    if (room >= desired + shake) {
+    if (room >= desired + MIN_BLOCK_SIZE + shake) {
       if (room < minabove) {
         minabove = room;
         targabove = conn;
@@ -1609,11 +2763,29 @@ int
 chop_circuit_t::recv_block(uint32_t seqno, opcode_t op, 
                            evbuffer *data, steg_config_t *steg_cfg)
 {
+  if (recv_queue.received(seqno)) {
+    // Sent again by retransmission or hedging, or already rebuilt
+    // from parity.  The first copy has been handled, ACKs included.
+    log_debug(this, "duplicate block %u", seqno);
+    metrics.duplicate_blocks_received++;
+    evbuffer_free(data);
+    return 0;
+  }
+
+  if (fec_rx.active() && op != op_PARITY) {
+    fec_rx.add_block(seqno, op, data);
+    recover_blocks();
+  }
+
   switch (op) {
   case op_DAT:
   case op_FIN:
   case op_STEG0:   // steganography modules
   case op_STEG_FIN:
+  case op_SOPEN:   // multiplexed streams
+  case op_SDAT:
+  case op_SFIN:
+  case op_SRST:
 
     // No special handling required.
     goto insert;
@@ -1631,7 +2803,7 @@ chop_circuit_t::recv_block(uint32_t seqno, opcode_t op,
       debug_ack_contents(data, ackdump);
       log_debug(this, "received ACK: %s", ackdump.str().c_str());
     }
-    if (tx_queue.process_ack(data))
+    if (tx_queue.process_ack(data, latency))
       log_warn(this, "protocol error: invalid ACK payload");
     //The upstream data always has priority but there are occasions that 
     //retransmitting is crucial for processing of the data 
@@ -1640,6 +2812,17 @@ chop_circuit_t::recv_block(uint32_t seqno, opcode_t op,
     retransmit();
     goto zap;
 
+  case op_PARITY:
+    if (!fec_rx.active())
+      fec_rx.activate(seqno + 1);
+    else
+      fec_rx.add_block(seqno, op, data);
+    if (fec_rx.add_parity(data))
+      log_warn(this, "protocol error: invalid parity payload");
+    evbuffer_free(data);
+    recover_blocks();
+    goto zap;
+
   case op_XXX:
   default:
     char fallbackbuf[4];
@@ -1659,6 +2842,30 @@ chop_circuit_t::recv_block(uint32_t seqno, opcode_t op,
   return 0;
 }
 
+/* Rebuild whatever blocks the parity received so far allows, and
+   handle them as if they had just arrived.  If the originals show up
+   later after all, they are duplicates. */
+void
+chop_circuit_t::recover_blocks()
+{
+  uint32_t seqno;
+  opcode_t op;
+  evbuffer *data;
+  while (fec_rx.recover(&seqno, &op, &data)) {
+    char fallbackbuf[4];
+    log_debug(this, "rebuilt block %u <d=%lu f=%s> from parity", seqno,
+              (unsigned long)evbuffer_get_length(data),
+              opname(op, fallbackbuf));
+    metrics.fec_blocks_recovered++;
+    if (op == op_PARITY) {
+      // A lost parity block: all we can do is fill in its hole.
+      recv_queue.insert(seqno, op_DAT, data, NULL);
+      continue;
+    }
+    recv_block(seqno, op, data, NULL);
+  }
+}
+
 int
 chop_circuit_t::process_queue()
 {
@@ -1700,6 +2907,11 @@ chop_circuit_t::process_queue()
                                   blk.data)) {
             log_warn(this, "buffer transfer failure");
             pending_error = true;
+          } else if (latency) {
+            latency_record(latency,
+                           blk.steg_cfg ? latency_profile_for_steg(blk.steg_cfg)
+                                        : NULL,
+                           LAT_REASSEMBLY, blk.received_at, latency_now());
           }
         }
       }
@@ -1728,6 +2940,18 @@ chop_circuit_t::process_queue()
       //if (evbuffer_get_length(((steg_config_t*)blk.steg_cfg)->protocol_data_out))
         send();
       break;
+
+    case op_SOPEN:
+    case op_SDAT:
+    case op_SFIN:
+    case op_SRST:
+      if (received_fin) {
+        log_info(this, "protocol error: stream block after FIN");
+        pending_error = true;
+      } else if (recv_stream_block(blk.op, blk.data)) {
+        pending_error = true;
+      }
+      break;
       
     // no other opcodes should get this far
     default:
@@ -1759,14 +2983,42 @@ chop_circuit_t::process_queue()
   if (maybe_send_ack())
     return -1;
 
+  circuit_account_memory(this);
+
   // It may have become possible to send queued data or a FIN.
   if (evbuffer_get_length(bufferevent_get_input(up_buffer))
-      || (upstream_eof && !sent_fin))
+      || stream_bytes() || fin_pending())
     return send();
 
   return check_for_eof();
 }
 
+void
+chop_circuit_t::account_memory(circuit_memory_usage &usage) const
+{
+  circuit_t::account_memory(usage);
+
+  usage.transmit_queue = tx_queue.bytes();
+  // the blocks kept for rebuilding others from parity with them
+  usage.reassembly_queue = recv_queue.bytes() + fec_rx.bytes();
+
+  for (map<uint16_t, chop_stream *>::const_iterator i = streams.begin();
+       i != streams.end(); ++i)
+    usage.upstream +=
+      evbuffer_get_length(bufferevent_get_input(i->second->buf)) +
+      evbuffer_get_length(bufferevent_get_output(i->second->buf));
+
+  for (unordered_set<chop_conn_t *>::const_iterator i = downstreams.begin();
+       i != downstreams.end(); i++) {
+    chop_conn_t *conn = *i;
+    if (conn->buffer)
+      usage.steg_buffers += evbuffer_get_length(conn->inbound()) +
+        evbuffer_get_length(bufferevent_get_output(conn->buffer));
+    if (conn->recv_pending)
+      usage.steg_buffers += evbuffer_get_length(conn->recv_pending);
+  }
+}
+
 int
 chop_circuit_t::check_for_eof()
 {
@@ -1808,9 +3060,10 @@ chop_circuit_t::retransmit()
        i != tx_queue.end();
        ++i) {
     transmit_elt &el = *i;
-    size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen(); //we don't need to add the min block size as it is done in pick_connections, maybe we sends these with double headers
+    // pick_connection wants the size of the data section
+    size_t lo = MIN_BLOCK_SIZE + el.hdr.dlen();
     size_t room;
-    chop_conn_t *conn = pick_connection(lo, lo, &room);
+    chop_conn_t *conn = pick_connection(el.hdr.dlen(), el.hdr.dlen(), &room);
     if (!conn)
       continue;
     log_assert(lo <= room);
@@ -1825,6 +3078,7 @@ chop_circuit_t::retransmit()
       evbuffer_free(block);
       return -1;
     }
+    metrics.blocks_retransmitted++;
     
     char fallbackbuf[4];
     log_debug(conn, "retransmitted block %u <d=%lu p=%lu f=%s>",
@@ -1834,17 +3088,8 @@ chop_circuit_t::retransmit()
               opname(el.hdr.opcode(), fallbackbuf));
     
     if (config->trace_packets)
-      fprintf(stderr,
-              "T:%.4f: ckt %u <ntp %u outq %lu>: "
-              "resend %lu <d=%lu p=%lu f=%s>\n",
-              log_get_timestamp(), this->serial,
-              this->recv_queue.window(),
-              (unsigned long)evbuffer_get_length(
-                                                 bufferevent_get_input(this->up_buffer)),
-              (unsigned long)el.hdr.seqno(),
-              (unsigned long)el.hdr.dlen(),
-              (unsigned long)el.hdr.plen(),
-              opname(el.hdr.opcode(), fallbackbuf));
+      trace_block(TRACE_RESEND, el.hdr.seqno(), el.hdr.dlen(),
+                  el.hdr.plen(), el.hdr.opcode());
 
     evbuffer_free(block);
     //did_retransmit = true;
@@ -1872,14 +3117,16 @@ chop_config_t::conn_create(size_t index)
 }
 
 chop_conn_t::chop_conn_t()
-  :upstream(NULL), must_send_timer(NULL), sent_handshake(false)
+  :upstream(NULL), must_send_timer(must_send_timeout, this), sent_handshake(false),
+   wire_since(0), wire_watch(NULL)
 {
 }
 
 chop_conn_t::~chop_conn_t()
 {
-  if (this->must_send_timer)
-    event_free(this->must_send_timer);
+  if (this->wire_watch && this->buffer)
+    evbuffer_remove_cb_entry(bufferevent_get_output(this->buffer),
+                             this->wire_watch);
   if (steg)
     delete steg;
   evbuffer_free(recv_pending);
@@ -1902,11 +3149,9 @@ chop_conn_t::close()
 void
 chop_conn_t::emancipate_from_upstream()
 {
-  if (this->must_send_timer) {
-    event_del(this->must_send_timer);
-    must_send_timer = NULL;
-  }
+  wheel_timer_disarm(&must_send_timer);
 
+  config->spare_conns.erase(this);
   if (upstream)
     upstream->drop_downstream(this);
 
@@ -1945,21 +3190,61 @@ chop_conn_t::send(struct evbuffer *block)
     }
   }
 
+  uint64_t encode_start = upstream && upstream->latency ? latency_now() : 0;
   int transmission_size = steg->transmit(block);
   if (transmission_size < 0) {
     log_warn(this, "failed to transmit block");
     return -1;
   }
+  if (encode_start) {
+    uint64_t now = latency_now();
+    latency_record(upstream->latency, latency_profile_for_steg(steg->cfg()),
+                   LAT_ENCODE, encode_start, now);
+    watch_wire(now);
+  }
 
-  config->total_transmited_cover_bytes += transmission_size;
+  metrics.blocks_sent++;
+  steg->cfg()->metrics()->blocks_sent++;
+  steg->cfg()->metrics()->cover_bytes_sent += transmission_size;
+  if (!sent_handshake)
+    config->spare_conns.erase(this);
   sent_handshake = true;
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  wheel_timer_disarm(&must_send_timer);
   return 0;
 }
 
+/**
+   Arranges for the time until the next byte leaves the output buffer
+   to be recorded as the wire latency of the block sent at NOW.
+*/
+void
+chop_conn_t::watch_wire(uint64_t now)
+{
+  if (!wire_watch) {
+    wire_watch = evbuffer_add_cb(bufferevent_get_output(buffer),
+                                 wire_drained_cb, this);
+    if (!wire_watch)
+      return;
+  }
+  if (!wire_since)
+    wire_since = now;
+}
+
+void
+chop_conn_t::wire_drained_cb(struct evbuffer *,
+                             const struct evbuffer_cb_info *info, void *arg)
+{
+  chop_conn_t *conn = static_cast<chop_conn_t *>(arg);
+  if (!info->n_deleted || !conn->wire_since)
+    return;
+
+  if (conn->upstream && conn->upstream->latency)
+    latency_record(conn->upstream->latency,
+                   latency_profile_for_steg(conn->steg->cfg()),
+                   LAT_WIRE, conn->wire_since, latency_now());
+  conn->wire_since = 0;
+}
+
 int
 chop_conn_t::handshake()
 {
@@ -1971,8 +3256,18 @@ chop_conn_t::handshake()
   // to associate this new connection with.  Note that in some cases
   // it's possible for us to have _already_ sent something on this
   // connection by the time we get called back!  Don't do it twice.
-  if (config->mode != LSN_SIMPLE_SERVER && !sent_handshake)
-    send();
+  //
+  // With share-connections, only a circuit's first connection does
+  // this.  The others stay unbound until they carry their first
+  // block, which may be for a different, busier circuit (see
+  // chop_circuit_t::adopt_spare_connection).
+  if (config->mode != LSN_SIMPLE_SERVER && !sent_handshake) {
+    if (config->share_connections && upstream && upstream->bound_downstream()) {
+      log_debug(this, "deferring handshake");
+      config->spare_conns.insert(this);
+    } else
+      send();
+  }
   return 0;
 }
 
@@ -2001,6 +3296,7 @@ chop_conn_t::recv_handshake()
     //invalid handshake, if we have a transparent proxy we 
     //we'll act as one for this connection
     log_warn("handshake authentication faild.");
+    metrics.handshake_failures++;
 
     //so we need to axe the must send timer as the connection will be
     //managed by the transparent proxy and also drop the connection from
@@ -2064,6 +3360,8 @@ chop_conn_t::recv()
       log_abort("was not able to make a copy of received data");
   }
 
+  uint64_t readable_at = latency_tracing ? latency_now() : 0;
+  size_t cover_len = evbuffer_get_length(bufferevent_get_input(buffer));
   if (steg->receive(recv_pending)) {
     if ((config->mode == LSN_SIMPLE_SERVER ) && config->transparent_proxy) {
       //If steg fails in recovering the data
@@ -2079,6 +3377,9 @@ chop_conn_t::recv()
     else
       return -1;
   }
+  steg->cfg()->metrics()->cover_bytes_received +=
+    cover_len - evbuffer_get_length(bufferevent_get_input(buffer));
+
   // If that succeeded but did not copy anything into recv_pending,
   // wait for more data.
   if (evbuffer_get_length(recv_pending) == 0)
@@ -2097,6 +3398,17 @@ chop_conn_t::recv()
       return 0;
     }
 
+    if (write_eof || pending_write_eof) {
+      // We're the server, and already sending EOF on this connection
+      // because its circuit finished: this is a client-to-server
+      // block (an ACK of our last blocks, say) that crossed with the
+      // teardown, not a new handshake.  Failing it would reset the
+      // connection under the blocks the client has yet to read.
+      log_debug(this, "discarding block after circuit closed");
+      evbuffer_drain(recv_pending, evbuffer_get_length(recv_pending));
+      return 0;
+    }
+
     // We're the server. Try to receive a handshake.
     int handshake_result = recv_handshake();
     if (config->transparent_proxy) 
@@ -2164,16 +3476,11 @@ chop_conn_t::recv()
                c[9], c[10], c[11], c[12], c[13], c[14], c[15]);
 
       if (config->trace_packets)
-        fprintf(stderr, "T:%.4f: ckt %u <ntp %u outq %lu>: recv-error "
-                "%02x%02x%02x%02x <d=%02x%02x p=%02x%02x f=%s r=%02x "
-                "c=%02x%02x%02x%02x%02x%02x>\n",
-                log_get_timestamp(), upstream->serial,
-                upstream->recv_queue.window(),
-                (unsigned long)evbuffer_get_length(
+        packet_trace_bad_header(config->trace, upstream->serial,
+                                upstream->recv_queue.window(),
+                                evbuffer_get_length(
                                   bufferevent_get_input(upstream->up_buffer)),
-                c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7],
-                opname(c[8], fallbackbuf),
-                c[9], c[10], c[11], c[12], c[13], c[14], c[15]);
+                                c);
 
       return -1;
     }
@@ -2183,6 +3490,10 @@ chop_conn_t::recv()
       break;
     }
 
+    if (upstream->latency)
+      latency_record(upstream->latency, latency_profile_for_steg(steg->cfg()),
+                     LAT_DECODE, readable_at, latency_now());
+
     uint8_t decodebuf[MAX_BLOCK_SIZE];
     if (evbuffer_drain(recv_pending, HEADER_LEN) ||
         evbuffer_remove(recv_pending, decodebuf, hdr.total_len() - HEADER_LEN)
@@ -2204,27 +3515,22 @@ chop_conn_t::recv()
               hdr.rcount());
 
     if (config->trace_packets) {
-      fprintf(stderr, "T:%.4f: ckt %u <ntp %u outq %lu>: recv %lu <d=%lu p=%lu f=%s r=%u>\n",
-              log_get_timestamp(), upstream->serial,
-              upstream->recv_queue.window(),
-              (unsigned long)evbuffer_get_length(bufferevent_get_input(upstream->up_buffer)),
-              (unsigned long)hdr.seqno(),
-              (unsigned long)hdr.dlen(),
-              (unsigned long)hdr.plen(),
-              opname(hdr.opcode(), fallbackbuf),
-              hdr.rcount());
+      upstream->trace_block(TRACE_RECV, hdr.seqno(), hdr.dlen(), hdr.plen(),
+                            hdr.opcode(), hdr.rcount());
 
-         // vmon: I need the content of the packet as well.
-        if (config->trace_packet_data && hdr.dlen())
-          {
-            char data_4_log[hdr.dlen() + 1];
-            memcpy(data_4_log, decodebuf, hdr.dlen());
-            data_4_log[hdr.dlen()] = '\0';
-            log_debug("Data received: %s",  data_4_log);
-            
-          }
-      }
+      // vmon: I need the content of the packet as well.
+      if (config->trace_packet_data && hdr.dlen() && log_do_debug())
+        log_debug("Data received: %.*s", (int)hdr.dlen(), decodebuf);
+    }
     
+    metrics.blocks_received++;
+    steg->cfg()->metrics()->blocks_received++;
+    if (hdr.opcode() == op_DAT || hdr.opcode() == op_FIN ||
+        hdr.opcode() == op_STEG0 || hdr.opcode() == op_STEG_FIN) {
+      steg->cfg()->metrics()->data_bytes_received += hdr.dlen();
+      bytes_carried += hdr.dlen();
+    }
+
     evbuffer *data = evbuffer_new();
     if (!data || (hdr.dlen() && evbuffer_add(data, decodebuf, hdr.dlen()))) {
       log_warn(this, "failed to extract data from decode buffer");
@@ -2278,10 +3584,7 @@ void
 chop_conn_t::cease_transmission()
 {
   no_more_transmissions = true;
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  wheel_timer_disarm(&must_send_timer);
   
   conn_do_flush(this);
 }
@@ -2289,25 +3592,14 @@ chop_conn_t::cease_transmission()
 void
 chop_conn_t::transmit_soon(unsigned long milliseconds)
 {
-  struct timeval tv;
-
   log_debug(this, "must send within %lu milliseconds", milliseconds);
-
-  tv.tv_sec = milliseconds / 1000;
-  tv.tv_usec = (milliseconds % 1000) * 1000;
-
-  if (!must_send_timer)
-    must_send_timer = evtimer_new(config->base, must_send_timeout, this);
-  evtimer_add(must_send_timer, &tv);
+  wheel_timer_arm(&must_send_timer, milliseconds);
 }
 
 void
 chop_conn_t::send()
 {
-  if (must_send_timer) {
-    evtimer_del(must_send_timer);
-    must_send_timer = NULL;
-  }
+  wheel_timer_disarm(&must_send_timer);
 
   if (!steg) {
     log_warn(this, "send() called with no steg module available");
@@ -2330,6 +3622,8 @@ chop_conn_t::send()
     if (upstream->send_targeted(this)) {
       upstream->drop_downstream(this);
       conn_do_flush(this);
+    } else if (upstream->send_parity()) {
+      log_warn(this, "failed to send parity");
     }
 
   } else {
@@ -2369,7 +3663,7 @@ chop_conn_t::send()
     if (transmission_size < 0)
       conn_do_flush(this);
     else
-      config->total_transmited_cover_bytes += transmission_size;
+      steg->cfg()->metrics()->cover_bytes_sent += transmission_size;
 
     evbuffer_free(chaff);
   }
@@ -2378,11 +3672,11 @@ chop_conn_t::send()
 bool
 chop_conn_t::must_send_p() const
 {
-  return must_send_timer && evtimer_pending(must_send_timer, 0);
+  return must_send_timer.pending();
 }
 
 /* static */ void
-chop_conn_t::must_send_timeout(evutil_socket_t, short, void *arg)
+chop_conn_t::must_send_timeout(void *arg)
 {
   static_cast<chop_conn_t *>(arg)->send();
 }
@@ -6,8 +6,10 @@
 #include "crypt.h"
 #include "chop_blk.h"
 #include "connections.h"
+#include "latency.h"
 
 #include <event2/buffer.h>
+#include <cmath>
 #include <iomanip>
 #include <limits>
 
@@ -20,6 +22,7 @@
 
 using std::unordered_set;
 using std::numeric_limits;
+using std::vector;
 
 const uint8_t c_genric_opname_buffer_size = 4;
 
@@ -44,6 +47,11 @@ opname(unsigned int o, char fallbackbuf[c_genric_opname_buffer_size])
   case op_FIN: return "FIN";
   case op_RST: return "RST";
   case op_ACK: return "ACK";
+  case op_SOPEN: return "SOPEN";
+  case op_SDAT: return "SDAT";
+  case op_SFIN: return "SFIN";
+  case op_SRST: return "SRST";
+  case op_PARITY: return "PARITY";
   case op_STEG0: return "STEG DAT";
   case op_STEG_FIN: return "STEG FIN";
   default:
@@ -202,10 +210,11 @@ ack_payload::ack_payload(evbuffer *wire, uint32_t hfloor)
   maxusedbyte = evbuffer_remove(wire, window, sizeof window);
 
   // there shouldn't be any _more_ data than that, the hsn should
-  // be in the range [hfloor-1, hfloor+256), and the first bit of the
-  // window should be zero.
+  // be below hfloor+256, and the first bit of the window should be
+  // zero.  An hsn below hfloor-1 is an ACK that was overtaken by a
+  // later one (say, a hedged or retransmitted copy); it is stale, but
+  // what it says is still true.
   if (evbuffer_get_length(wire) > 0 ||
-      (hfloor >= 1 && hsn_ < hfloor-1) ||
       hsn_ >= hfloor+256 ||
       block_received(hsn_ + 1))
     hsn_ = -1; // invalidate
@@ -243,7 +252,8 @@ ack_payload::serialize() const
 }
 
 transmit_queue::transmit_queue(bool intend_to_retransmit)
-  : next_to_ack(0), next_to_send(0), overwrite_allowed(not intend_to_retransmit)
+  : next_to_ack(0), next_to_send(0), queued_bytes(0),
+    overwrite_allowed(not intend_to_retransmit)
 {
 }
 
@@ -265,12 +275,15 @@ transmit_queue::enqueue(opcode_t f, evbuffer *data, uint16_t padding)
   transmit_elt &elt = cbuf[seqno & 0xFF];
 
   if (elt.data) {
+    queued_bytes -= elt.hdr.dlen();
     evbuffer_free(elt.data);
     elt.data = 0;      
   }
 
   elt.hdr = header(seqno, evbuffer_get_length(data), padding, f);
   elt.data = data;
+  elt.enqueued_at = latency_tracing ? latency_now() : 0;
+  queued_bytes += elt.hdr.dlen();
 
   next_to_send++;
   return seqno;
@@ -344,8 +357,9 @@ transmit_queue::retransmit(transmit_elt &elt,
 }
 
 int
-transmit_queue::process_ack(evbuffer *data)
+transmit_queue::process_ack(evbuffer *data, latency_profile *latency)
 {
+  uint64_t now = latency ? latency_now() : 0;
 
   ack_payload ack(data, next_to_ack);
 
@@ -359,6 +373,9 @@ transmit_queue::process_ack(evbuffer *data)
   for (; next_to_ack <= hsn; next_to_ack++) {
     uint8_t j = next_to_ack & 0xFF;
     if (cbuf[j].data) {
+      if (latency)
+        latency_record(latency, NULL, LAT_ACK, cbuf[j].enqueued_at, now);
+      queued_bytes -= cbuf[j].hdr.dlen();
       evbuffer_free(cbuf[j].data);
       cbuf[j].data = 0;
     }
@@ -370,6 +387,9 @@ transmit_queue::process_ack(evbuffer *data)
   for (uint32_t i = next_to_ack; i < next_to_send; i++) {
     uint8_t j = i & 0xFF;
     if (cbuf[j].data && ack.block_received(i)) {
+      if (latency)
+        latency_record(latency, NULL, LAT_ACK, cbuf[j].enqueued_at, now);
+      queued_bytes -= cbuf[j].hdr.dlen();
       evbuffer_free(cbuf[j].data);
       cbuf[j].data = 0;
     }
@@ -379,7 +399,7 @@ transmit_queue::process_ack(evbuffer *data)
 }
 
 reassembly_queue::reassembly_queue()
-  : next_to_process(0), count(0)
+  : next_to_process(0), count(0), queued_bytes(0)
 {
   memset(cbuf, 0, sizeof cbuf);
 }
@@ -395,7 +415,7 @@ reassembly_queue::~reassembly_queue()
 reassembly_elt
 reassembly_queue::remove_next()
 {
-  reassembly_elt rv = { 0, op_DAT, NULL, false };
+  reassembly_elt rv = { 0, op_DAT, NULL, false, 0 };
   uint8_t front = next_to_process & 0xFF;
   char fallbackbuf[4];
 
@@ -405,6 +425,7 @@ reassembly_queue::remove_next()
 
   if (cbuf[front].data) {
     rv = cbuf[front];
+    queued_bytes -= evbuffer_get_length(rv.data);
     cbuf[front].data = 0;
     cbuf[front].do_ack = true;
     cbuf[front].op   = op_DAT;
@@ -435,10 +456,23 @@ reassembly_queue::insert(uint32_t seqno, opcode_t op,
   cbuf[pos].data = data;
   cbuf[pos].op   = op;
   cbuf[pos].steg_cfg = steg_cfg;
+  cbuf[pos].received_at = latency_tracing ? latency_now() : 0;
+  queued_bytes += evbuffer_get_length(data);
   count++;
   return true;
 }
 
+bool
+reassembly_queue::received(uint32_t seqno) const
+{
+  uint32_t delta = seqno - window();
+  if (delta & 0x80000000u) // behind the window
+    return true;
+  if (delta > 255)
+    return false;
+  return cbuf[(next_to_process + delta) & 0xFF].data != NULL;
+}
+
 void
 reassembly_queue::reset()
 {
@@ -457,7 +491,7 @@ reassembly_queue::gen_ack() //const
   uint8_t pos = front;
   do {
     if (cbuf[pos].data) {
-      payload.set_block_received(next_to_process + (pos - front));
+      payload.set_block_received(next_to_process + uint8_t(pos - front));
       cbuf[pos].do_ack = false;
     }
     pos++;
@@ -466,6 +500,481 @@ reassembly_queue::gen_ack() //const
   return payload.serialize();
 }
 
+/* Above this many offers, trying every subset of them on every send
+   costs more than it is worth. */
+static const size_t c_EXACT_PLAN_LIMIT = 10;
+
+namespace {
+  /* Largest capacity first; among equals, the smaller block. */
+  struct by_capacity
+  {
+    const vector<block_offer> &offers;
+    by_capacity(const vector<block_offer> &offers_) : offers(offers_) {}
+
+    bool operator()(size_t a, size_t b) const
+    {
+      size_t ca = offers[a].capacity(), cb = offers[b].capacity();
+      if (ca != cb)
+        return ca > cb;
+      if (offers[a].room != offers[b].room)
+        return offers[a].room < offers[b].room;
+      return a < b;
+    }
+  };
+}
+
+static size_t
+fill_plan(size_t pending, const vector<block_offer> &offers,
+          vector<size_t> &chosen, vector<block_assignment> &plan)
+{
+  std::sort(chosen.begin(), chosen.end(), by_capacity(offers));
+
+  size_t planned = 0;
+  for (vector<size_t>::const_iterator i = chosen.begin();
+       i != chosen.end() && planned < pending; ++i) {
+    block_assignment blk;
+    blk.offer = *i;
+    blk.data = std::min(offers[*i].capacity(), pending - planned);
+    plan.push_back(blk);
+    planned += blk.data;
+  }
+  return planned;
+}
+
+size_t
+plan_blocks(size_t pending, const vector<block_offer> &offers,
+            vector<block_assignment> &plan)
+{
+  plan.clear();
+
+  if (pending == 0) {
+    size_t smallest = offers.size();
+    for (size_t i = 0; i < offers.size(); i++)
+      if (offers[i].room >= offers[i].overhead &&
+          (smallest == offers.size() || offers[i].room < offers[smallest].room))
+        smallest = i;
+    if (smallest < offers.size()) {
+      block_assignment blk;
+      blk.offer = smallest;
+      blk.data = 0;
+      plan.push_back(blk);
+    }
+    return 0;
+  }
+
+  vector<size_t> usable;
+  size_t total = 0;
+  for (size_t i = 0; i < offers.size(); i++)
+    if (offers[i].capacity() > 0) {
+      usable.push_back(i);
+      total += offers[i].capacity();
+    }
+
+  // Not enough room for everything: fill every block we can get.
+  if (total <= pending)
+    return fill_plan(pending, offers, usable, plan);
+
+  vector<size_t> chosen;
+  if (usable.size() <= c_EXACT_PLAN_LIMIT) {
+    // Smallest total room that carries everything; fewer blocks
+    // break ties.
+    uint32_t best = 0;
+    size_t best_room = 0, best_count = 0;
+    for (uint32_t mask = 1; mask < (1u << usable.size()); mask++) {
+      size_t capacity = 0, room = 0, count = 0;
+      for (size_t j = 0; j < usable.size(); j++)
+        if (mask & (1u << j)) {
+          capacity += offers[usable[j]].capacity();
+          room += offers[usable[j]].room;
+          count++;
+        }
+      if (capacity < pending)
+        continue;
+      if (!best || room < best_room ||
+          (room == best_room && count < best_count)) {
+        best = mask;
+        best_room = room;
+        best_count = count;
+      }
+    }
+    for (size_t j = 0; j < usable.size(); j++)
+      if (best & (1u << j))
+        chosen.push_back(usable[j]);
+  } else {
+    // Largest first until everything fits, then swap the last block
+    // for the smallest one that still holds what is left for it.
+    std::sort(usable.begin(), usable.end(), by_capacity(offers));
+    size_t capacity = 0, n = 0;
+    while (capacity < pending) {
+      capacity += offers[usable[n]].capacity();
+      n++;
+    }
+    size_t last = n - 1;
+    size_t need = pending - (capacity - offers[usable[last]].capacity());
+    for (size_t j = n; j < usable.size(); j++)
+      if (offers[usable[j]].capacity() >= need &&
+          offers[usable[j]].room < offers[usable[last]].room)
+        last = j;
+    chosen.assign(usable.begin(), usable.begin() + n - 1);
+    chosen.push_back(usable[last]);
+  }
+
+  return fill_plan(pending, offers, chosen, plan);
+}
+
+unsigned int
+coalesce_delay(size_t pending, size_t target, double rate,
+               unsigned int budget)
+{
+  if (pending == 0 || pending >= target || rate <= 0 || budget == 0)
+    return 0;
+
+  double wait = (target - pending) * 1000.0 / rate;
+  if (wait > budget)
+    return 0;
+  return std::max(1u, (unsigned int)std::ceil(wait));
+}
+
+stream_verdict
+check_stream_block(opcode_t op, uint16_t id, bool server,
+                   const stream_state *s, size_t n_streams)
+{
+  if (id == 0)
+    return stream_reject;
+
+  if (op == op_SOPEN) {
+    // only the client opens streams, each id once
+    if (!server || s)
+      return stream_reject;
+    return n_streams >= MAX_STREAMS_PER_CIRCUIT ? stream_refuse : stream_open;
+  }
+
+  if (!s)
+    // we have reset it while this block was on its way
+    return stream_ignore;
+  if (op == op_SRST)
+    return stream_drop;
+  if (s->received_fin)
+    return stream_reject;
+  return stream_deliver;
+}
+
+int
+pick_spare_conn(const vector<spare_conn_state> &spares)
+{
+  for (size_t i = 0; i < spares.size(); i++)
+    if (!spares[i].ours && spares[i].ready && !spares[i].donor_pending)
+      return i;
+  return -1;
+}
+
+bool
+offer_on_spare_conns(size_t pending, bool others_offered)
+{
+  return pending > 0 || !others_offered;
+}
+
+/* XOR the contents of DATA into ACC, growing it with zeroes if DATA
+   is longer. */
+static void
+xor_into(vector<uint8_t> &acc, evbuffer *data)
+{
+  size_t len = evbuffer_get_length(data);
+  if (len == 0)
+    return;
+  if (acc.size() < len)
+    acc.resize(len, 0);
+
+  int n = evbuffer_peek(data, -1, NULL, NULL, 0);
+  vector<evbuffer_iovec> v(n);
+  evbuffer_peek(data, -1, NULL, &v[0], n);
+
+  size_t off = 0;
+  for (int i = 0; i < n; i++) {
+    const uint8_t *p = (const uint8_t *)v[i].iov_base;
+    for (size_t j = 0; j < v[i].iov_len; j++)
+      acc[off + j] ^= p[j];
+    off += v[i].iov_len;
+  }
+}
+
+static void
+xor_into(vector<uint8_t> &acc, const vector<uint8_t> &data)
+{
+  if (acc.size() < data.size())
+    acc.resize(data.size(), 0);
+  for (size_t i = 0; i < data.size(); i++)
+    acc[i] ^= data[i];
+}
+
+fec_encoder::fec_encoder(unsigned int k_, unsigned int m_)
+  : k(k_), m(m_), open(false), first(0), count(0), carries_data(false),
+    parity_map(0), parities(m_)
+{
+  log_assert(k >= 1 && k <= FEC_MAX_GROUP);
+  log_assert(m >= 1 && m <= FEC_MAX_PARITY && m <= k);
+}
+
+fec_encoder::~fec_encoder()
+{
+  for (std::deque<evbuffer *>::iterator i = ready.begin();
+       i != ready.end(); ++i)
+    evbuffer_free(*i);
+}
+
+void
+fec_encoder::add(uint32_t seqno, opcode_t op, evbuffer *data)
+{
+  // Parity blocks of the previous group come in between the blocks of
+  // this one, but the group must still fit the bitmaps.
+  if (open && seqno - first >= 64)
+    finish();
+  if (!open) {
+    open = true;
+    first = seqno;
+  }
+
+  uint64_t bit = uint64_t(1) << (seqno - first);
+  if (op == op_PARITY) {
+    parity_map |= bit;
+    return;
+  }
+
+  size_t dlen = evbuffer_get_length(data);
+  if (op < op_STEG0 && dlen <= SECTION_LEN - FEC_HEADER_LEN) {
+    parity &p = parities[count % m];
+    p.covered |= bit;
+    p.op ^= op;
+    p.dlen ^= dlen;
+    xor_into(p.data, data);
+    if (dlen > 0)
+      carries_data = true;
+  }
+
+  if (++count == k)
+    finish();
+}
+
+void
+fec_encoder::flush()
+{
+  if (carries_data)
+    finish();
+}
+
+void
+fec_encoder::finish()
+{
+  for (vector<parity>::iterator p = parities.begin();
+       carries_data && p != parities.end(); ++p) {
+    if (!p->covered)
+      continue;
+
+    uint8_t hdr[FEC_HEADER_LEN];
+    for (int i = 0; i < 4; i++)
+      hdr[i] = (first >> (24 - 8*i)) & 0xFF;
+    for (int i = 0; i < 8; i++) {
+      hdr[4 + i] = (p->covered >> (56 - 8*i)) & 0xFF;
+      hdr[12 + i] = (parity_map >> (56 - 8*i)) & 0xFF;
+    }
+    hdr[20] = p->op;
+    hdr[21] = (p->dlen >> 8) & 0xFF;
+    hdr[22] = p->dlen & 0xFF;
+
+    evbuffer *wire = evbuffer_new();
+    if (!wire || evbuffer_add(wire, hdr, sizeof hdr) ||
+        (!p->data.empty() &&
+         evbuffer_add(wire, &p->data[0], p->data.size())))
+      log_abort("failed to construct parity block");
+    ready.push_back(wire);
+  }
+
+  parities.assign(m, parity());
+  open = false;
+  count = 0;
+  carries_data = false;
+  parity_map = 0;
+}
+
+evbuffer *
+fec_encoder::next_parity()
+{
+  if (ready.empty())
+    return 0;
+  evbuffer *wire = ready.front();
+  ready.pop_front();
+  return wire;
+}
+
+void
+fec_decoder::activate(uint32_t seqno)
+{
+  active_ = true;
+  floor = seqno;
+  highest = seqno;
+}
+
+void
+fec_decoder::prune()
+{
+  // Remember about the span of the receive window's worth of groups
+  // that can still be in flight; anything older has been retransmitted
+  // by now if it was lost.
+  if (highest - floor <= 4*FEC_MAX_GROUP)
+    return;
+
+  floor = highest - 4*FEC_MAX_GROUP;
+  recent.erase(recent.begin(), recent.lower_bound(floor));
+  for (std::list<parity>::iterator p = parities.begin();
+       p != parities.end(); )
+    if (p->first < floor)
+      p = parities.erase(p);
+    else
+      ++p;
+}
+
+void
+fec_decoder::add_block(uint32_t seqno, opcode_t op, evbuffer *data)
+{
+  if (!active_ || seqno < floor)
+    return;
+
+  // Parity is not covered by parity; only its being here matters.
+  block &b = recent[seqno];
+  b.op = op;
+  b.data.resize(op == op_PARITY ? 0 : evbuffer_get_length(data));
+  if (!b.data.empty())
+    evbuffer_copyout(data, &b.data[0], b.data.size());
+
+  if (seqno > highest) {
+    highest = seqno;
+    prune();
+  }
+}
+
+int
+fec_decoder::add_parity(evbuffer *data)
+{
+  size_t len = evbuffer_get_length(data);
+  if (len < FEC_HEADER_LEN)
+    return -1;
+
+  uint8_t hdr[FEC_HEADER_LEN];
+  evbuffer_copyout(data, hdr, sizeof hdr);
+
+  parity p;
+  p.first = 0;
+  for (int i = 0; i < 4; i++)
+    p.first = (p.first << 8) | hdr[i];
+  p.covered = 0;
+  p.parity_map = 0;
+  for (int i = 0; i < 8; i++) {
+    p.covered = (p.covered << 8) | hdr[4 + i];
+    p.parity_map = (p.parity_map << 8) | hdr[12 + i];
+  }
+  p.op = hdr[20];
+  p.dlen = (uint16_t(hdr[21]) << 8) | hdr[22];
+  if (!p.covered || (p.covered & p.parity_map))
+    return -1;
+
+  if (!active_ || p.first < floor)
+    return 0;
+
+  p.data.resize(len - FEC_HEADER_LEN);
+  if (!p.data.empty()) {
+    vector<uint8_t> all(len);
+    evbuffer_copyout(data, &all[0], len);
+    std::copy(all.begin() + FEC_HEADER_LEN, all.end(), p.data.begin());
+  }
+
+  parities.push_back(p);
+  if (parities.size() > 2*FEC_MAX_GROUP)
+    parities.pop_front();
+  return 0;
+}
+
+size_t
+fec_decoder::bytes() const
+{
+  size_t n = 0;
+  for (std::map<uint32_t, block>::const_iterator b = recent.begin();
+       b != recent.end(); ++b)
+    n += b->second.data.size();
+  for (std::list<parity>::const_iterator p = parities.begin();
+       p != parities.end(); ++p)
+    n += p->data.size();
+  return n;
+}
+
+bool
+fec_decoder::recover(uint32_t *seqno, opcode_t *op, evbuffer **data)
+{
+  for (std::list<parity>::iterator p = parities.begin();
+       p != parities.end(); ) {
+    for (unsigned int i = 0; i < 64; i++)
+      if ((p->parity_map >> i) & 1 && !recent.count(p->first + i)) {
+        recent[p->first + i].op = op_PARITY;
+        *seqno = p->first + i;
+        *op = op_PARITY;
+        *data = evbuffer_new();
+        if (!*data)
+          log_abort("failed to rebuild block");
+        return true;
+      }
+
+    unsigned int missing = 0;
+    uint32_t lost = 0;
+    for (unsigned int i = 0; i < 64 && missing < 2; i++)
+      if ((p->covered >> i) & 1 && !recent.count(p->first + i)) {
+        missing++;
+        lost = p->first + i;
+      }
+
+    if (missing > 1) {
+      ++p;
+      continue;
+    }
+    if (missing == 0) {
+      p = parities.erase(p);
+      continue;
+    }
+
+    unsigned int o = p->op;
+    size_t dlen = p->dlen;
+    vector<uint8_t> acc(p->data);
+    for (unsigned int i = 0; i < 64; i++) {
+      uint32_t s = p->first + i;
+      if (!((p->covered >> i) & 1) || s == lost)
+        continue;
+      const block &b = recent[s];
+      o ^= b.op;
+      dlen ^= b.data.size();
+      xor_into(acc, b.data);
+    }
+    p = parities.erase(p);
+
+    // A parity that does not agree with the blocks it covers yields
+    // garbage; the block will be retransmitted anyway.
+    if (dlen > acc.size() || !opcode_valid(o) || o >= op_STEG0 ||
+        o == op_PARITY) {
+      log_debug("parity over %u does not add up", lost);
+      continue;
+    }
+
+    block &b = recent[lost];
+    b.op = opcode_t(o);
+    b.data.assign(acc.begin(), acc.begin() + dlen);
+
+    *seqno = lost;
+    *op = b.op;
+    *data = evbuffer_new();
+    if (!*data || (dlen && evbuffer_add(*data, &b.data[0], dlen)))
+      log_abort("failed to rebuild block");
+    return true;
+  }
+  return false;
+}
+
 } // namespace chop_blk
 
 // Local Variables:
@@ -5,9 +5,15 @@
 #ifndef CHOP_BLK_H
 #define CHOP_BLK_H
 
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
 #include <ostream>
+#include <vector>
 
 struct steg_config_t;
+struct latency_profile;
 
 namespace chop_blk
 {
@@ -68,12 +74,22 @@ enum opcode_t
   op_FIN = 2,       // No further transmissions (pass data along if any)
   op_RST = 3,       // Protocol error, close circuit now
   op_ACK = 4,       // Acknowledge data received
-  op_RESERVED0 = 5, // 4 -- 127 reserved for future definition
+  op_SOPEN = 5,     // Open a multiplexed stream (data: stream id, data)
+  op_SDAT = 6,      // Pass data along to a multiplexed stream
+  op_SFIN = 7,      // No further data on a multiplexed stream
+  op_SRST = 8,      // Close a multiplexed stream now
+  op_PARITY = 9,    // Parity over earlier blocks (data: see fec_encoder)
+  op_RESERVED0 = 10,// 10 -- 127 reserved for future definition
   op_STEG0 = 128,   // 128 -- 255 reserved for steganography modules
   op_STEG_FIN = 129,
   op_LAST = 255
 };
 
+/* The data section of every op_SOPEN, op_SDAT, op_SFIN and op_SRST
+   block starts with the id of its stream, big-endian.  Stream 0 is
+   the circuit's own upstream, which uses op_DAT and op_FIN. */
+const size_t STREAM_ID_LEN = 2;
+
 /**
  * Produce a human-readable codename for opcode O.
  * FALLBACKBUF is used for opcodes that have no official assignment.
@@ -175,7 +191,8 @@ public:
 
   /**
    * Decode an ack_payload from the wire format.  HFLOOR is a lower
-   * bound on the expected HSN.  Before doing anything else with the
+   * bound on the expected HSN, less 1; an ACK below it is stale, but
+   * valid.  Before doing anything else with the
    * object constructed, you must check whether valid() returns true;
    * all the other functions will trigger a fatal assertion if called
    * on an invalid ack_payload.
@@ -280,8 +297,9 @@ public:
  {
    header hdr;
    evbuffer *data;
+   uint64_t enqueued_at; // latency tracing only, 0 otherwise
 
-   transmit_elt() : hdr(), data(0) {}
+   transmit_elt() : hdr(), data(0), enqueued_at(0) {}
  };
 
  class transmit_queue
@@ -289,6 +307,7 @@ public:
    transmit_elt cbuf[256];
    uint32_t next_to_ack;
    uint32_t next_to_send;
+   size_t queued_bytes; // data bytes held by the blocks in cbuf
 
    bool overwrite_allowed;
 
@@ -314,12 +333,26 @@ public:
    bool full() const
    { return (not overwrite_allowed) and (next_to_send - next_to_ack > 255); }
 
+   /**
+    * True if fewer than RESERVE slots are left.  Senders of many small
+    * data blocks stop there, so that both ends can still send ACKs.
+    */
+   bool nearly_full(unsigned int reserve) const
+   { return (not overwrite_allowed) and
+       (next_to_send - next_to_ack > 255 - reserve); }
+
    /**
     * True if we ought to rekey soon, i.e. the sequence number is in
     * danger of wrapping around.
     */
    bool should_rekey() const { return next_to_send >= 0x80000000u; }
 
+   /**
+    * Number of data bytes held by blocks which have not been
+    * discarded by process_ack.
+    */
+   size_t bytes() const { return queued_bytes; }
+
    /**
     * Push a block on the end of the transmit queue.  The block has
     * opcode F, carries all of the data in DATA, and is padded with
@@ -361,9 +394,25 @@ public:
     * counter and discarding blocks that have definitely been received
     * on the far side.  Returns -1 for failure or 0 for success:
     * failure indicates an ill-formed ack payload on the wire.
-    * Consumes DATA regardless of success or failure.
+    * Consumes DATA regardless of success or failure.  If LATENCY is
+    * given, the time each discarded block spent waiting for its
+    * acknowledgment is recorded there.
     */
-   int process_ack(evbuffer *data);
+   int process_ack(evbuffer *data, latency_profile *latency = NULL);
+
+   /**
+    * The block with sequence number SEQNO, if it has been sent and not
+    * yet discarded by process_ack; otherwise NULL.
+    */
+   transmit_elt *find(uint32_t seqno)
+   {
+     if (seqno - next_to_ack >= next_to_send - next_to_ack)
+       return NULL;
+     transmit_elt &elt = cbuf[seqno & 0xFF];
+     if (!elt.data || elt.hdr.seqno() != seqno)
+       return NULL;
+     return &elt;
+   }
 
    /**
     * Iteration over the transmit queue produces each block which has
@@ -429,6 +478,7 @@ struct reassembly_elt
   //conn_t* conn;
   steg_config_t* steg_cfg;
   bool do_ack;
+  uint64_t received_at; // latency tracing only, 0 otherwise
 };
 
 class reassembly_queue
@@ -439,6 +489,7 @@ class reassembly_queue
                   // economy; using a uint32_t means we don't have to
                   // worry about overflow at the upper limit, and the
                   // size of the class will be the same in either case
+  size_t queued_bytes; // data bytes held by the blocks in cbuf
 
   reassembly_queue(const reassembly_queue&) DELETE_METHOD;
   reassembly_queue& operator=(const reassembly_queue&) DELETE_METHOD;
@@ -461,11 +512,18 @@ public:
    * SEQNO, with opcode OP and data section DATA.  Returns true if the
    * block was successfully added to the queue, false if it is either
    * outside the acceptable window or duplicates a block already on
-   * the queue (both of these cases indicate protocol errors).
-   * DATA is consumed no matter what the return value is.
+   * the queue.  Neither is a protocol error: retransmission, hedging
+   * and parity all deliver some blocks more than once.  DATA is
+   * consumed no matter what the return value is.
    */
   bool insert(uint32_t seqno, opcode_t op, evbuffer *data, steg_config_t *conn);
 
+  /**
+   * True if the block with sequence number SEQNO has arrived already:
+   * it is either waiting on the queue or has been processed.
+   */
+  bool received(uint32_t seqno) const;
+
   /**
    * Return the current lowest acceptable sequence number in the
    * receive window. This is the value to be passed to
@@ -478,6 +536,11 @@ public:
    */
   bool empty() const { return count == 0; }
 
+  /**
+   * Number of data bytes held by blocks waiting to be processed.
+   */
+  size_t bytes() const { return queued_bytes; }
+
   /**
    * Reset the expected next sequence number to zero.  The queue must
    * be empty.  This is done as the last step of a rekeying cycle.
@@ -491,6 +554,294 @@ public:
   evbuffer *gen_ack(); // const;
 };
 
+/* Block packing.  Before a circuit transmits it asks every connection
+   that can transmit right now how big a block its steg module would
+   take (transmit_room), then decides which of those connections get a
+   block and how much data goes in each.  The cover a steg module
+   wraps around a block grows with the block, so the planner tries to
+   carry the pending data in as few total block bytes as it can,
+   rather than just picking whichever single connection fits best. */
+
+struct block_offer
+{
+  size_t room;      // whole block size the steg module offered
+  size_t overhead;  // bytes of it that cannot carry data: MIN_BLOCK_SIZE
+                    // plus the handshake, if the connection still owes one
+
+  block_offer(size_t room_, size_t overhead_)
+    : room(room_), overhead(overhead_) {}
+
+  /** Data bytes a block of this size can carry. */
+  size_t capacity() const
+  {
+    return room > overhead ? std::min(room - overhead, SECTION_LEN) : 0;
+  }
+};
+
+struct block_assignment
+{
+  size_t offer;     // index into the offers
+  size_t data;      // data bytes to put in the block
+};
+
+/**
+ * Plan blocks carrying PENDING bytes of data over OFFERS, at most one
+ * block per offer.  Every planned block is as big as its offer.  If
+ * the offers together can carry everything, the planner picks the set
+ * of them with the smallest total room that still does (exhaustively
+ * for small sets of offers, largest-first otherwise); if they cannot,
+ * it uses all of them, full.  With nothing pending it plans a single
+ * block on the smallest offer, so that the caller can still send one.
+ * PLAN receives the blocks in the order they should be sent: full
+ * blocks first, the partly filled one last.  Returns the number of
+ * data bytes planned.
+ */
+size_t plan_blocks(size_t pending, const std::vector<block_offer> &offers,
+                   std::vector<block_assignment> &plan);
+
+/**
+ * Decide whether to hold PENDING bytes of upstream data back for a
+ * little while, so that they go out in one block of about TARGET data
+ * bytes instead of several small ones.  RATE is the rate at which
+ * upstream data has been arriving, in bytes per second, and BUDGET
+ * how many more milliseconds the data may be held.  Returns how long
+ * to wait in milliseconds, or 0 to send now: when there is nothing to
+ * hold, the block would already be full, or at this rate it would not
+ * fill up within the budget (interactive traffic should not wait for
+ * data that is not coming).
+ */
+unsigned int coalesce_delay(size_t pending, size_t target, double rate,
+                            unsigned int budget);
+
+/* Connection sharing.  With share-connections, a client circuit's
+   connections other than its first stay spare, unbound to it, until
+   they carry a block, and a circuit with data and nowhere to send it
+   may take one over from another circuit. */
+
+struct spare_conn_state
+{
+  bool ours;            // already one of the adopting circuit's downstreams
+  bool ready;           // connected, with its steg module in place
+  size_t donor_pending; // upstream bytes waiting on the circuit holding it
+};
+
+/**
+ * Pick which of SPARES a circuit may adopt: the first one that is held
+ * by another circuit, is ready to transmit, and whose circuit has no
+ * data of its own waiting for it.  Returns its index, or -1 if none
+ * may be taken.
+ */
+int pick_spare_conn(const std::vector<spare_conn_state> &spares);
+
+/**
+ * Whether a circuit with PENDING bytes of data should ask its spare
+ * connections for blocks too.  Data goes wherever there is room, but
+ * chaff only binds a spare connection when the circuit has no other
+ * connection offering room (OTHERS_OFFERED), since another circuit
+ * could still use it for real data.
+ */
+bool offer_on_spare_conns(size_t pending, bool others_offered);
+
+/* Multiplexed streams (multiplex-streams).  The client opens a stream
+   with op_SOPEN, either side sends its data with op_SDAT and ends it
+   with op_SFIN, and either side may drop it at once with op_SRST.  A
+   stream is gone once both sides have sent their op_SFIN and the
+   peer's has been passed on upstream. */
+
+const size_t MAX_STREAMS_PER_CIRCUIT = 256;
+
+struct stream_state
+{
+  bool connected : 1;     // upstream is connected (server side)
+  bool sent_open : 1;
+  bool read_eof : 1;      // upstream will send no more
+  bool sent_fin : 1;
+  bool received_fin : 1;
+  bool write_eof : 1;     // we have shut down our side of upstream
+
+  stream_state()
+    : connected(false), sent_open(false), read_eof(false), sent_fin(false),
+      received_fin(false), write_eof(false) {}
+
+  /** The opcode of the stream's next block, if it carries everything
+      upstream has sent so far (ALL) or not. */
+  opcode_t next_opcode(bool all) const
+  {
+    if (!sent_open)
+      return op_SOPEN;
+    return all && read_eof ? op_SFIN : op_SDAT;
+  }
+
+  /** Done both ways: the stream may be dropped. */
+  bool finished() const { return sent_fin && received_fin && write_eof; }
+};
+
+/** What the receiver of a stream block does with it. */
+enum stream_verdict
+{
+  stream_reject,   // protocol error: drop the circuit
+  stream_open,     // a new stream: open it, then deliver
+  stream_refuse,   // a new stream, but there are too many: reset it
+  stream_ignore,   // for a stream already dropped on our side
+  stream_drop,     // op_SRST: drop the stream
+  stream_deliver   // pass the data on upstream, and the op_SFIN
+};
+
+/**
+ * Check block OP for stream ID against the receiver's state: whether
+ * it is the SERVER, the state of the stream if it has one by that id
+ * (else NULL), and the number of streams it has open.
+ */
+stream_verdict check_stream_block(opcode_t op, uint16_t id, bool server,
+                                  const stream_state *s, size_t n_streams);
+
+/* Forward error correction.  The sender counts the blocks it
+   transmits in groups of K, and after each group it transmits M
+   op_PARITY blocks.  Parity J of a group covers the group's blocks J,
+   J+M, J+2M, ...; its data section is
+
+     4 octets  sequence number of the group's first block
+     8 octets  bitmap of the blocks covered, bit I for that number + I
+     8 octets  bitmap of the parity blocks among them, likewise
+     1 octet   XOR of the covered blocks' opcodes
+     2 octets  XOR of their data lengths
+     ...       XOR of their data, each zero-extended to the longest
+
+   so a receiver that has all but one of them can rebuild the missing
+   one without waiting for it to be retransmitted.  Parity blocks take
+   sequence numbers like any other, and fall in the span of the next
+   group; they are not covered, but the next group's parity names
+   them, so that the receiver can fill in the hole a lost one leaves
+   rather than hold up the receive window for it.  Blocks too big to
+   fit a parity's data section, and steg blocks (which could not be
+   rebuilt with their steg module) are not covered either. */
+
+const size_t FEC_HEADER_LEN = 23;
+const unsigned int FEC_MAX_GROUP = 32;
+const unsigned int FEC_MAX_PARITY = 8;
+
+class fec_encoder
+{
+  struct parity
+  {
+    uint64_t covered;
+    uint8_t op;
+    uint16_t dlen;
+    std::vector<uint8_t> data;
+
+    parity() : covered(0), op(0), dlen(0) {}
+  };
+
+  unsigned int k, m;
+  bool open;             // whether a group has started
+  uint32_t first;        // sequence number of its first block
+  unsigned int count;    // blocks in it so far, not counting parity
+  bool carries_data;     // whether any of them carried data
+  uint64_t parity_map;   // parity blocks in its span
+  std::vector<parity> parities;
+  std::deque<evbuffer *> ready;
+
+  void finish();
+
+public:
+  fec_encoder(unsigned int k, unsigned int m);
+  ~fec_encoder();
+
+  /**
+   * Account for the block with sequence number SEQNO, opcode OP and
+   * data DATA (which is not consumed), just queued for transmission.
+   */
+  void add(uint32_t seqno, opcode_t op, evbuffer *data);
+
+  /**
+   * Close the current group early, e.g. because there is no more data
+   * to send for now.  A group of nothing but chaff and parity gets no
+   * parity of its own; it stays open for more blocks instead.
+   */
+  void flush();
+
+  /** Whether the current group has any data for parity to protect. */
+  bool pending() const { return carries_data; }
+
+  /**
+   * Take the next parity data section ready to be transmitted, or
+   * NULL if there is none.  The caller owns the buffer.
+   */
+  evbuffer *next_parity();
+
+  fec_encoder(const fec_encoder&) DELETE_METHOD;
+  fec_encoder& operator=(const fec_encoder&) DELETE_METHOD;
+};
+
+class fec_decoder
+{
+  struct block
+  {
+    opcode_t op;
+    std::vector<uint8_t> data;
+  };
+
+  struct parity
+  {
+    uint32_t first;
+    uint64_t covered;
+    uint64_t parity_map;
+    uint8_t op;
+    uint16_t dlen;
+    std::vector<uint8_t> data;
+  };
+
+  bool active_;
+  uint32_t floor;        // blocks below this are not remembered
+  uint32_t highest;      // highest sequence number seen
+  std::map<uint32_t, block> recent;
+  std::list<parity> parities;
+
+  void prune();
+
+public:
+  fec_decoder() : active_(false), floor(0), highest(0) {}
+
+  /**
+   * Whether the decoder is remembering blocks.  Until activate() is
+   * called it does nothing, so that circuits whose peer sends no
+   * parity do not pay for copying every block.
+   */
+  bool active() const { return active_; }
+
+  /**
+   * Start remembering blocks, from sequence number SEQNO on.
+   */
+  void activate(uint32_t seqno);
+
+  /**
+   * Remember the block with sequence number SEQNO, opcode OP and data
+   * DATA (which is not consumed).
+   */
+  void add_block(uint32_t seqno, opcode_t op, evbuffer *data);
+
+  /**
+   * Take note of the parity data section DATA (not consumed).
+   * Returns -1 if it is malformed, 0 otherwise.
+   */
+  int add_parity(evbuffer *data);
+
+  /**
+   * Rebuild one missing block, if any parity allows it: stores its
+   * sequence number, opcode and data (a new buffer, which the caller
+   * owns) and returns true.  The block is remembered as received.  A
+   * missing parity block comes back as an op_PARITY with no data, only
+   * good for filling in its hole.
+   */
+  bool recover(uint32_t *seqno, opcode_t *op, evbuffer **data);
+
+  /** Bytes of block and parity data remembered. */
+  size_t bytes() const;
+
+  fec_decoder(const fec_decoder&) DELETE_METHOD;
+  fec_decoder& operator=(const fec_decoder&) DELETE_METHOD;
+};
+
 } // namespace chop_blk
 
 #endif /* chop_blk.h */
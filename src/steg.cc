@@ -1,6 +1,7 @@
 /* Copyright 2011 SRI International
  * See LICENSE for other credits and copying information
  */
+#include <algorithm>
 #include <vector>
 #include <event2/buffer.h>
 
@@ -8,6 +9,7 @@
 
 #include "util.h"
 #include "steg.h"
+#include "metrics.h"
 
 /* Report whether a named steg-module is supported. */
 
@@ -49,17 +51,60 @@ steg_new(const char *name, config_t *cfg, const YAML::Node& options)
   return 0;
 }
 
+/* Every steg configuration alive, for steg_reload_all and
+   steg_start_all. */
+static std::vector<steg_config_t *> *live_stegs;
+
 /* defining the constructor here, so we don't need 
    to include buffer.h to all module who uses steg */
 steg_config_t::steg_config_t(config_t* c)
-  : cfg(c)
+  : cfg(c), _metrics(NULL)
  {
     log_assert(protocol_data_in = evbuffer_new());
     log_assert(protocol_data_out = evbuffer_new());
-    
+
+    if (!live_stegs)
+      live_stegs = new std::vector<steg_config_t *>;
+    live_stegs->push_back(this);
   }
 
+void
+steg_reload_all()
+{
+  if (!live_stegs)
+    return;
+
+  /* a copy, in case a reload creates or destroys a configuration */
+  std::vector<steg_config_t *> stegs(*live_stegs);
+  for (std::vector<steg_config_t *>::iterator i = stegs.begin();
+       i != stegs.end(); i++)
+    (*i)->reload();
+}
+
+void
+steg_start_all()
+{
+  if (!live_stegs)
+    return;
+
+  std::vector<steg_config_t *> stegs(*live_stegs);
+  for (std::vector<steg_config_t *>::iterator i = stegs.begin();
+       i != stegs.end(); i++)
+    (*i)->start();
+}
+
+steg_metrics *
+steg_config_t::metrics()
+{
+  if (!_metrics)
+    _metrics = metrics_for_steg(name());
+  return _metrics;
+}
+
 /* Define these here rather than in the class definition so that the
    vtables will be emitted in only one place. */
-steg_config_t::~steg_config_t() {}
+steg_config_t::~steg_config_t()
+{
+  live_stegs->erase(std::find(live_stegs->begin(), live_stegs->end(), this));
+}
 steg_t::~steg_t() {}
@@ -16,6 +16,7 @@
     Use STEG_CONFIG_DECLARE_METHODS in the declaration. */
 
 struct steg_t;
+struct steg_metrics;
 
 struct steg_config_t
 {
@@ -50,6 +51,10 @@ struct steg_config_t
   */
   double noise2signal;
 
+  /** The always-on counters of this module (see metrics.h),
+      resolved by name on first use. */
+  steg_metrics *metrics();
+
   /** If chop receives protocol related data, then it writes
       it in protocol_data then call this function to process it.
       
@@ -68,6 +73,22 @@ struct steg_config_t
               //to send as the result of the (non)process
   }
 
+  /** Picks up changes to whatever this module read at startup (its
+      covers, dictionaries...) without dropping any connection.  Called
+      on SIGHUP, see steg_reload_all; by default there is nothing to
+      reload. */
+  virtual void reload() {}
+
+  /** Starts whatever this module does in the background (threads,
+      timers on cfg->base).  Called once the listeners are open, see
+      steg_start_all: cfg->base is set then, and daemonize, which
+      would leave threads started before it behind, is done.  By
+      default there is nothing to start. */
+  virtual void start() {}
+
+ private:
+  steg_metrics *_metrics;
+
 };
 
 /** A 'steg_t' object handles the actual steganography for one
@@ -106,8 +127,8 @@ struct steg_t
   virtual size_t transmit_room(size_t pref, size_t min, size_t max) = 0;
 
   /** Consume all of the data in SOURCE, disguise it, and write it to
-      the outbound buffer for your connection. Return 0 on success, -1
-      on failure. */
+      the outbound buffer for your connection. Return the number of
+      bytes written, -1 on failure. */
   virtual int transmit(struct evbuffer *source) = 0;
 
   /** Unmask as much of the data in your connection's inbound buffer
@@ -142,6 +163,12 @@ int steg_is_supported(const char *name);
 steg_config_t *steg_new(const char *name, config_t *cfg, const std::vector<std::string>& options);
 steg_config_t *steg_new(const char *name, config_t *cfg, const YAML::Node& options);
 
+/** Calls reload() on every steg configuration there is. */
+void steg_reload_all();
+
+/** Calls start() on every steg configuration there is. */
+void steg_start_all();
+
 /* Macros for use in defining steg modules. */
 
 #define STEG_DEFINE_MODULE(mod)                         \
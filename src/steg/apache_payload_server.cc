@@ -1,12 +1,18 @@
 ﻿#include <fstream>
 #include <sstream>
+#include <set>
+#include <system_error>
 #include <vector>
 #include <assert.h>
 
+#include <event2/event.h>
+
 #include "util.h"
 #include "curl_util.h"
 #include "crypt.h"
 #include "rng.h"
+#include "latency.h"
+#include "metrics.h"
 #include "apache_payload_server.h"
 
 #include "http_steg_mods/file_steg.h"
@@ -22,12 +28,32 @@ using namespace std;
 
 typedef string (*RetrievingFunc)(const string&);
 
-ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& database_filename, const string& cover_server, const string& cover_list)
+ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& database_filename, const string& cover_server, const string& cover_list, const string& cover_root, const string& cover_mirrors)
   :PayloadServer(init_side),_database_filename(database_filename),
    _apache_host_name((cover_server.empty()) ? "127.0.0.1" : cover_server),
+   _cover_list(cover_list),
    c_max_buffer_size(HTTP_PAYLOAD_BUF_SIZE),
+   _cover_servers(NULL),
+   _file_covers(NULL),
+   _cover_source(&_http_covers),
+   _last_fetch_status(COVER_FETCH_OK),
    _payload_cache(this, &ApachePayloadServer::fetch_hashed_url, 
    c_PAYLOAD_CACHE_ELEMENT_CAPACITY),   
+   _demand(c_no_of_steg_protocol + 1, c_DEMAND_HALF_LIFE_MS),
+   _next_prefetch_plan(0),
+   _prefetch_timer(NULL),
+   _prefetch_servers(NULL),
+   _prefetch_file_covers(NULL),
+   _prefetch_source(&_prefetch_http),
+   _prefetch_done(false),
+   _prefetch_stale(false),
+   _stopping(false),
+   _reload_done(false),
+   _build_pending(false),
+   _reload_started(0),
+   _reload_reported(0),
+   _reload_timer(NULL),
+   _previous_uri_byte_cut(0),
    chosen_payload_choice_strategy(/*c_random_payload_choice*/c_most_efficient_payload_choice)
 {
   /* Ideally this should check the side and on client side
@@ -39,66 +65,66 @@ ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& da
   std::ifstream payload_info_stream;
 
   if (_side == server_side) {
-    //Initializing type specific data, we initiate with max_capacity = 0, count = 0
-    //I don't think we need this as we have the default constructor doing the same
-    TypeDetail init_empty_type;
-    for(unsigned int cur_type = 1; cur_type < c_no_of_steg_protocol+1; cur_type++)
-      _payload_database.type_detail[cur_type] = init_empty_type;
-    //it should be like this but beacause they are not pointers 
-    //we are in trouble need to change the type to pointer
-    //_payload_database.type_detail = new TypeDetail[c_no_of_steg_protocol];
-
-    if (!file_exists_with_name(_database_filename)) {
-        log_debug("payload database does not exists.");
-        log_debug("scarping payloads to create the database...");
-
-        PayloadScraper my_scraper(_database_filename, _apache_host_name,  cover_list);
-        my_scraper.scrape();
+    bool have_database = file_exists_with_name(_database_filename);
+    if (have_database) {
+      if (!read_payload_database_file(_database_filename, _payload_database))
+        log_abort("Cannot load the payload database %s.", _database_filename.c_str());
 
-      }
-    
-    payload_info_stream.open(_database_filename, std::ifstream::in);
-    if (!payload_info_stream.is_open()) {
-      log_abort("Cannot open payload info file.");
+      //This is how server side initiates the uri dict
+      init_uri_dict();
     }
-      
-    unsigned long file_id;
-    while (payload_info_stream >> file_id) {
-      PayloadInfo cur_payload_info;
 
-      if (_payload_database.payloads.find(cur_payload_info.url_hash) != _payload_database.payloads.end()) {
-        log_warn("duplicate url in the url list: %s", cur_payload_info.url.c_str());
-        continue;
-      }
+    if (!has_covers()) {
+      //scraping may take as long as fetching every cover, so we start
+      //listening without covers and swap the database in once it is
+      //built, see start_building. A database without covers is scraped
+      //again, see load_payload_database.
+      TypeDetail init_empty_type;
+      for(unsigned int cur_type = 1; cur_type < c_no_of_steg_protocol+1; cur_type++)
+        _payload_database.type_detail[cur_type] = init_empty_type;
+      compute_uri_dict_mac();
+
+      if (have_database)
+        log_warn("the payload database %s has no covers, building it again in the background. "
+                 "Connections are handed to the cover server until it is ready.",
+                 _database_filename.c_str());
+      else
+        log_info("no payload database %s yet, building it in the background. "
+                 "Connections are handed to the cover server until it is ready.",
+                 _database_filename.c_str());
+      _build_pending = true;
+    }
 
-      payload_info_stream >>  cur_payload_info.type;
-      payload_info_stream >>  cur_payload_info.url_hash;
-      payload_info_stream >>  cur_payload_info.capacity;
-      payload_info_stream >>  cur_payload_info.length;
-      payload_info_stream >>  cur_payload_info.url;
-      payload_info_stream >>  cur_payload_info.absolute_url_is_absolute;
-      payload_info_stream >>  cur_payload_info.absolute_url;
-
-        
-      _payload_database.payloads.insert(pair<string, PayloadInfo>(cur_payload_info.url_hash, cur_payload_info));
-      _payload_database.sorted_payloads.push_back(EfficiencyIndicator(cur_payload_info.url_hash, cur_payload_info.length));
-                                                  
-      //update type related global data 
-      _payload_database.type_detail[cur_payload_info.type].count++;
-      if (cur_payload_info.capacity > _payload_database.type_detail[cur_payload_info.type].max_capacity)
-        _payload_database.type_detail[cur_payload_info.type].max_capacity = cur_payload_info.capacity;
-
-    } // while
-     
-    if (payload_info_stream.bad())
-      log_abort("payload info file corrupted.");
-        
-    _payload_database.sorted_payloads.sort();
-    
-    log_debug("loaded %zu payloads from %s\n", _payload_database.payloads.size(), _database_filename.c_str());
-    
-    //This is how server side initiates the uri dict
-    init_uri_dict();
+    //the mirrors share the fetches with the cover server
+    vector<string> cover_hosts(1, _apache_host_name);
+    stringstream mirror_list(cover_mirrors);
+    for (string mirror; getline(mirror_list, mirror, ',');) {
+      mirror.erase(0, mirror.find_first_not_of(" \t"));
+      mirror.erase(mirror.find_last_not_of(" \t") + 1);
+      if (!mirror.empty())
+        cover_hosts.push_back(mirror);
+    }
+    if (cover_hosts.size() > 1)
+      log_info("sharing cover fetches among %zu cover servers", cover_hosts.size());
+    _cover_servers = new CoverServerPool(cover_hosts, &_http_covers);
+    _cover_source = _cover_servers;
+    _prefetch_servers = new CoverServerPool::Aside(*_cover_servers, &_prefetch_http);
+    _prefetch_source = _prefetch_servers;
+
+    //If the cover server serves its doc root from this host we read
+    //the covers from there instead of asking it for every one of them
+    string doc_root = cover_root;
+    if (doc_root.empty() && FileCoverSource::is_local_host(_apache_host_name) &&
+        file_exists_with_name(DEFAULT_APACHE_CONF))
+      doc_root = PayloadScraper::find_apache_doc_root(DEFAULT_APACHE_CONF);
+
+    if (!doc_root.empty() && doc_root != "none") {
+      log_info("reading covers from %s", doc_root.c_str());
+      _file_covers = new FileCoverSource(doc_root, "http://" + _apache_host_name + "/", _cover_servers);
+      _cover_source = _file_covers;
+      _prefetch_file_covers = new FileCoverSource(doc_root, "http://" + _apache_host_name + "/", _prefetch_servers);
+      _prefetch_source = _prefetch_file_covers;
+    }
   }
   else{ //client side
     payload_info_stream.open(_database_filename, std::ifstream::in);
@@ -111,16 +137,97 @@ ApachePayloadServer::ApachePayloadServer(MachineSide init_side, const string& da
     }
 
   }
-    
-  //init curl
-  if (!(_curl_obj = curl_easy_init()))
-    log_abort("Failed to initiate the curl object");
 
-  curl_easy_setopt(_curl_obj, CURLOPT_HEADER, 1L);
-  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_CONTENT_DECODING, 0L);
-  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
-  curl_easy_setopt(_curl_obj, CURLOPT_WRITEFUNCTION, curl_read_data_cb);
+}
+
+bool
+ApachePayloadServer::load_payload_database(const string& database_filename, const string& cover_server, const string& cover_list, PayloadDatabase& database, const std::atomic<bool>* cancel)
+{
+  if (file_exists_with_name(database_filename)) {
+    if (!read_payload_database_file(database_filename, database))
+      return false;
+    if (!database.payloads.empty())
+      return true;
+    log_warn("the payload database %s has no covers", database_filename.c_str());
+  }
+
+  log_info("scraping %s for the payload database...", cover_server.c_str());
+
+  //a scrape cut short, or one which found no covers because the cover
+  //server was down, must not pass for a database next time
+  string scraped_filename = database_filename + ".part";
+  PayloadScraper my_scraper(scraped_filename, cover_server, cover_list, DEFAULT_APACHE_CONF, cancel);
+  bool scraped = my_scraper.scrape() >= 0;
+  if (scraped && !my_scraper.payloads_written())
+    log_warn("found no covers on %s", cover_server.c_str());
+  if (!scraped || !my_scraper.payloads_written() ||
+      rename(scraped_filename.c_str(), database_filename.c_str())) {
+    log_warn("failed to scrape the payload database %s", database_filename.c_str());
+    remove(scraped_filename.c_str());
+    return false;
+  }
+
+  return read_payload_database_file(database_filename, database);
+}
+
+bool
+ApachePayloadServer::read_payload_database_file(const string& database_filename, PayloadDatabase& database)
+{
+  //Initializing type specific data, we initiate with max_capacity = 0, count = 0
+  TypeDetail init_empty_type;
+  for(unsigned int cur_type = 1; cur_type < c_no_of_steg_protocol+1; cur_type++)
+    database.type_detail[cur_type] = init_empty_type;
+
+  std::ifstream payload_info_stream(database_filename, std::ifstream::in);
+  if (!payload_info_stream.is_open()) {
+    log_warn("Cannot open payload info file %s.", database_filename.c_str());
+    return false;
+  }
+
+  if (!read_payload_database(payload_info_stream, database)) {
+    log_warn("payload info file %s corrupted.", database_filename.c_str());
+    return false;
+  }
+
+  log_debug("loaded %zu payloads from %s\n", database.payloads.size(), database_filename.c_str());
+  return true;
+}
+
+bool
+ApachePayloadServer::read_payload_database(istream& payload_info_stream, PayloadDatabase& database)
+{
+  unsigned long file_id;
+  while (payload_info_stream >> file_id) {
+    PayloadInfo cur_payload_info;
+
+    payload_info_stream >>  cur_payload_info.type;
+    payload_info_stream >>  cur_payload_info.url_hash;
+    payload_info_stream >>  cur_payload_info.capacity;
+    payload_info_stream >>  cur_payload_info.length;
+    payload_info_stream >>  cur_payload_info.url;
+    payload_info_stream >>  cur_payload_info.absolute_url_is_absolute;
+    payload_info_stream >>  cur_payload_info.absolute_url;
+
+    if (database.payloads.find(cur_payload_info.url_hash) != database.payloads.end()) {
+      log_warn("duplicate url in the url list: %s", cur_payload_info.url.c_str());
+      continue;
+    }
+
+    database.payloads.insert(pair<string, PayloadInfo>(cur_payload_info.url_hash, cur_payload_info));
+    database.sorted_payloads.push_back(EfficiencyIndicator(cur_payload_info.url_hash, cur_payload_info.length));
+
+    //update type related global data 
+    database.type_detail[cur_payload_info.type].count++;
+    if (cur_payload_info.capacity > database.type_detail[cur_payload_info.type].max_capacity)
+      database.type_detail[cur_payload_info.type].max_capacity = cur_payload_info.capacity;
+
+  } // while
 
+  if (payload_info_stream.bad())
+    return false;
+
+  database.sorted_payloads.sort();
+  return true;
 }
 
 unsigned int
@@ -137,6 +244,7 @@ ApachePayloadServer::find_client_payload(char* buf, int len, int type)
 int
 ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* size, double noise2signal, std::string* payload_id_hash)
 {
+  _demand.record(contentType, cap);
 
   for(unsigned int search_tries = 0; search_tries < c_MAX_SEARCH_TRIES; search_tries++) /* each payload which is found but is corrupted */ {
     int found = 0, numCandidate = 0;
@@ -202,29 +310,44 @@ ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* siz
                   numCandidate,
                   cap);
 
-        std::string url_to_resource = (itr_best->absolute_url_is_absolute ? "" : "http://" + _apache_host_name + "/") + (itr_best->absolute_url);
+        std::string url_to_resource = cover_url(*itr_best);
+        bool cover_missing = false;
         for(unsigned int fetch_tries = 0; fetch_tries < c_MAX_FETCH_TRIES; fetch_tries++) {
           log_debug("attempt %i to fetch %s", fetch_tries + 1, url_to_resource.c_str());
-          string& best_payload = _payload_cache(url_to_resource); //this is a permanent object in cache so it is ok to get a reference to it.
-          //if curl fails the size will be zero. we disqualify the resource because it might be
+          bool warm = _payload_cache.contains(url_to_resource);
+          CoverResponsePtr& best_payload = _payload_cache(url_to_resource); //this is a permanent object in cache so it is ok to get a reference to it.
+          //if the fetch fails there is no cover. we disqualify the resource because it might be
           //removed from the cover server and try again
-          if (!best_payload.empty() != 0) {
-            *buf = (char*)best_payload.c_str();
-            *size = best_payload.length();
+          if (best_payload && best_payload->size()) {
+            *buf = best_payload->data();
+            *size = best_payload->size();
             if (payload_id_hash)
               *payload_id_hash = itr_best->url_hash;
 
+            if (warm)
+              metrics.covers_served_warm++;
+            else
+              metrics.covers_served_fetched++;
             return 1;
           } else {
             //drop the empty string from the cache, force
             //retriving
             log_warn("error in retrieving cover %s", url_to_resource.c_str());
             _payload_cache.drop(url_to_resource);
-            
+            //the cover server says it doesn't have it, asking again won't help
+            if (_last_fetch_status == COVER_FETCH_MISSING) {
+              cover_missing = true;
+              break;
+            }
           }
         } // tries < MAX_FETCH_TRIES
-        //if we arrive here it means the best payload was empty and hence 
-        //corrupted/not found etc
+        //if the cover servers failed to answer the cover is not to
+        //blame, keep it for when they are back
+        if (!cover_missing) {
+          log_warn("cover servers are failing, no cover to send");
+          return 0;
+        }
+        //the cover is gone from the cover server
         itr_best->corrupted = true;
         continue; //search for a new one
       
@@ -246,22 +369,170 @@ ApachePayloadServer::get_payload( int contentType, int cap, char** buf, int* siz
 
    @param url_hash the sha-1 hash of the url
  */
-string
+CoverResponsePtr
 ApachePayloadServer::fetch_hashed_url(const string& url)
 {
-  stringstream tmp_stream_buf;
-  string payload_uri = url;
-
-  log_debug("asking cover server for payload %s", payload_uri.c_str());
-  size_t payload_size = fetch_url_raw(_curl_obj, payload_uri, tmp_stream_buf);
-  if (payload_size == 0) {
-    log_warn("Failed fetch the url %s", payload_uri.c_str()); //here we should signal that we failed
-    //to retreieve the file and mark it as unacceptable
-    return string();
+  //an empty pointer signals that we failed to retreieve the file,
+  //get_payload marks it as unacceptable if the server says it is gone
+  return _cover_source->fetch(url, _last_fetch_status);
+
+}
+
+string
+ApachePayloadServer::cover_url(const PayloadInfo& cover_info) const
+{
+  return (cover_info.absolute_url_is_absolute ? "" : "http://" + _apache_host_name + "/") + cover_info.absolute_url;
+}
+
+void
+ApachePayloadServer::plan_prefetch()
+{
+  std::vector<CoverDemand::WarmSet> warm_sets =
+    _demand.plan(c_PREFETCH_BUDGET, latency_now() / 1000);
+
+  for (size_t i = 0; i < warm_sets.size(); i++) {
+    const CoverDemand::WarmSet& warm_set = warm_sets[i];
+    const unsigned long lowest = CoverDemand::bucket_floor(warm_set.bucket);
+    const unsigned long highest = CoverDemand::bucket_floor(warm_set.bucket + 1) - 1;
+
+    //get_payload takes the first good cover in the sorted list which
+    //holds the capacity asked for, so the ones it takes for the bucket
+    //are those holding more than all the ones before them
+    unsigned long covered = 0;
+    size_t queued = 0;
+    for (list<EfficiencyIndicator>::iterator itr_payloads = _payload_database.sorted_payloads.begin();
+         itr_payloads != _payload_database.sorted_payloads.end() && queued < warm_set.covers && covered < highest;
+         itr_payloads++) {
+      PayloadDict::iterator cover_info = _payload_database.payloads.find(itr_payloads->url_hash);
+      if (cover_info == _payload_database.payloads.end() ||
+          cover_info->second.corrupted ||
+          cover_info->second.type != warm_set.type ||
+          cover_info->second.capacity < max(lowest, covered + 1) ||
+          cover_info->second.length >= c_max_buffer_size)
+        continue;
+
+      _prefetch_queue.push_back(itr_payloads->url_hash);
+      covered = cover_info->second.capacity;
+      queued++;
+    }
+  }
+}
+
+void
+ApachePayloadServer::prefetch_covers()
+{
+  if (_prefetch_thread.joinable()) {
+    if (_prefetch_done.load(std::memory_order_acquire))
+      collect_prefetches();
+    return;
+  }
+
+  if (_prefetch_queue.empty()) {
+    uint64_t now = latency_now() / 1000;
+    if (now < _next_prefetch_plan)
+      return;
+    _next_prefetch_plan = now + c_PREFETCH_PLAN_MS;
+    plan_prefetch();
   }
 
-  return tmp_stream_buf.str();
+  _prefetching.clear();
+  while (_prefetching.size() < c_PREFETCH_BATCH && !_prefetch_queue.empty()) {
+    PayloadDict::iterator cover_info = _payload_database.payloads.find(_prefetch_queue.front());
+    _prefetch_queue.pop_front();
+    if (cover_info == _payload_database.payloads.end() || cover_info->second.corrupted)
+      continue;
+
+    Prefetch cur_prefetch;
+    cur_prefetch.url_hash = cover_info->first;
+    cur_prefetch.url = cover_url(cover_info->second);
+    cur_prefetch.status = COVER_FETCH_FAILED;
+    if (_payload_cache.contains(cur_prefetch.url))
+      continue;
+
+    _prefetching.push_back(cur_prefetch);
+    metrics.cover_prefetches++;
+  }
+  if (_prefetching.empty())
+    return;
+
+  if (_prefetch_servers)
+    _prefetch_servers->start();
+  _prefetch_done.store(false);
+  _prefetch_stale = false;
+  try {
+    _prefetch_thread = std::thread(&ApachePayloadServer::fetch_prefetches, this);
+  } catch (std::system_error& e) {
+    log_warn("failed to start prefetching covers: %s", e.what());
+    _prefetching.clear();
+  }
+}
 
+/**
+   Runs on the prefetch thread. It only uses its own cover sources and
+   hands the covers over through _prefetching.
+*/
+void
+ApachePayloadServer::fetch_prefetches()
+{
+  for (size_t i = 0; i < _prefetching.size() && !_stopping.load(); i++) {
+    log_debug("prefetching cover %s", _prefetching[i].url.c_str());
+    _prefetching[i].cover = _prefetch_source->fetch(_prefetching[i].url, _prefetching[i].status);
+  }
+
+  _prefetch_done.store(true, std::memory_order_release);
+}
+
+void
+ApachePayloadServer::collect_prefetches()
+{
+  _prefetch_thread.join();
+  if (_prefetch_servers)
+    _prefetch_servers->finish();
+
+  //a cover may have changed under the same url
+  if (_prefetch_stale) {
+    _prefetching.clear();
+    return;
+  }
+
+  for (size_t i = 0; i < _prefetching.size(); i++) {
+    const Prefetch& cur_prefetch = _prefetching[i];
+    if (cur_prefetch.cover && cur_prefetch.cover->size()) {
+      //unless get_payload got there first
+      _payload_cache.prefetch(cur_prefetch.url, cur_prefetch.cover);
+      continue;
+    }
+
+    //same as get_payload: only a cover none of the cover servers asked
+    //has is to blame
+    PayloadDict::iterator cover_info = _payload_database.payloads.find(cur_prefetch.url_hash);
+    if (cur_prefetch.status == COVER_FETCH_MISSING && cover_info != _payload_database.payloads.end())
+      cover_info->second.corrupted = true;
+  }
+  _prefetching.clear();
+}
+
+void
+ApachePayloadServer::prefetch_cb(evutil_socket_t, short, void* arg)
+{
+  ((ApachePayloadServer*)arg)->prefetch_covers();
+}
+
+void
+ApachePayloadServer::start_prefetching(struct event_base* base)
+{
+  if (_side != server_side || _prefetch_timer || !base ||
+      chosen_payload_choice_strategy != c_most_efficient_payload_choice)
+    return;
+
+  _prefetch_timer = event_new(base, -1, EV_PERSIST, prefetch_cb, this);
+  if (!_prefetch_timer) {
+    log_warn("failed to set up cover prefetching");
+    return;
+  }
+
+  struct timeval interval = { 0, (suseconds_t)c_PREFETCH_INTERVAL_MS * 1000 };
+  event_add(_prefetch_timer, &interval);
 }
 
 bool
@@ -273,35 +544,225 @@ ApachePayloadServer::init_uri_dict()
       return false;
     }
 
-  uri_dict.clear();
-  uri_decode_book.clear();
+  build_uri_dict(_payload_database, URIDict(), uri_dict);
 
-  PayloadDict::iterator itr_payloads;
-  unsigned long i = 0;
+  compute_uri_dict_mac();
+  return true;
 
-  for (itr_payloads = _payload_database.payloads.begin(); itr_payloads != _payload_database.payloads.end(); itr_payloads++, i++) {
+}
 
-    uri_dict.push_back(URIEntry((*itr_payloads).second.url));
-    uri_decode_book[itr_payloads->second.url] = i;
+void
+ApachePayloadServer::build_uri_dict(const PayloadDatabase& database, const URIDict& previous_dict, URIDict& dict)
+{
+  set<string> present;
+  for (PayloadDict::const_iterator itr_payloads = database.payloads.begin(); itr_payloads != database.payloads.end(); itr_payloads++)
+    present.insert(itr_payloads->second.url);
+
+  //the urls which are not in the previous dict, in database order
+  set<string> kept;
+  for (size_t i = 0; i < previous_dict.size(); i++)
+    if (present.count(previous_dict.url(i)))
+      kept.insert(previous_dict.url(i));
+  vector<string> fresh;
+  for (PayloadDict::const_iterator itr_payloads = database.payloads.begin(); itr_payloads != database.payloads.end(); itr_payloads++)
+    if (!kept.count(itr_payloads->second.url))
+      fresh.push_back(itr_payloads->second.url);
+
+  //every url keeps its index, so a client still on the previous dict
+  //means the same by it. The places of the urls which are gone go to
+  //new ones; while there aren't enough of them the gone ones stay,
+  //only those at the end are dropped.
+  vector<string> urls;
+  vector<string>::const_iterator next_fresh = fresh.begin();
+  for (size_t i = 0; i < previous_dict.size(); i++) {
+    string cur_url = previous_dict.url(i);
+    if (!present.count(cur_url) && next_fresh != fresh.end())
+      urls.push_back(*next_fresh++);
+    else
+      urls.push_back(cur_url);
   }
+  while (!urls.empty() && !present.count(urls.back()))
+    urls.pop_back();
+  urls.insert(urls.end(), next_fresh, vector<string>::const_iterator(fresh.end()));
 
-  compute_uri_dict_mac();
+  dict.clear();
+  for (vector<string>::const_iterator itr_url = urls.begin(); itr_url != urls.end(); itr_url++)
+    dict.append(*itr_url);
+}
+
+unsigned long
+ApachePayloadServer::uri_byte_cut(size_t no_of_uris)
+{
+  unsigned long byte_cut;
+  for(byte_cut = 0; (no_of_uris /=256) > 0; byte_cut++);
+  return byte_cut;
+}
+
+unsigned long
+ApachePayloadServer::uri_code(const char* url, size_t len, unsigned long* byte_cut) const
+{
+  size_t code = uri_dict.find(url, len);
+  if (byte_cut)
+    *byte_cut = uri_byte_cut(uri_dict.size());
+  if (code != URIDict::npos)
+    return code;
+
+  //a client which hasn't got the dict we reloaded yet, it puts as
+  //many bytes in a url as that dict allows
+  code = _previous_uri_dict.find(url, len);
+  if (code != URIDict::npos) {
+    if (byte_cut)
+      *byte_cut = _previous_uri_byte_cut;
+    return code;
+  }
+
+  log_debug("url %.*s is in no dict we know", (int)len, url);
+  return 0;
+}
+
+bool
+ApachePayloadServer::reload(struct event_base* base)
+{
+  if (_side != server_side || !base)
+    return false;
+
+  if (_reload_thread.joinable()) {
+    log_info("the payload database is already being reloaded");
+    return false;
+  }
+
+  if (!_reload_timer && !(_reload_timer = evtimer_new(base, reload_poll_cb, this))) {
+    log_warn("failed to set up the payload database reload");
+    return false;
+  }
+
+  log_info("reloading the payload database %s", _database_filename.c_str());
+  if (!start_reload_thread())
+    return false;
+
+  struct timeval poll_interval = { 0, (suseconds_t)c_RELOAD_POLL_MS * 1000 };
+  evtimer_add(_reload_timer, &poll_interval);
   return true;
+}
 
+bool
+ApachePayloadServer::start_reload_thread()
+{
+  _reload_done.store(false);
+  _reload_started = _reload_reported = latency_now() / 1000;
+  try {
+    _reload_thread = std::thread(&ApachePayloadServer::build_catalog, this, uri_dict);
+  } catch (std::system_error& e) {
+    log_warn("failed to start building the payload database: %s", e.what());
+    return false;
+  }
+
+  return true;
+}
+
+void
+ApachePayloadServer::start_building(struct event_base* base)
+{
+  if (!_build_pending || !base)
+    return;
+  _build_pending = false;
+
+  if (!(_reload_timer = evtimer_new(base, reload_poll_cb, this)))
+    log_abort("failed to watch the payload database being built");
+  if (!start_reload_thread())
+    log_abort("Cannot build the payload database %s.", _database_filename.c_str());
+
+  struct timeval poll_interval = { 0, (suseconds_t)c_RELOAD_POLL_MS * 1000 };
+  evtimer_add(_reload_timer, &poll_interval);
+}
+
+/**
+   Runs on the reload thread. It only reads what never changes after
+   the constructor and hands the catalog over through _reloaded.
+*/
+void
+ApachePayloadServer::build_catalog(URIDict previous_dict)
+{
+  std::unique_ptr<Catalog> catalog(new Catalog);
+
+  if (load_payload_database(_database_filename, _apache_host_name, _cover_list, catalog->database, &_stopping) &&
+      !catalog->database.payloads.empty()) {
+    build_uri_dict(catalog->database, previous_dict, catalog->uri_dict);
+    _reloaded.swap(catalog);
+  }
+
+  _reload_done.store(true, std::memory_order_release);
+}
+
+void
+ApachePayloadServer::reload_poll_cb(evutil_socket_t, short, void* arg)
+{
+  ((ApachePayloadServer*)arg)->finish_reload();
+}
+
+void
+ApachePayloadServer::finish_reload()
+{
+  if (!_reload_done.load(std::memory_order_acquire)) {
+    uint64_t cur_time = latency_now() / 1000;
+    if (cur_time - _reload_reported >= c_RELOAD_PROGRESS_MS) {
+      log_info("still building the payload database, %lu s so far",
+               (unsigned long)((cur_time - _reload_started) / 1000));
+      _reload_reported = cur_time;
+    }
+
+    struct timeval poll_interval = { 0, (suseconds_t)c_RELOAD_POLL_MS * 1000 };
+    evtimer_add(_reload_timer, &poll_interval);
+    return;
+  }
+
+  _reload_thread.join();
+  std::unique_ptr<Catalog> catalog;
+  catalog.swap(_reloaded);
+  if (!catalog) {
+    if (has_covers())
+      log_warn("failed to reload the payload database, keeping the one we have");
+    else
+      log_warn("failed to build the payload database, connections still go to "
+               "the cover server. Send SIGHUP to try again.");
+    return;
+  }
+
+  //we are on the event loop, nothing is half way through the old
+  //catalog. The steg modules are done with the covers get_payload
+  //handed out by the time they return to the loop, so emptying the
+  //cache frees none in use.
+  _previous_uri_byte_cut = uri_byte_cut(uri_dict.size());
+  _previous_uri_dict.swap(uri_dict);
+  uri_dict.swap(catalog->uri_dict);
+  std::swap(_payload_database, catalog->database);
+  compute_uri_dict_mac();
+
+  //a cover may have changed under the same url
+  _payload_cache.clear();
+  gzip_covers.clear();
+  _prefetch_queue.clear();
+  _prefetch_stale = true;
+
+  metrics.payload_database_reloads++;
+  log_info("%s %zu payloads in %lu s, the uri dict has %zu entries",
+           catalog->database.payloads.empty() ? "built" : "reloaded",
+           _payload_database.payloads.size(),
+           (unsigned long)((latency_now() / 1000 - _reload_started) / 1000),
+           uri_dict.size());
+
+  if (_on_reload)
+    _on_reload();
 }
 
 bool
 ApachePayloadServer::init_uri_dict(istream& dict_stream)
 {
   uri_dict.clear();
-  uri_decode_book.clear();
 
   string cur_url;
-  for (size_t i = 0; dict_stream >> cur_url; i++) {
-    uri_dict.push_back(URIEntry(cur_url));
-    uri_decode_book[cur_url] = i;
-
-  }
+  while (dict_stream >> cur_url)
+    uri_dict.append(cur_url);
 
   log_debug("Stored uri dictionary loaded with %zu entries", uri_dict.size());
 
@@ -317,11 +778,7 @@ ApachePayloadServer::init_uri_dict(istream& dict_stream)
 void
 ApachePayloadServer::export_dict(iostream& dict_stream)
 {
-  URIDict::iterator itr_uri;
-  for(itr_uri = uri_dict.begin(); itr_uri != uri_dict.end(); itr_uri++)
-    {
-      dict_stream << itr_uri->URL.c_str() << endl;
-    }
+  dict_stream << uri_dict.text();
 
   log_debug("uri dictionary of size %zu has been exported.", uri_dict.size());
   
@@ -330,10 +787,7 @@ ApachePayloadServer::export_dict(iostream& dict_stream)
 const uint8_t*
 ApachePayloadServer::compute_uri_dict_mac()
 {
-  stringstream dict_str_stream;
-  export_dict(dict_str_stream);
-  
-  sha256((const uint8_t*)dict_str_stream.str().c_str(), dict_str_stream.str().size(), _uri_dict_mac);
+  uri_dict.compute_mac(_uri_dict_mac);
 
   return _uri_dict_mac;
 
@@ -363,9 +817,19 @@ ApachePayloadServer::store_dict(char* dict_buf, size_t dict_buf_size)
 
 ApachePayloadServer::~ApachePayloadServer()
 {
-  /* always cleanup */ 
-  log_debug("cleaning up curl easy handle for payload retrieval");
-  curl_easy_cleanup(_curl_obj);
+  _stopping.store(true);
+  if (_prefetch_thread.joinable())
+    _prefetch_thread.join();
+  if (_reload_thread.joinable())
+    _reload_thread.join();
+  if (_reload_timer)
+    event_free(_reload_timer);
+  if (_prefetch_timer)
+    event_free(_prefetch_timer);
+  delete _prefetch_file_covers;
+  delete _prefetch_servers;
+  delete _file_covers;
+  delete _cover_servers;
 
 }
 
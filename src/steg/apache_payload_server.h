@@ -2,33 +2,25 @@
 #define _APACHE_PAYLOAD_SERVER_H
 
 #include <openssl/sha.h> 
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
 #include <unordered_map>
 #include <string>
+#include <vector>
 
 #include "payload_lru_cache.h"
 #include "payload_server.h"
+#include "cover_source.h"
+#include "cover_demand.h"
+#include "uri_dict.h"
 
 
 class PayloadScraper; /* Just tell ApachePayloadServer that such a
                         class exists */
 
-class URIEntry
-{
-  public:
-    bool accept_param; /*This is to discriminate between types like html
-                                vs cgi, js, etc, but for now I'm not using it
-                              */
-    std::string URL;
-
-    URIEntry(std::string init_URL)
-      : accept_param(true),
-       URL(init_URL)
-      {
-        
-      }
-};
-
-typedef vector<URIEntry> URIDict;
 
 class ApachePayloadServer: public PayloadServer
 {
@@ -37,19 +29,25 @@ class ApachePayloadServer: public PayloadServer
  protected:
   std::string _database_filename;
   std::string _apache_host_name;
+  std::string _cover_list;
   
   const unsigned long c_max_buffer_size;
   const static unsigned int c_MAX_FETCH_TRIES = 3; //no of attemps in fetching a cover in case of curl error
   const static unsigned int c_MAX_SEARCH_TRIES = 3; //no of attemps in searching a suitable cover in case
   //the cover is corrupted.
 
-  CURL* _curl_obj; //this is used to communicate with http server
+  HTTPCoverSource _http_covers; //fetches covers from other http servers
+  CoverServerPool* _cover_servers; //fetches them from the cover server and its mirrors
+  FileCoverSource* _file_covers; //reads them off the doc root of a local server, if known
+  CoverSource* _cover_source; //where covers are looked for first
+  CoverFetchStatus _last_fetch_status; //how the last fetch of the cache went
 
   //This is too keep the dict in sync between client and server
   uint8_t _uri_dict_mac[SHA256_DIGEST_LENGTH];
 
   /**
-     re-computes the sha256 of the uri_dict and store it in _uri_dict_mac
+     takes the sha256 of the uri_dict, which it keeps up to date as
+     urls are added, and stores it in _uri_dict_mac
 
      @return a pointer to the sha256 hash buffer
      
@@ -63,14 +61,125 @@ class ApachePayloadServer: public PayloadServer
      on the server, for now we work with number of payload and can 
      be improved to the limit by total size
    */
-  PayloadLRUCache<std::string, std::string, ApachePayloadServer, unordered_map> _payload_cache;
+  PayloadLRUCache<std::string, CoverResponsePtr, ApachePayloadServer, unordered_map> _payload_cache;
   /**
      This function is supposed to be given to the cache class to be used to retrieve the
      the element when it isn't in the hash table
 
-     @param url_hash the sha-1 hash of the url
+     @param url the url of the cover
+  */
+  CoverResponsePtr fetch_hashed_url(const std::string& url);
+
+  //Prefetch stuff
+  /* at most this many covers are kept warm, so that prefetching
+     leaves most of the cache to the covers actually used */
+  static const size_t c_PREFETCH_BUDGET = c_PAYLOAD_CACHE_ELEMENT_CAPACITY / 4;
+  static const unsigned int c_PREFETCH_INTERVAL_MS = 100;
+  static const unsigned int c_PREFETCH_BATCH = 8; //covers fetched by one run of the prefetch thread
+  static const uint64_t c_PREFETCH_PLAN_MS = 1000;
+  static const uint64_t c_DEMAND_HALF_LIFE_MS = 30000;
+
+  CoverDemand _demand; //what get_payload has been asked for lately
+  std::deque<std::string> _prefetch_queue; //url hashes of the covers to fetch ahead
+  uint64_t _next_prefetch_plan; //ms
+  struct event* _prefetch_timer;
+
+  /* The prefetch thread fetches a batch of covers off the event loop,
+     with sources of its own: the curl handles of get_payload are the
+     event loop's, and so is the cover servers' health, which
+     _prefetch_servers takes when the batch starts and records when it
+     is collected. */
+  struct Prefetch {
+    std::string url_hash;
+    std::string url;
+    CoverResponsePtr cover;
+    CoverFetchStatus status;
+  };
+
+  HTTPCoverSource _prefetch_http;
+  CoverServerPool::Aside* _prefetch_servers;
+  FileCoverSource* _prefetch_file_covers;
+  CoverSource* _prefetch_source;
+  std::thread _prefetch_thread;
+  std::atomic<bool> _prefetch_done;
+  bool _prefetch_stale; //the catalog was reloaded while the batch was fetched
+  std::vector<Prefetch> _prefetching; //the prefetch thread's until _prefetch_done
+  std::atomic<bool> _stopping; //the threads give up when set
+
+  /**
+     the url get_payload fetches the cover from
+  */
+  std::string cover_url(const PayloadInfo& cover_info) const;
+
+  /**
+     queues the covers get_payload would pick for the busiest content
+     types and capacities, up to c_PREFETCH_BUDGET of them
+  */
+  void plan_prefetch();
+
+  /**
+     starts fetching a batch of the queued covers which are not in the
+     cache yet on the prefetch thread, planning again when the queue
+     runs out, and puts them in the cache once they are in
+  */
+  void prefetch_covers();
+
+  /**
+     fetches the covers in _prefetching, on the prefetch thread
+  */
+  void fetch_prefetches();
+
+  /**
+     hands the covers the prefetch thread fetched to the cache
   */
-  std::string fetch_hashed_url(const std::string& url_hash);
+  void collect_prefetches();
+
+  static void prefetch_cb(evutil_socket_t, short, void* arg);
+
+  //Reload stuff
+  /**
+     what a reload builds off the event loop and swaps in
+  */
+  struct Catalog {
+    PayloadDatabase database;
+    URIDict uri_dict;
+  };
+
+  static const unsigned int c_RELOAD_POLL_MS = 100;
+  static const uint64_t c_RELOAD_PROGRESS_MS = 10000; /* how often a long build reports */
+
+  std::thread _reload_thread;
+  std::atomic<bool> _reload_done;
+  bool _build_pending; //there is no database yet, start_building builds it
+  uint64_t _reload_started;  /* ms */
+  uint64_t _reload_reported; /* ms */
+  std::unique_ptr<Catalog> _reloaded; //belongs to the reload thread until _reload_done
+  struct event* _reload_timer;
+  //the dict before the last reload, for the clients which haven't
+  //got the new one yet, and the bytes they put in a url of it
+  URIDict _previous_uri_dict;
+  unsigned long _previous_uri_byte_cut;
+  std::function<void()> _on_reload;
+
+  /**
+     reads the payload database and builds a dict keeping the urls of
+     previous_dict where they are. Runs on the reload thread.
+  */
+  void build_catalog(URIDict previous_dict);
+
+  /**
+     starts build_catalog on the reload thread
+
+     @return false if the thread could not be started
+  */
+  bool start_reload_thread();
+
+  /**
+     swaps in what the reload thread built, once it is done
+  */
+  void finish_reload();
+
+  static void reload_poll_cb(evutil_socket_t, short, void* arg);
 
  public:
   enum PayloadChoiceStrategy {
@@ -81,7 +190,6 @@ class ApachePayloadServer: public PayloadServer
    public because http_apache_steg_t uses them frequently.
    FIX ME: They need to be protected though*/
   URIDict uri_dict;
-  map<std::string, unsigned long> uri_decode_book;
 
   const uint8_t* uri_dict_mac()
   {
@@ -122,8 +230,118 @@ class ApachePayloadServer: public PayloadServer
   /**
      The constructor reads the payload database prepared by scraper
      and initialize the payload table.
+
+     @param cover_root the doc root of the cover server, to read the
+            covers from disk instead of fetching them. If it is empty
+            and the cover server is on this host, the DocumentRoot in
+            the apache config is used. "none" always fetches.
+     @param cover_mirrors comma separated servers serving the same
+            covers as cover_server, to share the fetches with it
     */
-  ApachePayloadServer(MachineSide init_side, const std::string& database_filename, const std::string& cover_server, const std::string& cover_list); 
+  ApachePayloadServer(MachineSide init_side, const std::string& database_filename, const std::string& cover_server, const std::string& cover_list, const std::string& cover_root = "", const std::string& cover_mirrors = ""); 
+
+  /**
+     starts probing the cover servers in the background on base,
+     does nothing on the client side or after the first call
+  */
+  void start_health_checks(struct event_base* base)
+  {
+    if (_cover_servers)
+      _cover_servers->start_health_checks(base);
+  }
+
+  /**
+     reads the payload database in database_filename, scraping the
+     cover server for it first if there is none, or it has no covers.
+     The scrape is written next to it and only renamed to
+     database_filename once complete, and if it found any cover.
+
+     @param cancel if not NULL, the scrape gives up as soon as it is set
+
+     @return false if the database can't be read or scraped
+  */
+  static bool load_payload_database(const std::string& database_filename, const std::string& cover_server, const std::string& cover_list, PayloadDatabase& database, const std::atomic<bool>* cancel = NULL);
+
+  /**
+     reads the payload database in database_filename, as it is
+
+     @return false if the file can't be read or is corrupted
+  */
+  static bool read_payload_database_file(const std::string& database_filename, PayloadDatabase& database);
+
+  /**
+     reads the entries of a payload database from payload_info_stream
+     into database
+
+     @return false if the stream is corrupted
+  */
+  static bool read_payload_database(istream& payload_info_stream, PayloadDatabase& database);
+
+  /**
+     builds the uri dict of the covers in database. The urls already in
+     previous_dict keep their index in it, see reload.
+  */
+  static void build_uri_dict(const PayloadDatabase& database, const URIDict& previous_dict, URIDict& dict);
+
+  /**
+     the number of bytes of data a url of a uri dict of no_of_uris
+     urls carries
+  */
+  static unsigned long uri_byte_cut(size_t no_of_uris);
+
+  /**
+     the code of the len bytes of url in the uri dict, or in the one
+     before the last reload if it is not in it anymore. 0 if it is in
+     neither.
+
+     @param byte_cut if not NULL, set to the uri_byte_cut of the dict
+            the url is in, the one of the uri dict if it is in neither
+  */
+  unsigned long uri_code(const char* url, size_t len, unsigned long* byte_cut = NULL) const;
+
+  /**
+     reads the payload database again and rebuilds the uri dict on a
+     thread of its own, then swaps them in on the event loop of base.
+     The urls still in the database keep their place in the dict, and
+     the old dict is still decoded until the next reload, so clients
+     keep working while they get the new dict. The payload cache is
+     emptied.
+
+     @return false if no reload was started (client side, or one is
+             running already)
+  */
+  bool reload(struct event_base* base);
+
+  /**
+     on_reload is called on the event loop every time a reload has been
+     swapped in
+  */
+  void set_reload_callback(const std::function<void()>& on_reload)
+  {
+    _on_reload = on_reload;
+  }
+
+  /**
+     when the server started without a database, starts building it
+     on the reload thread and swaps it in on the event loop of base as
+     soon as it is ready, reporting progress meanwhile. Does nothing
+     otherwise, or after the first call. The thread is only started
+     here, not by the constructor, which runs before daemonize.
+  */
+  void start_building(struct event_base* base);
+
+  /**
+     false until the server has a payload database to pick covers
+     from, which it may not have while the first one is being built
+  */
+  bool has_covers() const { return !_payload_database.payloads.empty(); }
+
+  /**
+     starts fetching the covers in demand ahead of get_payload, on a
+     thread of its own watched from base. Does nothing on the client
+     side or after the first call
+  */
+  void start_prefetching(struct event_base* base);
 
   /** virtual functions */
   virtual unsigned int find_client_payload(char* buf, int len, int type);
@@ -155,7 +373,7 @@ class ApachePayloadServer: public PayloadServer
   }
 
   /** 
-      Destructor to clean up curl
+      Destructor, releases the cover sources
   */
   ~ApachePayloadServer();
 
@@ -0,0 +1,88 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <algorithm>
+#include <math.h>
+
+#include "util.h"
+#include "cover_demand.h"
+
+using std::vector;
+
+const double CoverDemand::c_MIN_DEMAND = 0.5;
+
+CoverDemand::CoverDemand(unsigned int no_of_types, uint64_t half_life_ms)
+  : _no_of_types(no_of_types), _half_life_ms(half_life_ms),
+    _demand(no_of_types * c_BUCKETS, 0), _last_decay(0)
+{
+  log_assert(_half_life_ms);
+}
+
+unsigned int
+CoverDemand::bucket_of(size_t capacity)
+{
+  unsigned int bucket = 0;
+  while (capacity >>= 1)
+    bucket++;
+  return std::min(bucket, c_BUCKETS - 1);
+}
+
+void
+CoverDemand::record(unsigned int type, size_t capacity)
+{
+  if (type >= _no_of_types)
+    return;
+  _demand[type * c_BUCKETS + bucket_of(capacity)] += 1;
+}
+
+void
+CoverDemand::decay(uint64_t now_ms)
+{
+  if (!_last_decay || now_ms <= _last_decay) {
+    _last_decay = std::max(_last_decay, now_ms);
+    return;
+  }
+
+  double factor = pow(0.5, (double)(now_ms - _last_decay) / _half_life_ms);
+  for (size_t i = 0; i < _demand.size(); i++)
+    _demand[i] *= factor;
+  _last_decay = now_ms;
+}
+
+static bool
+busier(const std::pair<double, size_t>& a, const std::pair<double, size_t>& b)
+{
+  return a.first > b.first;
+}
+
+vector<CoverDemand::WarmSet>
+CoverDemand::plan(size_t budget, uint64_t now_ms)
+{
+  decay(now_ms);
+
+  vector<std::pair<double, size_t> > in_demand;
+  double total = 0;
+  for (size_t i = 0; i < _demand.size(); i++)
+    if (_demand[i] >= c_MIN_DEMAND) {
+      in_demand.push_back(std::make_pair(_demand[i], i));
+      total += _demand[i];
+    }
+  std::stable_sort(in_demand.begin(), in_demand.end(), busier);
+
+  vector<WarmSet> warm_sets;
+  for (size_t i = 0; i < in_demand.size() && budget; i++) {
+    WarmSet warm_set;
+    warm_set.type = in_demand[i].second / c_BUCKETS;
+    warm_set.bucket = in_demand[i].second % c_BUCKETS;
+    warm_set.covers = (size_t)ceil(budget * in_demand[i].first / total);
+    warm_set.covers = std::min(std::min(warm_set.covers, c_MAX_WARM_PER_BUCKET), budget);
+
+    //what a bucket takes the ones after it can't have
+    total -= in_demand[i].first;
+    budget -= warm_set.covers;
+    warm_sets.push_back(warm_set);
+  }
+
+  return warm_sets;
+}
@@ -0,0 +1,79 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _COVER_DEMAND_H
+#define _COVER_DEMAND_H
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+   Remembers what covers the server has been asked for lately, by
+   content type and capacity bucket (covers for 2^b to 2^(b+1) - 1
+   bytes of data fall in bucket b), so the covers likely to be asked
+   for next can be fetched before they are.
+
+   Demand fades away with a half life, so the plan follows what the
+   clients do now rather than what they did an hour ago.
+*/
+class CoverDemand
+{
+ public:
+  static const unsigned int c_BUCKETS = 32;
+  /* below this a bucket is not worth keeping covers warm for */
+  static const double c_MIN_DEMAND;
+  static const size_t c_MAX_WARM_PER_BUCKET = 16;
+
+  /** how many covers to keep ready for a bucket */
+  struct WarmSet
+  {
+    unsigned int type;
+    unsigned int bucket;
+    size_t covers;
+  };
+
+ protected:
+  const unsigned int _no_of_types;
+  const uint64_t _half_life_ms;
+  std::vector<double> _demand;  /* type * c_BUCKETS + bucket */
+  uint64_t _last_decay;
+
+  void decay(uint64_t now_ms);
+
+ public:
+  /**
+     @param no_of_types content types go from 0 to no_of_types - 1
+     @param half_life_ms how long it takes for demand to halve
+  */
+  CoverDemand(unsigned int no_of_types, uint64_t half_life_ms);
+
+  /** the bucket of a request for capacity bytes */
+  static unsigned int bucket_of(size_t capacity);
+
+  /** the smallest capacity falling in bucket */
+  static size_t bucket_floor(unsigned int bucket)
+  {
+    return bucket ? (size_t)1 << bucket : 0;
+  }
+
+  /** counts a request for a cover of type holding capacity bytes */
+  void record(unsigned int type, size_t capacity);
+
+  /** the current demand for a bucket */
+  double demand(unsigned int type, unsigned int bucket) const
+  {
+    return _demand[type * c_BUCKETS + bucket];
+  }
+
+  /**
+     shares budget covers among the buckets in demand, in proportion
+     to their demand, the busiest bucket first. Every bucket in demand
+     gets at least one cover while the budget lasts.
+  */
+  std::vector<WarmSet> plan(size_t budget, uint64_t now_ms);
+};
+
+#endif
@@ -0,0 +1,715 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <sstream>
+
+#include <algorithm>
+#include <mutex>
+#include <system_error>
+
+#include <event2/event.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "curl_util.h"
+#include "cover_source.h"
+#include "latency.h"
+#include "metrics.h"
+
+using std::string;
+
+CoverResponse::CoverResponse(string fetched)
+  : _map(NULL), _map_len(0), _size(fetched.size())
+{
+  _fetched.swap(fetched);
+  _data = &_fetched[0];
+}
+
+CoverResponse::CoverResponse(char* map, size_t map_len, char* data, size_t size)
+  : _map(map), _map_len(map_len), _data(data), _size(size)
+{
+}
+
+/* The mappings of the files, for the SIGBUS handler: a file truncated
+   under its mapping faults on the pages past its new end, and the
+   handler puts a page of zeros there. Slots are claimed by setting
+   their start, and the handler only trusts a slot once its length is
+   in. Covers which don't fit are read instead of mapped. */
+static const size_t c_GUARDED_MAPS = 1024;
+static std::atomic<uintptr_t> guarded_start[c_GUARDED_MAPS];
+static std::atomic<size_t> guarded_len[c_GUARDED_MAPS];
+static struct sigaction unguarded_sigbus;
+
+static void
+guard_sigbus(int, siginfo_t *si, void *)
+{
+  const uintptr_t addr = (uintptr_t)si->si_addr;
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+
+  for (size_t i = 0; i < c_GUARDED_MAPS; i++) {
+    uintptr_t start = guarded_start[i].load();
+    size_t len = guarded_len[i].load();
+    if (!start || !len || addr < start || addr - start >= len)
+      continue;
+    if (mmap((void*)(addr & ~(page - 1)), page, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+      return;
+    break;
+  }
+
+  //not ours: returning faults again, into whatever handled it before
+  sigaction(SIGBUS, &unguarded_sigbus, NULL);
+}
+
+static void
+install_sigbus_guard()
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sa.sa_sigaction = guard_sigbus;
+  if (sigaction(SIGBUS, &sa, &unguarded_sigbus))
+    log_warn("failed to guard the mapped covers: %s", strerror(errno));
+}
+
+/* @return the slot guarding len bytes at start, or -1 if all are taken */
+static int
+guard_mapping(char* start, size_t len)
+{
+  static std::once_flag installed;
+  std::call_once(installed, install_sigbus_guard);
+
+  for (size_t i = 0; i < c_GUARDED_MAPS; i++) {
+    uintptr_t free_slot = 0;
+    if (guarded_start[i].compare_exchange_strong(free_slot, (uintptr_t)start)) {
+      guarded_len[i].store(len);
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void
+unguard_mapping(char* start)
+{
+  for (size_t i = 0; i < c_GUARDED_MAPS; i++)
+    if (guarded_start[i].load() == (uintptr_t)start) {
+      guarded_len[i].store(0);
+      guarded_start[i].store(0);
+      return;
+    }
+}
+
+CoverResponse::~CoverResponse()
+{
+  if (_map) {
+    unguard_mapping(_map);
+    munmap(_map, _map_len);
+  }
+}
+
+/**
+   The header goes at the end of the pages reserved in front of the
+   file, so that it runs straight into the body. One more page after
+   the file stays zero, the \0 a fetched response gets from its string.
+*/
+CoverResponse*
+CoverResponse::map_file(const string& header, int fd, size_t len)
+{
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t header_pages = (header.size() + page - 1) / page * page;
+  const size_t body_pages = (len + page - 1) / page * page;
+  const size_t map_len = header_pages + body_pages + page;
+
+  char* map = (char*)mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    log_warn("failed to reserve %zu bytes for a cover: %s", map_len, strerror(errno));
+    return NULL;
+  }
+
+  if (mmap(map + header_pages, len, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    log_warn("failed to map a cover of %zu bytes: %s", len, strerror(errno));
+    munmap(map, map_len);
+    return NULL;
+  }
+
+  if (guard_mapping(map, map_len) < 0) {
+    log_debug("too many covers mapped, reading this one");
+    munmap(map, map_len);
+    return read_file(header, fd, len);
+  }
+
+  char* data = map + header_pages - header.size();
+  memcpy(data, header.data(), header.size());
+
+  return new CoverResponse(map, map_len, data, header.size() + len);
+}
+
+CoverResponse*
+CoverResponse::read_file(const string& header, int fd, size_t len)
+{
+  string cover(header.size() + len, '\0');
+  memcpy(&cover[0], header.data(), header.size());
+
+  for (size_t done = 0; done < len; ) {
+    ssize_t got = pread(fd, &cover[header.size() + done], len - done, done);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      log_warn("failed to read a cover of %zu bytes: %s", len,
+               got ? strerror(errno) : "the file got shorter");
+      return NULL;
+    }
+    done += got;
+  }
+
+  return new CoverResponse(std::move(cover));
+}
+
+HTTPCoverSource::HTTPCoverSource()
+{
+  if (!(_curl_obj = curl_easy_init()))
+    log_abort("Failed to initiate the curl object");
+
+  curl_easy_setopt(_curl_obj, CURLOPT_HEADER, 1L);
+  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+  curl_easy_setopt(_curl_obj, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
+  curl_easy_setopt(_curl_obj, CURLOPT_WRITEFUNCTION, curl_read_data_cb);
+  curl_easy_setopt(_curl_obj, CURLOPT_CONNECTTIMEOUT_MS, c_CONNECT_TIMEOUT_MS);
+  curl_easy_setopt(_curl_obj, CURLOPT_TIMEOUT_MS, c_FETCH_TIMEOUT_MS);
+  //the timeouts must not be signals, the probes run on a thread
+  curl_easy_setopt(_curl_obj, CURLOPT_NOSIGNAL, 1L);
+}
+
+HTTPCoverSource::~HTTPCoverSource()
+{
+  /* always cleanup */
+  log_debug("cleaning up curl easy handle for payload retrieval");
+  curl_easy_cleanup(_curl_obj);
+}
+
+/**
+   a 4xx means the server is fine but has no such cover, anything the
+   server could not answer properly is worth another try. So is a
+   408 Request Timeout or a 429 Too Many Requests: the server is busy,
+   the cover is fine.
+*/
+CoverFetchStatus
+HTTPCoverSource::status_of(long code)
+{
+  if (code >= 500 || code == 0 || code == 408 || code == 429)
+    return COVER_FETCH_FAILED;
+  if (code >= 400)
+    return COVER_FETCH_MISSING;
+  return COVER_FETCH_OK;
+}
+
+static CoverFetchStatus
+response_status(CURL* curl_obj)
+{
+  long code = 0;
+  curl_easy_getinfo(curl_obj, CURLINFO_RESPONSE_CODE, &code);
+  return HTTPCoverSource::status_of(code);
+}
+
+CoverResponsePtr
+HTTPCoverSource::fetch(const string& url, CoverFetchStatus& status)
+{
+  std::stringstream tmp_stream_buf;
+  string payload_uri = url;
+
+  log_debug("asking cover server for payload %s", payload_uri.c_str());
+  if (fetch_url_raw(_curl_obj, payload_uri, tmp_stream_buf) == 0) {
+    log_warn("Failed fetch the url %s", payload_uri.c_str());
+    status = COVER_FETCH_FAILED;
+    return CoverResponsePtr();
+  }
+
+  status = response_status(_curl_obj);
+  if (status != COVER_FETCH_OK) {
+    log_warn("the cover server refused %s", payload_uri.c_str());
+    return CoverResponsePtr();
+  }
+
+  return CoverResponsePtr(new CoverResponse(tmp_stream_buf.str()));
+}
+
+CoverFetchStatus
+HTTPCoverSource::probe(const string& url)
+{
+  std::stringstream tmp_stream_buf;
+  string probe_uri = url;
+
+  curl_easy_setopt(_curl_obj, CURLOPT_NOBODY, 1L);
+  unsigned long got = fetch_url_raw(_curl_obj, probe_uri, tmp_stream_buf);
+  curl_easy_setopt(_curl_obj, CURLOPT_HTTPGET, 1L);
+
+  return got ? response_status(_curl_obj) : COVER_FETCH_FAILED;
+}
+
+FileCoverSource::FileCoverSource(const string& doc_root, const string& url_prefix,
+                                 CoverSource* fallback)
+  : _doc_root(doc_root), _url_prefix(url_prefix), _fallback(fallback)
+{
+  log_assert(_fallback);
+  if (_doc_root.empty() || _doc_root[_doc_root.length() - 1] != '/')
+    _doc_root.push_back('/');
+}
+
+CoverResponsePtr
+FileCoverSource::fetch(const string& url, CoverFetchStatus& status)
+{
+  if (url.compare(0, _url_prefix.length(), _url_prefix))
+    return _fallback->fetch(url, status);
+
+  //the scraper stores the paths under the doc root as they are, we
+  //only have to drop a query. Anything going up is left to the server.
+  string rel_path = url.substr(_url_prefix.length());
+  rel_path = rel_path.substr(0, rel_path.find_first_of("?#"));
+  if (rel_path.find("..") != string::npos)
+    return _fallback->fetch(url, status);
+
+  string path = _doc_root + rel_path;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    log_debug("cannot open %s: %s, asking the cover server", path.c_str(), strerror(errno));
+    return _fallback->fetch(url, status);
+  }
+
+  struct stat st;
+  CoverResponse* cover = NULL;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    //copying a small file costs less than mapping it
+    if ((size_t)st.st_size < c_MAP_MIN_SIZE) {
+      log_debug("reading cover %s of %lu bytes", path.c_str(), (unsigned long)st.st_size);
+      cover = CoverResponse::read_file(response_header(path, st), fd, st.st_size);
+    } else {
+      log_debug("mapping cover %s of %lu bytes", path.c_str(), (unsigned long)st.st_size);
+      cover = CoverResponse::map_file(response_header(path, st), fd, st.st_size);
+    }
+  }
+  close(fd);
+
+  if (!cover)
+    return _fallback->fetch(url, status);
+
+  status = COVER_FETCH_OK;
+  return CoverResponsePtr(cover);
+}
+
+static string
+http_date(time_t t)
+{
+  struct tm tm;
+  char buf[64];
+  gmtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buf;
+}
+
+string
+FileCoverSource::response_header(const string& path, const struct stat& st)
+{
+  unsigned long long mtime_usec =
+    (unsigned long long)st.st_mtim.tv_sec * 1000000 + st.st_mtim.tv_nsec / 1000;
+  const char* type = content_type(path);
+
+  std::ostringstream header;
+  header << "HTTP/1.1 200 OK\r\n"
+         << "Date: " << http_date(time(NULL)) << "\r\n"
+         << "Server: Apache\r\n"
+         << "Last-Modified: " << http_date(st.st_mtime) << "\r\n"
+         << "ETag: \"" << std::hex << (unsigned long long)st.st_size
+         << "-" << mtime_usec << std::dec << "\"\r\n"
+         << "Accept-Ranges: bytes\r\n"
+         << "Content-Length: " << (unsigned long long)st.st_size << "\r\n";
+  if (type)
+    header << "Content-Type: " << type << "\r\n";
+  header << "\r\n";
+
+  return header.str();
+}
+
+const char*
+FileCoverSource::content_type(const string& path)
+{
+  static const struct {
+    const char* extension;
+    const char* type;
+  } c_types[] = {
+    { "html", "text/html" },
+    { "htm",  "text/html" },
+    { "js",   "application/javascript" },
+    { "pdf",  "application/pdf" },
+    { "swf",  "application/x-shockwave-flash" },
+    { "jpg",  "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "png",  "image/png" },
+    { "gif",  "image/gif" },
+  };
+
+  size_t last_dot = path.rfind('.');
+  if (last_dot == string::npos || path.find('/', last_dot) != string::npos)
+    return NULL;
+
+  const char* ext = path.c_str() + last_dot + 1;
+  for (size_t i = 0; i < sizeof(c_types) / sizeof(c_types[0]); i++)
+    if (!strcasecmp(ext, c_types[i].extension))
+      return c_types[i].type;
+
+  return NULL;
+}
+
+bool
+FileCoverSource::is_local_host(const string& host)
+{
+  string name = host;
+  if (!name.empty() && name[0] == '[') {
+    name = name.substr(1, name.find(']') - 1);
+  } else {
+    size_t colon = name.find(':');
+    if (colon != string::npos && name.find(':', colon + 1) == string::npos)
+      name.erase(colon);
+  }
+
+  return name == "localhost" || name == "::1" || !name.compare(0, 4, "127.");
+}
+
+CoverServerPool::Server::Server(const string& server_host)
+  : host(server_host), latency_ms(0), failures_in_row(0),
+    ejected_until(0), eject_ms(CoverServerPool::c_MIN_EJECT_MS), last_used(0),
+    fetches(0), failures(0)
+{
+}
+
+CoverServerPool::CoverServerPool(const std::vector<string>& hosts, CoverSource* fallback)
+  : _fallback(fallback), _health_timer(NULL), _probes_done(false)
+{
+  log_assert(!hosts.empty() && _fallback);
+  for (size_t i = 0; i < hosts.size(); i++)
+    _servers.push_back(new Server(hosts[i]));
+  _url_prefix = "http://" + hosts[0] + "/";
+}
+
+CoverServerPool::~CoverServerPool()
+{
+  if (_probe_thread.joinable())
+    _probe_thread.join();
+  if (_health_timer)
+    event_free(_health_timer);
+  for (size_t i = 0; i < _servers.size(); i++)
+    delete _servers[i];
+}
+
+uint64_t
+CoverServerPool::now()
+{
+  return latency_now() / 1000;
+}
+
+CoverResponsePtr
+CoverServerPool::fetch_from(Server&, HTTPCoverSource& http, const string& url,
+                            CoverFetchStatus& status)
+{
+  return http.fetch(url, status);
+}
+
+CoverFetchStatus
+CoverServerPool::probe(Server& server)
+{
+  return server.probe_http.probe("http://" + server.host + "/");
+}
+
+int
+CoverServerPool::pick(const std::vector<Standing>& standings, const std::vector<bool>& tried,
+                      bool asked_any)
+{
+  const uint64_t cur_time = now();
+  int best = -1;
+
+  for (size_t i = 0; i < standings.size(); i++) {
+    if (tried[i] || standings[i].ejected_until > cur_time)
+      continue;
+    if (best < 0 || standings[i].latency_ms < standings[best].latency_ms)
+      best = i;
+  }
+
+  //everyone is out: ask the one due back first rather than nobody
+  if (best < 0 && !asked_any)
+    for (size_t i = 0; i < standings.size(); i++)
+      if (!tried[i] && (best < 0 || standings[i].ejected_until < standings[best].ejected_until))
+        best = i;
+
+  return best;
+}
+
+std::vector<CoverServerPool::Standing>
+CoverServerPool::standings() const
+{
+  std::vector<Standing> cur_standings(_servers.size());
+  for (size_t i = 0; i < _servers.size(); i++) {
+    cur_standings[i].ejected_until = _servers[i]->ejected_until;
+    cur_standings[i].latency_ms = _servers[i]->latency_ms;
+  }
+  return cur_standings;
+}
+
+void
+CoverServerPool::record(Server& server, CoverFetchStatus status, uint64_t at)
+{
+  if (status != COVER_FETCH_FAILED) {
+    if (server.ejected_until)
+      log_info("cover server %s is back", server.host.c_str());
+    server.failures_in_row = 0;
+    server.ejected_until = 0;
+    server.eject_ms = c_MIN_EJECT_MS;
+    return;
+  }
+
+  server.failures++;
+  server.failures_in_row++;
+  metrics.cover_fetch_failures++;
+
+  //a server just back from being out gets no second chance
+  if (server.failures_in_row < c_EJECT_AFTER && !server.ejected_until)
+    return;
+
+  log_warn("cover server %s failed %u times in a row, leaving it out for %lu s",
+           server.host.c_str(), server.failures_in_row,
+           (unsigned long)(server.eject_ms / 1000));
+  server.ejected_until = at + server.eject_ms;
+  server.eject_ms = std::min(2 * server.eject_ms, c_MAX_EJECT_MS);
+  metrics.cover_server_ejections++;
+}
+
+void
+CoverServerPool::record(const Attempt& attempt)
+{
+  Server& server = *_servers[attempt.server];
+  server.last_used = std::max(server.last_used, attempt.done);
+  server.fetches++;
+  if (attempt.failover)
+    metrics.cover_fetch_failovers++;
+
+  //an Aside's attempt may come in after the event loop left the
+  //server out for failing the same way
+  if (attempt.status == COVER_FETCH_FAILED && server.ejected_until > attempt.done) {
+    server.failures++;
+    metrics.cover_fetch_failures++;
+    return;
+  }
+
+  record(server, attempt.status, attempt.done);
+  if (attempt.status == COVER_FETCH_OK) {
+    uint64_t elapsed_ms = attempt.done - attempt.start;
+    server.latency_ms = server.latency_ms ?
+      0.8 * server.latency_ms + 0.2 * elapsed_ms : elapsed_ms;
+  }
+}
+
+CoverResponsePtr
+CoverServerPool::ask(const string& path, std::vector<Standing>& standings, bool aside,
+                     std::vector<Attempt>& attempts, CoverFetchStatus& status)
+{
+  std::vector<bool> tried(_servers.size(), false);
+  unsigned int asked = 0, missing = 0;
+
+  for (int i; (i = pick(standings, tried, asked)) >= 0; ) {
+    Server& server = *_servers[i];
+    Attempt attempt;
+    tried[i] = true;
+    attempt.server = i;
+    attempt.failover = asked++ > 0;
+
+    attempt.start = now();
+    CoverResponsePtr cover = fetch_from(server, aside ? server.aside_http : server.http,
+                                        "http://" + server.host + "/" + path,
+                                        attempt.status);
+    attempt.done = now();
+    attempts.push_back(attempt);
+
+    if (attempt.status == COVER_FETCH_OK) {
+      status = COVER_FETCH_OK;
+      return cover;
+    }
+    if (attempt.status == COVER_FETCH_MISSING)
+      missing++;
+    else
+      standings[i].ejected_until = UINT64_MAX;
+  }
+
+  //a mirror lagging behind does not make the cover gone
+  status = (asked && missing == asked) ? COVER_FETCH_MISSING : COVER_FETCH_FAILED;
+  return CoverResponsePtr();
+}
+
+bool
+CoverServerPool::serves(const string& url) const
+{
+  return !url.compare(0, _url_prefix.length(), _url_prefix);
+}
+
+CoverResponsePtr
+CoverServerPool::fetch(const string& url, CoverFetchStatus& status)
+{
+  if (!serves(url))
+    return _fallback->fetch(url, status);
+
+  std::vector<Standing> cur_standings = standings();
+  std::vector<Attempt> attempts;
+  CoverResponsePtr cover = ask(url.substr(_url_prefix.length()), cur_standings, false,
+                               attempts, status);
+  for (size_t i = 0; i < attempts.size(); i++)
+    record(attempts[i]);
+
+  return cover;
+}
+
+bool
+CoverServerPool::check_health()
+{
+  if (_probe_thread.joinable())
+    return false;
+
+  const uint64_t cur_time = now();
+  _probing.clear();
+  for (size_t i = 0; i < _servers.size(); i++) {
+    const Server& server = *_servers[i];
+    bool due = server.ejected_until ? server.ejected_until <= cur_time
+      : cur_time - server.last_used >= c_IDLE_PROBE_MS;
+    if (due)
+      _probing.push_back(i);
+  }
+  if (_probing.empty())
+    return false;
+
+  _probe_results.assign(_probing.size(), COVER_FETCH_FAILED);
+  _probes_done.store(false);
+  try {
+    _probe_thread = std::thread(&CoverServerPool::run_probes, this);
+  } catch (std::system_error& e) {
+    log_warn("failed to start probing the cover servers: %s", e.what());
+    _probing.clear();
+    return false;
+  }
+
+  return true;
+}
+
+/**
+   Runs on the probe thread. It only reads the hosts, which never
+   change, and hands the results over through _probe_results.
+*/
+void
+CoverServerPool::run_probes()
+{
+  for (size_t i = 0; i < _probing.size(); i++) {
+    Server& server = *_servers[_probing[i]];
+    log_debug("probing cover server %s", server.host.c_str());
+    _probe_results[i] = probe(server);
+  }
+
+  _probes_done.store(true, std::memory_order_release);
+}
+
+bool
+CoverServerPool::collect_health(bool wait)
+{
+  if (!_probe_thread.joinable() ||
+      (!wait && !_probes_done.load(std::memory_order_acquire)))
+    return false;
+
+  _probe_thread.join();
+
+  //a probe says nothing about how long covers take, only whether the
+  //server answers
+  const uint64_t cur_time = now();
+  for (size_t i = 0; i < _probing.size(); i++) {
+    Server& server = *_servers[_probing[i]];
+    record(server, _probe_results[i], cur_time);
+    server.last_used = cur_time;
+  }
+  _probing.clear();
+
+  return true;
+}
+
+/**
+   Checks the health every c_HEALTH_CHECK_MS and, while the probes
+   run, looks for their results every c_PROBE_POLL_MS.
+*/
+void
+CoverServerPool::health_check_cb(evutil_socket_t, short, void* arg)
+{
+  CoverServerPool* pool = (CoverServerPool*)arg;
+
+  if (pool->_probe_thread.joinable())
+    pool->collect_health(false);
+  else
+    pool->check_health();
+
+  uint64_t next_ms = pool->_probe_thread.joinable() ? c_PROBE_POLL_MS : c_HEALTH_CHECK_MS;
+  struct timeval interval = { (time_t)(next_ms / 1000), (suseconds_t)(next_ms % 1000 * 1000) };
+  evtimer_add(pool->_health_timer, &interval);
+}
+
+void
+CoverServerPool::start_health_checks(struct event_base* base)
+{
+  if (_health_timer || !base)
+    return;
+
+  _health_timer = evtimer_new(base, health_check_cb, this);
+  if (!_health_timer) {
+    log_warn("failed to set up the cover server health checks");
+    return;
+  }
+
+  struct timeval interval = { (time_t)(c_HEALTH_CHECK_MS / 1000), 0 };
+  evtimer_add(_health_timer, &interval);
+}
+
+CoverServerPool::Aside::Aside(CoverServerPool& pool, CoverSource* fallback)
+  : _pool(pool), _fallback(fallback)
+{
+  log_assert(_fallback);
+}
+
+void
+CoverServerPool::Aside::start()
+{
+  _standings = _pool.standings();
+  _attempts.clear();
+}
+
+/**
+   Runs on the Aside's thread. Only the hosts of the servers, which
+   never change, and their aside_http handles are read there.
+*/
+CoverResponsePtr
+CoverServerPool::Aside::fetch(const string& url, CoverFetchStatus& status)
+{
+  if (!_pool.serves(url))
+    return _fallback->fetch(url, status);
+
+  return _pool.ask(url.substr(_pool._url_prefix.length()), _standings, true,
+                   _attempts, status);
+}
+
+void
+CoverServerPool::Aside::finish()
+{
+  for (size_t i = 0; i < _attempts.size(); i++)
+    _pool.record(_attempts[i]);
+  _attempts.clear();
+}
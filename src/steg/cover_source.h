@@ -0,0 +1,390 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _COVER_SOURCE_H
+#define _COVER_SOURCE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <event2/util.h>
+
+/**
+   A cover as the cover server sends it: the HTTP response header and
+   the body in one buffer, followed by a \0. The buffer is either a
+   string holding a response fetched over HTTP or read from a file, or,
+   for a large file read from the doc root, a mapping of the file with
+   the synthesized header written on the page right before it, so the
+   body is never copied.
+
+   Covers are shared by everyone using the payload cache and should not
+   be changed. Writes to a mapped cover stay private to the process and
+   never reach the file. A file truncated under its mapping would raise
+   SIGBUS on the pages past its new end: the mappings are guarded, such
+   a page reads as zeros instead.
+*/
+class CoverResponse
+{
+ protected:
+  std::string _fetched;
+  char* _map;       /* start and length of the mapping, if mapped */
+  size_t _map_len;
+  char* _data;
+  size_t _size;
+
+  /* not copyable, it may own a mapping */
+  CoverResponse(const CoverResponse&);
+  CoverResponse& operator=(const CoverResponse&);
+
+  CoverResponse(char* map, size_t map_len, char* data, size_t size);
+
+ public:
+  /**
+     takes over a response fetched from the cover server
+  */
+  explicit CoverResponse(std::string fetched);
+
+  /**
+     maps len bytes of the file open as fd right behind header
+
+     @return the cover or NULL if the file can't be mapped
+  */
+  static CoverResponse* map_file(const std::string& header, int fd, size_t len);
+
+  /**
+     reads len bytes of the file open as fd right behind header
+
+     @return the cover or NULL if the file can't be read or is shorter
+  */
+  static CoverResponse* read_file(const std::string& header, int fd, size_t len);
+
+  ~CoverResponse();
+
+  char* data() { return _data; }
+  size_t size() const { return _size; }
+  bool mapped() const { return _map != NULL; }
+};
+
+typedef std::shared_ptr<CoverResponse> CoverResponsePtr;
+
+/**
+   How a fetch went: we have the cover, the server answered that it
+   has no such cover (a 4xx, the cover is gone), or the server could
+   not be asked or failed to answer (no connection, a timeout, a 5xx,
+   or a 408 or 429 asking us to come back later: worth trying again
+   later or somewhere else).
+*/
+enum CoverFetchStatus {
+  COVER_FETCH_OK,
+  COVER_FETCH_MISSING,
+  COVER_FETCH_FAILED
+};
+
+/**
+   Where ApachePayloadServer gets its covers from.
+*/
+class CoverSource
+{
+ public:
+  virtual ~CoverSource() {}
+
+  /**
+     retrieves the cover at url
+
+     @param url absolute url of the cover, with scheme and host
+     @param status set to how the fetch went
+
+     @return the cover, or an empty pointer if it could not be retrieved
+  */
+  virtual CoverResponsePtr fetch(const std::string& url, CoverFetchStatus& status) = 0;
+};
+
+/**
+   Fetches covers from the cover server with curl, as they are served.
+*/
+class HTTPCoverSource : public CoverSource
+{
+ protected:
+  CURL* _curl_obj;
+
+  /* a cover server which doesn't answer in time is as good as down */
+  static const long c_CONNECT_TIMEOUT_MS = 3000;
+  static const long c_FETCH_TIMEOUT_MS = 10000;
+
+ public:
+  HTTPCoverSource();
+  virtual ~HTTPCoverSource();
+
+  virtual CoverResponsePtr fetch(const std::string& url, CoverFetchStatus& status);
+
+  /**
+     asks for the header of url only, to see if the server is up
+
+     @return COVER_FETCH_FAILED if the server did not answer properly
+  */
+  CoverFetchStatus probe(const std::string& url);
+
+  /**
+     how a fetch answered with the HTTP status code went, 0 for no
+     answer at all
+  */
+  static CoverFetchStatus status_of(long code);
+};
+
+/**
+   Reads covers straight off the disk when the cover server runs on
+   this host and serves its doc root as is. Every url under url_prefix
+   (http://cover-server/) is the file of the same path under doc_root,
+   read behind a header like the one Apache sends for a static file,
+   or mapped into memory if it is c_MAP_MIN_SIZE or more. Other urls,
+   and files which can't be opened, are handed to the fallback source.
+
+   A mapped cover sees the file as it is on disk: a file changed in
+   place changes the covers in the cache, and a truncated one leaves
+   them with zeros. Covers should be updated by writing the new file
+   next to the old one and renaming it over it, which leaves the
+   mapping with the old file. Reloading the payload database drops the
+   covers mapped so far.
+*/
+class FileCoverSource : public CoverSource
+{
+ public:
+  static const size_t c_MAP_MIN_SIZE = 64 * 1024;
+
+ protected:
+  std::string _doc_root;   /* ends with / */
+  std::string _url_prefix;
+  CoverSource* _fallback;  /* not owned */
+
+ public:
+  FileCoverSource(const std::string& doc_root, const std::string& url_prefix,
+                  CoverSource* fallback);
+
+  virtual CoverResponsePtr fetch(const std::string& url, CoverFetchStatus& status);
+
+  /**
+     the response header Apache would send with the file at path: Date,
+     Server, Last-Modified, ETag (size and mtime, Apache's default
+     FileETag), Accept-Ranges, Content-Length and, for the types we
+     know, Content-Type.
+  */
+  static std::string response_header(const std::string& path, const struct stat& st);
+
+  /**
+     the Content-Type Apache's mime.types gives for the extension of
+     path, or NULL if it is not one of the cover types
+  */
+  static const char* content_type(const std::string& path);
+
+  /**
+     true if host (with or without a :port) names this host
+  */
+  static bool is_local_host(const std::string& host);
+};
+
+struct event;
+struct event_base;
+
+/**
+   Spreads the fetches of a cover server over a pool of equivalent
+   servers, mirrors serving the same covers under the same paths. Each
+   url under http://<first server>/ is fetched from the server with the
+   lowest recent latency, and from the next one if that fails. Other
+   urls are handed to the fallback source.
+
+   A server failing c_EJECT_AFTER fetches in a row (no connection, a
+   timeout or a 5xx) is left out of the pool for a while, twice as long
+   every time it fails again right after coming back. The health checks
+   probe the servers whose time out is up, and the ones which have not
+   been used for a while, so a cover is not the first thing to find out
+   that a server is down. The probes run on a thread of their own, a
+   server not answering would hold up the event loop for seconds, and
+   their results are recorded on the event loop. When every server is
+   out the one due back first is still asked: the pool never refuses to
+   fetch.
+
+   Threads fetching off the event loop go through an Aside, which
+   leaves the health of the servers to the event loop.
+
+   A cover is only reported missing if every server asked says so.
+*/
+class CoverServerPool : public CoverSource
+{
+ public:
+  struct Server
+  {
+    std::string host;
+    HTTPCoverSource http;
+    HTTPCoverSource probe_http;   /* the probe thread's own */
+    HTTPCoverSource aside_http;   /* the Aside's own */
+    double latency_ms;            /* moving average over the good fetches */
+    unsigned int failures_in_row;
+    uint64_t ejected_until;       /* ms, 0 while in the pool */
+    uint64_t eject_ms;            /* how long the next ejection lasts */
+    uint64_t last_used;           /* ms */
+    unsigned long fetches;        /* covers asked for, probes aside */
+    unsigned long failures;
+
+    explicit Server(const std::string& server_host);
+  };
+
+  /** what pick goes by for a server */
+  struct Standing
+  {
+    uint64_t ejected_until;  /* ms, 0 while in the pool */
+    double latency_ms;
+  };
+
+  /** a server asked for a cover, as record sees it */
+  struct Attempt
+  {
+    size_t server;
+    CoverFetchStatus status;
+    uint64_t start;  /* ms */
+    uint64_t done;   /* ms */
+    bool failover;   /* another server was asked first */
+  };
+
+  class Aside;
+
+  static const unsigned int c_EJECT_AFTER = 3;
+  static const uint64_t c_MIN_EJECT_MS = 5000;
+  static const uint64_t c_MAX_EJECT_MS = 300000;
+  static const uint64_t c_HEALTH_CHECK_MS = 10000;
+  static const uint64_t c_IDLE_PROBE_MS = 60000; /* probe servers unused this long */
+  static const uint64_t c_PROBE_POLL_MS = 100; /* how often to look for the probe results */
+
+ protected:
+  std::vector<Server*> _servers;
+  std::string _url_prefix;       /* http://<first server>/ */
+  CoverSource* _fallback;        /* not owned */
+  struct event* _health_timer;
+
+  std::thread _probe_thread;
+  std::atomic<bool> _probes_done;
+  std::vector<size_t> _probing;                 /* the servers being probed */
+  std::vector<CoverFetchStatus> _probe_results; /* the probe thread's until _probes_done */
+
+  /* not copyable, it owns the servers */
+  CoverServerPool(const CoverServerPool&);
+  CoverServerPool& operator=(const CoverServerPool&);
+
+  /**
+     the server to ask next among those not tried yet, or -1 if there
+     are none. Servers out of the pool are only picked when nobody has
+     been asked yet.
+  */
+  int pick(const std::vector<Standing>& standings, const std::vector<bool>& tried,
+           bool asked_any);
+
+  /** where every server stands now */
+  std::vector<Standing> standings() const;
+
+  /** updates the health of server after a fetch or a probe done at time at */
+  void record(Server& server, CoverFetchStatus status, uint64_t at);
+
+  /** updates the health and the latency of the server asked in attempt */
+  void record(const Attempt& attempt);
+
+  /**
+     asks the servers for the cover at path, by standings, until one of
+     them has it, with their aside_http handles if aside. A server which
+     fails is left out of standings. Every server asked is added to
+     attempts, for record.
+  */
+  CoverResponsePtr ask(const std::string& path, std::vector<Standing>& standings, bool aside,
+                       std::vector<Attempt>& attempts, CoverFetchStatus& status);
+
+  /* the network side, separate so tests can stand in for the servers:
+     http is server.http on the event loop, server.aside_http off it */
+  virtual CoverResponsePtr fetch_from(Server& server, HTTPCoverSource& http,
+                                      const std::string& url, CoverFetchStatus& status);
+  /** runs on the probe thread, only server.probe_http is its own */
+  virtual CoverFetchStatus probe(Server& server);
+  /** monotonic clock in ms */
+  virtual uint64_t now();
+
+  /** probes the servers in _probing, on the probe thread */
+  void run_probes();
+
+  static void health_check_cb(evutil_socket_t, short, void* arg);
+
+ public:
+  /**
+     @param hosts the equivalent servers (host[:port]), the first one
+            is the one the urls of the covers name
+     @param fallback fetches the urls which are not under the first server
+  */
+  CoverServerPool(const std::vector<std::string>& hosts, CoverSource* fallback);
+  /** waits for the probes running, if any */
+  virtual ~CoverServerPool();
+
+  virtual CoverResponsePtr fetch(const std::string& url, CoverFetchStatus& status);
+
+  /** true if url is under the first server */
+  bool serves(const std::string& url) const;
+
+  /**
+     starts probing, on the probe thread, every server out of the pool
+     whose time is up and every server in it which has been idle for
+     c_IDLE_PROBE_MS
+
+     @return false if there is none, or the last probes are still running
+  */
+  bool check_health();
+
+  /**
+     records the results of the probes started by check_health, once
+     they are all in
+
+     @param wait wait for the probes still running
+     @return false if there were no results to record
+  */
+  bool collect_health(bool wait);
+
+  /**
+     runs check_health every c_HEALTH_CHECK_MS on base, from the first
+     call on, and collect_health as soon as the probes are done
+  */
+  void start_health_checks(struct event_base* base);
+
+  const std::vector<Server*>& servers() const { return _servers; }
+};
+
+/**
+   Fetches covers from the servers of a pool on a thread off the event
+   loop, one thread at a time. The thread goes by where the servers
+   stood when start was called on the event loop, and leaves out those
+   which fail it meanwhile, so an ejected or dead server is not asked
+   for cover after cover. How the servers did is recorded in the pool
+   by finish, back on the event loop. Urls the pool does not serve are
+   handed to the fallback source, which should be the thread's own too.
+*/
+class CoverServerPool::Aside : public CoverSource
+{
+ protected:
+  CoverServerPool& _pool;
+  CoverSource* _fallback;  /* not owned */
+  std::vector<Standing> _standings;
+  std::vector<Attempt> _attempts;
+
+ public:
+  Aside(CoverServerPool& pool, CoverSource* fallback);
+
+  /** takes where the servers stand, on the event loop before the thread fetches */
+  void start();
+
+  virtual CoverResponsePtr fetch(const std::string& url, CoverFetchStatus& status);
+
+  /** records how the servers did in the pool, on the event loop once the thread is done */
+  void finish();
+};
+
+#endif
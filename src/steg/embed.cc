@@ -232,7 +232,7 @@ embed_steg_t::transmit(struct evbuffer *source)
 
   // update last time
   gettimeofday(&last_pkt, NULL);
-  return 0;
+  return pkt_size > used ? pkt_size : used;
 }
 
 int
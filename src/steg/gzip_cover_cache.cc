@@ -0,0 +1,108 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <string.h>
+
+#include "util.h"
+#include "metrics.h"
+#include "gzip_cover_cache.h"
+
+using std::string;
+
+GzipCoverCache::GzipCoverCache(size_t capacity)
+  : _capacity(capacity),
+    inflate_hits(0),
+    inflate_misses(0)
+{
+  log_assert(_capacity != 0);
+}
+
+bool
+GzipCoverCache::is_gzip_encoded(const char* header, size_t header_len)
+{
+  static const char c_gzip_field[] = "Content-Encoding: gzip";
+  const size_t field_len = sizeof(c_gzip_field) - 1;
+
+  for (const char* line = header; line + field_len <= header + header_len;) {
+    if (!strncasecmp(line, c_gzip_field, field_len))
+      return true;
+
+    const char* next_line = (const char*)memchr(line, '\n', header + header_len - line);
+    if (!next_line)
+      break;
+    line = next_line + 1;
+  }
+
+  return false;
+}
+
+GzipCoverCache::CoverEntry&
+GzipCoverCache::touch(const string& cover_id)
+{
+  CoverEntryMap::iterator it = _entries.find(cover_id);
+  if (it != _entries.end()) {
+    _lru_keys.splice(_lru_keys.end(), _lru_keys, it->second.lru_position);
+    return it->second;
+  }
+
+  if (_entries.size() >= _capacity) {
+    log_assert(!_lru_keys.empty());
+    _entries.erase(_lru_keys.front());
+    _lru_keys.pop_front();
+  }
+
+  CoverEntry& new_entry = _entries[cover_id];
+  new_entry.lru_position = _lru_keys.insert(_lru_keys.end(), cover_id);
+  return new_entry;
+}
+
+const string*
+GzipCoverCache::inflated_body(const string& cover_id,
+                              const uint8_t* body, size_t body_len,
+                              size_t max_inflated_len)
+{
+  CoverEntry* entry = NULL;
+  if (!cover_id.empty()) {
+    entry = &touch(cover_id);
+    if (!entry->inflated_body.empty()) {
+      inflate_hits++;
+      metrics.gzip_cover_hits++;
+      return &entry->inflated_body;
+    }
+  }
+
+  inflate_misses++;
+  metrics.gzip_cover_misses++;
+  string& target = entry ? entry->inflated_body : _scratch_body;
+  target.resize(max_inflated_len);
+  ssize_t inflated_len = decompress(body, body_len,
+                                    (uint8_t*)&target[0], max_inflated_len);
+  if (inflated_len <= 0) {
+    if (inflated_len == -2)
+      log_warn("inflated cover is larger than %zu bytes", max_inflated_len);
+    else
+      log_warn("failed to inflate gzip encoded cover");
+
+    target.clear();
+    return NULL;
+  }
+
+  target.resize(inflated_len);
+  target.shrink_to_fit();
+  return &target;
+}
+
+ssize_t
+GzipCoverCache::deflate_body(const uint8_t* body, size_t body_len,
+                             uint8_t* dest, size_t dest_len)
+{
+  return deflater.compress(body, body_len, dest, dest_len, c_format_gzip);
+}
+
+void
+GzipCoverCache::clear()
+{
+  _entries.clear();
+  _lru_keys.clear();
+}
@@ -0,0 +1,101 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _GZIP_COVER_CACHE_H
+#define _GZIP_COVER_CACHE_H
+
+#include <string>
+#include <list>
+#include <unordered_map>
+
+#include "compression.h"
+
+/**
+   Keeps the inflated form of covers which are served with
+   "Content-Encoding: gzip" next to the raw bytes held by the payload
+   server, so that the text steg mods (js, html) can embed into the
+   plain body without inflating the same cover over and over, and
+   re-gzips the embedded body with a pooled deflater.
+
+   Covers are identified by their payload id hash. Covers without an
+   id (payload servers that do not support disqualification) are
+   inflated on every use and never cached.
+*/
+class GzipCoverCache
+{
+ protected:
+  struct CoverEntry {
+    std::string inflated_body;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  typedef std::unordered_map<std::string, CoverEntry> CoverEntryMap;
+
+  CoverEntryMap _entries;
+  std::list<std::string> _lru_keys; /* most recently used at the back */
+  size_t _capacity;
+
+  /* used for covers which can't be cached */
+  std::string _scratch_body;
+
+  /**
+     brings the entry for cover_id to the front of the lru list,
+     creating it (and evicting the least recently used one) if needed.
+  */
+  CoverEntry& touch(const std::string& cover_id);
+
+ public:
+  static const size_t c_GZIP_COVER_CACHE_ELEMENT_CAPACITY = 200;
+
+  deflater_pool deflater;
+
+  /* statistics */
+  unsigned long inflate_hits;
+  unsigned long inflate_misses;
+
+  GzipCoverCache(size_t capacity = c_GZIP_COVER_CACHE_ELEMENT_CAPACITY);
+
+  /**
+     checks if an http header declares the body as gzip encoded
+
+     @param header the http header, does not need to be \0 terminated
+     @param header_len length of header
+  */
+  static bool is_gzip_encoded(const char* header, size_t header_len);
+
+  /**
+     returns the inflated body of a gzip encoded cover, inflating it
+     if it is not already in the cache.
+
+     @param cover_id the payload id hash of the cover, can be empty
+     @param body the compressed body of the cover
+     @param body_len length of body
+     @param max_inflated_len the inflated body is rejected if it is
+            larger than this
+
+     @return a pointer to the inflated body, valid till the next call,
+             or NULL in case of error
+  */
+  const std::string* inflated_body(const std::string& cover_id,
+                                   const uint8_t* body, size_t body_len,
+                                   size_t max_inflated_len);
+
+  /**
+     gzips an embedded body with the pooled deflater. The embedding
+     always changes the body, so there is no compressed form of the
+     cover worth keeping around to serve instead.
+
+     @return the length of compressed data written in dest or < 0 in
+             case of error
+  */
+  ssize_t deflate_body(const uint8_t* body, size_t body_len,
+                       uint8_t* dest, size_t dest_len);
+
+  /** drops every cached cover */
+  void clear();
+
+  size_t size() const { return _entries.size(); }
+};
+
+#endif
@@ -14,6 +14,7 @@ using namespace std;
 #include "protocol.h"
 #include "steg.h"
 #include "rng.h"
+#include "latency.h"
 
 /** here we initiate our payload strategy (it should be)based on the config 
     file so I include all available payload servers. The global object is of
@@ -86,6 +87,30 @@ http_steg_config_t::store_options(const std::vector<string>& options)
       http_steg_user_configs["cover-list"] = *(cur_option + 1);
       cur_option++;
       
+    } else if (*cur_option == "--cover-root") {
+      if (cur_option + 1 == options.end()) {
+        log_warn("http_steg: option --cover-root requires the doc root of the cover server");
+        goto usage;
+      }
+      http_steg_user_configs["cover-root"] = *(cur_option + 1);
+      cur_option++;
+
+    } else if (*cur_option == "--cover-mirrors") {
+      if (cur_option + 1 == options.end()) {
+        log_warn("http_steg: option --cover-mirrors requires a list of cover servers");
+        goto usage;
+      }
+      http_steg_user_configs["cover-mirrors"] = *(cur_option + 1);
+      cur_option++;
+
+    } else if (*cur_option == "--response-timing") {
+      if (cur_option + 1 == options.end()) {
+        log_warn("http_steg: option --response-timing requires the trace filename");
+        goto usage;
+      }
+      http_steg_user_configs["response-timing"] = *(cur_option + 1);
+      cur_option++;
+
     } else {
       log_warn("chop: unrecognized option '%s'", cur_option->c_str());
       goto usage;
@@ -125,7 +150,11 @@ http_steg_config_t::store_options(const YAML::Node& options)
             (current_field_name == "name") ||
             (current_field_name == "down-address") ||
             (current_field_name == "steg-mod") ||
-            (current_field_name == "cover-list")
+            (current_field_name == "cover-list") ||
+            (current_field_name == "cover-root") ||
+            (current_field_name == "cover-mirrors") ||
+            (current_field_name == "cover-gzip-level") ||
+            (current_field_name == "response-timing")
               )) {
           log_warn("http steg: invalid config keyword %s", current_field_name.c_str());
           return false;
@@ -183,6 +212,22 @@ http_steg_config_t::init_file_steg_mods()
   if (http_steg_user_configs.find("steg_mod") != http_steg_user_configs.end()) {
     payload_server->set_active_steg_mods(http_steg_user_configs["steg_mod"]);
   }
+
+  //the level gzip encoded covers are gzipped again with after every
+  //embedding, there is no compressed copy to serve instead
+  if (http_steg_user_configs.find("cover-gzip-level") != http_steg_user_configs.end()) {
+    if (!payload_server->gzip_covers.deflater.set_level(atoi(http_steg_user_configs["cover-gzip-level"].c_str())))
+      log_abort("http steg: cover-gzip-level should be between -1 and 9");
+  }
+
+  //recorded server response times, otherwise the built-in model is used
+  if (!is_clientside &&
+      http_steg_user_configs.find("response-timing") != http_steg_user_configs.end()) {
+    if (!response_timing.load(http_steg_user_configs["response-timing"], payload_server))
+      log_warn("http steg: cannot load response-timing trace %s, "
+               "using the built-in model",
+               http_steg_user_configs["response-timing"].c_str());
+  }
 }
 
 //unfortunate army of constructors
@@ -281,7 +326,7 @@ buf_dump(unsigned char* buf, int len, FILE *out)
 
 http_steg_t::http_steg_t(http_steg_config_t *cf, conn_t *cn)
   : config(cf), conn(cn),
-    have_transmitted(false), have_received(false)
+    have_transmitted(false), have_received(false), respond_not_before(0)
 {
   memset(peer_dnsname, 0, sizeof peer_dnsname);
 }
@@ -325,6 +370,17 @@ http_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
       return 0;
     }
 
+    // Too early to answer: come back when a real server might have.
+    // Timers fire up to a wheel tick early, and the must-send timer
+    // must always find room, so allow for that.
+    uint64_t now = latency_now();
+    if (now + 1000 * timer_wheel::TICK_MS < respond_not_before) {
+      unsigned long wait = (respond_not_before - now + 999) / 1000;
+      log_debug(conn, "may answer in %lu ms", wait);
+      conn->transmit_soon(wait);
+      return 0;
+    }
+
     //for test
     //type = HTTP_CONTENT_JAVASCRIPT;
     log_debug(conn, "checking available capacity for type %u", type);
@@ -817,7 +873,12 @@ http_steg_t::http_server_receive(conn_t *conn, struct evbuffer *dest, struct evb
   // in transmit_room.) 
   conn->expect_close();
 
-  conn->transmit_soon(WAIT_BEFORE_TRANSMIT);
+  // Answer as soon as there is data, but no sooner than a real server
+  // plausibly would; with nothing to send, answer after a delay drawn
+  // from the same distribution.
+  respond_not_before = latency_now() +
+    1000 * (uint64_t)config->response_timing.earliest(type, 0);
+  conn->transmit_soon(config->response_timing.sample(type, 0));
   return RECV_GOOD;
 }
 
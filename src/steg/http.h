@@ -4,9 +4,12 @@
 #define MIN_COOKIE_SIZE 24
 #define MAX_COOKIE_SIZE 1024
 
+#include "response_timing.h"
+
 #define WAIT_BEFORE_TRANSMIT 100 //in milisecond a conn_t that receive should
                                     //wait before transmiting no matter what to 
-                                    //keep the cover looks real
+                                    //keep the cover looks real (http_apache;
+                                    //http uses its ResponseTiming model)
 
 int
 lookup_peer_name_from_ip(const char* p_ip, char* p_name);
@@ -22,6 +25,9 @@ lookup_peer_name_from_ip(const char* p_ip, char* p_name);
     //list of available steg type modules
     map<unsigned int, FileStegMod*> file_steg_mods;    
 
+    //when the server side answers requests
+    ResponseTiming response_timing;
+
     /** If you are a child of http_steg_t and you want to initiate your own,
         you need to call this constructor in your config_t constructor instead.
         In normal world we could have http_trace_steg which only implements 
@@ -76,6 +82,7 @@ lookup_peer_name_from_ip(const char* p_ip, char* p_name);
     bool have_transmitted : 1;
     bool have_received : 1;
     int type;
+    uint64_t respond_not_before; // server side, latency_now() units
 
     http_steg_t(http_steg_config_t *cf, conn_t *cn);
     STEG_DECLARE_METHODS(http);
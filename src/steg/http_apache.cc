@@ -86,6 +86,23 @@ namespace  {
     */
     size_t send_dict_to_peer();
 
+    /**
+       reloads the payload database on the server side
+    */
+    virtual void reload();
+
+    /**
+       on the server side, starts building the payload database if
+       there is none, the cover server health checks and prefetching
+    */
+    virtual void start();
+
+    /**
+       called once a reload is swapped in: the dict may have grown, and
+       the client should get it
+    */
+    void uri_dict_reloaded();
+
     /**
        is called by either constructor to perform the actual act of initialization.
 
@@ -199,7 +216,7 @@ void
 http_apache_steg_config_t::http_apache_steg_config_common_init(config_t *cfg)
 {
   string payload_filename;
-  string cover_server, cover_list;
+  string cover_server, cover_list, cover_root, cover_mirrors;
 
   if (is_clientside)
     payload_filename = "apache_payload/client_list.txt";
@@ -217,16 +234,24 @@ http_apache_steg_config_t::http_apache_steg_config_common_init(config_t *cfg)
         http_steg_user_configs["cover-list"] : "";
     }
 
+    //covers under the doc root of a local cover server are read from disk
+    if (http_steg_user_configs.find("cover-root") != http_steg_user_configs.end())
+      cover_root = http_steg_user_configs["cover-root"];
+
+    //servers with the same covers as the cover server share its load
+    if (http_steg_user_configs.find("cover-mirrors") != http_steg_user_configs.end())
+      cover_mirrors = http_steg_user_configs["cover-mirrors"];
+
   }
 
-  payload_server = new ApachePayloadServer(is_clientside ? client_side : server_side, payload_filename, cover_server, cover_list);
+  payload_server = new ApachePayloadServer(is_clientside ? client_side : server_side, payload_filename, cover_server, cover_list, cover_root, cover_mirrors);
 
   init_file_steg_mods();
 
   if (!is_clientside) {//on server side the dictionary is ready to be used
-    size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-    for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
+    uri_byte_cut = ApachePayloadServer::uri_byte_cut(((ApachePayloadServer*)payload_server)->uri_dict.size());
     ((ApachePayloadServer*)payload_server)->chosen_payload_choice_strategy = ApachePayloadServer::c_most_efficient_payload_choice; //This is hard coded now but it should become user's choice
+    ((ApachePayloadServer*)payload_server)->set_reload_callback([this]() { uri_dict_reloaded(); });
 
   }
 
@@ -252,6 +277,37 @@ http_apache_steg_config_t::~http_apache_steg_config_t()
 
 }
 
+void
+http_apache_steg_config_t::reload()
+{
+  //the client gets its dict from the server
+  if (!is_clientside)
+    ((ApachePayloadServer*)payload_server)->reload(cfg->base);
+}
+
+void
+http_apache_steg_config_t::uri_dict_reloaded()
+{
+  uri_byte_cut = ApachePayloadServer::uri_byte_cut(((ApachePayloadServer*)payload_server)->uri_dict.size());
+
+  //if the client is in the middle of checking its dict it gets the new
+  //one anyway, as the macs won't match
+  if (_cur_operation == op_STEG_NO_OP) {
+    log_debug("sending the reloaded uri dict to the client");
+    send_dict_to_peer();
+  }
+}
+
+void
+http_apache_steg_config_t::start()
+{
+  if (!is_clientside) {
+    ((ApachePayloadServer*)payload_server)->start_building(cfg->base);
+    ((ApachePayloadServer*)payload_server)->start_health_checks(cfg->base);
+    ((ApachePayloadServer*)payload_server)->start_prefetching(cfg->base);
+  }
+}
+
 steg_t *
 http_apache_steg_config_t::steg_create(conn_t *conn)
 {
@@ -360,7 +416,7 @@ http_apache_steg_t::http_client_uri_transmit (struct evbuffer *source, conn_t *c
         log_debug("uri index so far %lu", url_index);
       }
     
-    chosen_url= ((ApachePayloadServer*)_apache_config->payload_server)->uri_dict[url_index].URL;
+    chosen_url= ((ApachePayloadServer*)_apache_config->payload_server)->uri_dict.url(url_index);
   }
 
   type = ((ApachePayloadServer*)_apache_config->payload_server)->find_url_type(chosen_url.c_str());
@@ -576,13 +632,15 @@ http_apache_steg_t::http_server_receive_uri(char *p, evbuffer* dest)
                        //is more realistic to change that
     }
       
-    string extracted_url = string(p, url_end - p);
     unsigned long url_code = 0;
     size_t url_meaning_length = 0;
-    if (extracted_url != "") { 
+    if (url_end != p) { 
       //Otherwise the uri_dict sync hasn't been verified so 
       //we can't use it
-      url_code = ((ApachePayloadServer*)_apache_config->payload_server)->uri_decode_book[extracted_url];
+      //a client still on the dict before a reload encodes as many
+      //bytes as that dict allows
+      unsigned long byte_cut = 0;
+      url_code = ((ApachePayloadServer*)_apache_config->payload_server)->uri_code(p, url_end - p, &byte_cut);
       log_debug(conn, "url code %lu", url_code);
 
       if (*(url_end + sizeof("?") - 1) == 'p') { //all info are coded in url
@@ -591,7 +649,7 @@ http_apache_steg_t::http_server_receive_uri(char *p, evbuffer* dest)
         param_valid_load = false;
       }
       else
-        url_meaning_length = _apache_config->uri_byte_cut;
+        url_meaning_length = byte_cut;
     }
         
     for(size_t i = 0; i < url_meaning_length; i++)
@@ -664,8 +722,7 @@ inline bool http_apache_steg_config_t::init_uri_dict()
   if (!((ApachePayloadServer*)payload_server)->init_uri_dict())
     return false;
 
-  size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-  for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
+  uri_byte_cut = ApachePayloadServer::uri_byte_cut(((ApachePayloadServer*)payload_server)->uri_dict.size());
 
   return true;
 }
@@ -758,6 +815,14 @@ http_apache_steg_t::receive(struct evbuffer *dest)
   } 
 
   //We are here becouse we are on the server side
+  //Until the first payload database is built we have no covers to
+  //answer with: failing lets the transparent proxy hand the connection
+  //to the cover server.
+  if (!((ApachePayloadServer*)_apache_config->payload_server)->has_covers()) {
+    log_debug(conn, "no payload database yet, passing the connection on");
+    return RECV_BAD;
+  }
+
   source = conn->inbound();
   return http_server_receive(conn, dest, source);
 
@@ -802,8 +867,7 @@ http_apache_steg_config_t::process_protocol_data()
       //client side
       uri_dict_up2date = true;
 
-      size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-      for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
+      uri_byte_cut = ApachePayloadServer::uri_byte_cut(((ApachePayloadServer*)payload_server)->uri_dict.size());
 
       _cur_operation = op_STEG_NO_OP;
       log_debug("peer's uri dict is synced with ours");
@@ -831,8 +895,7 @@ http_apache_steg_config_t::process_protocol_data()
           //We need a way to inform server that we got updated.
           uri_dict_up2date = true;
 
-          size_t no_of_uris = ((ApachePayloadServer*)payload_server)->uri_dict.size();
-          for(uri_byte_cut = 0; (no_of_uris /=256) > 0; uri_byte_cut++);
+          uri_byte_cut = ApachePayloadServer::uri_byte_cut(((ApachePayloadServer*)payload_server)->uri_dict.size());
 
           log_debug("uri dict updated"); 
           _cur_operation = op_STEG_NO_OP;
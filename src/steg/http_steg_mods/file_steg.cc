@@ -21,14 +21,12 @@ using namespace std;
 
 #include "file_steg.h"
 #include "connections.h"
+#include "compression.h"
 
 // error codes
 #define INVALID_BUF_SIZE  -1
 #define INVALID_DATA_CHAR -2
 
-// controlling content gzipping for jsSteg
-#define JS_GZIP_RESP             1
-
 const size_t FileStegMod::c_HIGH_BYTES_DISCARDER = static_cast<size_t>(pow(2, c_NO_BYTES_TO_STORE_MSG_SIZE * 8));
 /**
   constructor, sets the playoad server
@@ -172,7 +170,11 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
   ssize_t newHdrLen = 0;
   ssize_t cnt = 0;
   size_t body_len = 0;
+  size_t raw_body_len = 0; //the body length as served by the cover server
   size_t hLen = 0;
+  bool cover_is_gzipped = false;
+  uint8_t* send_buf = outbuf;
+  ssize_t send_len = 0;
 
   evbuffer *dest;
 
@@ -207,15 +209,33 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
       continue; //we try with another cover
     }
 
-    body_len = cnt-body_offset;
+    raw_body_len = body_len = cnt-body_offset;
     hLen = body_offset;
-    log_debug("coping body of %zu size", (body_len));
-    if ((body_len) > c_HTTP_PAYLOAD_BUF_SIZE) {
-      log_warn("HTTP response doesn't fit in the buffer %zu > %zu", (body_len)*sizeof(char), c_HTTP_PAYLOAD_BUF_SIZE);
-      _payload_server->disqualify_payload(payload_id_hash);
-      return -1;
+
+    //gzip encoded covers are embedded in their inflated form, which is
+    //kept by the payload server so we don't inflate the same cover on
+    //every use
+    cover_is_gzipped = GzipCoverCache::is_gzip_encoded(cover_payload, hLen);
+    if (cover_is_gzipped) {
+      const string* inflated_body = _payload_server->gzip_covers.inflated_body(payload_id_hash, (const uint8_t*)(cover_payload + body_offset), raw_body_len, c_HTTP_PAYLOAD_BUF_SIZE);
+      if (!inflated_body) {
+        _payload_server->disqualify_payload(payload_id_hash);
+        outbuflen = -1;
+        continue; //we try with another cover
+      }
+
+      body_len = inflated_body->size();
+      log_debug("coping inflated body of %zu size", (body_len));
+      memcpy(outbuf, inflated_body->data(), body_len);
+    } else {
+      log_debug("coping body of %zu size", (body_len));
+      if ((body_len) > c_HTTP_PAYLOAD_BUF_SIZE) {
+        log_warn("HTTP response doesn't fit in the buffer %zu > %zu", (body_len)*sizeof(char), c_HTTP_PAYLOAD_BUF_SIZE);
+        _payload_server->disqualify_payload(payload_id_hash);
+        return -1;
+      }
+      memcpy(outbuf, (const void*)(cover_payload + body_offset), (body_len)*sizeof(char));
     }
-    memcpy(outbuf, (const void*)(cover_payload + body_offset), (body_len)*sizeof(char));
 
     //int hLen = body_offset - (size_t)cover_payload - 4 + 1;
     //extrancting the body part of the payload
@@ -245,8 +265,8 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
      // if(pgenflag == FILE_PAYLOAD)
      //{
       	ofstream failure_evidence_file("fail_cover.log", ios::binary | ios::out);
-      	failure_evidence_file.write(cover_payload + body_offset, body_len);
-      	failure_evidence_file.write(cover_payload + body_offset, body_len);
+      	failure_evidence_file.write(cover_payload + body_offset, raw_body_len);
+      	failure_evidence_file.write(cover_payload + body_offset, raw_body_len);
       	failure_evidence_file.close();
      //}
       ofstream failure_embed_evidence_file("failed_embeded_cover.log", ios::binary | ios::out);
@@ -257,8 +277,19 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
     }
   }
 
+  send_len = outbuflen;
+  if (cover_is_gzipped) {
+    gzip_buf.resize(deflater_pool::compress_bound(outbuflen, c_format_gzip));
+    send_len = _payload_server->gzip_covers.deflate_body(outbuf, outbuflen, gzip_buf.data(), gzip_buf.size());
+    if (send_len < 0) {
+      log_warn("SERVER ERROR: failed to gzip the embedded body");
+      goto error;
+    }
+    send_buf = gzip_buf.data();
+  }
+
   log_debug("SERVER FileSteg sends resp with hdr len %zu body len %zd",
-            body_offset, outbuflen);
+            body_offset, send_len);
  
   //Update: we can't assert this anymore, SWFSteg changes the size
   //so this equalit.ie doesn't hold anymore
@@ -279,14 +310,14 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
    }
   //I'm not crazy, these are filler for later change*/
 
-  if ((size_t)outbuflen == body_len) {
+  if ((size_t)send_len == raw_body_len) {
      log_assert(hLen < MAX_RESP_HDR_SIZE);
      memcpy(newHdr, cover_payload,hLen);
      newHdrLen = hLen;
 	
   }
   else { //if the length is different, then we need to update the header
-    newHdrLen = alter_length_in_response_header((uint8_t *)cover_payload, hLen, outbuflen, newHdr);
+    newHdrLen = alter_length_in_response_header((uint8_t *)cover_payload, hLen, send_len, newHdr);
     if (!newHdrLen) {
       log_warn("SERVER ERROR: failed to alter length field in response headerr");
       _payload_server->disqualify_payload(payload_id_hash);
@@ -300,7 +331,7 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
     goto error;
     }
 
-  if (evbuffer_add(dest, outbuf, outbuflen)) {
+  if (evbuffer_add(dest, send_buf, send_len)) {
     log_warn("SERVER ERROR: evbuffer_add() fails for outbuf");
     goto error;
     return -1;
@@ -308,7 +339,7 @@ FileStegMod::http_server_transmit(evbuffer *source, conn_t *conn)
 
   evbuffer_drain(source, sbuflen);
   
-  return outbuflen;
+  return send_len;
 
  error:
   return -1;
@@ -366,6 +397,18 @@ FileStegMod::http_client_receive(conn_t *conn, struct evbuffer *dest,
   }
 
   httpBody = httpHdr + hdrLen;
+
+  if (GzipCoverCache::is_gzip_encoded((const char*)httpHdr, hdrLen)) {
+    gzip_buf.resize(c_HTTP_PAYLOAD_BUF_SIZE);
+    ssize_t inflated_len = decompress(httpBody, content_len, gzip_buf.data(), gzip_buf.size());
+    if (inflated_len < 0) {
+      log_warn("CLIENT ERROR: failed to inflate gzip encoded body");
+      return RECV_BAD;
+    }
+    httpBody = gzip_buf.data();
+    content_len = inflated_len;
+  }
+
   log_debug("CLIENT unwrapping data out of type %d payload", c_content_type);
 
   outbuflen = decode(httpBody, content_len, outbuf);
@@ -5,6 +5,7 @@
 #define SWF_SAVE_FOOTER_LEN 1500
 
 #include <list>
+#include <vector>
 #include <math.h>
 
 using namespace std;
@@ -35,6 +36,9 @@ protected:
   uint8_t* outbuf; //this is where the payload sit after being injected by the
   //the message. it is define as class member to avoid allocation and delocation
 
+  std::vector<uint8_t> gzip_buf; //holds the gzipped body on server side and
+  //the inflated body on client side when the cover is gzip encoded
+
   //const int pgenflag; //tells us whether we are dealing with a payload taken from the database (0) or a generated on the fly one (1, for SWF only atm) 
   //not clear if we need this at all
 
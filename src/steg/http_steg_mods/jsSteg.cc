@@ -18,7 +18,9 @@
 #define INVALID_BUF_SIZE	-1
 #define INVALID_DATA_CHAR	-2
 
-// controlling content gzipping for jsSteg
+// controlling content gzipping for jsSteg: gzip encoded covers reach
+// the steg mods inflated and are gzipped again after embedding (see
+// GzipCoverCache), so jsSteg never gzips itself
 #define JS_GZIP_RESP             0
 
 void buf_dump(unsigned char* buf, int len, FILE *out);
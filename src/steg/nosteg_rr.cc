@@ -92,6 +92,8 @@ nosteg_rr_steg_t::transmit(struct evbuffer *source)
 
   struct evbuffer *dest = conn->outbound();
 
+  int no_byte_to_transmit = (unsigned long)evbuffer_get_length(source);
+
   log_debug(conn, "transmitting %lu bytes",
             (unsigned long)evbuffer_get_length(source));
 
@@ -104,7 +106,7 @@ nosteg_rr_steg_t::transmit(struct evbuffer *source)
   can_transmit = false;
   conn->cease_transmission();
 
-  return 0;
+  return no_byte_to_transmit;
 }
 
 int
@@ -6,6 +6,7 @@
 #include <algorithm>
 
 #include <util.h> 
+#include <metrics.h>
 // Class providing fixed-size (by number of records) 
 // LRU-replacement cache of a function with signature 
 // V f(K). 
@@ -61,6 +62,7 @@ public:
  
     if (it==_key_to_value.end()) { 
       log_debug("payload cache MISS");
+      metrics.payload_cache_misses++;
       
       // We don't have it: 
  
@@ -75,6 +77,7 @@ public:
     } else { 
       // We do have it: 
       log_debug("payload cache HIT");
+      metrics.payload_cache_hits++;
 
     }
   
@@ -92,6 +95,35 @@ public:
 
   } 
  
+  // True if k is cached, without counting as a use of it
+  bool contains(const key_type& k) const {
+    return _key_to_value.find(k) != _key_to_value.end();
+  }
+
+  // Cache v, the function for k evaluated ahead of its use, as the
+  // most recently used record, unless k is cached already. Does not
+  // count as a hit or a miss.
+  value_type& prefetch(const key_type& k, const value_type& v) {
+    typename key_to_value_type::iterator it
+      =_key_to_value.find(k);
+
+    if (it==_key_to_value.end()) {
+      insert(k,v);
+      it = _key_to_value.find(k);
+    }
+
+    return (*it).second.first;
+  }
+
+  // Forget every record
+  void clear() {
+    _key_to_value.clear();
+    _key_tracker.clear();
+  }
+
+  // Maximum number of records kept
+  size_t capacity() const { return _capacity; }
+
   // Obtain the cached keys, most recently used element 
   // at head, least recently used at tail. 
   // This method is provided purely to support testing. 
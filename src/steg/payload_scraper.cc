@@ -24,6 +24,8 @@ using namespace std;
 
 #include "payload_scraper.h"
 #include "base64.h"
+#include "compression.h"
+#include "gzip_cover_cache.h"
 
 #include "protocol/chop_blk.h" //We need this to no what's the minimum 
 
@@ -110,7 +112,7 @@ PayloadScraper::scrape_dir(const string dir_string_path)
 
   recursive_directory_iterator end_itr; // default construction yields past-the-end
    for ( recursive_directory_iterator itr( dir_path );
-        itr != end_itr;
+        itr != end_itr && !cancelled();
         ++itr, total_file_count++)
     {
       for(steg_type* cur_steg = _available_stegs; cur_steg->type!= 0; cur_steg++)
@@ -121,11 +123,19 @@ PayloadScraper::scrape_dir(const string dir_string_path)
             string cur_url(cur_filename.substr(_apache_doc_root.length(), cur_filename.length() -  _apache_doc_root.length()));
 
             string scrape_result = scrape_url(cur_url, cur_steg);
-            if (!scrape_result.empty())
+            if (!scrape_result.empty()) {
               _payload_db << total_file_count << " " << cur_steg->type << " " << scrape_result  << " " << cur_url << " " << 0 << " " << cur_url << "\n"; //absolute_url false
+              _payloads_written++;
+            }
           }
+
+      if ((total_file_count + 1) % c_PROGRESS_EVERY == 0)
+        log_info("scraped %ld files under %s", total_file_count + 1, dir_string_path.c_str());
     }
 
+   if (cancelled())
+     return -1;
+
 #else
    (void) dir_string_path;
    log_abort("unable to scrape dir when made without boost");
@@ -160,7 +170,7 @@ PayloadScraper::scrape_url_list(const string list_filename)
   
   string file_url, cur_url_ext;
   unsigned long total_processed_items = 0;
-  while (url_list_stream >> file_url) {
+  while (!cancelled() && url_list_stream >> file_url) {
     total_processed_items++;
     if (scraped_tracker.find(file_url) != scraped_tracker.end()) {
       //make sure it is not a repetition of a url we already have
@@ -186,6 +196,7 @@ PayloadScraper::scrape_url_list(const string list_filename)
         string scrape_result = scrape_url(file_url, cur_steg, true);
         if (!scrape_result.empty()) {
             _payload_db << total_file_count << " " << cur_steg->type << " " << scrape_result  << " " << relativize_url(file_url) << " " << 1 << " " << file_url << "\n"; //absolute_url = true
+            _payloads_written++;
         }
         
       }
@@ -193,9 +204,14 @@ PayloadScraper::scrape_url_list(const string list_filename)
 
     scraped_tracker[file_url] = true;
     log_debug("processed: %ld, scraped: %ld", total_processed_items, total_file_count);
+    if (total_processed_items % c_PROGRESS_EVERY == 0)
+      log_info("scraped %lu urls of %s", total_processed_items, list_filename.c_str());
 
   }
 
+  if (cancelled())
+    return -1;
+
   return total_file_count; 
 
 }
@@ -205,11 +221,13 @@ PayloadScraper::scrape_url_list(const string list_filename)
     
     @param database_filename the name of the file to store the payload list   
 */
-PayloadScraper::PayloadScraper(string  database_filename, string cover_server,const string& cover_list, string apache_conf)
+PayloadScraper::PayloadScraper(string  database_filename, string cover_server,const string& cover_list, string apache_conf, const std::atomic<bool>* cancel)
   : _available_stegs(),
     _available_file_stegs(), 
    _cover_list(cover_list),
-   capacity_handle(curl_easy_init())
+   capacity_handle(curl_easy_init()),
+   _payloads_written(0),
+   _cancel(cancel)
 {
   /* curl initiation */
   log_assert(capacity_handle);
@@ -217,6 +235,10 @@ PayloadScraper::PayloadScraper(string  database_filename, string cover_server,co
   curl_easy_setopt(capacity_handle, CURLOPT_HTTP_CONTENT_DECODING, 0L);
   curl_easy_setopt(capacity_handle, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
   curl_easy_setopt(capacity_handle, CURLOPT_WRITEFUNCTION, curl_read_data_cb);
+  curl_easy_setopt(capacity_handle, CURLOPT_CONNECTTIMEOUT_MS, c_CONNECT_TIMEOUT_MS);
+  curl_easy_setopt(capacity_handle, CURLOPT_TIMEOUT_MS, c_FETCH_TIMEOUT_MS);
+  //the scrape may run on a thread, timeouts must not be signals
+  curl_easy_setopt(capacity_handle, CURLOPT_NOSIGNAL, 1L);
   
   _database_filename = database_filename;
   _cover_server = cover_server;
@@ -284,6 +306,12 @@ int PayloadScraper::scrape()
     
   }
 
+  if (cancelled()) {
+    log_info("scrape of %s cancelled", _cover_server.c_str());
+    _payload_db.close();
+    return -1;
+  }
+
 #if HAVE_BOOST == 1
   if (!scrape_succeed) { //no url list is given, try to scrape file system only if we have
       //boost
@@ -322,7 +350,7 @@ int PayloadScraper::scrape()
       
       int mount_result = system(ftp_mount_command_string.c_str());
       if (mount_result) {
-        log_abort("Failed to mount the remote filesystem");
+        log_warn("Failed to mount the remote filesystem");
         _payload_db.close();
         return -1;
       }
@@ -363,43 +391,64 @@ int PayloadScraper::scrape()
 
 */
 int PayloadScraper::apache_conf_parser()
+{
+  _apache_doc_root = find_apache_doc_root(_apache_conf_filename);
+  return _apache_doc_root.empty() ? -1 : 0;
+
+}
+
+/**
+   reads the DocumentRoot off an apache configuration file
+
+   @param apache_conf the name of the apache configuration file
+
+   @return the doc root ending with /, or empty if it isn't found
+*/
+string PayloadScraper::find_apache_doc_root(const string& apache_conf)
 {
   /* open the apache config file to find the doc root dir*/
-  FILE* apache_conf;
+  FILE* apache_conf_file;
 
-  apache_conf = fopen(_apache_conf_filename.c_str(), "rb");
-  if (apache_conf == NULL)
+  apache_conf_file = fopen(apache_conf.c_str(), "rb");
+  if (apache_conf_file == NULL)
     {
       log_warn("error in opening apache config file: %s",strerror(errno));
-      return 0;
+      return "";
     }
 
+  string doc_root;
   char* cur_line = NULL;
-  size_t line_length;
-  while(~feof(apache_conf))
+  size_t line_length = 0;
+  while(xgetline(&cur_line, &line_length, apache_conf_file) > 0)
     {
-      xgetline(&cur_line, &line_length, apache_conf);
+      const char* directive = cur_line + strspn(cur_line, " \t");
       /*pass the comment*/
-      if ((line_length > 0) && ( cur_line[0] == '#')) continue;
+      if (directive[0] == '#') continue;
 
-      if (!strncmp(cur_line,"DocumentRoot", strlen("DocumentRoot")))
+      if (!strncmp(directive,"DocumentRoot", strlen("DocumentRoot")))
         {
-           _apache_doc_root =  cur_line + strlen("DocumentRoot ");
-          _apache_doc_root.erase(remove( _apache_doc_root.begin(), _apache_doc_root.end(), '\"' ), _apache_doc_root.end());
-          _apache_doc_root.erase(std::remove( _apache_doc_root.begin(), _apache_doc_root.end(), '\n' ), _apache_doc_root.end());
-          if (_apache_doc_root[_apache_doc_root.length()-1] != '/')
-            _apache_doc_root.push_back('/');
-
-          return 0;
+          const char* value = directive + strlen("DocumentRoot");
+          doc_root = value + strspn(value, " \t");
+          doc_root.erase(remove( doc_root.begin(), doc_root.end(), '\"' ), doc_root.end());
+          doc_root.erase(std::remove( doc_root.begin(), doc_root.end(), '\n' ), doc_root.end());
+          if (!doc_root.empty() && doc_root[doc_root.length()-1] != '/')
+            doc_root.push_back('/');
+
+          break;
         }
     }
 
+  free(cur_line);
+  fclose(apache_conf_file);
+
   /* no suitable tag in apache config file
      I should probably return a defult dir in this case
      but we return error for now
   */
-  log_warn("DocumentRoot isn't specified in apache config file");
-  return -1;
+  if (doc_root.empty())
+    log_warn("DocumentRoot isn't specified in apache config file");
+
+  return doc_root;
 
 }
 
@@ -438,7 +487,28 @@ pair<unsigned long, unsigned long> PayloadScraper::compute_capacity(string paylo
     assert(test_cur_filelength == cur_filelength);
   }
   
-  long capacity = cur_steg->capacity_function(buf, apache_size);
+  //gzip encoded covers are embedded in their inflated form (see
+  //GzipCoverCache), so that is the form their capacity is of
+  char* capacity_buf = buf;
+  size_t capacity_buf_len = apache_size;
+  string inflated_cover;
+  size_t header_len = hend - buf + 4;
+  if (GzipCoverCache::is_gzip_encoded(buf, header_len)) {
+    inflated_cover.assign(buf, header_len);
+    inflated_cover.resize(header_len + HTTP_PAYLOAD_BUF_SIZE);
+    ssize_t inflated_len = decompress((const uint8_t*)buf + header_len, cur_filelength,
+                                      (uint8_t*)&inflated_cover[header_len], HTTP_PAYLOAD_BUF_SIZE);
+    if (inflated_len <= 0) {
+      log_warn("unable to inflate the gzip encoded %s", url_to_retreive.c_str());
+      delete [] buf;
+      return pair<unsigned long, unsigned long>(0, 0);
+    }
+    inflated_cover.resize(header_len + inflated_len);
+    capacity_buf = &inflated_cover[0];
+    capacity_buf_len = inflated_cover.size();
+  }
+
+  long capacity = cur_steg->capacity_function(capacity_buf, capacity_buf_len);
   log_debug("capacity: %lu", capacity);
   if (capacity < 0){ 
     log_warn("error occurd during capacity computation");
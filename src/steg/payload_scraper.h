@@ -4,6 +4,10 @@
 #ifndef PAYLOADSCRAPER_H
 #define PAYLOADSCRAPER_H
 
+#include <atomic>
+
+#define DEFAULT_APACHE_CONF "/etc/httpd/conf/httpd.conf"
+
 //TODO: This structure should be depricated as the FileSteg as
 //parent type should replace it
 struct steg_type
@@ -47,6 +51,17 @@ protected:
                                in task of computing the capacity of the 
                                payloads */
 
+    unsigned long _payloads_written; /* entries in the database so far */
+    const std::atomic<bool>* _cancel; /* the scrape stops when set, not owned */
+
+    static const long c_PROGRESS_EVERY = 100; /* covers between two progress reports */
+    /* a cover server which doesn't answer in time won't hold up a
+       cancelled scrape */
+    static const long c_CONNECT_TIMEOUT_MS = 3000;
+    static const long c_FETCH_TIMEOUT_MS = 10000;
+
+    bool cancelled() const { return _cancel && _cancel->load(); }
+
     /**
        Computes the capacity and length of a filename indicated by a url as well as the  hash of the url.
 
@@ -103,14 +118,31 @@ public:
 
       @param database_filename the name of the file to store the payload list   
       @param cover_list a list of potential cover on the cover server to avoid ftp access
+      @param cancel if not NULL, the scrape gives up as soon as it is set
     */
-   PayloadScraper(std::string database_filename,  std::string cover_server, const std::string& cover_list = "", const std::string apache_conf = "/etc/httpd/conf/httpd.conf");
+   PayloadScraper(std::string database_filename,  std::string cover_server, const std::string& cover_list = "", const std::string apache_conf = DEFAULT_APACHE_CONF, const std::atomic<bool>* cancel = NULL);
+
+   /**
+      reads the DocumentRoot off an apache configuration file
+
+      @param apache_conf the name of the apache configuration file
+
+      @return the doc root ending with /, or empty if it isn't found
+   */
+   static std::string find_apache_doc_root(const std::string& apache_conf);
 
    /**
       reads all the files in the Doc root and classifies them. return the number of payload file founds. -1 if it fails
+      or is cancelled
    */
    int scrape();
 
+   /**
+      the number of covers the scrape put in the database, those it
+      tried but found no use for aside
+   */
+   unsigned long payloads_written() const { return _payloads_written; }
+
    virtual ~PayloadScraper()
      {
        for(unsigned int i = 0; i < c_no_of_steg_protocol; i++)
@@ -6,6 +6,8 @@
 #include <list>
 #include <algorithm>
 
+#include "gzip_cover_cache.h"
+
 using namespace std; 
 
 //Constants
@@ -256,6 +258,9 @@ class PayloadServer
   /** TODO: either change the name (no _) or the access */
   PayloadDatabase _payload_database;
 
+  /** inflated copies of the gzip encoded covers served by this server */
+  GzipCoverCache gzip_covers;
+
   /** Construtor needs to init the side the least */
   PayloadServer(MachineSide init_side)
     {
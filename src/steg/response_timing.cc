@@ -0,0 +1,229 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "rng.h"
+#include "payload_server.h"
+#include "response_timing.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using std::vector;
+
+const double ResponseTiming::c_EARLIEST_QUANTILE = 0.05;
+
+namespace {
+  const unsigned int c_N_TYPES = c_no_of_steg_protocol + 1;
+  const unsigned int c_N_SIZE_BUCKETS = 64;
+
+  /* built-in model: time to the first byte at the 5th, 25th, 50th,
+     75th and 95th percentile, in ms, and the transfer rate for the
+     rest of the response */
+  const double c_BUILTIN_P[] = { 0.05, 0.25, 0.50, 0.75, 0.95 };
+  const double c_BUILTIN_BYTES_PER_MS = 2000;
+
+  struct builtin_quantiles {
+    int type;
+    double ms[5];
+  };
+
+  const builtin_quantiles c_BUILTIN[] = {
+    { HTTP_CONTENT_HTML,       { 15, 40, 80, 150, 400 } },
+    { HTTP_CONTENT_JAVASCRIPT, {  5, 15, 30,  60, 150 } },
+    { HTTP_CONTENT_PDF,        { 10, 30, 60, 120, 300 } },
+    { HTTP_CONTENT_SWF,        { 10, 25, 50, 100, 250 } },
+    { HTTP_CONTENT_JPEG,       {  5, 12, 25,  50, 120 } },
+    { HTTP_CONTENT_PNG,        {  5, 12, 25,  50, 120 } },
+    { HTTP_CONTENT_GIF,        {  5, 12, 25,  50, 120 } },
+  };
+
+  unsigned int
+  size_bucket(size_t size)
+  {
+    unsigned int bucket = 0;
+    while (size > 1 && bucket < c_N_SIZE_BUCKETS - 1) {
+      size >>= 1;
+      bucket++;
+    }
+    return bucket;
+  }
+
+  bool
+  valid_type(int type)
+  {
+    return type > HTTP_CONTENT_RESERVED && type < (int)c_N_TYPES;
+  }
+}
+
+double
+ResponseTiming::Distribution::at(double u) const
+{
+  log_assert(!p.empty());
+  if (u <= p.front())
+    return ms.front();
+  if (u >= p.back())
+    return ms.back();
+
+  size_t i = std::upper_bound(p.begin(), p.end(), u) - p.begin();
+  double f = (u - p[i-1]) / (p[i] - p[i-1]);
+  return ms[i-1] + f * (ms[i] - ms[i-1]);
+}
+
+ResponseTiming::ResponseTiming()
+  : _samples(c_N_TYPES, vector<vector<double> >(c_N_SIZE_BUCKETS)),
+    _by_size(c_N_TYPES, vector<Distribution>(c_N_SIZE_BUCKETS)),
+    _by_type(c_N_TYPES), _builtin(c_N_TYPES), _from_trace(false)
+{
+  for (size_t i = 0; i < sizeof c_BUILTIN / sizeof c_BUILTIN[0]; i++) {
+    Distribution &d = _builtin[c_BUILTIN[i].type];
+    d.p.assign(c_BUILTIN_P, c_BUILTIN_P + 5);
+    d.ms.assign(c_BUILTIN[i].ms, c_BUILTIN[i].ms + 5);
+  }
+}
+
+void
+ResponseTiming::record(int type, size_t size, double ms)
+{
+  if (!valid_type(type) || ms < 0)
+    return;
+  _samples[type][size_bucket(size)].push_back(ms);
+}
+
+/* Turn the recorded delays into distributions: one per (type, size)
+   cell with enough samples, and one per type with all of them. */
+void
+ResponseTiming::finish()
+{
+  _from_trace = false;
+  for (unsigned int t = 0; t < c_N_TYPES; t++) {
+    vector<double> all;
+    for (unsigned int b = 0; b < c_N_SIZE_BUCKETS; b++) {
+      vector<double> &cell = _samples[t][b];
+      all.insert(all.end(), cell.begin(), cell.end());
+      _by_size[t][b].p.clear();
+      _by_size[t][b].ms.clear();
+      if (cell.size() < c_MIN_SAMPLES)
+        continue;
+
+      std::sort(cell.begin(), cell.end());
+      for (size_t i = 0; i < cell.size(); i++) {
+        _by_size[t][b].p.push_back((double)i / (cell.size() - 1));
+        _by_size[t][b].ms.push_back(cell[i]);
+      }
+    }
+
+    _by_type[t].p.clear();
+    _by_type[t].ms.clear();
+    if (all.empty())
+      continue;
+
+    _from_trace = true;
+    std::sort(all.begin(), all.end());
+    for (size_t i = 0; i < all.size(); i++) {
+      _by_type[t].p.push_back(all.size() > 1 ? (double)i / (all.size() - 1)
+                              : 0);
+      _by_type[t].ms.push_back(all[i]);
+    }
+  }
+}
+
+void
+ResponseTiming::swap(ResponseTiming& other)
+{
+  _samples.swap(other._samples);
+  _by_size.swap(other._by_size);
+  _by_type.swap(other._by_type);
+  _builtin.swap(other._builtin);
+  std::swap(_from_trace, other._from_trace);
+}
+
+void
+ResponseTiming::add(int type, size_t size, double ms)
+{
+  record(type, size, ms);
+  finish();
+}
+
+bool
+ResponseTiming::load(const std::string& filename,
+                     PayloadServer* payload_server)
+{
+  std::ifstream trace(filename.c_str());
+  if (!trace.is_open()) {
+    log_warn("response timing: cannot open %s", filename.c_str());
+    return false;
+  }
+
+  // Only a trace read to the end replaces the model.
+  ResponseTiming loaded(*this);
+  unsigned long count = 0, skipped = 0;
+  std::string line;
+  while (std::getline(trace, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    std::istringstream fields(line);
+    std::string name;
+    double size, ms;
+    if (!(fields >> name >> size >> ms) || size < 0 || ms < 0) {
+      log_warn("response timing: %s: bad line '%s'", filename.c_str(),
+               line.c_str());
+      return false;
+    }
+
+    size_t dot = name.rfind('.');
+    int type = payload_server->extension_to_content_type(
+      dot == std::string::npos ? name.c_str() : name.c_str() + dot + 1);
+    if (!valid_type(type)) {
+      skipped++;
+      continue;
+    }
+    loaded.record(type, (size_t)size, ms);
+    count++;
+  }
+
+  loaded.finish();
+  swap(loaded);
+  log_info("response timing: %lu responses from %s (%lu of unknown type)",
+           count, filename.c_str(), skipped);
+  return true;
+}
+
+const ResponseTiming::Distribution*
+ResponseTiming::lookup(int type, size_t size, double *extra_ms) const
+{
+  if (!valid_type(type) || _builtin[type].p.empty())
+    type = HTTP_CONTENT_HTML;
+
+  *extra_ms = 0;
+  if (size && !_by_size[type][size_bucket(size)].p.empty())
+    return &_by_size[type][size_bucket(size)];
+  if (!_by_type[type].p.empty())
+    return &_by_type[type];
+
+  *extra_ms = size / c_BUILTIN_BYTES_PER_MS;
+  return &_builtin[type];
+}
+
+unsigned int
+ResponseTiming::earliest(int type, size_t size) const
+{
+  double extra;
+  const Distribution *d = lookup(type, size, &extra);
+  return (unsigned int)(d->at(c_EARLIEST_QUANTILE) + extra);
+}
+
+unsigned int
+ResponseTiming::sample(int type, size_t size, double u) const
+{
+  if (u < 0)
+    u = rng_int(1 << 30) / (double)(1 << 30);
+
+  double extra;
+  const Distribution *d = lookup(type, size, &extra);
+  return (unsigned int)(std::max(d->at(u), d->at(c_EARLIEST_QUANTILE))
+                        + extra);
+}
@@ -0,0 +1,93 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _RESPONSE_TIMING_H
+#define _RESPONSE_TIMING_H
+
+#include <string>
+#include <vector>
+
+class PayloadServer;
+
+/**
+   How long a web server takes to answer a request, by content type
+   and response size.  The http steg server uses it to decide when it
+   may answer a request: no sooner than a real server plausibly would,
+   and, if it has no data by then, at a delay drawn from the same
+   distribution, rather than after a fixed delay every time.
+
+   The model is either loaded from a trace of recorded responses or,
+   failing that, made of built-in quantiles for each content type (rough
+   figures for ordinary web servers) plus a transfer time proportional
+   to the size.
+*/
+class ResponseTiming
+{
+ protected:
+  /* a distribution given by a few (probability, delay in ms) points,
+     linearly interpolated between them */
+  struct Distribution {
+    std::vector<double> p;
+    std::vector<double> ms;
+
+    double at(double u) const;
+  };
+
+  /* recorded delays, by content type and by log2 of the size */
+  std::vector<std::vector<std::vector<double> > > _samples;
+  /* built from _samples by finish() */
+  std::vector<std::vector<Distribution> > _by_size;
+  std::vector<Distribution> _by_type;
+  std::vector<Distribution> _builtin;
+
+  bool _from_trace;
+
+  const Distribution* lookup(int type, size_t size, double *extra_ms) const;
+  void record(int type, size_t size, double ms);
+  void finish();
+
+ public:
+  /* a (type, size) cell needs this many samples to be used on its own,
+     otherwise all the samples of the type are used */
+  static const size_t c_MIN_SAMPLES = 8;
+  /* quantile below which nobody answers */
+  static const double c_EARLIEST_QUANTILE;
+
+  ResponseTiming();
+
+  /**
+     Read recorded responses from FILENAME, one "<name> <bytes> <ms>"
+     line each: the requested file name (or only its extension), the
+     size of the response and how long the server took to start
+     answering.  Empty lines and lines starting with '#' are skipped.
+     The types come from PAYLOAD_SERVER.
+
+     @return true if the trace was read, false otherwise (the model is
+             then unchanged)
+  */
+  bool load(const std::string& filename, PayloadServer* payload_server);
+
+  /** Record one response and rebuild the model. */
+  void add(int type, size_t size, double ms);
+
+  void swap(ResponseTiming& other);
+
+  /** True if the model comes from recorded responses. */
+  bool from_trace() const { return _from_trace; }
+
+  /**
+     The shortest delay, in milliseconds, after which a response of
+     TYPE and SIZE (0 if not known yet) may go out.
+  */
+  unsigned int earliest(int type, size_t size) const;
+
+  /**
+     A delay, in milliseconds, drawn from the distribution for TYPE and
+     SIZE, never below earliest(type, size).  U in [0, 1) picks the
+     quantile; pass a negative U for a random one.
+  */
+  unsigned int sample(int type, size_t size, double u = -1) const;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <string.h>
+
+#include "util.h"
+#include "uri_dict.h"
+
+const size_t URIDict::npos;
+
+uint64_t
+URIDict::hash(const char* url, size_t len)
+{
+  //FNV-1a
+  uint64_t url_hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    url_hash ^= (uint8_t)url[i];
+    url_hash *= 1099511628211ULL;
+  }
+  return url_hash;
+}
+
+size_t
+URIDict::url_length(size_t index) const
+{
+  size_t end = (index + 1 < _starts.size()) ? _starts[index + 1] : _arena.size();
+  return end - _starts[index] - 1; //the newline
+}
+
+size_t
+URIDict::slot_of(const char* url, size_t len, uint64_t url_hash) const
+{
+  size_t mask = _slots.size() - 1;
+  for (size_t slot = url_hash & mask;; slot = (slot + 1) & mask) {
+    uint32_t entry = _slots[slot];
+    if (!entry)
+      return slot;
+    if (url_length(entry - 1) == len && !memcmp(url_data(entry - 1), url, len))
+      return slot;
+  }
+}
+
+void
+URIDict::grow()
+{
+  _slots.assign(_slots.empty() ? 16 : _slots.size() * 2, 0);
+
+  for (size_t i = 0; i < _starts.size(); i++) {
+    size_t slot = slot_of(url_data(i), url_length(i), hash(url_data(i), url_length(i)));
+    if (!_slots[slot]) //duplicates stay at their first index
+      _slots[slot] = i + 1;
+  }
+}
+
+void
+URIDict::clear()
+{
+  _arena.clear();
+  _starts.clear();
+  _slots.clear();
+  _mac.reset();
+}
+
+void
+URIDict::append(const char* url, size_t len)
+{
+  log_assert(_arena.size() + len + 1 <= UINT32_MAX);
+
+  _starts.push_back(_arena.size());
+  _arena.append(url, len);
+  _arena.push_back('\n');
+  _mac.update(url, len);
+  _mac.update("\n", 1);
+
+  //at most half full, so a probe is short
+  if (_starts.size() * 2 > _slots.size()) {
+    grow();
+    return;
+  }
+
+  size_t slot = slot_of(url, len, hash(url, len));
+  if (!_slots[slot])
+    _slots[slot] = _starts.size();
+}
+
+size_t
+URIDict::find(const char* url, size_t len) const
+{
+  if (_slots.empty())
+    return npos;
+
+  uint32_t entry = _slots[slot_of(url, len, hash(url, len))];
+  return entry ? entry - 1 : npos;
+}
+
+void
+URIDict::swap(URIDict& other)
+{
+  _arena.swap(other._arena);
+  _starts.swap(other._starts);
+  _slots.swap(other._slots);
+  _mac.swap(other._mac);
+}
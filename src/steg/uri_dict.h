@@ -0,0 +1,79 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef _URI_DICT_H
+#define _URI_DICT_H
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crypt.h"
+
+/**
+   The urls of the covers the client codes its data with, by index.
+   The client sends the index of a url as the url itself and the server
+   looks the url up to get the index back.
+
+   The urls are kept back to back in one string, each followed by a
+   newline, which is also the form the dict is sent to the client in
+   and the one its mac is the SHA256 of. The mac is fed every url as it
+   is appended, so it is ready without going over the dict again.
+   Urls are looked up in an open addressing table of entry indexes, and
+   looking up a url which is not there adds nothing.
+*/
+class URIDict
+{
+ public:
+  static const size_t npos = (size_t)-1;
+
+ protected:
+  std::string _arena;              /* url\n url\n ... */
+  std::vector<uint32_t> _starts;   /* where each url starts in _arena */
+  std::vector<uint32_t> _slots;    /* entry index + 1, 0 if free */
+  sha256_stream _mac;
+
+  static uint64_t hash(const char* url, size_t len);
+
+  /** the slot url is in, or the free one it would go to */
+  size_t slot_of(const char* url, size_t len, uint64_t url_hash) const;
+
+  /** rebuilds the table with twice as many slots */
+  void grow();
+
+ public:
+  size_t size() const { return _starts.size(); }
+  bool empty() const { return _starts.empty(); }
+
+  void clear();
+
+  /**
+     adds url as the next entry. A url already in the dict takes an
+     index nonetheless but is still found at its first one.
+  */
+  void append(const char* url, size_t len);
+  void append(const std::string& url) { append(url.data(), url.size()); }
+
+  /**
+     the index of url, or npos if it is not in the dict
+  */
+  size_t find(const char* url, size_t len) const;
+  size_t find(const std::string& url) const { return find(url.data(), url.size()); }
+
+  const char* url_data(size_t index) const { return _arena.data() + _starts[index]; }
+  size_t url_length(size_t index) const;
+  std::string url(size_t index) const { return std::string(url_data(index), url_length(index)); }
+
+  /** the dict as it is sent to the client, one url per line */
+  const std::string& text() const { return _arena; }
+
+  /** writes the SHA256 of text() to mac */
+  void compute_mac(uint8_t* mac) const { _mac.digest(mac); }
+
+  void swap(URIDict& other);
+};
+
+#endif
@@ -0,0 +1,177 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <map>
+
+#include <math.h>
+
+#include <yaml-cpp/yaml.h>
+
+#include "util.h"
+#include "latency.h"
+#include "protocol.h"
+#include "steg.h"
+#include "target_stats.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace {
+  const double c_EWMA_WEIGHT = 0.2;
+
+  typedef map<config_t *, vector<target_stats> > target_stats_map;
+}
+
+static target_stats_map *tss = NULL;
+
+void
+target_stats::connected(uint64_t start)
+{
+  double elapsed = (latency_now() - start) / 1e6;
+  connect_time = connects - connect_failures == 0 ? elapsed
+    : connect_time + c_EWMA_WEIGHT * (elapsed - connect_time);
+  connects++;
+}
+
+void
+target_stats::failed()
+{
+  connects++;
+  connect_failures++;
+  throughput -= c_EWMA_WEIGHT * throughput;
+  samples++;
+}
+
+void
+target_stats::closed_after(uint64_t since, unsigned long long bytes)
+{
+  double elapsed = (latency_now() - since) / 1e6;
+  closed++;
+  bytes_carried += bytes;
+  connected_time += elapsed;
+
+  // a connection that was closed right away carried what it carried
+  // in no time at all; don't let that look like infinite throughput
+  double sample = bytes / std::max(elapsed, 0.01);
+  throughput = samples == 0 ? sample
+    : throughput + c_EWMA_WEIGHT * (sample - throughput);
+  samples++;
+}
+
+/* Connections keep pointers into these vectors, so each is sized for
+   all of its configuration's targets at once and never grows. */
+static vector<target_stats> &
+targets_of(config_t *cfg)
+{
+  if (!tss)
+    tss = new target_stats_map;
+
+  vector<target_stats> &targets = (*tss)[cfg];
+  if (targets.empty()) {
+    struct evutil_addrinfo *addr;
+    for (size_t n = 0; (addr = cfg->get_target_addrs(n)); n++) {
+      targets.push_back(target_stats());
+
+      const steg_config_t *steg = cfg->get_steg(n);
+      char *peername = printable_address(addr->ai_addr, addr->ai_addrlen);
+      targets.back().steg = steg ? steg->name() : cfg->name();
+      targets.back().address = peername;
+      free(peername);
+    }
+  }
+  return targets;
+}
+
+target_stats *
+target_stats_get(config_t *cfg, size_t index)
+{
+  vector<target_stats> &targets = targets_of(cfg);
+  log_assert(index < targets.size());
+  return &targets[index];
+}
+
+size_t
+target_select(vector<target_stats> &targets)
+{
+  log_assert(!targets.empty());
+
+  double best_throughput = 0;
+  unsigned long total = 0;
+  for (vector<target_stats>::const_iterator i = targets.begin();
+       i != targets.end(); ++i) {
+    if (i->connects == 0) {
+      size_t untried = i - targets.begin();
+      targets[untried].selected++;
+      return untried;
+    }
+    best_throughput = std::max(best_throughput, i->throughput);
+    total += i->connects;
+  }
+
+  size_t pick = 0;
+  double best_score = -1;
+  for (size_t i = 0; i < targets.size(); i++) {
+    const target_stats &t = targets[i];
+    // targets whose connections are all still open have no
+    // throughput yet; be optimistic about them
+    double mean = t.samples == 0 ? 1
+      : best_throughput > 0 ? t.throughput / best_throughput
+      : 0;
+    double score = mean + sqrt(2 * log((double)total) / t.connects);
+    log_debug("target %s %s: throughput %.0f score %.3f",
+              t.steg.c_str(), t.address.c_str(), t.throughput, score);
+    if (score > best_score) {
+      best_score = score;
+      pick = i;
+    }
+  }
+
+  targets[pick].selected++;
+  return pick;
+}
+
+size_t
+target_select(config_t *cfg)
+{
+  return target_select(targets_of(cfg));
+}
+
+static void
+append_target_metric(string &out, const char *name, const target_stats &t,
+                     double value)
+{
+  char buf[256];
+  xsnprintf(buf, sizeof buf, "%s{steg=\"%s\",address=\"%s\"} %.6g\n",
+            name, t.steg.c_str(), t.address.c_str(), value);
+  out += buf;
+}
+
+void
+target_stats_snapshot(string &out)
+{
+  if (!tss)
+    return;
+
+  for (target_stats_map::const_iterator i = tss->begin();
+       i != tss->end(); ++i)
+    for (vector<target_stats>::const_iterator t = i->second.begin();
+         t != i->second.end(); ++t) {
+      append_target_metric(out, "target_connects", *t, t->connects);
+      append_target_metric(out, "target_connect_failures", *t,
+                           t->connect_failures);
+      append_target_metric(out, "target_connect_seconds", *t,
+                           t->connect_time);
+      append_target_metric(out, "target_room_offered_bytes", *t,
+                           t->room_offered);
+      append_target_metric(out, "target_room_queries", *t, t->room_queries);
+      append_target_metric(out, "target_bytes_carried", *t,
+                           t->bytes_carried);
+      append_target_metric(out, "target_connected_seconds", *t,
+                           t->connected_time);
+      append_target_metric(out, "target_throughput_bytes_per_second", *t,
+                           t->throughput);
+      append_target_metric(out, "target_selected", *t, t->selected);
+    }
+}
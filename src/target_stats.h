@@ -0,0 +1,81 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef TARGET_STATS_H
+#define TARGET_STATS_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+/* Per-target statistics for client configurations.  A target is one
+   of the down address / steg module pairs returned by
+   config_t::get_target_addrs.  Every outbound connection reports how
+   long it took to connect (or that it failed), how much room its steg
+   module offered and how much covert data it carried before it was
+   closed.  circuit_reopen_downstreams uses them to decide which target
+   a circuit should open its next connection to, so that slow or broken
+   cover channels stop eating into the connection budget. */
+
+struct target_stats {
+  std::string steg;
+  std::string address;
+
+  unsigned long connects;          /* attempts */
+  unsigned long connect_failures;
+  double connect_time;             /* seconds, EWMA over successes */
+
+  unsigned long long room_offered; /* bytes offered by transmit_room */
+  unsigned long room_queries;
+
+  unsigned long closed;            /* established connections closed */
+  unsigned long long bytes_carried; /* data bytes, closed connections */
+  double connected_time;           /* seconds, closed connections */
+
+  /* bytes per second per connection, EWMA; failed connections count
+     as zero */
+  double throughput;
+  unsigned long samples;           /* number of throughput samples */
+  unsigned long selected;          /* picked by target_select */
+
+  target_stats()
+    : connects(0), connect_failures(0), connect_time(0),
+      room_offered(0), room_queries(0),
+      closed(0), bytes_carried(0), connected_time(0),
+      throughput(0), samples(0), selected(0)
+  {}
+
+  /** A connection attempt started at START (latency_now()) succeeded. */
+  void connected(uint64_t start);
+
+  /** A connection attempt failed, or the connection was dropped
+      before it was ever usable. */
+  void failed();
+
+  /** A connection that became usable at SINCE (latency_now()) and
+      carried BYTES of covert data is being closed. */
+  void closed_after(uint64_t since, unsigned long long bytes);
+
+  void offered(size_t room) { room_offered += room; room_queries++; }
+};
+
+/** Returns the statistics for target INDEX of CFG, creating them on
+    first use.  The pointer stays valid for the life of the process. */
+target_stats *target_stats_get(config_t *cfg, size_t index);
+
+/** Pick one of TARGETS to connect to.  This is UCB1: every target is
+    tried once, after that the one with the best sum of its normalized
+    throughput and an exploration bonus that shrinks as it is tried more
+    often wins. */
+size_t target_select(std::vector<target_stats> &targets);
+
+/** Same, for the targets of CFG. */
+size_t target_select(config_t *cfg);
+
+/** Appends one "name{steg,address} value" line per statistic and
+    target to OUT.  Part of the metrics snapshot. */
+void target_stats_snapshot(std::string &out);
+
+#endif
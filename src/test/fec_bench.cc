@@ -0,0 +1,236 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Delivery latency of chop blocks under loss, with and without
+   forward error correction.  Interactive traffic (bursts of a few
+   blocks every 50 ms) goes out round-robin over four connections,
+   each with its own delay; blocks are lost either at random or by a
+   connection going dark for a while, as when an HTTP steg connection
+   dies mid-response.  A lost block arrives again after the
+   retransmission timeout, unless the real fec_decoder, fed the blocks
+   and parity as they arrive, rebuilds it sooner.  Blocks are handed
+   upstream in order, so one lost block holds up all behind it.
+
+   It reports the distribution of the time from sending a data block
+   to handing it upstream, the bandwidth spent on parity and how many
+   blocks parity rebuilt, for each loss scenario and fec ratio.
+
+   usage: fec_bench */
+
+#include "util.h"
+#include "latency.h"
+#include "rng.h"
+#include "crypt.h"
+#include "protocol/chop_blk.h"
+
+#include <event2/buffer.h>
+#include <algorithm>
+
+using namespace chop_blk;
+using std::vector;
+
+namespace {
+  const unsigned int c_CONNS = 4;
+  const unsigned int c_BURSTS = 4000;
+  const unsigned int c_BURST_INTERVAL_MS = 50;
+  const unsigned int c_DELAY_MS = 40;        /* one way, plus jitter */
+  const unsigned int c_JITTER_MS = 20;
+  const unsigned int c_RETRANSMIT_MS = 300;  /* until a lost block is resent */
+  const unsigned int c_FLUSH_MS = 20;        /* FEC_FLUSH_DELAY in chop.cc */
+
+  struct scenario {
+    const char *name;
+    unsigned int loss_ppm;          /* random loss, per million blocks */
+    unsigned int outage_every_ms;   /* one connection goes dark ... */
+    unsigned int outage_ms;         /* ... for this long; 0 = never */
+  };
+
+  const scenario scenarios[] = {
+    { "clean",      0,    0,   0 },
+    { "loss-1%",    10000, 0,  0 },
+    { "loss-5%",    50000, 0,  0 },
+    { "conn-drop",  0, 5000, 100 },
+  };
+
+  struct ratio {
+    const char *name;
+    unsigned int k, m;              /* k = 0: no fec */
+  };
+
+  const ratio ratios[] = {
+    { "none", 0, 0 },
+    { "8:1",  8, 1 },
+    { "4:1",  4, 1 },
+    { "4:2",  4, 2 },
+  };
+
+  struct block {
+    bool parity;
+    unsigned int sent_ms;
+    unsigned int conn;
+    evbuffer *data;
+    double available_ms;
+  };
+
+  struct arrival {
+    double at_ms;
+    uint32_t seqno;
+
+    bool operator<(const arrival &o) const { return at_ms < o.at_ms; }
+  };
+}
+
+static evbuffer *
+random_data()
+{
+  size_t len = 64 + rng_int(1400);
+  uint8_t buf[1464];
+  rng_bytes(buf, len);
+  evbuffer *b = evbuffer_new();
+  evbuffer_add(b, buf, len);
+  return b;
+}
+
+/* Send the parity that is due, each on a connection that carried
+   none of the blocks since the last parity went out if there is one,
+   as chop_circuit_t::pick_parity_connection does. */
+static void
+send_parity(fec_encoder &enc, vector<block> &blocks, unsigned int at_ms,
+            vector<bool> &used)
+{
+  evbuffer *p;
+  bool sent = false;
+  while ((p = enc.next_parity())) {
+    unsigned int conn = rng_int(c_CONNS);
+    for (unsigned int j = 0; j < c_CONNS && used[conn]; j++)
+      conn = (conn + 1) % c_CONNS;
+    used[conn] = true;
+
+    block b = { true, at_ms, conn, p, 0 };
+    blocks.push_back(b);
+    // as in chop, parity falls in the next group
+    enc.add(blocks.size() - 1, op_PARITY, p);
+    sent = true;
+  }
+  if (sent)
+    used.assign(c_CONNS, false);
+}
+
+static bool
+lost(const scenario &sc, const block &b)
+{
+  if (sc.loss_ppm && (unsigned int)rng_int(1000000) < sc.loss_ppm)
+    return true;
+  if (sc.outage_ms) {
+    // connection N goes dark at N * period / CONNS into each period
+    unsigned int phase = (b.sent_ms + sc.outage_every_ms
+                          - b.conn * sc.outage_every_ms / c_CONNS)
+      % sc.outage_every_ms;
+    if (phase < sc.outage_ms)
+      return true;
+  }
+  return false;
+}
+
+static void
+run(const scenario &sc, const ratio &r)
+{
+  vector<block> blocks;
+  fec_encoder *enc = r.k ? new fec_encoder(r.k, r.m) : 0;
+  unsigned int conn = 0;
+  vector<bool> used(c_CONNS, false);
+  size_t data_bytes = 0, parity_bytes = 0;
+
+  for (unsigned int i = 0; i < c_BURSTS; i++) {
+    unsigned int t = i * c_BURST_INTERVAL_MS;
+    unsigned int n = 1 + rng_int(6);
+    for (unsigned int j = 0; j < n; j++) {
+      block b = { false, t + j, conn, random_data(), 0 };
+      blocks.push_back(b);
+      data_bytes += evbuffer_get_length(b.data);
+      if (enc) {
+        enc->add(blocks.size() - 1, op_DAT, b.data);
+        used[conn] = true;
+        send_parity(*enc, blocks, t + j, used);
+      }
+      conn = (conn + 1) % c_CONNS;
+    }
+    if (enc) {
+      // the circuit goes idle after the burst
+      enc->flush();
+      send_parity(*enc, blocks, t + n - 1 + c_FLUSH_MS, used);
+    }
+  }
+
+  vector<arrival> arrivals;
+  for (uint32_t s = 0; s < blocks.size(); s++) {
+    block &b = blocks[s];
+    if (b.parity)
+      parity_bytes += evbuffer_get_length(b.data);
+    double delay = c_DELAY_MS + rng_int(c_JITTER_MS * 1000) / 1000.0;
+    arrival a = { b.sent_ms + delay, s };
+    if (lost(sc, b))
+      a.at_ms += c_RETRANSMIT_MS;
+    b.available_ms = a.at_ms;
+    arrivals.push_back(a);
+  }
+  std::sort(arrivals.begin(), arrivals.end());
+
+  unsigned long recovered = 0;
+  if (enc) {
+    fec_decoder dec;
+    dec.activate(0);
+    for (vector<arrival>::iterator a = arrivals.begin();
+         a != arrivals.end(); ++a) {
+      block &b = blocks[a->seqno];
+      dec.add_block(a->seqno, b.parity ? op_PARITY : op_DAT, b.data);
+      if (b.parity)
+        dec.add_parity(b.data);
+
+      uint32_t seqno;
+      opcode_t op;
+      evbuffer *data;
+      while (dec.recover(&seqno, &op, &data)) {
+        evbuffer_free(data);
+        if (a->at_ms < blocks[seqno].available_ms) {
+          blocks[seqno].available_ms = a->at_ms;
+          recovered++;
+        }
+      }
+    }
+  }
+
+  latency_histogram h;
+  double delivered = 0;
+  for (vector<block>::iterator b = blocks.begin(); b != blocks.end(); ++b) {
+    delivered = std::max(delivered, b->available_ms);
+    if (!b->parity)
+      h.record((uint64_t)((delivered - b->sent_ms) * 1000));
+    evbuffer_free(b->data);
+  }
+  delete enc;
+
+  printf("%-10s %-5s p50 %4lu ms  p95 %4lu ms  p99 %4lu ms  "
+         "p99.9 %4lu ms  parity %5.1f%%  rebuilt %5lu\n",
+         sc.name, r.name,
+         (unsigned long)h.value_at_percentile(50) / 1000,
+         (unsigned long)h.value_at_percentile(95) / 1000,
+         (unsigned long)h.value_at_percentile(99) / 1000,
+         (unsigned long)h.value_at_percentile(99.9) / 1000,
+         100.0 * parity_bytes / data_bytes, recovered);
+}
+
+int
+main(int argc, char **)
+{
+  if (argc > 1) {
+    fprintf(stderr, "usage: fec_bench\n");
+    return 1;
+  }
+
+  for (size_t s = 0; s < sizeof scenarios / sizeof scenarios[0]; s++)
+    for (size_t r = 0; r < sizeof ratios / sizeof ratios[0]; r++)
+      run(scenarios[s], ratios[r]);
+  return 0;
+}
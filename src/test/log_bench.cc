@@ -0,0 +1,195 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Cost of logging on the chop send path.  Every block goes through
+   what chop_circuit_t::send does for one block: asking four
+   connections for their room and picking one (offered_room,
+   pick_connection), then enqueueing, encrypting and transmitting the
+   block, with the log_debug calls those make, arguments and all.  It
+   runs with the minimum severity at info, where the debug messages
+   are skipped, and at debug, written to a file from the sending
+   thread and through the background writer (log_start_async).  The
+   file is in the directory of $TMPDIR, /tmp by default.
+
+   Rebuild with configure --with-log-floor=info to see the debug
+   messages compiled out altogether.
+
+   usage: log_bench [blocks] */
+
+#include "util.h"
+#include "latency.h"
+#include "crypt.h"
+#include "protocol/chop_blk.h"
+
+#include <event2/buffer.h>
+
+#include <algorithm>
+
+#include <time.h>
+#include <unistd.h>
+
+using namespace chop_blk;
+using std::min;
+
+namespace {
+  const unsigned int c_CONNS = 4;
+
+  struct bench_conn {
+    unsigned int serial;
+    time_t creation_time;
+    size_t room;
+    const char *steg;
+  };
+
+  struct mode {
+    const char *name;
+    const char *severity;
+    bool async;
+  };
+
+  const mode modes[] = {
+    { "info",        "info",  false },
+    { "debug-sync",  "debug", false },
+    { "debug-async", "debug", true },
+  };
+}
+
+/* The connection choice of pick_connection, with its log messages
+   and those of offered_room. */
+static bench_conn *
+pick(bench_conn *conns, size_t desired, unsigned int ckt)
+{
+  bench_conn *best = 0;
+  log_debug("target block size %lu bytes",
+            (unsigned long)(desired + MIN_BLOCK_SIZE));
+  for (unsigned int i = 0; i < c_CONNS; i++) {
+    bench_conn *c = &conns[i];
+    log_debug("has been connected for %lu secs",
+              (unsigned long)difftime(time(0), c->creation_time));
+    log_debug("offers %lu bytes (%s)", (unsigned long)c->room, c->steg);
+    if (c->room >= desired + MIN_BLOCK_SIZE && (!best || c->room < best->room))
+      best = c;
+  }
+  if (!best)
+    best = &conns[0];
+  log_debug("minabove %lu for <%u.%u> maxbelow %lu for <%u.%u>",
+            (unsigned long)best->room, ckt, best->serial,
+            (unsigned long)0, ckt, 0);
+  return best;
+}
+
+static unsigned long
+count_lines(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  unsigned long lines = 0;
+  int c;
+  if (!f)
+    return 0;
+  while ((c = getc(f)) != EOF)
+    if (c == '\n')
+      lines++;
+  fclose(f);
+  return lines;
+}
+
+static void
+run(const mode &m, unsigned long blocks)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char path[256];
+  xsnprintf(path, sizeof path, "%s/log_benchXXXXXX", tmpdir ? tmpdir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    exit(1);
+  }
+  close(fd);
+
+  const char *phrase = "log bench";
+  key_generator *kgen =
+    key_generator::from_passphrase((const uint8_t *)phrase, strlen(phrase),
+                                   0, 0, 0, 0);
+  gcm_encryptor *gc = gcm_encryptor::create(kgen, 16);
+  ecb_encryptor *ec = ecb_encryptor::create(kgen, 16);
+  delete kgen;
+
+  bench_conn conns[c_CONNS];
+  for (unsigned int i = 0; i < c_CONNS; i++) {
+    conns[i].serial = i + 1;
+    conns[i].creation_time = time(0) - 60 * i;
+    conns[i].room = 600 + 400 * i;
+    conns[i].steg = i % 2 ? "http" : "nosteg";
+  }
+
+  transmit_queue q;
+  uint8_t payload[SECTION_LEN];
+  memset(payload, 'x', sizeof payload);
+  evbuffer *out = evbuffer_new();
+
+  if (log_set_method(LOG_METHOD_FILE, path) ||
+      log_set_min_severity(m.severity) ||
+      (m.async && log_start_async())) {
+    fprintf(stderr, "failed to set up logging to %s\n", path);
+    exit(1);
+  }
+
+  uint64_t start = latency_now();
+  for (unsigned long i = 0; i < blocks; i++) {
+    size_t desired = 100 + i % 1200;
+    bench_conn *c = pick(conns, desired, 1);
+    size_t d = min(desired, c->room - MIN_BLOCK_SIZE);
+    size_t p = c->room - MIN_BLOCK_SIZE - d;
+
+    evbuffer *data = evbuffer_new();
+    evbuffer_add(data, payload, d);
+    uint32_t seqno = q.enqueue(op_DAT, data, p);
+    if (q.transmit(seqno, out, *ec, *gc))
+      log_abort("encryption failure for block %u", seqno);
+    evbuffer_drain(out, evbuffer_get_length(out));
+
+    char fallbackbuf[4];
+    log_debug("transmitted block %u <d=%lu p=%lu f=%s>",
+              seqno, (unsigned long)d, (unsigned long)p,
+              opname(op_DAT, fallbackbuf));
+
+    // acknowledge everything now and then, as the far end would
+    if (seqno % 128 == 127) {
+      evbuffer *ack = ack_payload(seqno).serialize();
+      log_debug("received ACK: hsn %u", seqno);
+      if (q.process_ack(ack))
+        log_abort("invalid ACK payload");
+    }
+  }
+  uint64_t sent = latency_now();
+  // closing the log waits for the writer to catch up
+  log_set_method(LOG_METHOD_NULL, NULL);
+  uint64_t done = latency_now();
+
+  printf("%-12s %7.0f ns/block sending  %7.0f ns/block until written  "
+         "%9lu lines\n",
+         m.name, (sent - start) * 1000.0 / blocks,
+         (done - start) * 1000.0 / blocks, count_lines(path));
+
+  evbuffer_free(out);
+  delete gc;
+  delete ec;
+  unlink(path);
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned long blocks = 100000;
+  if (argc > 2 || (argc == 2 && !(blocks = strtoul(argv[1], 0, 10)))) {
+    fprintf(stderr, "usage: log_bench [blocks]\n");
+    return 1;
+  }
+
+  init_crypto();
+  for (size_t i = 0; i < sizeof modes / sizeof modes[0]; i++)
+    run(modes[i], blocks);
+  free_crypto();
+  return 0;
+}
@@ -0,0 +1,100 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Request/response latency of the http steg server with the old fixed
+   WAIT_BEFORE_TRANSMIT and with the ResponseTiming model.  For each
+   request the upstream data becomes ready after some delay (drawn
+   from one of a few scenarios) and the server answers:
+
+     constant: as soon as the data is ready, or empty after 100 ms;
+     model:    as soon as the data is ready but not before
+               earliest(), or empty after sample().
+
+   It reports the distribution of the time taken to answer (with the
+   data when it was ready in time, empty otherwise; data that missed
+   its answer goes with the next request) for each, and how many answers
+   came sooner than 95% of real servers would have, with the built-in
+   model.
+
+   usage: response_timing_bench */
+
+#include "util.h"
+#include "latency.h"
+#include "rng.h"
+#include "payload_server.h"
+#include "response_timing.h"
+
+namespace {
+  /* WAIT_BEFORE_TRANSMIT in http.h */
+  const unsigned int c_CONSTANT_MS = 100;
+
+  struct scenario {
+    const char *name;
+    unsigned int lo_ms, hi_ms;   /* data ready after [lo, hi) ms */
+    bool never;                  /* no data at all: polling */
+  };
+
+  const scenario scenarios[] = {
+    { "ready",      0,   1, false },
+    { "echo",       1,  20, false },
+    { "fetch",     20, 250, false },
+    { "idle",       0,   0, true },
+  };
+
+  const int types[] = {
+    HTTP_CONTENT_HTML, HTTP_CONTENT_JAVASCRIPT, HTTP_CONTENT_JPEG,
+    HTTP_CONTENT_PNG, HTTP_CONTENT_GIF, HTTP_CONTENT_PDF, HTTP_CONTENT_SWF
+  };
+}
+
+static void
+report(const char *policy, const char *scenario,
+       const latency_histogram &h, unsigned long too_soon)
+{
+  printf("%-8s %-6s mean %6.1f ms  p50 %4lu ms  p95 %4lu ms  "
+         "sooner than p5 %5.1f%%\n",
+         policy, scenario, h.mean() / 1000,
+         (unsigned long)h.value_at_percentile(50) / 1000,
+         (unsigned long)h.value_at_percentile(95) / 1000,
+         h.count() ? 100.0 * too_soon / h.count() : 0);
+}
+
+int
+main(int argc, char **)
+{
+  if (argc > 1) {
+    fprintf(stderr, "usage: response_timing_bench\n");
+    return 1;
+  }
+
+  ResponseTiming timing;
+  const unsigned int requests = 100000;
+  const unsigned int n_types = sizeof types / sizeof types[0];
+  for (size_t s = 0; s < sizeof scenarios / sizeof scenarios[0]; s++) {
+    const scenario &sc = scenarios[s];
+    latency_histogram constant, model;
+    unsigned long constant_soon = 0, model_soon = 0;
+
+    for (unsigned int i = 0; i < requests; i++) {
+      int type = types[i % n_types];
+      unsigned int ready = sc.never ? UINT_MAX
+        : sc.lo_ms + rng_int(sc.hi_ms - sc.lo_ms);
+      unsigned int earliest = timing.earliest(type, 0);
+
+      unsigned int c = std::min(ready, c_CONSTANT_MS);
+      constant.record(c * 1000);
+      constant_soon += c < earliest;
+
+      unsigned int deadline = timing.sample(type, 0);
+      unsigned int m = ready <= deadline ? std::max(ready, earliest)
+        : deadline;
+      model.record(m * 1000);
+      model_soon += m < earliest;
+    }
+
+    report("constant", sc.name, constant, constant_soon);
+    report("model", sc.name, model, model_soon);
+  }
+  return 0;
+}
@@ -0,0 +1,846 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Load generator for many concurrent circuits.  It keeps up to
+   --circuits SOCKS5 connections open through a stegotorus client in
+   socks mode, opening new ones at --rate per second as old ones
+   finish (0: as fast as they finish).  Each does --requests requests,
+   pausing for an exponentially distributed think time between them,
+   and then closes.  It also listens on UPSTREAM-ADDR, which should be
+   the up address of the stegotorus server at the other end: every
+   request is an 8-byte size in network order, and the answer is that
+   many bytes.  Request sizes follow --sizes:
+
+     fixed:N                 N bytes
+     uniform:MIN:MAX         between MIN and MAX bytes
+     pareto:MIN:ALPHA[:CAP]  Pareto with scale MIN and shape ALPHA,
+                             capped at CAP (default 16 MB)
+
+   Every --interval ms it samples what the circuits are doing and, if
+   given, the CPU and resident memory of the stegotorus process --pid
+   (from /proc) and the circuit and connection counts its metrics
+   listener (--metrics) reports.  A line of each sample goes to
+   stderr as it is taken; at the end a JSON report of all samples,
+   failures by reason and every circuit goes to stdout or --output.
+   A circuit's goodput is the bytes it received over the time it
+   spent waiting for answers, think time excluded.
+
+   Failure reasons:
+
+     connect  - could not connect to the SOCKS port
+     socks    - the SOCKS handshake failed or was refused
+     reset    - socket error after the handshake
+     eof      - the connection closed before the circuit was done
+     timeout  - no progress for --timeout seconds
+
+   Circuits still open when --duration is up are closed and counted as
+   cut, not failed.
+
+   usage: socks_load [options] SOCKS-ADDR UPSTREAM-ADDR */
+
+#include "util.h"
+#include "latency.h"
+#define SOCKS_PRIVATE
+#include "socks.h"
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+
+#include <getopt.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+  enum failure {
+    F_NONE, F_CONNECT, F_SOCKS, F_RESET, F_EOF, F_TIMEOUT, F_CUT, F_N
+  };
+  const char *const failure_names[F_N] = {
+    "none", "connect", "socks", "reset", "eof", "timeout", "cut"
+  };
+
+  const size_t c_UPSTREAM_CHUNK = 64 * 1024;
+
+  struct size_dist {
+    enum { FIXED, UNIFORM, PARETO } kind;
+    double a, b, cap;
+  };
+
+  struct load_state;
+
+  struct load_circuit {
+    load_state *st;
+    unsigned int serial;
+    struct bufferevent *bev;
+    struct event *think_timer;
+    enum { GREETING, REPLY, REQUESTING, THINKING } state;
+    bool connected;
+    unsigned int requests_left;
+    uint64_t want;              /* bytes still due for this request */
+    uint64_t bytes;
+    uint64_t opened, established, request_start, busy, closed;
+    failure why;
+  };
+
+  /* The far end of a circuit, answering its requests. */
+  struct upstream_conn {
+    struct bufferevent *bev;
+    uint64_t owed;
+  };
+
+  struct load_sample {
+    double t;
+    size_t open;
+    unsigned long established, completed, failed;
+    uint64_t bytes;
+    double cpu_pct;             /* < 0: not sampled */
+    long rss_kb;
+    long st_circuits, st_connections, st_memory;
+  };
+
+  struct load_state {
+    struct event_base *base;
+    struct evutil_addrinfo *socks_addr;
+    struct evutil_addrinfo *upstream_addr;
+    struct evconnlistener *listener;
+    struct event *open_timer;
+    struct event *sample_timer;
+    struct event *end_timer;
+
+    /* options */
+    unsigned int circuits;
+    double rate;
+    unsigned int requests;
+    double think_ms;
+    size_dist sizes;
+    unsigned int duration;
+    unsigned int timeout;
+    unsigned int interval_ms;
+    pid_t pid;
+    const char *metrics;
+    const char *output;
+
+    std::mt19937 rng;
+    uint64_t start;
+    double open_credit;
+    uint64_t last_credit;
+    bool ending;
+    unsigned int next_serial;
+
+    vector<load_circuit *> live;
+    vector<load_circuit *> done;
+    unsigned long established;
+    unsigned long failures[F_N];
+    uint64_t bytes;
+
+    /* previous /proc sample, for the CPU rate */
+    uint64_t last_cpu_ticks;
+    uint64_t last_cpu_at;
+    /* latest answer of the metrics listener, -1 if none */
+    long st_circuits, st_connections, st_memory;
+    vector<load_sample> samples;
+  };
+}
+
+static void circuit_open(load_state *st);
+static void circuit_request(load_circuit *c);
+
+static uint64_t
+draw_size(load_state *st)
+{
+  const size_dist &d = st->sizes;
+  switch (d.kind) {
+  case size_dist::FIXED:
+    return (uint64_t)d.a;
+  case size_dist::UNIFORM:
+    return std::uniform_int_distribution<uint64_t>((uint64_t)d.a,
+                                                   (uint64_t)d.b)(st->rng);
+  case size_dist::PARETO: {
+    double u = std::uniform_real_distribution<double>(0, 1)(st->rng);
+    return (uint64_t)std::min(d.cap, d.a / pow(1 - u, 1 / d.b));
+  }
+  }
+  return 0;
+}
+
+static bool
+parse_sizes(const char *spec, size_dist *d)
+{
+  double a = 0, b = 0, cap = 16 * 1024 * 1024;
+  if (sscanf(spec, "fixed:%lf", &a) == 1 && a >= 1) {
+    d->kind = size_dist::FIXED;
+  } else if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 &&
+             a >= 1 && b >= a) {
+    d->kind = size_dist::UNIFORM;
+  } else if (sscanf(spec, "pareto:%lf:%lf:%lf", &a, &b, &cap) >= 2 &&
+             a >= 1 && b > 0 && cap >= a) {
+    d->kind = size_dist::PARETO;
+  } else {
+    return false;
+  }
+  d->a = a;
+  d->b = b;
+  d->cap = cap;
+  return true;
+}
+
+/* Circuits */
+
+static void
+circuit_finish(load_circuit *c, failure why)
+{
+  load_state *st = c->st;
+  c->why = why;
+  c->closed = latency_now();
+  if (c->state == load_circuit::REQUESTING && c->request_start)
+    c->busy += c->closed - c->request_start;
+  st->failures[why]++;
+  if (c->bev)
+    bufferevent_free(c->bev);
+  c->bev = NULL;
+  if (c->think_timer)
+    event_free(c->think_timer);
+  c->think_timer = NULL;
+  st->live.erase(std::find(st->live.begin(), st->live.end(), c));
+  st->done.push_back(c);
+  // open_timer_cb replaces it
+}
+
+static void
+circuit_think_cb(evutil_socket_t, short, void *arg)
+{
+  circuit_request((load_circuit *)arg);
+}
+
+static void
+circuit_next(load_circuit *c)
+{
+  load_state *st = c->st;
+  if (c->requests_left == 0) {
+    circuit_finish(c, F_NONE);
+    return;
+  }
+  if (st->think_ms <= 0) {
+    circuit_request(c);
+    return;
+  }
+
+  double ms = std::exponential_distribution<double>(1 / st->think_ms)(st->rng);
+  struct timeval tv;
+  tv.tv_sec = (long)(ms / 1000);
+  tv.tv_usec = (long)fmod(ms * 1000, 1000000);
+  c->state = load_circuit::THINKING;
+  bufferevent_set_timeouts(c->bev, NULL, NULL);
+  evtimer_add(c->think_timer, &tv);
+}
+
+static void
+circuit_request(load_circuit *c)
+{
+  load_state *st = c->st;
+  uint64_t size = draw_size(st);
+  uint8_t req[8];
+  for (int i = 0; i < 8; i++)
+    req[i] = (size >> (56 - 8 * i)) & 0xFF;
+  struct timeval tv = { (long)st->timeout, 0 };
+  bufferevent_set_timeouts(c->bev, &tv, &tv);
+
+  c->state = load_circuit::REQUESTING;
+  c->want = size;
+  c->requests_left--;
+  c->request_start = latency_now();
+  bufferevent_write(c->bev, req, sizeof req);
+}
+
+static void
+circuit_read_cb(struct bufferevent *bev, void *arg)
+{
+  load_circuit *c = (load_circuit *)arg;
+  load_state *st = c->st;
+  struct evbuffer *in = bufferevent_get_input(bev);
+
+  if (c->state == load_circuit::GREETING) {
+    uint8_t m[2];
+    if (evbuffer_get_length(in) < 2)
+      return;
+    evbuffer_remove(in, m, 2);
+    if (m[0] != SOCKS5_VERSION || m[1] != SOCKS5_METHOD_NOAUTH) {
+      circuit_finish(c, F_SOCKS);
+      return;
+    }
+
+    // CONNECT to the upstream address; chop ignores it
+    uint8_t r[22] = { SOCKS5_VERSION, SOCKS5_CMD_CONNECT, 0 };
+    size_t n;
+    const struct sockaddr *sa = st->upstream_addr->ai_addr;
+    if (sa->sa_family == AF_INET) {
+      const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+      r[3] = SOCKS5_ATYP_IPV4;
+      memcpy(r + 4, &sin->sin_addr, 4);
+      memcpy(r + 8, &sin->sin_port, 2);
+      n = 10;
+    } else {
+      const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+      r[3] = SOCKS5_ATYP_IPV6;
+      memcpy(r + 4, &sin6->sin6_addr, 16);
+      memcpy(r + 20, &sin6->sin6_port, 2);
+      n = 22;
+    }
+    bufferevent_write(bev, r, n);
+    c->state = load_circuit::REPLY;
+    return;
+  }
+
+  if (c->state == load_circuit::REPLY) {
+    uint8_t *m = evbuffer_pullup(in, 5);
+    if (!m)
+      return;
+    if (m[0] != SOCKS5_VERSION || m[1] != SOCKS5_SUCCESS) {
+      circuit_finish(c, F_SOCKS);
+      return;
+    }
+    size_t n = m[3] == SOCKS5_ATYP_IPV4 ? 10
+      : m[3] == SOCKS5_ATYP_IPV6 ? 22
+      : 7 + m[4];
+    if (evbuffer_get_length(in) < n)
+      return;
+    evbuffer_drain(in, n);
+    c->established = latency_now();
+    st->established++;
+    circuit_request(c);
+    return;
+  }
+
+  size_t avail = evbuffer_get_length(in);
+  if (c->state != load_circuit::REQUESTING || avail > c->want) {
+    // more than was asked for; the tunnel mixed something up
+    circuit_finish(c, F_EOF);
+    return;
+  }
+  evbuffer_drain(in, avail);
+  c->want -= avail;
+  c->bytes += avail;
+  st->bytes += avail;
+  if (c->want == 0) {
+    c->busy += latency_now() - c->request_start;
+    c->request_start = 0;
+    circuit_next(c);
+  }
+}
+
+static void
+circuit_event_cb(struct bufferevent *, short what, void *arg)
+{
+  load_circuit *c = (load_circuit *)arg;
+
+  if (what & BEV_EVENT_CONNECTED) {
+    uint8_t m[3] = { SOCKS5_VERSION, 1, SOCKS5_METHOD_NOAUTH };
+    c->connected = true;
+    bufferevent_write(c->bev, m, sizeof m);
+    return;
+  }
+  if (!c->connected)
+    circuit_finish(c, F_CONNECT);
+  else if (what & BEV_EVENT_TIMEOUT)
+    circuit_finish(c, F_TIMEOUT);
+  else if (!c->established)
+    circuit_finish(c, F_SOCKS);
+  else if (what & BEV_EVENT_ERROR)
+    circuit_finish(c, F_RESET);
+  else
+    circuit_finish(c, F_EOF);
+}
+
+static void
+circuit_open(load_state *st)
+{
+  load_circuit *c = new load_circuit();
+  c->st = st;
+  c->serial = ++st->next_serial;
+  c->state = load_circuit::GREETING;
+  c->requests_left = st->requests;
+  c->opened = latency_now();
+  c->think_timer = evtimer_new(st->base, circuit_think_cb, c);
+  c->bev = bufferevent_socket_new(st->base, -1, BEV_OPT_CLOSE_ON_FREE);
+  st->live.push_back(c);
+
+  if (!c->bev || !c->think_timer) {
+    fprintf(stderr, "creating circuit %u: %s\n", c->serial, strerror(errno));
+    circuit_finish(c, F_CONNECT);
+    return;
+  }
+  struct timeval tv = { (long)st->timeout, 0 };
+  bufferevent_set_timeouts(c->bev, &tv, &tv);
+  bufferevent_setcb(c->bev, circuit_read_cb, NULL, circuit_event_cb, c);
+  bufferevent_enable(c->bev, EV_READ|EV_WRITE);
+  if (bufferevent_socket_connect(c->bev, st->socks_addr->ai_addr,
+                                 st->socks_addr->ai_addrlen) < 0)
+    circuit_finish(c, F_CONNECT);
+}
+
+/* Every 10 ms, top the circuits up, as far as the rate allows. */
+static void
+open_timer_cb(evutil_socket_t, short, void *arg)
+{
+  load_state *st = (load_state *)arg;
+  uint64_t now = latency_now();
+  if (st->rate > 0)
+    st->open_credit = std::min(st->open_credit + st->rate *
+                               (now - st->last_credit) / 1e6,
+                               (double)st->circuits);
+  else
+    st->open_credit = st->circuits;
+  st->last_credit = now;
+  while (st->open_credit >= 1 && st->live.size() < st->circuits) {
+    st->open_credit -= 1;
+    circuit_open(st);
+  }
+}
+
+/* The upstream end */
+
+static void
+upstream_fill(upstream_conn *u)
+{
+  static const char pattern[] = "0123456789abcdef";
+  static char chunk[c_UPSTREAM_CHUNK];
+  if (!chunk[0])
+    for (size_t i = 0; i < sizeof chunk; i++)
+      chunk[i] = pattern[i % 16];
+
+  struct evbuffer *out = bufferevent_get_output(u->bev);
+  while (u->owed && evbuffer_get_length(out) < c_UPSTREAM_CHUNK) {
+    size_t n = std::min((uint64_t)sizeof chunk, u->owed);
+    evbuffer_add(out, chunk, n);
+    u->owed -= n;
+  }
+}
+
+static void
+upstream_free(upstream_conn *u)
+{
+  bufferevent_free(u->bev);
+  delete u;
+}
+
+static void
+upstream_read_cb(struct bufferevent *bev, void *arg)
+{
+  upstream_conn *u = (upstream_conn *)arg;
+  struct evbuffer *in = bufferevent_get_input(bev);
+  uint8_t req[8];
+  while (evbuffer_get_length(in) >= sizeof req) {
+    evbuffer_remove(in, req, sizeof req);
+    uint64_t n = 0;
+    for (size_t i = 0; i < sizeof req; i++)
+      n = (n << 8) | req[i];
+    u->owed += n;
+  }
+  upstream_fill(u);
+}
+
+static void
+upstream_write_cb(struct bufferevent *, void *arg)
+{
+  upstream_fill((upstream_conn *)arg);
+}
+
+static void
+upstream_event_cb(struct bufferevent *, short, void *arg)
+{
+  // EOF or error: the circuit is done with us
+  upstream_free((upstream_conn *)arg);
+}
+
+static void
+upstream_accept_cb(struct evconnlistener *, evutil_socket_t fd,
+                   struct sockaddr *, int, void *arg)
+{
+  load_state *st = (load_state *)arg;
+  upstream_conn *u = new upstream_conn();
+  u->bev = bufferevent_socket_new(st->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  if (!u->bev) {
+    evutil_closesocket(fd);
+    delete u;
+    return;
+  }
+  bufferevent_setcb(u->bev, upstream_read_cb, upstream_write_cb,
+                    upstream_event_cb, u);
+  bufferevent_setwatermark(u->bev, EV_WRITE, c_UPSTREAM_CHUNK / 2, 0);
+  bufferevent_enable(u->bev, EV_READ|EV_WRITE);
+}
+
+/* Sampling */
+
+/* CPU ticks (user + system) and resident KB of process PID, from
+   /proc.  Returns false if it cannot be read. */
+static bool
+read_proc(pid_t pid, uint64_t *ticks, long *rss_kb)
+{
+  char path[64], buf[1024];
+  xsnprintf(path, sizeof path, "/proc/%ld/stat", (long)pid);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+  size_t n = fread(buf, 1, sizeof buf - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+
+  // fields 14 and 15, counting from the pid; the command name in
+  // parentheses may contain spaces
+  char *p = strrchr(buf, ')');
+  unsigned long utime, stime;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                   "%lu %lu", &utime, &stime) != 2)
+    return false;
+  *ticks = utime + stime;
+
+  *rss_kb = -1;
+  xsnprintf(path, sizeof path, "/proc/%ld/status", (long)pid);
+  if ((f = fopen(path, "r"))) {
+    while (fgets(buf, sizeof buf, f))
+      if (sscanf(buf, "VmRSS: %ld", rss_kb) == 1)
+        break;
+    fclose(f);
+  }
+  return true;
+}
+
+static void
+metrics_read_cb(struct bufferevent *, void *)
+{
+  // read it all at EOF
+}
+
+static void
+metrics_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+  load_state *st = (load_state *)arg;
+  if (what & BEV_EVENT_CONNECTED)
+    return;
+  if (what & BEV_EVENT_EOF) {
+    struct evbuffer *in = bufferevent_get_input(bev);
+    size_t n = evbuffer_get_length(in);
+    string text(n ? (const char *)evbuffer_pullup(in, n) : "", n);
+    size_t pos = 0;
+    while (pos < text.size()) {
+      size_t eol = text.find('\n', pos);
+      if (eol == string::npos)
+        eol = text.size();
+      string line = text.substr(pos, eol - pos);
+      long v;
+      if (sscanf(line.c_str(), "circuits_active %ld", &v) == 1)
+        st->st_circuits = v;
+      else if (sscanf(line.c_str(), "connections_active %ld", &v) == 1)
+        st->st_connections = v;
+      else if (sscanf(line.c_str(), "memory_in_use_bytes %ld", &v) == 1)
+        st->st_memory = v;
+      pos = eol + 1;
+    }
+  }
+  bufferevent_free(bev);
+}
+
+static void
+metrics_fetch(load_state *st)
+{
+  struct evutil_addrinfo *ai = resolve_address_port(st->metrics, 1, 0, NULL);
+  if (!ai)
+    return;
+  struct bufferevent *bev =
+    bufferevent_socket_new(st->base, -1, BEV_OPT_CLOSE_ON_FREE);
+  if (bev) {
+    bufferevent_setcb(bev, metrics_read_cb, NULL, metrics_event_cb, st);
+    bufferevent_enable(bev, EV_READ);
+    if (bufferevent_socket_connect(bev, ai->ai_addr, ai->ai_addrlen) < 0)
+      bufferevent_free(bev);
+  }
+  evutil_freeaddrinfo(ai);
+}
+
+static void
+sample_timer_cb(evutil_socket_t, short, void *arg)
+{
+  load_state *st = (load_state *)arg;
+  uint64_t now = latency_now();
+  load_sample s;
+  s.t = (now - st->start) / 1e6;
+  s.open = st->live.size();
+  s.established = st->established;
+  s.completed = st->failures[F_NONE];
+  s.failed = 0;
+  for (int i = F_CONNECT; i < F_CUT; i++)
+    s.failed += st->failures[i];
+  s.bytes = st->bytes;
+  s.cpu_pct = -1;
+  s.rss_kb = -1;
+
+  uint64_t ticks;
+  if (st->pid && read_proc(st->pid, &ticks, &s.rss_kb)) {
+    if (st->last_cpu_at)
+      s.cpu_pct = 100.0 * (ticks - st->last_cpu_ticks) / sysconf(_SC_CLK_TCK)
+        / ((now - st->last_cpu_at) / 1e6);
+    st->last_cpu_ticks = ticks;
+    st->last_cpu_at = now;
+  }
+  // the metrics answer arrives later; report the previous one
+  s.st_circuits = st->st_circuits;
+  s.st_connections = st->st_connections;
+  s.st_memory = st->st_memory;
+  if (st->metrics)
+    metrics_fetch(st);
+
+  st->samples.push_back(s);
+  fprintf(stderr, "t=%.1fs open=%lu completed=%lu failed=%lu "
+          "bytes=%llu cpu=%.0f%% rss=%ldKB st_circuits=%ld st_conns=%ld\n",
+          s.t, (unsigned long)s.open, s.completed, s.failed,
+          (unsigned long long)s.bytes, s.cpu_pct, s.rss_kb,
+          s.st_circuits, s.st_connections);
+}
+
+static void
+end_timer_cb(evutil_socket_t, short, void *arg)
+{
+  load_state *st = (load_state *)arg;
+  // a last sample, unless the sample timer has just taken one
+  if (st->samples.empty() ||
+      (latency_now() - st->start) / 1e6 - st->samples.back().t >
+      st->interval_ms / 2000.0)
+    sample_timer_cb(-1, 0, st);
+  st->ending = true;
+  while (!st->live.empty())
+    circuit_finish(st->live.back(), F_CUT);
+  event_del(st->open_timer);
+  event_del(st->sample_timer);
+  event_base_loopexit(st->base, NULL);
+}
+
+/* Report */
+
+static uint64_t
+percentile(vector<double> &v, double p)
+{
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  return (uint64_t)v[std::min(v.size() - 1, (size_t)(v.size() * p / 100))];
+}
+
+static void
+write_report(load_state *st, FILE *out)
+{
+  vector<double> goodput, setup;
+  for (vector<load_circuit *>::iterator i = st->done.begin();
+       i != st->done.end(); ++i) {
+    load_circuit *c = *i;
+    if (c->busy && c->bytes)
+      goodput.push_back(c->bytes / (c->busy / 1e6));
+    if (c->established)
+      setup.push_back((c->established - c->opened) / 1e3);
+  }
+
+  fprintf(out, "{\n  \"circuits\": %u, \"rate\": %g, \"requests\": %u, "
+          "\"think_ms\": %g, \"duration\": %u,\n",
+          st->circuits, st->rate, st->requests, st->think_ms, st->duration);
+  fprintf(out, "  \"opened\": %lu, \"established\": %lu, \"bytes\": %llu,\n",
+          (unsigned long)st->done.size(), st->established,
+          (unsigned long long)st->bytes);
+  fprintf(out, "  \"outcomes\": {");
+  for (int i = 0; i < F_N; i++)
+    fprintf(out, "%s\"%s\": %lu", i ? ", " : "",
+            i == F_NONE ? "completed" : failure_names[i], st->failures[i]);
+  fprintf(out, "},\n");
+  fprintf(out, "  \"goodput_Bps\": {\"p5\": %llu, \"p50\": %llu, "
+          "\"p95\": %llu},\n",
+          (unsigned long long)percentile(goodput, 5),
+          (unsigned long long)percentile(goodput, 50),
+          (unsigned long long)percentile(goodput, 95));
+  fprintf(out, "  \"setup_ms\": {\"p50\": %llu, \"p99\": %llu},\n",
+          (unsigned long long)percentile(setup, 50),
+          (unsigned long long)percentile(setup, 99));
+
+  fprintf(out, "  \"samples\": [\n");
+  for (size_t i = 0; i < st->samples.size(); i++) {
+    const load_sample &s = st->samples[i];
+    fprintf(out, "    {\"t\": %.1f, \"open\": %lu, \"established\": %lu, "
+            "\"completed\": %lu, \"failed\": %lu, \"bytes\": %llu, "
+            "\"cpu_pct\": %.1f, \"rss_kb\": %ld, \"st_circuits\": %ld, "
+            "\"st_connections\": %ld, \"st_memory\": %ld}%s\n",
+            s.t, (unsigned long)s.open, s.established, s.completed,
+            s.failed, (unsigned long long)s.bytes, s.cpu_pct, s.rss_kb,
+            s.st_circuits, s.st_connections, s.st_memory,
+            i + 1 < st->samples.size() ? "," : "");
+  }
+  fprintf(out, "  ],\n");
+
+  // serial, bytes, lifetime ms, goodput B/s, outcome
+  fprintf(out, "  \"per_circuit\": [\n");
+  for (size_t i = 0; i < st->done.size(); i++) {
+    const load_circuit *c = st->done[i];
+    fprintf(out, "    [%u, %llu, %.1f, %.0f, \"%s\"]%s\n", c->serial,
+            (unsigned long long)c->bytes, (c->closed - c->opened) / 1e3,
+            c->busy ? c->bytes / (c->busy / 1e6) : 0.0,
+            c->why == F_NONE ? "completed" : failure_names[c->why],
+            i + 1 < st->done.size() ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [options] SOCKS-ADDR UPSTREAM-ADDR\n"
+          "  --circuits N    circuits to keep open (default 100)\n"
+          "  --rate R        circuits to open per second, 0 = refill at "
+          "once (default 0)\n"
+          "  --requests N    requests per circuit (default 10)\n"
+          "  --think MS      mean think time between requests (default 0)\n"
+          "  --sizes SPEC    fixed:N, uniform:MIN:MAX or "
+          "pareto:MIN:ALPHA[:CAP]\n"
+          "                  (default pareto:4096:1.2)\n"
+          "  --duration S    run for S seconds (default 30)\n"
+          "  --timeout S     fail a circuit after S idle seconds "
+          "(default 30)\n"
+          "  --interval MS   sampling interval (default 1000)\n"
+          "  --pid PID       sample CPU and memory of this process\n"
+          "  --metrics ADDR  sample this metrics listener\n"
+          "  --seed N        seed for sizes and think times (default 1)\n"
+          "  --output FILE   write the report here, not to stdout\n",
+          name);
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const struct option options[] = {
+    { "circuits", required_argument, NULL, 'n' },
+    { "rate",     required_argument, NULL, 'r' },
+    { "requests", required_argument, NULL, 'q' },
+    { "think",    required_argument, NULL, 'k' },
+    { "sizes",    required_argument, NULL, 's' },
+    { "duration", required_argument, NULL, 'd' },
+    { "timeout",  required_argument, NULL, 't' },
+    { "interval", required_argument, NULL, 'i' },
+    { "pid",      required_argument, NULL, 'p' },
+    { "metrics",  required_argument, NULL, 'm' },
+    { "seed",     required_argument, NULL, 'S' },
+    { "output",   required_argument, NULL, 'o' },
+    { "help",     no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  char *name = strrchr(argv[0], '/');
+  name = name ? name+1 : argv[0];
+
+  load_state *st = new load_state();
+  st->circuits = 100;
+  st->requests = 10;
+  st->duration = 30;
+  st->timeout = 30;
+  st->interval_ms = 1000;
+  st->st_circuits = st->st_connections = st->st_memory = -1;
+  parse_sizes("pareto:4096:1.2", &st->sizes);
+  unsigned long seed = 1;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'n': st->circuits = strtoul(optarg, NULL, 10); break;
+    case 'r': st->rate = strtod(optarg, NULL); break;
+    case 'q': st->requests = strtoul(optarg, NULL, 10); break;
+    case 'k': st->think_ms = strtod(optarg, NULL); break;
+    case 's':
+      if (!parse_sizes(optarg, &st->sizes))
+        usage(name);
+      break;
+    case 'd': st->duration = strtoul(optarg, NULL, 10); break;
+    case 't': st->timeout = strtoul(optarg, NULL, 10); break;
+    case 'i': st->interval_ms = strtoul(optarg, NULL, 10); break;
+    case 'p': st->pid = strtol(optarg, NULL, 10); break;
+    case 'm': st->metrics = optarg; break;
+    case 'S': seed = strtoul(optarg, NULL, 10); break;
+    case 'o': st->output = optarg; break;
+    default: usage(name);
+    }
+  }
+  if (argc - optind != 2 || !st->circuits || !st->requests ||
+      !st->duration || !st->timeout || !st->interval_ms || st->rate < 0)
+    usage(name);
+  st->rng.seed(seed);
+
+  st->socks_addr = resolve_address_port(argv[optind], 1, 0, NULL);
+  st->upstream_addr = resolve_address_port(argv[optind + 1], 1, 1, NULL);
+  if (!st->socks_addr || !st->upstream_addr) {
+    fprintf(stderr, "%s: cannot parse address\n", name);
+    return 2;
+  }
+
+  FILE *out = stdout;
+  if (st->output && !(out = fopen(st->output, "w"))) {
+    fprintf(stderr, "%s: %s\n", st->output, strerror(errno));
+    return 1;
+  }
+
+  st->base = event_base_new();
+  if (!st->base) {
+    fprintf(stderr, "creating event base: %s\n", strerror(errno));
+    return 1;
+  }
+  st->listener =
+    evconnlistener_new_bind(st->base, upstream_accept_cb, st,
+                            LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+                            st->upstream_addr->ai_addr,
+                            st->upstream_addr->ai_addrlen);
+  if (!st->listener) {
+    fprintf(stderr, "listening on %s: %s\n", argv[optind + 1],
+            evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    return 1;
+  }
+
+  st->start = st->last_credit = latency_now();
+  struct timeval tv;
+  st->open_timer = event_new(st->base, -1, EV_PERSIST, open_timer_cb, st);
+  tv.tv_sec = 0;
+  tv.tv_usec = 10000;
+  evtimer_add(st->open_timer, &tv);
+  if (st->rate == 0)
+    open_timer_cb(-1, 0, st);
+  st->sample_timer = event_new(st->base, -1, EV_PERSIST, sample_timer_cb, st);
+  tv.tv_sec = st->interval_ms / 1000;
+  tv.tv_usec = (st->interval_ms % 1000) * 1000;
+  evtimer_add(st->sample_timer, &tv);
+  st->end_timer = evtimer_new(st->base, end_timer_cb, st);
+  tv.tv_sec = st->duration;
+  tv.tv_usec = 0;
+  evtimer_add(st->end_timer, &tv);
+
+  event_base_dispatch(st->base);
+
+  write_report(st, out);
+  if (out != stdout)
+    fclose(out);
+
+  for (size_t i = 0; i < st->done.size(); i++)
+    delete st->done[i];
+  event_free(st->open_timer);
+  event_free(st->sample_timer);
+  event_free(st->end_timer);
+  evconnlistener_free(st->listener);
+  evutil_freeaddrinfo(st->socks_addr);
+  evutil_freeaddrinfo(st->upstream_addr);
+  event_base_free(st->base);
+  delete st;
+  return 0;
+}
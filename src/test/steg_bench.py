@@ -0,0 +1,401 @@
+# Copyright 2014 SRI International
+# See LICENSE for other credits and copying information
+
+# Loopback benchmark of the steg modules.
+#
+# For each steg module this starts one stegotorus running both a chop
+# client and a chop server over that module on 127.0.0.1, as the
+# integration tests do, with a local HTTP server standing in for the
+# cover server and an upstream server that answers every request with
+# as many bytes as it asks for.  It then downloads files through the
+# tunnel one after another: first a run of fixed-size files, then a
+# run of sizes drawn from a Pareto distribution, as web objects are.
+#
+# For each module and run it reports, as JSON:
+#
+#   throughput_Bps   - bytes downloaded per second of the whole run
+#   ttfb_ms          - p50 and p99 of the time from connecting to the
+#                      first byte of the answer
+#   latency_ms       - p50 and p99 of the time from connecting to the
+#                      last byte of the answer
+#   cover_efficiency - covert bytes carried per byte on the wire, from
+#                      the steg_data_bytes_sent and steg_cover_bytes_sent
+#                      metrics (both directions)
+#   failed           - downloads that did not complete in time
+#
+# If stegotorus dies (e.g. embed without traces/embed.txt), the module
+# is reported with the runs it finished, an "error" with the last
+# [error] line it logged, and where its log is.  Nothing here needs a
+# network, Tor or root; "make bench" runs it on a freshly built tree.
+
+from __future__ import division, print_function
+
+import argparse
+import json
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+try:
+    from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+    from SocketServer import ThreadingMixIn
+except ImportError:
+    from http.server import BaseHTTPRequestHandler, HTTPServer
+    from socketserver import ThreadingMixIn
+
+STEGS = ("nosteg", "nosteg_rr", "http", "http_apache", "embed")
+
+STARTUP_TIMEOUT = 60    # seconds, loading the http traces is slow
+TRANSFER_TIMEOUT = 30   # seconds, per download
+
+# Helper: a port nobody is listening on right now.
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+def percentile(values, p):
+    if not values:
+        return None
+    v = sorted(values)
+    return round(v[min(len(v) - 1, int(len(v) * p / 100.0))], 1)
+
+# The cover server stand-in: a few HTML pages and scripts with room
+# for the HTML and JavaScript steg modules to hide data in.
+
+class CoverServer(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+    pages = {}
+
+    @classmethod
+    def make_pages(cls, n, rng):
+        hexdigits = "0123456789abcdef"
+        for i in range(n):
+            js = "".join("var v%d = 0x%s;\n" %
+                         (j, "".join(rng.choice(hexdigits)
+                                     for _ in range(16)))
+                         for j in range(200 + 100 * i))
+            cls.pages["/cover%d.js" % i] = ("application/javascript", js)
+            cls.pages["/cover%d.html" % i] = (
+                "text/html",
+                "<html><head><title>cover %d</title>\n"
+                "<script type=\"text/javascript\">\n%s</script>\n"
+                "</head><body><p>cover page %d</p></body></html>\n"
+                % (i, js, i))
+
+class CoverHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        page = CoverServer.pages.get(self.path.split("?")[0])
+        if page is None:
+            self.send_error(404)
+            return
+        body = page[1].encode("ascii")
+        self.send_response(200)
+        self.send_header("Content-Type", page[0])
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+# The upstream end of the tunnel: reads an 8-byte size and sends back
+# that many bytes.
+
+class Upstream(threading.Thread):
+    chunk = b"0123456789abcdef" * 4096
+
+    def __init__(self):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.sock = socket.socket()
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.listen(16)
+        self.port = self.sock.getsockname()[1]
+
+    def run(self):
+        while True:
+            c, _ = self.sock.accept()
+            t = threading.Thread(target=self.serve, args=(c,))
+            t.daemon = True
+            t.start()
+
+    def serve(self, c):
+        try:
+            req = b""
+            while len(req) < 8:
+                d = c.recv(8 - len(req))
+                if not d:
+                    return
+                req += d
+            n = struct.unpack("!Q", req)[0]
+            while n > 0:
+                sent = c.send(self.chunk[:n])
+                n -= sent
+            c.shutdown(socket.SHUT_WR)
+            while c.recv(4096):
+                pass
+        except socket.error:
+            pass
+        finally:
+            c.close()
+
+# One download through the tunnel.  Returns (ttfb, total) in seconds,
+# or None if it did not complete.
+
+def download(port, size):
+    t0 = time.time()
+    ttfb = None
+    got = 0
+    try:
+        c = socket.create_connection(("127.0.0.1", port), TRANSFER_TIMEOUT)
+    except socket.error:
+        return None
+    try:
+        c.sendall(struct.pack("!Q", size))
+        deadline = t0 + TRANSFER_TIMEOUT
+        while got < size:
+            c.settimeout(max(0.01, deadline - time.time()))
+            d = c.recv(65536)
+            if not d:
+                break
+            if ttfb is None:
+                ttfb = time.time() - t0
+            got += len(d)
+    except socket.error:
+        pass
+    finally:
+        c.close()
+    if got < size:
+        return None
+    return (ttfb, time.time() - t0)
+
+def fetch_metrics(port):
+    m = socket.create_connection(("127.0.0.1", port), 5)
+    text = b""
+    while True:
+        d = m.recv(65536)
+        if not d:
+            break
+        text += d
+    m.close()
+    values = {}
+    for line in text.decode("ascii", "replace").split("\n"):
+        parts = line.rsplit(" ", 1)
+        if len(parts) == 2:
+            try:
+                values[parts[0]] = int(parts[1])
+            except ValueError:
+                pass
+    return values
+
+# Stegotorus running both ends of a chop circuit over one steg module.
+
+class Tunnel(object):
+    def __init__(self, args, steg, upstream_port, cover_port, workdir):
+        self.steg = steg
+        self.client_port = free_port()
+        self.metrics_port = free_port()
+        steg_addr = "127.0.0.1:%d" % free_port()
+        server = ["chop", "server"]
+        steg_opts = []
+        if steg == "http_apache":
+            server += ["--cover-server", "127.0.0.1:%d" % cover_port]
+            steg_opts = ["--cover-list", "cover_list.txt"]
+        argv = [os.path.abspath(args.stegotorus),
+                "--log-min-severity=warn",
+                "--metrics-address=127.0.0.1:%d" % self.metrics_port]
+        argv += server + ["127.0.0.1:%d" % upstream_port,
+                          steg, steg_addr] + steg_opts
+        argv += ["chop", "client", "127.0.0.1:%d" % self.client_port,
+                 steg, steg_addr]
+
+        self.log = open(os.path.join(workdir, steg + ".log"), "w")
+        self.proc = subprocess.Popen(argv, cwd=workdir,
+                                     stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE,
+                                     stderr=self.log,
+                                     close_fds=True)
+        # stegotorus closes its stdout once it is listening
+        timer = threading.Timer(STARTUP_TIMEOUT, self.stop)
+        timer.start()
+        self.proc.stdout.read()
+        timer.cancel()
+
+    def running(self):
+        return self.proc.poll() is None
+
+    def exit_report(self):
+        self.log.flush()
+        last = ""
+        with open(self.log.name) as f:
+            for line in f:
+                if line.startswith("[error]"):
+                    last = line.strip()
+        return ("stegotorus exited with status %d%s"
+                % (self.proc.returncode, last and ": " + last))
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.terminate()
+            self.proc.wait()
+        self.log.close()
+
+def cover_figures(before, after, steg):
+    data = cover = 0
+    for k, v in after.items():
+        if k == 'steg_data_bytes_sent{steg="%s"}' % steg:
+            data = v - before.get(k, 0)
+        elif k == 'steg_cover_bytes_sent{steg="%s"}' % steg:
+            cover = v - before.get(k, 0)
+    return data / cover if cover else None
+
+def run_workload(tunnel, name, sizes):
+    before = fetch_metrics(tunnel.metrics_port)
+    ttfbs, latencies = [], []
+    failed = done = 0
+    start = time.time()
+    for size in sizes:
+        r = download(tunnel.client_port, size)
+        if r is None:
+            failed += 1
+            if not tunnel.running():
+                break
+            continue
+        done += size
+        ttfbs.append(r[0] * 1000)
+        latencies.append(r[1] * 1000)
+    elapsed = time.time() - start
+    result = {
+        "workload": name,
+        "transfers": len(sizes),
+        "failed": failed,
+        "bytes": done,
+        "throughput_Bps": int(done / elapsed) if elapsed > 0 else None,
+        "ttfb_ms": {"p50": percentile(ttfbs, 50),
+                    "p99": percentile(ttfbs, 99)},
+        "latency_ms": {"p50": percentile(latencies, 50),
+                       "p99": percentile(latencies, 99)},
+    }
+    if tunnel.running():
+        efficiency = cover_figures(before, fetch_metrics(tunnel.metrics_port),
+                                   tunnel.steg)
+        result["cover_efficiency"] = efficiency and round(efficiency, 3)
+    return result
+
+def prepare_workdir(args, steg, cover_port):
+    workdir = tempfile.mkdtemp(prefix="steg_bench_%s_" % steg,
+                               dir=args.workdir)
+    if args.traces:
+        os.symlink(os.path.abspath(args.traces),
+                   os.path.join(workdir, "traces"))
+    os.mkdir(os.path.join(workdir, "apache_payload"))
+    with open(os.path.join(workdir, "cover_list.txt"), "w") as f:
+        for path in sorted(CoverServer.pages):
+            f.write("http://127.0.0.1:%d%s\n" % (cover_port, path))
+    return workdir
+
+def bench_steg(args, steg, upstream, cover_port, rng):
+    fixed = [args.size] * args.transfers
+    pareto = [min(args.pareto_cap,
+                  int(args.pareto_min * rng.paretovariate(args.pareto_alpha)))
+              for _ in range(args.transfers)]
+
+    workdir = prepare_workdir(args, steg, cover_port)
+    tunnel = Tunnel(args, steg, upstream.port, cover_port, workdir)
+    entry = {"steg": steg, "runs": []}
+    try:
+        # the first circuit pays for handshakes and warm-up
+        if tunnel.running():
+            download(tunnel.client_port, 1024)
+        for name, sizes in (("fixed", fixed), ("pareto", pareto)):
+            if not tunnel.running():
+                break
+            entry["runs"].append(run_workload(tunnel, name, sizes))
+        if not tunnel.running():
+            entry["error"] = tunnel.exit_report()
+    except socket.error as e:
+        # most likely stegotorus has just died; give it time to exit
+        for _ in range(20):
+            if not tunnel.running():
+                break
+            time.sleep(0.05)
+        entry["error"] = (str(e) if tunnel.running()
+                          else tunnel.exit_report())
+    finally:
+        tunnel.stop()
+    if "error" in entry:
+        entry["log"] = os.path.join(workdir, steg + ".log")
+    if "error" not in entry and not args.keep:
+        shutil.rmtree(workdir, True)
+    return entry
+
+def main():
+    p = argparse.ArgumentParser(
+        description="Benchmark stegotorus steg modules over loopback.")
+    p.add_argument("--stegotorus", default="./stegotorus")
+    p.add_argument("--traces", default="traces",
+                   help="directory made by pgen_fake, for http")
+    p.add_argument("--steg", action="append", choices=STEGS,
+                   help="module to run (repeatable; default all)")
+    p.add_argument("--transfers", type=int, default=20,
+                   help="downloads per run")
+    p.add_argument("--size", type=int, default=256 * 1024,
+                   help="bytes per download in the fixed run")
+    p.add_argument("--pareto-min", type=int, default=4096)
+    p.add_argument("--pareto-alpha", type=float, default=1.2)
+    p.add_argument("--pareto-cap", type=int, default=4 * 1024 * 1024)
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("--output", help="write the JSON here, not stdout")
+    p.add_argument("--workdir", help="where to put scratch directories")
+    p.add_argument("--keep", action="store_true",
+                   help="keep scratch directories and logs")
+    args = p.parse_args()
+
+    if not os.path.isdir(args.traces):
+        args.traces = None
+
+    rng = random.Random(args.seed)
+    CoverServer.make_pages(4, rng)
+    cover = CoverServer(("127.0.0.1", 0), CoverHandler)
+    t = threading.Thread(target=cover.serve_forever)
+    t.daemon = True
+    t.start()
+    upstream = Upstream()
+    upstream.start()
+
+    report = {"seed": args.seed,
+              "transfers": args.transfers,
+              "fixed_size": args.size,
+              "results": []}
+    for steg in args.steg or STEGS:
+        # every module gets the same sizes
+        entry = bench_steg(args, steg, upstream, cover.server_address[1],
+                           random.Random(args.seed))
+        report["results"].append(entry)
+        print("%-12s %s" % (steg, entry.get("error", "done")),
+              file=sys.stderr)
+
+    cover.shutdown()
+    text = json.dumps(report, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,520 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Speed of the file steg modules.  For every FileStegMod (js, html,
+   pdf, swf, jpg, png, gif) it times capacity, on the whole response,
+   and headless_capacity, on the body, of each cover, then for each
+   data size the cover can take, encode and decode the way
+   FileStegMod::http_server_transmit does: the body is copied into the
+   module's own output buffer and embedded there, and the data is
+   decoded from what encode left behind.  The copy is part of the
+   encode time.  Data that does not decode back to what went in counts
+   as a failure and is not timed.
+
+   The covers are the JPEG, PNG, GIF and SWF files in --covers (the
+   steg unit test covers; those without capacity, the corrupt ones,
+   are left out), which get an HTTP response header in front of them,
+   and the first --per-type HTML, JavaScript, PDF and SWF responses in
+   the --traces file, as written by pgen_fake.
+
+   Each call is repeated for --time ms per cover.  There is one line
+   per module, operation and data size, with the number of covers that
+   took part and that failed, the mean time per call over those covers
+   and the rate at which cover bytes and data bytes went through.  The
+   lines always come out in the same order, and given the output of an
+   earlier run as --baseline it adds how much slower (+) or faster (-)
+   each call has become.
+
+   usage: steg_mod_bench [options] */
+
+#include "util.h"
+#include "latency.h"
+#include "connections.h"
+#include "payload_server.h"
+
+#include "file_steg.h"
+#include "jsSteg.h"
+#include "htmlSteg.h"
+#include "pdfSteg.h"
+#include "swfSteg.h"
+#include "jpgSteg.h"
+#include "pngSteg.h"
+#include "gifSteg.h"
+#include "trace_payload_server.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <getopt.h>
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace {
+  const size_t c_DEFAULT_SIZES[] = { 16, 256, 1024, 4096, 16384, 65536 };
+  // JSSteg and HTMLSteg decode hex, two characters per byte, into a
+  // buffer of c_MAX_MSG_BUF_SIZE
+  const size_t c_MAX_DATA_SIZE = FileStegMod::c_MAX_MSG_BUF_SIZE / 2 - 16;
+
+  enum op_t { OP_CAPACITY, OP_HEADLESS, OP_ENCODE, OP_DECODE, OP_COUNT };
+  const char *const op_names[OP_COUNT] = {
+    "capacity", "headless", "encode", "decode"
+  };
+
+  /* The FileStegMod subclass M with its output buffer, which
+     http_server_transmit embeds into, within reach. */
+  template <class M>
+  class bench_mod : public M
+  {
+  public:
+    bench_mod() : M(NULL, 0) {}
+    uint8_t *buffer() { return this->outbuf; }
+  };
+
+  struct cover {
+    string name;
+    vector<char> response; // header and body, NUL terminated
+    size_t body_offset;
+
+    char *body() { return response.data() + body_offset; }
+    size_t body_len() const { return response.size() - 1 - body_offset; }
+  };
+
+  struct module {
+    const char *name;
+    FileStegMod *mod;
+    uint8_t *buf;
+    const char *extension; // of cover files, or NULL
+    const char *mime;      // Content-Type of trace covers, or NULL
+    vector<cover> covers;
+  };
+
+  struct result {
+    unsigned int covers;
+    unsigned int failed;
+    double ns_per_call_sum;
+    double cover_bytes;
+    double data_bytes;
+    double usecs;
+
+    result()
+      : covers(0), failed(0), ns_per_call_sum(0),
+        cover_bytes(0), data_bytes(0), usecs(0) {}
+  };
+
+  struct bench_options {
+    const char *covers_dir;
+    const char *traces;
+    const char *baseline;
+    unsigned int per_type;
+    uint64_t budget_us;
+    vector<size_t> sizes;
+  };
+}
+
+template <class M>
+static module
+make_module(const char *name, const char *extension, const char *mime)
+{
+  bench_mod<M> *m = new bench_mod<M>();
+  module md;
+  md.name = name;
+  md.mod = m;
+  md.buf = m->buffer();
+  md.extension = extension;
+  md.mime = mime;
+  return md;
+}
+
+static void
+add_cover(module &md, const string &name, const char *response, size_t len)
+{
+  if (len >= FileStegMod::c_HTTP_PAYLOAD_BUF_SIZE)
+    return;
+
+  cover c;
+  c.name = name;
+  c.response.assign(response, response + len);
+  c.response.push_back('\0');
+  const char *hend = strstr(c.response.data(), "\r\n\r\n");
+  if (!hend)
+    return;
+  c.body_offset = hend + 4 - c.response.data();
+
+  if (md.mod->headless_capacity(c.body(), c.body_len()) <= 0)
+    return;
+  md.covers.push_back(c);
+}
+
+static bool
+read_file(const string &path, string &out)
+{
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f)
+    return false;
+  char chunk[8192];
+  size_t n;
+  out.clear();
+  while ((n = fread(chunk, 1, sizeof chunk, f)) > 0)
+    out.append(chunk, n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+/* Every file in DIR whose name ends in one of the modules'
+   extensions, behind a made-up response header. */
+static void
+load_cover_files(const char *dir, vector<module> &mods)
+{
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+    return;
+  }
+
+  vector<string> names;
+  while (struct dirent *e = readdir(d))
+    names.push_back(e->d_name);
+  closedir(d);
+  std::sort(names.begin(), names.end());
+
+  for (size_t i = 0; i < names.size(); i++) {
+    for (size_t j = 0; j < mods.size(); j++) {
+      module &md = mods[j];
+      if (!md.extension)
+        continue;
+      size_t elen = strlen(md.extension);
+      if (names[i].size() <= elen ||
+          names[i].compare(names[i].size() - elen, elen, md.extension))
+        continue;
+
+      string body;
+      if (!read_file(string(dir) + "/" + names[i], body)) {
+        fprintf(stderr, "%s/%s: %s\n", dir, names[i].c_str(),
+                strerror(errno));
+        continue;
+      }
+      char hdr[256];
+      xsnprintf(hdr, sizeof hdr,
+                "HTTP/1.1 200 OK\r\nServer: Apache\r\n"
+                "Content-Length: %lu\r\nConnection: keep-alive\r\n\r\n",
+                (unsigned long)body.size());
+      string response = string(hdr) + body;
+      add_cover(md, names[i], response.data(), response.size());
+    }
+  }
+}
+
+/* The first PER_TYPE responses of each module's content type in a
+   trace file. */
+static void
+load_trace_covers(const char *fname, unsigned int per_type,
+                  vector<module> &mods)
+{
+  FILE *f = fopen(fname, "rb");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+    return;
+  }
+
+  vector<unsigned int> seen(mods.size());
+  vector<char> buf;
+  unsigned long n = 0;
+  pentry_header pentry;
+  while (fread(&pentry, sizeof pentry, 1, f) == 1) {
+    size_t len = ntohl(pentry.length);
+    buf.resize(len + 1);
+    if (fread(buf.data(), 1, len, f) != len)
+      break;
+    buf[len] = '\0';
+    n++;
+    if (ntohs(pentry.ptype) != TYPE_HTTP_RESPONSE)
+      continue;
+
+    const char *hend = strstr(buf.data(), "\r\n\r\n");
+    const char *ct = strstr(buf.data(), "Content-Type: ");
+    if (!hend || !ct || ct > hend)
+      continue;
+    ct += strlen("Content-Type: ");
+
+    for (size_t j = 0; j < mods.size(); j++) {
+      if (!mods[j].mime || seen[j] >= per_type ||
+          strncmp(ct, mods[j].mime, strlen(mods[j].mime)))
+        continue;
+      char name[64];
+      xsnprintf(name, sizeof name, "trace#%lu", n);
+      size_t before = mods[j].covers.size();
+      add_cover(mods[j], name, buf.data(), len);
+      seen[j] += mods[j].covers.size() - before;
+    }
+  }
+  fclose(f);
+}
+
+static void
+record(result &r, uint64_t usecs, unsigned long calls,
+       size_t cover_len, size_t data_len)
+{
+  r.covers++;
+  r.ns_per_call_sum += usecs * 1000.0 / calls;
+  r.cover_bytes += (double)cover_len * calls;
+  r.data_bytes += (double)data_len * calls;
+  r.usecs += usecs;
+}
+
+static void
+run_cover(module &md, cover &c, const bench_options &o,
+          const vector<uint8_t> &data, map<size_t, result> *res)
+{
+  FileStegMod *mod = md.mod;
+  uint64_t start, now;
+  unsigned long calls;
+
+  calls = 0;
+  start = latency_now();
+  do {
+    mod->capacity((const uint8_t *)c.response.data(), c.response.size() - 1);
+    calls++;
+  } while ((now = latency_now()) - start < o.budget_us);
+  record(res[OP_CAPACITY][0], now - start, calls, c.body_len(), 0);
+
+  calls = 0;
+  start = latency_now();
+  do {
+    mod->headless_capacity(c.body(), c.body_len());
+    calls++;
+  } while ((now = latency_now()) - start < o.budget_us);
+  record(res[OP_HEADLESS][0], now - start, calls, c.body_len(), 0);
+
+  ssize_t room = mod->headless_capacity(c.body(), c.body_len());
+  vector<uint8_t> recovered(FileStegMod::c_MAX_MSG_BUF_SIZE);
+
+  for (size_t i = 0; i < o.sizes.size(); i++) {
+    size_t size = o.sizes[i];
+    if ((ssize_t)size > room)
+      continue;
+
+    // make sure what is embedded comes back out before timing it
+    memcpy(md.buf, c.body(), c.body_len() + 1);
+    int stegged_len = mod->encode((uint8_t *)data.data(), size, md.buf,
+                                  c.body_len());
+    if (stegged_len < 0 ||
+        mod->decode(md.buf, stegged_len, recovered.data()) != (ssize_t)size ||
+        memcmp(recovered.data(), data.data(), size)) {
+      res[OP_ENCODE][size].failed++;
+      res[OP_DECODE][size].failed++;
+      continue;
+    }
+
+    calls = 0;
+    start = latency_now();
+    do {
+      memcpy(md.buf, c.body(), c.body_len() + 1);
+      mod->encode((uint8_t *)data.data(), size, md.buf, c.body_len());
+      calls++;
+    } while ((now = latency_now()) - start < o.budget_us);
+    record(res[OP_ENCODE][size], now - start, calls, c.body_len(), size);
+
+    calls = 0;
+    start = latency_now();
+    do {
+      mod->decode(md.buf, stegged_len, recovered.data());
+      calls++;
+    } while ((now = latency_now()) - start < o.budget_us);
+    record(res[OP_DECODE][size], now - start, calls, stegged_len, size);
+  }
+}
+
+/* ns/call by "module op size" from the output of an earlier run. */
+static map<string, double>
+read_baseline(const char *fname)
+{
+  map<string, double> base;
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+    return base;
+  }
+  char line[256], name[32], op[32], size[32];
+  unsigned int covers, failed;
+  double ns;
+  while (fgets(line, sizeof line, f))
+    if (sscanf(line, "%31s %31s %31s %u %u %lf",
+               name, op, size, &covers, &failed, &ns) == 6 && covers)
+      base[string(name) + " " + op + " " + size] = ns;
+  fclose(f);
+  return base;
+}
+
+static void
+print_results(const module &md, map<size_t, result> *res,
+              const map<string, double> &base)
+{
+  for (int op = 0; op < OP_COUNT; op++) {
+    for (map<size_t, result>::const_iterator i = res[op].begin();
+         i != res[op].end(); ++i) {
+      const result &r = i->second;
+      char size[32];
+      if (op == OP_CAPACITY || op == OP_HEADLESS)
+        xsnprintf(size, sizeof size, "-");
+      else
+        xsnprintf(size, sizeof size, "%lu", (unsigned long)i->first);
+
+      printf("%-6s %-9s %6s %6u %4u", md.name, op_names[op], size,
+             r.covers, r.failed);
+      if (!r.covers) {
+        printf(" %12s %10s %10s\n", "-", "-", "-");
+        continue;
+      }
+
+      double ns = r.ns_per_call_sum / r.covers;
+      printf(" %12.1f %10.1f", ns, r.cover_bytes / r.usecs);
+      if (op == OP_ENCODE || op == OP_DECODE)
+        printf(" %10.1f", r.data_bytes / r.usecs);
+      else
+        printf(" %10s", "-");
+
+      map<string, double>::const_iterator b =
+        base.find(string(md.name) + " " + op_names[op] + " " + size);
+      if (b != base.end())
+        printf(" %+7.1f%%", (ns - b->second) * 100.0 / b->second);
+      printf("\n");
+    }
+  }
+}
+
+static bool
+parse_sizes(const char *arg, vector<size_t> &sizes)
+{
+  sizes.clear();
+  while (*arg) {
+    char *end;
+    unsigned long s = strtoul(arg, &end, 10);
+    if (end == arg || !s || s > c_MAX_DATA_SIZE || (*end && *end != ','))
+      return false;
+    sizes.push_back(s);
+    arg = *end ? end + 1 : end;
+  }
+  std::sort(sizes.begin(), sizes.end());
+  return !sizes.empty();
+}
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --covers DIR     cover files (default src/test/steg_test)\n"
+          "  --traces FILE    pgen_fake server trace "
+          "(default traces/server.out)\n"
+          "  --per-type N     trace covers per content type (default 8)\n"
+          "  --sizes LIST     comma separated data sizes, at most %lu\n"
+          "                   (default 16,256,1024,4096,16384,65536)\n"
+          "  --time MS        time each call on each cover this long "
+          "(default 10)\n"
+          "  --baseline FILE  compare with the output of an earlier run\n",
+          name, (unsigned long)c_MAX_DATA_SIZE);
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const struct option options[] = {
+    { "covers",   required_argument, NULL, 'c' },
+    { "traces",   required_argument, NULL, 't' },
+    { "per-type", required_argument, NULL, 'n' },
+    { "sizes",    required_argument, NULL, 's' },
+    { "time",     required_argument, NULL, 'T' },
+    { "baseline", required_argument, NULL, 'b' },
+    { "help",     no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  char *name = strrchr(argv[0], '/');
+  name = name ? name+1 : argv[0];
+
+  bench_options o;
+  o.covers_dir = "src/test/steg_test";
+  o.traces = "traces/server.out";
+  o.baseline = NULL;
+  o.per_type = 8;
+  o.budget_us = 10000;
+  o.sizes.assign(c_DEFAULT_SIZES,
+                 c_DEFAULT_SIZES + sizeof c_DEFAULT_SIZES / sizeof c_DEFAULT_SIZES[0]);
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'c': o.covers_dir = optarg; break;
+    case 't': o.traces = optarg; break;
+    case 'n': o.per_type = strtoul(optarg, NULL, 10); break;
+    case 's':
+      if (!parse_sizes(optarg, o.sizes))
+        usage(name);
+      break;
+    case 'T': o.budget_us = strtoul(optarg, NULL, 10) * 1000; break;
+    case 'b': o.baseline = optarg; break;
+    default: usage(name);
+    }
+  }
+  if (optind != argc || !o.budget_us)
+    usage(name);
+
+  vector<module> mods;
+  mods.push_back(make_module<JSSteg>("js", NULL, "text/javascript"));
+  mods.push_back(make_module<HTMLSteg>("html", NULL, "text/html"));
+  mods.push_back(make_module<PDFSteg>("pdf", NULL, "application/pdf"));
+  mods.push_back(make_module<SWFSteg>("swf", ".swf",
+                                      "application/x-shockwave-flash"));
+  mods.push_back(make_module<JPGSteg>("jpg", ".jpg", NULL));
+  mods.push_back(make_module<PNGSteg>("png", ".png", NULL));
+  mods.push_back(make_module<GIFSteg>("gif", ".gif", NULL));
+
+  load_cover_files(o.covers_dir, mods);
+  load_trace_covers(o.traces, o.per_type, mods);
+
+  map<string, double> base;
+  if (o.baseline)
+    base = read_baseline(o.baseline);
+
+  // the same data every run, so the covers see the same bytes
+  vector<uint8_t> data(o.sizes.back());
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < data.size(); i++) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    data[i] = x;
+  }
+
+  printf("%-6s %-9s %6s %6s %4s %12s %10s %10s%s\n",
+         "module", "op", "size", "covers", "fail", "ns/call",
+         "cover MB/s", "data MB/s", o.baseline ? "  vs base" : "");
+  for (size_t i = 0; i < mods.size(); i++) {
+    module &md = mods[i];
+    if (md.covers.empty())
+      fprintf(stderr, "%s: no covers\n", md.name);
+
+    map<size_t, result> res[OP_COUNT];
+    res[OP_CAPACITY][0];
+    res[OP_HEADLESS][0];
+    for (size_t j = 0; j < o.sizes.size(); j++) {
+      res[OP_ENCODE][o.sizes[j]];
+      res[OP_DECODE][o.sizes[j]];
+    }
+
+    for (size_t j = 0; j < md.covers.size(); j++)
+      run_cover(md, md.covers[j], o, data, res);
+
+    print_results(md, res, base);
+    fflush(stdout);
+    delete md.mod;
+  }
+  return 0;
+}
@@ -0,0 +1,196 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Benchmark for the circuit and connection timers.  Simulates a
+   number of idle circuits (50000 by default), each with a flush, an
+   axe and a must-send timer, used the way chop uses them: the flush
+   and must-send timers are re-armed with a random interval whenever
+   they fire, the axe timer is pushed back whenever the circuit
+   "sends", and the circuits send in random order.  The same load runs
+   once with one libevent timer per timer, as stegotorus used to do,
+   and once on the timer wheel.
+
+   usage: timer_bench [circuits] [seconds] */
+
+#include "util.h"
+#include "latency.h"
+#include "timer_wheel.h"
+
+#include <event2/event.h>
+
+#include <sys/resource.h>
+
+namespace {
+  enum { FLUSH, AXE, MUST_SEND, N_TIMERS };
+
+  struct bench_circuit {
+    struct event *ev[N_TIMERS];
+    wheel_timer wt[N_TIMERS];
+  };
+
+  struct bench_state {
+    bool use_wheel;
+    uint32_t rng;
+    unsigned long fired;
+  };
+}
+
+static bench_state bs;
+
+static unsigned long
+random_ms(unsigned long lo, unsigned long hi)
+{
+  // xorshift32, good enough for spreading timers around
+  bs.rng ^= bs.rng << 13;
+  bs.rng ^= bs.rng >> 17;
+  bs.rng ^= bs.rng << 5;
+  return lo + bs.rng % (hi - lo);
+}
+
+static void
+arm(bench_circuit *c, int which, unsigned long ms)
+{
+  if (bs.use_wheel) {
+    wheel_timer_arm(&c->wt[which], ms);
+  } else {
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    evtimer_add(c->ev[which], &tv);
+  }
+}
+
+static void
+flush_cb(void *arg)
+{
+  bs.fired++;
+  arm((bench_circuit *)arg, FLUSH, random_ms(100, 5000));
+}
+
+static void
+must_send_cb(void *arg)
+{
+  bs.fired++;
+  arm((bench_circuit *)arg, MUST_SEND, random_ms(50, 1000));
+}
+
+static void
+axe_cb(void *)
+{
+  bs.fired++;
+}
+
+static void
+flush_ev_cb(evutil_socket_t, short, void *arg)
+{
+  flush_cb(arg);
+}
+
+static void
+must_send_ev_cb(evutil_socket_t, short, void *arg)
+{
+  must_send_cb(arg);
+}
+
+static void
+axe_ev_cb(evutil_socket_t, short, void *arg)
+{
+  axe_cb(arg);
+}
+
+static double
+cpu_seconds(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void
+run(bool use_wheel, size_t n, unsigned int seconds)
+{
+  bs.use_wheel = use_wheel;
+  bs.rng = 2463534242u;
+  bs.fired = 0;
+
+  struct event_base *base = event_base_new();
+  if (!base)
+    log_abort("failed to create event base");
+  if (use_wheel)
+    timer_wheel_start(base);
+
+  bench_circuit *circuits = new bench_circuit[n];
+  for (size_t i = 0; i < n; i++) {
+    bench_circuit *c = &circuits[i];
+    c->ev[FLUSH] = evtimer_new(base, flush_ev_cb, c);
+    c->ev[AXE] = evtimer_new(base, axe_ev_cb, c);
+    c->ev[MUST_SEND] = evtimer_new(base, must_send_ev_cb, c);
+    c->wt[FLUSH].cb = flush_cb;
+    c->wt[AXE].cb = axe_cb;
+    c->wt[MUST_SEND].cb = must_send_cb;
+    for (int k = 0; k < N_TIMERS; k++)
+      c->wt[k].arg = c;
+  }
+
+  uint64_t start = latency_now();
+  for (size_t i = 0; i < n; i++) {
+    arm(&circuits[i], FLUSH, random_ms(100, 5000));
+    arm(&circuits[i], AXE, random_ms(60000, 1200000));
+    arm(&circuits[i], MUST_SEND, random_ms(50, 1000));
+  }
+  double arm_ns = (latency_now() - start) * 1000.0 / (n * N_TIMERS);
+
+  // a send disarms the flush timer and pushes back the axe
+  const size_t sends = 1000000;
+  start = latency_now();
+  for (size_t i = 0; i < sends; i++) {
+    bench_circuit *c = &circuits[random_ms(0, n)];
+    if (use_wheel)
+      wheel_timer_disarm(&c->wt[FLUSH]);
+    else
+      evtimer_del(c->ev[FLUSH]);
+    arm(c, AXE, random_ms(60000, 1200000));
+    arm(c, FLUSH, random_ms(100, 5000));
+  }
+  double send_ns = (latency_now() - start) * 1000.0 / sends;
+
+  struct timeval tv;
+  tv.tv_sec = seconds;
+  tv.tv_usec = 0;
+  event_base_loopexit(base, &tv);
+  double cpu = cpu_seconds();
+  start = latency_now();
+  event_base_dispatch(base);
+  double wall = (latency_now() - start) / 1e6;
+  cpu = cpu_seconds() - cpu;
+
+  printf("%-8s %lu circuits: arm %.0f ns, send %.0f ns, "
+         "%.1f s loop: %lu expiries, %.3f s cpu (%.2f us per expiry)\n",
+         use_wheel ? "wheel" : "libevent", (unsigned long)n, arm_ns, send_ns,
+         wall, bs.fired, cpu, bs.fired ? cpu * 1e6 / bs.fired : 0.0);
+
+  for (size_t i = 0; i < n; i++)
+    for (int k = 0; k < N_TIMERS; k++)
+      event_free(circuits[i].ev[k]);
+  delete [] circuits;
+  if (use_wheel)
+    timer_wheel_stop();
+  event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+  size_t n = argc > 1 ? atoi(argv[1]) : 50000;
+  unsigned int seconds = argc > 2 ? atoi(argv[2]) : 5;
+  if (n == 0 || seconds == 0 || argc > 3) {
+    fprintf(stderr, "usage: timer_bench [circuits] [seconds]\n");
+    return 1;
+  }
+
+  run(false, n, seconds);
+  run(true, n, seconds);
+  return 0;
+}
@@ -0,0 +1,227 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+#include "util.h"
+#include "unittest.h"
+#include "apache_payload_server.h"
+
+using std::string;
+
+/* file_id type url_hash capacity length url absolute_url_is_absolute absolute_url */
+static const char c_database[] =
+  "1 1 aaaa 100 2000 a.js 0 a.js\n"
+  "2 2 bbbb 300 1000 b.html 0 b.html\n"
+  "3 1 aaaa 100 2000 a.js 0 a.js\n"
+  "4 1 cccc 500 900 c.js 0 c.js\n";
+
+static void
+test_apache_payload_server_read_database(void *)
+{
+  std::istringstream db(c_database);
+  PayloadDatabase database;
+
+  tt_assert(ApachePayloadServer::read_payload_database(db, database));
+
+  // the duplicate is left out
+  tt_uint_op(database.payloads.size(), ==, 3);
+  tt_uint_op(database.sorted_payloads.size(), ==, 3);
+  tt_uint_op(database.type_detail[1].count, ==, 2);
+  tt_uint_op(database.type_detail[1].max_capacity, ==, 500);
+  tt_uint_op(database.type_detail[2].max_capacity, ==, 300);
+  tt_str_op(database.payloads["bbbb"].url.c_str(), ==, "b.html");
+
+  // shortest first
+  tt_str_op(database.sorted_payloads.front().url_hash.c_str(), ==, "cccc");
+  tt_str_op(database.sorted_payloads.back().url_hash.c_str(), ==, "aaaa");
+
+ end:;
+}
+
+static void
+test_apache_payload_server_uri_dict(void *)
+{
+  std::istringstream db(c_database);
+  std::istringstream reloaded_db(
+    "1 1 cccc 500 900 c.js 0 c.js\n"
+    "2 1 dddd 500 900 d.js 0 d.js\n"
+    "3 1 eeee 500 900 e.js 0 e.js\n");
+  PayloadDatabase database, reloaded;
+  URIDict dict, reloaded_dict;
+
+  tt_assert(ApachePayloadServer::read_payload_database(db, database));
+  ApachePayloadServer::build_uri_dict(database, URIDict(), dict);
+  tt_uint_op(dict.size(), ==, 3);
+  tt_assert(dict.url(0) == "a.js");
+  tt_assert(dict.url(1) == "b.html");
+  tt_assert(dict.url(2) == "c.js");
+  tt_uint_op(dict.find("c.js"), ==, 2);
+
+  // c.js stays where it was, the new ones take the places of the gone
+  tt_assert(ApachePayloadServer::read_payload_database(reloaded_db, reloaded));
+  ApachePayloadServer::build_uri_dict(reloaded, dict, reloaded_dict);
+  tt_uint_op(reloaded_dict.size(), ==, 3);
+  tt_assert(reloaded_dict.url(0) == "d.js");
+  tt_assert(reloaded_dict.url(1) == "e.js");
+  tt_assert(reloaded_dict.url(2) == "c.js");
+  tt_uint_op(reloaded_dict.find("c.js"), ==, 2);
+  tt_uint_op(reloaded_dict.find("a.js"), ==, URIDict::npos);
+
+  // with fewer new urls than gone ones, the gone ones before a kept
+  // one stay, those at the end are dropped
+  {
+    std::istringstream smaller_db("1 1 eeee 500 900 e.js 0 e.js\n");
+    PayloadDatabase smaller;
+    URIDict smaller_dict;
+
+    tt_assert(ApachePayloadServer::read_payload_database(smaller_db, smaller));
+    ApachePayloadServer::build_uri_dict(smaller, reloaded_dict, smaller_dict);
+    tt_uint_op(smaller_dict.size(), ==, 2);
+    tt_assert(smaller_dict.url(0) == "d.js");
+    tt_assert(smaller_dict.url(1) == "e.js");
+  }
+
+ end:;
+}
+
+namespace {
+  /* a server with the dicts of a reload swapped in by hand */
+  struct reloaded_server : ApachePayloadServer
+  {
+    reloaded_server()
+      : ApachePayloadServer(client_side, "/nonexistent/payload_db", "", "", "none", "") {}
+
+    void swap_in(URIDict& dict)
+    {
+      _previous_uri_byte_cut = uri_byte_cut(uri_dict.size());
+      _previous_uri_dict.swap(uri_dict);
+      uri_dict.swap(dict);
+    }
+  };
+}
+
+namespace {
+  /* a server which may be building its database in the background */
+  struct building_server : ApachePayloadServer
+  {
+    building_server(const string& database, const string& cover_list)
+      : ApachePayloadServer(server_side, database, "127.0.0.1", cover_list, "none", "") {}
+
+    bool building() const { return _reload_thread.joinable(); }
+  };
+}
+
+static void
+test_apache_payload_server_uri_code(void *)
+{
+  reloaded_server server;
+  URIDict dict;
+  char url[32];
+  unsigned long byte_cut = 99;
+
+  tt_uint_op(ApachePayloadServer::uri_byte_cut(0), ==, 0);
+  tt_uint_op(ApachePayloadServer::uri_byte_cut(255), ==, 0);
+  tt_uint_op(ApachePayloadServer::uri_byte_cut(256), ==, 1);
+  tt_uint_op(ApachePayloadServer::uri_byte_cut(65536), ==, 2);
+
+  // the reload grows the dict past 256 urls
+  for (unsigned int i = 0; i < 200; i++) {
+    xsnprintf(url, sizeof url, "old%u.html", i);
+    server.uri_dict.append(url);
+  }
+  for (unsigned int i = 0; i < 300; i++) {
+    xsnprintf(url, sizeof url, "new%u.html", i);
+    dict.append(url);
+  }
+  server.swap_in(dict);
+
+  // a url of the new dict carries a byte, one of the old dict, from a
+  // client which hasn't got the new one, carries none
+  tt_uint_op(server.uri_code("new7.html", 9, &byte_cut), ==, 7);
+  tt_uint_op(byte_cut, ==, 1);
+  tt_uint_op(server.uri_code("old7.html", 9, &byte_cut), ==, 7);
+  tt_uint_op(byte_cut, ==, 0);
+  tt_uint_op(server.uri_code("gone.html", 9, &byte_cut), ==, 0);
+  tt_uint_op(byte_cut, ==, 1);
+
+ end:;
+}
+
+static void
+test_apache_payload_server_background_build(void *)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char root[256];
+  struct event_base *base = event_base_new();
+  xsnprintf(root, sizeof root, "%s/payload_serverXXXXXX", tmpdir ? tmpdir : "/tmp");
+  tt_assert(mkdtemp(root));
+  tt_assert(base);
+
+  {
+    string database = string(root) + "/payload_db";
+    string cover_list = string(root) + "/covers";
+    FILE *f = fopen(cover_list.c_str(), "w");
+    tt_assert(f);
+    fclose(f);
+
+    // the constructor leaves the scrape to start_building, which
+    // doesn't wait for it: there are no covers until it is swapped in
+    building_server *server = new building_server(database, cover_list);
+    tt_assert(!server->building());
+    server->start_building(base);
+    tt_assert(!server->has_covers());
+    tt_assert(server->building());
+    tt_uint_op(server->uri_dict.size(), ==, 0);
+    delete server;
+
+    // stopping the server cuts the scrape short, which leaves nothing
+    // behind
+    tt_assert(!file_exists_with_name(database));
+    tt_assert(!file_exists_with_name(database + ".part"));
+
+    // nor does a scrape which found no covers
+    {
+      PayloadDatabase scraped;
+      tt_assert(!ApachePayloadServer::load_payload_database(database, "127.0.0.1", cover_list,
+                                                            scraped));
+      tt_assert(!file_exists_with_name(database));
+      tt_assert(!file_exists_with_name(database + ".part"));
+    }
+
+    // a database without covers is built again
+    f = fopen(database.c_str(), "w");
+    tt_assert(f);
+    fclose(f);
+    server = new building_server(database, cover_list);
+    server->start_building(base);
+    tt_assert(!server->has_covers());
+    tt_assert(server->building());
+    delete server;
+
+    remove(database.c_str());
+    remove(cover_list.c_str());
+  }
+
+ end:
+  rmdir(root);
+  if (base)
+    event_base_free(base);
+}
+
+#define T(name) \
+  { #name, test_apache_payload_server_##name, 0, 0, 0 }
+
+struct testcase_t apache_payload_server_tests[] = {
+  T(read_database),
+  T(uri_dict),
+  T(uri_code),
+  T(background_build),
+  END_OF_TESTCASES
+};
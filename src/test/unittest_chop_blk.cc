@@ -0,0 +1,505 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "crypt.h"
+#include "protocol/chop_blk.h"
+
+#include <event2/buffer.h>
+
+using std::vector;
+using namespace chop_blk;
+
+static size_t
+plan_room(const vector<block_offer> &offers,
+          const vector<block_assignment> &plan)
+{
+  size_t room = 0;
+  for (vector<block_assignment>::const_iterator i = plan.begin();
+       i != plan.end(); ++i)
+    room += offers[i->offer].room;
+  return room;
+}
+
+static void
+test_chop_blk_plan_best_fit(void *)
+{
+  vector<block_offer> offers;
+  vector<block_assignment> plan;
+  offers.push_back(block_offer(5000, MIN_BLOCK_SIZE));
+  offers.push_back(block_offer(1000, MIN_BLOCK_SIZE));
+  offers.push_back(block_offer(600, MIN_BLOCK_SIZE));
+
+  // the smallest block that takes everything
+  tt_uint_op(plan_blocks(900, offers, plan), ==, 900);
+  tt_uint_op(plan.size(), ==, 1);
+  tt_uint_op(plan[0].offer, ==, 1);
+  tt_uint_op(plan[0].data, ==, 900);
+
+  // nothing to send: one block, as small as possible
+  tt_uint_op(plan_blocks(0, offers, plan), ==, 0);
+  tt_uint_op(plan.size(), ==, 1);
+  tt_uint_op(plan[0].offer, ==, 2);
+  tt_uint_op(plan[0].data, ==, 0);
+
+ end:;
+}
+
+static void
+test_chop_blk_plan_split(void *)
+{
+  vector<block_offer> offers;
+  vector<block_assignment> plan;
+  offers.push_back(block_offer(20000, MIN_BLOCK_SIZE));
+  offers.push_back(block_offer(1000, MIN_BLOCK_SIZE));
+  offers.push_back(block_offer(700, MIN_BLOCK_SIZE + 4));
+  offers.push_back(block_offer(400, MIN_BLOCK_SIZE));
+
+  // two medium blocks are much less cover than the big one
+  tt_uint_op(plan_blocks(1500, offers, plan), ==, 1500);
+  tt_uint_op(plan.size(), ==, 2);
+  tt_uint_op(plan_room(offers, plan), ==, 1700);
+  tt_uint_op(plan[0].offer, ==, 1);
+  tt_uint_op(plan[0].data, ==, 1000 - MIN_BLOCK_SIZE);
+  tt_uint_op(plan[1].offer, ==, 2);
+  tt_uint_op(plan[1].data, ==, 1500 - (1000 - MIN_BLOCK_SIZE));
+
+ end:;
+}
+
+static void
+test_chop_blk_plan_short(void *)
+{
+  vector<block_offer> offers;
+  vector<block_assignment> plan;
+  offers.push_back(block_offer(100, MIN_BLOCK_SIZE));
+  offers.push_back(block_offer(MIN_BLOCK_SIZE, MIN_BLOCK_SIZE));
+  offers.push_back(block_offer(300, MIN_BLOCK_SIZE));
+
+  // not enough room: everything that can carry data, full, biggest
+  // first
+  tt_uint_op(plan_blocks(1000, offers, plan), ==, 336);
+  tt_uint_op(plan.size(), ==, 2);
+  tt_uint_op(plan[0].offer, ==, 2);
+  tt_uint_op(plan[0].data, ==, 300 - MIN_BLOCK_SIZE);
+  tt_uint_op(plan[1].offer, ==, 0);
+  tt_uint_op(plan[1].data, ==, 100 - MIN_BLOCK_SIZE);
+
+  // and no offers at all
+  offers.clear();
+  tt_uint_op(plan_blocks(1000, offers, plan), ==, 0);
+  tt_uint_op(plan.size(), ==, 0);
+  tt_uint_op(plan_blocks(0, offers, plan), ==, 0);
+  tt_uint_op(plan.size(), ==, 0);
+
+ end:;
+}
+
+static void
+test_chop_blk_plan_many(void *)
+{
+  // too many offers for the exhaustive search
+  vector<block_offer> offers;
+  vector<block_assignment> plan;
+  for (size_t i = 0; i < 20; i++)
+    offers.push_back(block_offer(MIN_BLOCK_SIZE + 100 * (i + 1),
+                                 MIN_BLOCK_SIZE));
+
+  // 2000 + 1900, then the 100 left over go in the smallest block
+  tt_uint_op(plan_blocks(4000, offers, plan), ==, 4000);
+  tt_uint_op(plan.size(), ==, 3);
+  tt_uint_op(plan[0].offer, ==, 19);
+  tt_uint_op(plan[1].offer, ==, 18);
+  tt_uint_op(plan[2].offer, ==, 0);
+  tt_uint_op(plan[2].data, ==, 100);
+
+ end:;
+}
+
+static void
+test_chop_blk_coalesce(void *)
+{
+  // 1000 of 5000 bytes at 100 kB/s: full in 40 ms
+  tt_uint_op(coalesce_delay(1000, 5000, 100000, 50), ==, 40);
+  tt_uint_op(coalesce_delay(1000, 5000, 100000, 40), ==, 40);
+  tt_uint_op(coalesce_delay(1000, 5000, 100000, 39), ==, 0);
+  tt_uint_op(coalesce_delay(4999, 5000, 1e9, 50), ==, 1);
+
+  // nothing to wait for
+  tt_uint_op(coalesce_delay(0, 5000, 100000, 50), ==, 0);
+  tt_uint_op(coalesce_delay(5000, 5000, 100000, 50), ==, 0);
+  tt_uint_op(coalesce_delay(6000, 5000, 100000, 50), ==, 0);
+  tt_uint_op(coalesce_delay(1000, 5000, 0, 50), ==, 0);
+  tt_uint_op(coalesce_delay(1000, 5000, 100000, 0), ==, 0);
+
+ end:;
+}
+
+static void
+test_chop_blk_spare_conns(void *)
+{
+  vector<spare_conn_state> spares;
+  spare_conn_state ready_idle = { false, true, 0 };
+  spare_conn_state ours = { true, true, 0 };
+  spare_conn_state connecting = { false, false, 0 };
+  spare_conn_state donor_busy = { false, true, 1200 };
+
+  tt_int_op(pick_spare_conn(spares), ==, -1);
+
+  // none of these may be taken
+  spares.push_back(ours);
+  spares.push_back(connecting);
+  spares.push_back(donor_busy);
+  tt_int_op(pick_spare_conn(spares), ==, -1);
+
+  // the first one that may
+  spares.push_back(ready_idle);
+  spares.push_back(ready_idle);
+  tt_int_op(pick_spare_conn(spares), ==, 3);
+
+  // the donor's data no longer waiting for it frees it up
+  spares[2].donor_pending = 0;
+  tt_int_op(pick_spare_conn(spares), ==, 2);
+
+  // data goes to spare connections too, chaff only as a last resort
+  tt_assert(offer_on_spare_conns(1, true));
+  tt_assert(offer_on_spare_conns(1, false));
+  tt_assert(offer_on_spare_conns(0, false));
+  tt_assert(!offer_on_spare_conns(0, true));
+
+ end:;
+}
+
+static void
+test_chop_blk_streams(void *)
+{
+  char fallbackbuf[4];
+  tt_assert(opcode_valid(op_SOPEN));
+  tt_assert(opcode_valid(op_SRST));
+  tt_assert(!opcode_valid(op_RESERVED0));
+  tt_str_op(opname(op_SDAT, fallbackbuf), ==, "SDAT");
+  tt_str_op(opname(op_RESERVED0, fallbackbuf), ==, "R0a");
+
+  {
+    // stream data stops short of the end of the queue; ACKs do not
+    transmit_queue q;
+    for (unsigned int i = 0; i < 240; i++) {
+      tt_assert(!q.nearly_full(16));
+      q.enqueue(op_SDAT, evbuffer_new(), 0);
+    }
+    tt_assert(q.nearly_full(16));
+    tt_assert(!q.full());
+    for (unsigned int i = 0; i < 16; i++)
+      q.enqueue(op_ACK, evbuffer_new(), 0);
+    tt_assert(q.full());
+  }
+
+ end:;
+}
+
+static void
+test_chop_blk_stream_blocks(void *)
+{
+  stream_state open_stream, closing;
+  closing.received_fin = true;
+
+  // stream 0 is the circuit's own
+  tt_int_op(check_stream_block(op_SDAT, 0, true, &open_stream, 1), ==,
+            stream_reject);
+
+  // only the client opens streams, and each one once
+  tt_int_op(check_stream_block(op_SOPEN, 7, true, NULL, 0), ==, stream_open);
+  tt_int_op(check_stream_block(op_SOPEN, 7, false, NULL, 0), ==,
+            stream_reject);
+  tt_int_op(check_stream_block(op_SOPEN, 7, true, &open_stream, 1), ==,
+            stream_reject);
+
+  // no more than MAX_STREAMS_PER_CIRCUIT of them
+  tt_int_op(check_stream_block(op_SOPEN, 7, true, NULL,
+                               MAX_STREAMS_PER_CIRCUIT - 1), ==, stream_open);
+  tt_int_op(check_stream_block(op_SOPEN, 7, true, NULL,
+                               MAX_STREAMS_PER_CIRCUIT), ==, stream_refuse);
+
+  // data and the end of it go to an open stream, on either side
+  tt_int_op(check_stream_block(op_SDAT, 7, true, &open_stream, 1), ==,
+            stream_deliver);
+  tt_int_op(check_stream_block(op_SFIN, 7, false, &open_stream, 1), ==,
+            stream_deliver);
+  // but nothing after the end
+  tt_int_op(check_stream_block(op_SDAT, 7, true, &closing, 1), ==,
+            stream_reject);
+  tt_int_op(check_stream_block(op_SFIN, 7, true, &closing, 1), ==,
+            stream_reject);
+
+  // a reset drops the stream, even one that is closing
+  tt_int_op(check_stream_block(op_SRST, 7, false, &open_stream, 1), ==,
+            stream_drop);
+  tt_int_op(check_stream_block(op_SRST, 7, false, &closing, 1), ==,
+            stream_drop);
+
+  // whatever was on its way to a stream we dropped is let go
+  tt_int_op(check_stream_block(op_SDAT, 7, true, NULL, 0), ==, stream_ignore);
+  tt_int_op(check_stream_block(op_SFIN, 7, true, NULL, 0), ==, stream_ignore);
+  tt_int_op(check_stream_block(op_SRST, 7, true, NULL, 0), ==, stream_ignore);
+
+ end:;
+}
+
+static void
+test_chop_blk_stream_teardown(void *)
+{
+  stream_state s;
+
+  // the first block opens the stream, whatever it carries
+  tt_int_op(s.next_opcode(false), ==, op_SOPEN);
+  s.read_eof = true;
+  tt_int_op(s.next_opcode(true), ==, op_SOPEN);
+  s.read_eof = false;
+  s.sent_open = true;
+
+  // the end only goes with the last of the data
+  tt_int_op(s.next_opcode(true), ==, op_SDAT);
+  s.read_eof = true;
+  tt_int_op(s.next_opcode(false), ==, op_SDAT);
+  tt_int_op(s.next_opcode(true), ==, op_SFIN);
+
+  // and the stream is done once both ends are, and the peer's end has
+  // been passed on
+  s.sent_fin = true;
+  tt_assert(!s.finished());
+  s.received_fin = true;
+  tt_assert(!s.finished());
+  s.write_eof = true;
+  tt_assert(s.finished());
+
+ end:;
+}
+
+static void
+test_chop_blk_duplicates(void *)
+{
+  transmit_queue tq;
+  reassembly_queue rq;
+  reassembly_elt el = { 0, op_DAT, NULL, false, 0 };
+
+  for (unsigned int i = 0; i < 3; i++)
+    tq.enqueue(op_DAT, evbuffer_new(), 0);
+  tt_assert(tq.find(0));
+  tt_assert(tq.find(2));
+  tt_assert(!tq.find(3));
+
+  // blocks 0 and 2 arrive, 0 is processed; a second copy of either
+  // is recognized, of 1 is not
+  tt_assert(rq.insert(0, op_DAT, evbuffer_new(), NULL));
+  tt_assert(rq.insert(2, op_DAT, evbuffer_new(), NULL));
+  tt_assert(!rq.insert(2, op_DAT, evbuffer_new(), NULL));
+  el = rq.remove_next();
+  tt_assert(el.data);
+  evbuffer_free(el.data);
+  tt_assert(rq.received(0));
+  tt_assert(!rq.received(1));
+  tt_assert(rq.received(2));
+  tt_assert(!rq.received(3));
+  tt_assert(!rq.received(300));
+  tt_assert(!rq.insert(0, op_DAT, evbuffer_new(), NULL));
+
+  // the ACK for them leaves only block 1 on the transmit queue
+  tt_int_op(tq.process_ack(rq.gen_ack()), ==, 0);
+  tt_assert(!tq.find(0));
+  tt_assert(tq.find(1));
+  tt_assert(!tq.find(2));
+
+  // an ACK for a window that wraps around the end of the queue
+  for (uint32_t i = 1; i < 250; i++)
+    if (i != 2)
+      tt_assert(rq.insert(i, op_DAT, evbuffer_new(), NULL));
+  while ((el = rq.remove_next()).data)
+    evbuffer_free(el.data);
+  tt_uint_op(rq.window(), ==, 250);
+  tt_assert(rq.insert(260, op_DAT, evbuffer_new(), NULL));
+  {
+    ack_payload ack(rq.gen_ack(), 249);
+    tt_assert(ack.valid());
+    tt_uint_op(ack.hsn(), ==, 249);
+    tt_assert(ack.block_received(260));
+    tt_assert(!ack.block_received(259));
+  }
+
+  {
+    // an ACK overtaken by a later one is not an error
+    transmit_queue q;
+    for (unsigned int i = 0; i < 5; i++)
+      q.enqueue(op_DAT, evbuffer_new(), 0);
+    tt_int_op(q.process_ack(ack_payload(2).serialize()), ==, 0);
+    ack_payload stale(0);
+    stale.set_block_received(4);
+    tt_int_op(q.process_ack(stale.serialize()), ==, 0);
+    tt_assert(q.find(3));
+    tt_assert(!q.find(4));
+  }
+
+ end:;
+}
+
+static evbuffer *
+fec_block(size_t len, uint8_t fill)
+{
+  evbuffer *b = evbuffer_new();
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = fill + i;
+    evbuffer_add(b, &c, 1);
+  }
+  return b;
+}
+
+static void
+test_chop_blk_fec(void *)
+{
+  const size_t lens[4] = { 10, 0, 7, 30 };
+  const opcode_t ops[4] = { op_DAT, op_ACK, op_SDAT, op_FIN };
+  evbuffer *blocks[4] = { 0, 0, 0, 0 };
+  evbuffer *parity[3] = { 0, 0, 0 };
+  evbuffer *rebuilt = 0;
+  uint32_t seqno;
+  opcode_t op;
+
+  // 4:2 -- parity 0 covers blocks 0 and 2, parity 1 blocks 1 and 3
+  fec_encoder enc(4, 2);
+  for (unsigned int i = 0; i < 4; i++) {
+    blocks[i] = fec_block(lens[i], 0x40 + 16*i);
+    enc.add(100 + i, ops[i], blocks[i]);
+  }
+  tt_assert(!enc.pending());
+  parity[0] = enc.next_parity();
+  parity[1] = enc.next_parity();
+  tt_assert(parity[0] && parity[1]);
+  tt_assert(!enc.next_parity());
+  tt_int_op(evbuffer_get_length(parity[0]), ==, FEC_HEADER_LEN + 10);
+  tt_int_op(evbuffer_get_length(parity[1]), ==, FEC_HEADER_LEN + 30);
+
+  {
+    // block 2 lost: rebuilt from parity 0 and block 0
+    fec_decoder dec;
+    dec.activate(100);
+    dec.add_block(100, ops[0], blocks[0]);
+    dec.add_block(101, ops[1], blocks[1]);
+    dec.add_block(103, ops[3], blocks[3]);
+    tt_int_op(dec.add_parity(parity[1]), ==, 0);
+    tt_assert(!dec.recover(&seqno, &op, &rebuilt));
+    tt_int_op(dec.add_parity(parity[0]), ==, 0);
+    tt_assert(dec.recover(&seqno, &op, &rebuilt));
+    tt_int_op(seqno, ==, 102);
+    tt_int_op(op, ==, op_SDAT);
+    tt_int_op(evbuffer_get_length(rebuilt), ==, 7);
+    tt_int_op(memcmp(evbuffer_pullup(rebuilt, -1),
+                     evbuffer_pullup(blocks[2], -1), 7), ==, 0);
+    evbuffer_free(rebuilt);
+    rebuilt = 0;
+    tt_assert(!dec.recover(&seqno, &op, &rebuilt));
+  }
+
+  {
+    // blocks 0 and 2 both lost: parity 0 cannot help
+    fec_decoder dec;
+    dec.activate(100);
+    dec.add_block(101, ops[1], blocks[1]);
+    dec.add_block(103, ops[3], blocks[3]);
+    tt_int_op(dec.add_parity(parity[0]), ==, 0);
+    tt_int_op(dec.add_parity(parity[1]), ==, 0);
+    tt_assert(!dec.recover(&seqno, &op, &rebuilt));
+
+    // ... until one of them arrives after all
+    dec.add_block(100, ops[0], blocks[0]);
+    tt_assert(dec.recover(&seqno, &op, &rebuilt));
+    tt_int_op(seqno, ==, 102);
+    evbuffer_free(rebuilt);
+    rebuilt = 0;
+  }
+
+  {
+    // blocks from before the decoder was activated cannot be counted on
+    fec_decoder dec;
+    dec.activate(102);
+    dec.add_block(103, ops[3], blocks[3]);
+    tt_int_op(dec.add_parity(parity[0]), ==, 0);
+    tt_assert(!dec.recover(&seqno, &op, &rebuilt));
+  }
+
+  {
+    // short groups: chaff alone gets no parity, data does
+    fec_encoder short_enc(8, 1);
+    evbuffer *chaff = evbuffer_new();
+    short_enc.add(0, op_DAT, chaff);
+    tt_assert(!short_enc.pending());
+    short_enc.flush();
+    tt_assert(!short_enc.next_parity());
+    short_enc.add(1, op_DAT, blocks[0]);
+    tt_assert(short_enc.pending());
+    short_enc.flush();
+    tt_assert(!short_enc.pending());
+    parity[2] = short_enc.next_parity();
+    tt_assert(parity[2]);
+    tt_assert(!short_enc.next_parity());
+
+    // that parity falls in the next group, whose parity names it
+    short_enc.add(2, op_PARITY, parity[2]);
+    short_enc.flush();
+    tt_assert(!short_enc.next_parity());
+    short_enc.add(3, op_DAT, blocks[3]);
+    short_enc.flush();
+    evbuffer *next = short_enc.next_parity();
+    tt_assert(next);
+    {
+      fec_decoder dec;
+      dec.activate(0);
+      dec.add_block(3, op_DAT, blocks[3]);
+      tt_int_op(dec.add_parity(next), ==, 0);
+      evbuffer_free(next);
+      tt_assert(dec.recover(&seqno, &op, &rebuilt));
+      tt_int_op(seqno, ==, 2);
+      tt_int_op(op, ==, op_PARITY);
+      tt_int_op(evbuffer_get_length(rebuilt), ==, 0);
+      evbuffer_free(rebuilt);
+      rebuilt = 0;
+      tt_assert(!dec.recover(&seqno, &op, &rebuilt));
+    }
+    evbuffer_free(chaff);
+  }
+
+  {
+    fec_decoder dec;
+    evbuffer *junk = fec_block(FEC_HEADER_LEN - 1, 0);
+    tt_int_op(dec.add_parity(junk), ==, -1);
+    evbuffer_free(junk);
+  }
+
+ end:
+  for (unsigned int i = 0; i < 4; i++)
+    if (blocks[i])
+      evbuffer_free(blocks[i]);
+  for (unsigned int i = 0; i < 3; i++)
+    if (parity[i])
+      evbuffer_free(parity[i]);
+  if (rebuilt)
+    evbuffer_free(rebuilt);
+}
+
+#define T(name) \
+  { #name, test_chop_blk_##name, 0, 0, 0 }
+
+struct testcase_t chop_blk_tests[] = {
+  T(plan_best_fit),
+  T(plan_split),
+  T(plan_short),
+  T(plan_many),
+  T(coalesce),
+  T(spare_conns),
+  T(streams),
+  T(stream_blocks),
+  T(stream_teardown),
+  T(fec),
+  T(duplicates),
+  END_OF_TESTCASES
+};
@@ -425,6 +425,42 @@ test_decompress_gzip(void *)
  end:;
 }
 
+static void
+test_deflater_pool(void *)
+{
+  uint8_t obuf[1024];
+  deflater_pool pool;
+  // twice over, so that the second round runs on recycled streams
+  for (int round = 0; round < 2; round++) {
+    for (const zlib_testvec *t = testvecs; t->text; t++) {
+      ssize_t n = pool.compress(t->text, t->tlen, obuf, sizeof obuf,
+                                c_format_zlib);
+      tt_uint_op(n, ==, t->zlen);
+      tt_mem_op(obuf, ==, t->zlibbed, t->zlen);
+
+      n = pool.compress(t->text, t->tlen, obuf, sizeof obuf, c_format_gzip);
+      tt_uint_op(n, ==, t->glen);
+      tt_mem_op(obuf, ==, t->gzipped, t->glen);
+      tt_uint_op(n, <=, deflater_pool::compress_bound(t->tlen, c_format_gzip));
+    }
+  }
+
+  tt_assert(!pool.set_level(10));
+  tt_assert(pool.set_level(1));
+  tt_int_op(pool.level(), ==, 1);
+  for (const zlib_testvec *t = testvecs; t->text; t++) {
+    uint8_t tbuf[1024];
+    ssize_t n = pool.compress(t->text, t->tlen, obuf, sizeof obuf,
+                              c_format_gzip);
+    tt_int_op(n, >, 0);
+    n = decompress(obuf, n, tbuf, sizeof tbuf);
+    tt_uint_op(n, ==, t->tlen);
+    tt_mem_op(tbuf, ==, t->text, t->tlen);
+  }
+
+ end:;
+}
+
 #define T(name) \
   { #name, test_##name, 0, 0, 0 }
 
@@ -433,5 +469,6 @@ struct testcase_t zlib_tests[] = {
   T(decompress_zlib),
   T(compress_gzip),
   T(decompress_gzip),
+  T(deflater_pool),
   END_OF_TESTCASES
 };
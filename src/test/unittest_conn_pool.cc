@@ -0,0 +1,280 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "connections.h"
+#include "protocol.h"
+
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+using std::vector;
+
+/* A client configuration with one target, a listening socket on the
+   loopback interface that never accepts: the kernel completes the
+   connects, which is all the pool needs. */
+
+namespace {
+struct test_circuit_t;
+
+struct test_conn_t : conn_t
+{
+  test_circuit_t *ckt;
+
+  test_conn_t() : ckt(NULL) {}
+  virtual circuit_t *circuit() const;
+  virtual int maybe_open_upstream() { return 0; }
+  virtual int handshake() { return 0; }
+  virtual int recv() { return 0; }
+  virtual int recv_eof() { return 0; }
+  virtual void expect_close() {}
+  virtual void cease_transmission() {}
+  virtual void transmit_soon(unsigned long) {}
+};
+
+struct test_config_t : config_t
+{
+  evutil_addrinfo *target;
+
+  test_config_t() : target(NULL) {}
+  virtual ~test_config_t() { if (target) evutil_freeaddrinfo(target); }
+  virtual const char *name() const { return "test"; }
+  virtual bool init(unsigned int, const char *const *) { return true; }
+  virtual evutil_addrinfo *get_listen_addrs(size_t) const { return NULL; }
+  virtual evutil_addrinfo *get_target_addrs(size_t n) const
+  { return n == 0 ? target : NULL; }
+  virtual const steg_config_t *get_steg(size_t) const { return NULL; }
+  virtual circuit_t *circuit_create(size_t) { return NULL; }
+  virtual conn_t *conn_create(size_t) { return new test_conn_t; }
+};
+
+struct test_circuit_t : circuit_t
+{
+  config_t *config;
+  vector<conn_t *> downstreams;
+  bool closed;
+
+  test_circuit_t(config_t *c, struct bufferevent *up)
+    : config(c), closed(false)
+  {
+    up_buffer = up;
+    up_peer = xstrdup("upstream");
+  }
+
+  virtual void close() { closed = true; circuit_t::close(); }
+  virtual config_t *cfg() const { return config; }
+  virtual void add_downstream(conn_t *conn)
+  {
+    ((test_conn_t *)conn)->ckt = this;
+    downstreams.push_back(conn);
+  }
+  virtual void drop_downstream(conn_t *) {}
+  virtual int send() { return 0; }
+  virtual int send_eof() { return 0; }
+};
+
+circuit_t *
+test_conn_t::circuit() const
+{
+  return ckt;
+}
+
+struct pool_env
+{
+  struct event_base *base;
+  int listener;
+  test_config_t cfg;
+  test_circuit_t *ckt;
+  vector<conn_t *> filler;
+
+  pool_env() : base(NULL), listener(-1), ckt(NULL) {}
+};
+}
+
+static bool
+pool_env_setup(pool_env &env, unsigned int pool_size)
+{
+  struct sockaddr_in sin;
+  socklen_t slen = sizeof sin;
+  struct evutil_addrinfo hints;
+  char port[16];
+  int up[2];
+
+  // as in main: the close cleanup runs at the lower priority
+  env.base = event_base_new();
+  if (!env.base || event_base_priority_init(env.base, 2))
+    return false;
+  conn_global_init(env.base);
+
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  env.listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (env.listener < 0 ||
+      bind(env.listener, (struct sockaddr *)&sin, sizeof sin) ||
+      listen(env.listener, 64) ||
+      getsockname(env.listener, (struct sockaddr *)&sin, &slen))
+    return false;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = EVUTIL_AI_NUMERICHOST | EVUTIL_AI_NUMERICSERV;
+  xsnprintf(port, sizeof port, "%u", (unsigned int)ntohs(sin.sin_port));
+  if (evutil_getaddrinfo("127.0.0.1", port, &hints, &env.cfg.target))
+    return false;
+
+  env.cfg.base = env.base;
+  env.cfg.mode = LSN_SIMPLE_CLIENT;
+  env.cfg.conn_pool_size = pool_size;
+
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, up))
+    return false;
+  close(up[1]);
+  env.ckt = new test_circuit_t(&env.cfg,
+                               bufferevent_socket_new(env.base, up[0],
+                                                      BEV_OPT_CLOSE_ON_FREE));
+
+  conn_pool_open(&env.cfg);
+  return true;
+}
+
+/** Run the event loop until the pool has IDLE connections ready. */
+static bool
+pool_wait_idle(pool_env &env, size_t idle)
+{
+  conn_pool_stats stats;
+  for (int rounds = 0; rounds < 1000; rounds++) {
+    event_base_loop(env.base, EVLOOP_NONBLOCK);
+    conn_pool_get_stats(&stats);
+    if (stats.idle >= idle)
+      return true;
+    usleep(1000);
+  }
+  return false;
+}
+
+/** Fill the global connection count up to LIMIT with connections
+    that never open a socket. */
+static void
+pool_fill_conns(pool_env &env, size_t limit)
+{
+  while (conn_count() < limit)
+    env.filler.push_back(conn_create(&env.cfg, 0, NULL, NULL));
+}
+
+static void
+pool_env_teardown(pool_env &env)
+{
+  conn_pool_close_all();
+  if (env.ckt && !env.ckt->closed)
+    env.ckt->close();
+  if (env.base) {
+    conn_start_shutdown(1);
+    event_base_dispatch(env.base);
+    event_base_free(env.base);
+  }
+  if (env.listener >= 0)
+    close(env.listener);
+}
+
+static void
+test_conn_pool_reuse(void *)
+{
+  pool_env env;
+  conn_pool_stats stats;
+  size_t before;
+
+  tt_assert(pool_env_setup(env, 2));
+  tt_assert(pool_wait_idle(env, 1));
+
+  // a circuit gets the pooled connection, connected already, and
+  // nothing new is opened for it
+  before = conn_count();
+  circuit_reopen_downstreams(env.ckt);
+  tt_uint_op(env.ckt->downstreams.size(), ==, 1);
+  tt_assert(env.ckt->downstreams[0]->connected);
+  tt_uint_op(conn_count(), ==, before);
+  conn_pool_get_stats(&stats);
+  tt_uint_op(stats.hits, ==, 1);
+  tt_uint_op(stats.misses, ==, 0);
+
+  // and the pool makes up for it
+  tt_assert(pool_wait_idle(env, 1));
+
+ end:
+  pool_env_teardown(env);
+}
+
+static void
+test_conn_pool_expiry(void *)
+{
+  pool_env env;
+  conn_pool_stats stats;
+
+  tt_assert(pool_env_setup(env, 2));
+  tt_assert(pool_wait_idle(env, 1));
+
+  // still fresh
+  conn_pool_maintain_all(time(NULL));
+  conn_pool_get_stats(&stats);
+  tt_uint_op(stats.discarded, ==, 0);
+  tt_uint_op(stats.idle, >=, 1);
+
+  // connections that waited too long are replaced with new ones
+  conn_pool_maintain_all(time(NULL) + 3600);
+  conn_pool_get_stats(&stats);
+  tt_uint_op(stats.discarded, >=, 1);
+  tt_uint_op(stats.idle, ==, 0);
+  tt_uint_op(stats.connecting, >=, 1);
+  tt_assert(pool_wait_idle(env, 1));
+
+ end:
+  pool_env_teardown(env);
+}
+
+static void
+test_conn_pool_limit(void *)
+{
+  pool_env env;
+  conn_pool_stats stats;
+
+  tt_assert(pool_env_setup(env, 2));
+  tt_assert(pool_wait_idle(env, 1));
+
+  // at the limit a pooled connection, open already, still fits
+  pool_fill_conns(env, MAX_GLOBAL_CONN_COUNT);
+  circuit_reopen_downstreams(env.ckt);
+  tt_uint_op(env.ckt->downstreams.size(), ==, 1);
+  tt_uint_op(conn_count(), ==, MAX_GLOBAL_CONN_COUNT);
+
+  // but the pool is not refilled, and with the pool empty nothing new
+  // is opened, nor is the circuit given up on
+  event_base_loop(env.base, EVLOOP_NONBLOCK);
+  conn_pool_get_stats(&stats);
+  tt_uint_op(stats.idle + stats.connecting, ==, 0);
+  circuit_reopen_downstreams(env.ckt);
+  tt_uint_op(env.ckt->downstreams.size(), ==, 1);
+  tt_uint_op(conn_count(), ==, MAX_GLOBAL_CONN_COUNT);
+  tt_assert(!env.ckt->closed);
+
+ end:
+  pool_env_teardown(env);
+}
+
+#define T(name) \
+  { #name, test_conn_pool_##name, 0, 0, 0 }
+
+struct testcase_t conn_pool_tests[] = {
+  T(reuse),
+  T(expiry),
+  T(limit),
+  END_OF_TESTCASES
+};
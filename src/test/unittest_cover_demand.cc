@@ -0,0 +1,69 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "cover_demand.h"
+
+static void
+test_cover_demand_buckets(void *)
+{
+  tt_uint_op(CoverDemand::bucket_of(0), ==, 0);
+  tt_uint_op(CoverDemand::bucket_of(1), ==, 0);
+  tt_uint_op(CoverDemand::bucket_of(2), ==, 1);
+  tt_uint_op(CoverDemand::bucket_of(1023), ==, 9);
+  tt_uint_op(CoverDemand::bucket_of(1024), ==, 10);
+  tt_uint_op(CoverDemand::bucket_floor(10), ==, 1024);
+  tt_uint_op(CoverDemand::bucket_floor(0), ==, 0);
+
+ end:;
+}
+
+static void
+test_cover_demand_plan(void *)
+{
+  CoverDemand demand(3, 1000);
+  std::vector<CoverDemand::WarmSet> plan;
+
+  tt_assert(demand.plan(10, 1).empty());
+
+  // three quarters of the demand is for big js covers
+  for (int i = 0; i < 30; i++)
+    demand.record(1, 5000);
+  for (int i = 0; i < 10; i++)
+    demand.record(2, 100);
+  demand.record(7, 100);  // no such type
+
+  plan = demand.plan(8, 1);
+  tt_uint_op(plan.size(), ==, 2);
+  tt_uint_op(plan[0].type, ==, 1);
+  tt_uint_op(plan[0].bucket, ==, 12);
+  tt_uint_op(plan[0].covers, ==, 6);
+  tt_uint_op(plan[1].type, ==, 2);
+  tt_uint_op(plan[1].bucket, ==, 6);
+  tt_uint_op(plan[1].covers, ==, 2);
+
+  // the budget is never exceeded, nor the cap of a bucket
+  plan = demand.plan(1, 1);
+  tt_uint_op(plan.size(), ==, 1);
+  tt_uint_op(plan[0].covers, ==, 1);
+  plan = demand.plan(1000, 1);
+  tt_uint_op(plan[0].covers, ==, CoverDemand::c_MAX_WARM_PER_BUCKET);
+
+  // demand halves every half life, and is forgotten in the end
+  demand.plan(8, 1001);
+  tt_assert(demand.demand(1, 12) > 14.9 && demand.demand(1, 12) < 15.1);
+  tt_assert(demand.plan(8, 10001).empty());
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_cover_demand_##name, 0, 0, 0 }
+
+struct testcase_t cover_demand_tests[] = {
+  T(buckets),
+  T(plan),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,445 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "cover_source.h"
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+
+namespace {
+  /* answers every url with a made-up response and counts them */
+  struct counting_source : CoverSource
+  {
+    unsigned int fetches;
+    string last_url;
+
+    counting_source() : fetches(0) {}
+
+    virtual CoverResponsePtr fetch(const string& url, CoverFetchStatus& status)
+    {
+      fetches++;
+      last_url = url;
+      status = COVER_FETCH_OK;
+      return CoverResponsePtr(new CoverResponse("HTTP/1.1 200 OK\r\n\r\nfetched"));
+    }
+  };
+
+  /* a pool whose servers answer as told, on a clock of our own */
+  struct scripted_pool : CoverServerPool
+  {
+    std::vector<CoverFetchStatus> answers;  /* what each server answers */
+    std::vector<uint64_t> delays;           /* and how long it takes */
+    std::vector<unsigned int> asked;
+    std::vector<unsigned int> probed;
+    uint64_t clock;
+
+    scripted_pool(const std::vector<string>& hosts, CoverSource* fallback)
+      : CoverServerPool(hosts, fallback),
+        answers(hosts.size(), COVER_FETCH_OK), delays(hosts.size(), 10),
+        asked(hosts.size(), 0), probed(hosts.size(), 0), clock(1000000) {}
+
+    size_t index(Server& server)
+    {
+      return std::find(_servers.begin(), _servers.end(), &server) - _servers.begin();
+    }
+
+    virtual CoverResponsePtr fetch_from(Server& server, HTTPCoverSource&, const string& url,
+                                        CoverFetchStatus& status)
+    {
+      size_t i = index(server);
+      asked[i]++;
+      clock += delays[i];
+      status = answers[i];
+      if (status != COVER_FETCH_OK)
+        return CoverResponsePtr();
+      return CoverResponsePtr(new CoverResponse("HTTP/1.1 200 OK\r\n\r\n" + url));
+    }
+
+    virtual CoverFetchStatus probe(Server& server)
+    {
+      size_t i = index(server);
+      probed[i]++;
+      return answers[i];
+    }
+
+    virtual uint64_t now() { return clock; }
+  };
+}
+
+static string
+make_doc_root()
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char root[256];
+  xsnprintf(root, sizeof root, "%s/cover_sourceXXXXXX", tmpdir ? tmpdir : "/tmp");
+  if (!mkdtemp(root))
+    return "";
+  return root;
+}
+
+static bool
+write_file(const string& path, const string& content)
+{
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(content.data(), 1, content.size(), f) == content.size();
+  return !fclose(f) && ok;
+}
+
+static void
+test_cover_source_map_file(void *)
+{
+  string root = make_doc_root();
+  string path = root + "/page.js";
+  string body(5000, 'x');
+  body += "the end";
+  int fd = -1;
+  CoverResponse *cover = NULL;
+
+  tt_assert(!root.empty());
+  tt_assert(write_file(path, body));
+
+  fd = open(path.c_str(), O_RDONLY);
+  tt_int_op(fd, >=, 0);
+  cover = CoverResponse::map_file("HTTP/1.1 200 OK\r\n\r\n", fd, body.size());
+  tt_assert(cover);
+  tt_assert(cover->mapped());
+
+  // header and body in one piece, \0 terminated like a fetched cover
+  tt_uint_op(cover->size(), ==, strlen("HTTP/1.1 200 OK\r\n\r\n") + body.size());
+  tt_assert(!memcmp(cover->data(), "HTTP/1.1 200 OK\r\n\r\nxxx", 22));
+  tt_assert(!memcmp(cover->data() + cover->size() - 7, "the end", 7));
+  tt_int_op(cover->data()[cover->size()], ==, '\0');
+
+  // writing to the cover leaves the file alone
+  cover->data()[cover->size() - 1] = 'D';
+  {
+    char buf[8];
+    lseek(fd, body.size() - 7, SEEK_SET);
+    tt_int_op(read(fd, buf, 7), ==, 7);
+    tt_assert(!memcmp(buf, "the end", 7));
+  }
+
+  // a file truncated under the cover leaves zeros, not SIGBUS
+  tt_assert(!truncate(path.c_str(), 0));
+  tt_int_op(cover->data()[strlen("HTTP/1.1 200 OK\r\n\r\n")], ==, '\0');
+  tt_int_op(cover->data()[0], ==, 'H');
+
+ end:
+  delete cover;
+  if (fd >= 0)
+    close(fd);
+  unlink(path.c_str());
+  rmdir(root.c_str());
+}
+
+static void
+test_cover_source_file(void *)
+{
+  string root = make_doc_root();
+  counting_source http;
+  FileCoverSource files(root, "http://127.0.0.1/", &http);
+  CoverResponsePtr cover;
+  CoverFetchStatus status;
+  char field[64];
+  string header, body = "<html><script type=\"text/javascript\">x</script></html>";
+
+  tt_assert(!root.empty());
+  tt_assert(!mkdir((root + "/sub").c_str(), 0700));
+  tt_assert(write_file(root + "/sub/index.html", body));
+
+  cover = files.fetch("http://127.0.0.1/sub/index.html", status);
+  tt_assert(cover);
+  tt_assert(!cover->mapped());
+  tt_int_op(status, ==, COVER_FETCH_OK);
+  tt_uint_op(http.fetches, ==, 0);
+
+  header = string(cover->data(), cover->size() - body.size());
+  tt_assert(!header.compare(0, 17, "HTTP/1.1 200 OK\r\n"));
+  tt_assert(header.find("\r\nContent-Type: text/html\r\n") != string::npos);
+  xsnprintf(field, sizeof field, "\r\nContent-Length: %lu\r\n",
+            (unsigned long)body.size());
+  tt_assert(header.find(field) != string::npos);
+  tt_assert(header.find("\r\nLast-Modified: ") != string::npos);
+  xsnprintf(field, sizeof field, "\r\nETag: \"%lx-", (unsigned long)body.size());
+  tt_assert(header.find(field) != string::npos);
+  tt_assert(!header.compare(header.size() - 4, 4, "\r\n\r\n"));
+  tt_assert(!memcmp(cover->data() + header.size(), body.data(), body.size()));
+
+  // a query does not change the file
+  cover = files.fetch("http://127.0.0.1/sub/index.html?a=b", status);
+  tt_assert(cover && !cover->mapped());
+  tt_uint_op(http.fetches, ==, 0);
+
+  // a large one is mapped
+  tt_assert(write_file(root + "/sub/large.js", string(FileCoverSource::c_MAP_MIN_SIZE, 'x')));
+  cover = files.fetch("http://127.0.0.1/sub/large.js", status);
+  tt_assert(cover && cover->mapped());
+  tt_int_op(status, ==, COVER_FETCH_OK);
+  tt_int_op(cover->data()[cover->size() - 1], ==, 'x');
+  tt_int_op(cover->data()[cover->size()], ==, '\0');
+
+  // missing files, other servers and paths going up are fetched
+  cover = files.fetch("http://127.0.0.1/missing.html", status);
+  tt_assert(cover && !cover->mapped());
+  tt_uint_op(http.fetches, ==, 1);
+  cover = files.fetch("http://10.0.0.1/sub/index.html", status);
+  tt_uint_op(http.fetches, ==, 2);
+  tt_str_op(http.last_url.c_str(), ==, "http://10.0.0.1/sub/index.html");
+  files.fetch("http://127.0.0.1/../etc/passwd", status);
+  tt_uint_op(http.fetches, ==, 3);
+  files.fetch("http://127.0.0.1/sub", status);
+  tt_uint_op(http.fetches, ==, 4);
+
+ end:
+  unlink((root + "/sub/index.html").c_str());
+  unlink((root + "/sub/large.js").c_str());
+  rmdir((root + "/sub").c_str());
+  rmdir(root.c_str());
+}
+
+static void
+test_cover_source_names(void *)
+{
+  tt_str_op(FileCoverSource::content_type("a/b.JS"), ==, "application/javascript");
+  tt_str_op(FileCoverSource::content_type("x.jpeg"), ==, "image/jpeg");
+  tt_ptr_op(FileCoverSource::content_type("x.tar"), ==, NULL);
+  tt_ptr_op(FileCoverSource::content_type("dir.js/file"), ==, NULL);
+
+  tt_assert(FileCoverSource::is_local_host("127.0.0.1"));
+  tt_assert(FileCoverSource::is_local_host("127.0.0.1:8080"));
+  tt_assert(FileCoverSource::is_local_host("localhost"));
+  tt_assert(FileCoverSource::is_local_host("[::1]:80"));
+  tt_assert(!FileCoverSource::is_local_host("66.135.46.119:80"));
+  tt_assert(!FileCoverSource::is_local_host("example.com"));
+
+ end:;
+}
+
+static void
+test_cover_source_http_status(void *)
+{
+  tt_int_op(HTTPCoverSource::status_of(200), ==, COVER_FETCH_OK);
+  tt_int_op(HTTPCoverSource::status_of(304), ==, COVER_FETCH_OK);
+  tt_int_op(HTTPCoverSource::status_of(404), ==, COVER_FETCH_MISSING);
+  tt_int_op(HTTPCoverSource::status_of(410), ==, COVER_FETCH_MISSING);
+
+  // a busy server is no reason to give up on the cover
+  tt_int_op(HTTPCoverSource::status_of(408), ==, COVER_FETCH_FAILED);
+  tt_int_op(HTTPCoverSource::status_of(429), ==, COVER_FETCH_FAILED);
+  tt_int_op(HTTPCoverSource::status_of(503), ==, COVER_FETCH_FAILED);
+  tt_int_op(HTTPCoverSource::status_of(0), ==, COVER_FETCH_FAILED);
+
+ end:;
+}
+
+static void
+test_cover_source_pool_balance(void *)
+{
+  counting_source http;
+  std::vector<string> hosts;
+  hosts.push_back("10.0.0.1");
+  hosts.push_back("10.0.0.2:8080");
+  scripted_pool pool(hosts, &http);
+  CoverResponsePtr cover;
+  CoverFetchStatus status;
+
+  // the slow server is only asked until its latency is known
+  pool.delays[0] = 200;
+  for (int i = 0; i < 10; i++) {
+    cover = pool.fetch("http://10.0.0.1/a.html", status);
+    tt_assert(cover);
+    tt_int_op(status, ==, COVER_FETCH_OK);
+  }
+  tt_uint_op(pool.asked[0], ==, 1);
+  tt_uint_op(pool.asked[1], ==, 9);
+  tt_str_op(cover->data(), ==, "HTTP/1.1 200 OK\r\n\r\nhttp://10.0.0.2:8080/a.html");
+  tt_assert(pool.servers()[0]->latency_ms > pool.servers()[1]->latency_ms);
+
+  // other servers are not the pool's business
+  cover = pool.fetch("http://10.0.0.2:8080/a.html", status);
+  tt_uint_op(http.fetches, ==, 1);
+  tt_uint_op(pool.asked[1], ==, 9);
+
+ end:;
+}
+
+static void
+test_cover_source_pool_eject(void *)
+{
+  counting_source http;
+  std::vector<string> hosts;
+  hosts.push_back("10.0.0.1");
+  hosts.push_back("10.0.0.2");
+  scripted_pool pool(hosts, &http);
+  CoverResponsePtr cover;
+  CoverFetchStatus status;
+  unsigned int i;
+
+  // the fast server fails: every fetch fails over to the other one,
+  // until the fast one is out of the pool
+  pool.delays[1] = 100;
+  pool.fetch("http://10.0.0.1/a.html", status);
+  pool.fetch("http://10.0.0.1/a.html", status);
+  pool.answers[0] = COVER_FETCH_FAILED;
+  for (i = 0; i < CoverServerPool::c_EJECT_AFTER; i++) {
+    cover = pool.fetch("http://10.0.0.1/a.html", status);
+    tt_assert(cover);
+    tt_int_op(status, ==, COVER_FETCH_OK);
+  }
+  tt_uint_op(pool.asked[0], ==, 1 + CoverServerPool::c_EJECT_AFTER);
+  tt_assert(pool.servers()[0]->ejected_until > pool.clock);
+
+  pool.fetch("http://10.0.0.1/a.html", status);
+  tt_uint_op(pool.asked[0], ==, 1 + CoverServerPool::c_EJECT_AFTER);
+
+  // probed when its time is up, and failing again it is out for longer
+  tt_assert(!pool.check_health());
+  tt_assert(!pool.collect_health(true));
+  tt_uint_op(pool.probed[0], ==, 0);
+  pool.clock = pool.servers()[0]->ejected_until;
+  tt_assert(pool.check_health());
+  tt_assert(!pool.check_health());
+  tt_assert(pool.collect_health(true));
+  tt_uint_op(pool.probed[0], ==, 1);
+  tt_uint_op(pool.servers()[0]->ejected_until, ==,
+             pool.clock + 2 * CoverServerPool::c_MIN_EJECT_MS);
+
+  // and back once it answers
+  pool.answers[0] = COVER_FETCH_OK;
+  pool.clock = pool.servers()[0]->ejected_until;
+  tt_assert(pool.check_health());
+  tt_assert(pool.collect_health(true));
+  tt_uint_op(pool.servers()[0]->ejected_until, ==, 0);
+  tt_uint_op(pool.servers()[0]->eject_ms, ==, CoverServerPool::c_MIN_EJECT_MS);
+  pool.fetch("http://10.0.0.1/a.html", status);
+  tt_uint_op(pool.asked[0], ==, 2 + CoverServerPool::c_EJECT_AFTER);
+
+ end:;
+}
+
+static void
+test_cover_source_pool_status(void *)
+{
+  counting_source http;
+  std::vector<string> hosts;
+  hosts.push_back("10.0.0.1");
+  hosts.push_back("10.0.0.2");
+  scripted_pool pool(hosts, &http);
+  CoverResponsePtr cover;
+  CoverFetchStatus status;
+  bool first_due;
+
+  // one mirror not having the cover does not make it missing
+  pool.answers[0] = COVER_FETCH_MISSING;
+  pool.answers[1] = COVER_FETCH_FAILED;
+  cover = pool.fetch("http://10.0.0.1/a.html", status);
+  tt_assert(!cover);
+  tt_int_op(status, ==, COVER_FETCH_FAILED);
+
+  // it is if all of them say so, and that is no failure of theirs
+  pool.answers[1] = COVER_FETCH_MISSING;
+  cover = pool.fetch("http://10.0.0.1/a.html", status);
+  tt_assert(!cover);
+  tt_int_op(status, ==, COVER_FETCH_MISSING);
+  tt_uint_op(pool.servers()[0]->failures, ==, 0);
+  tt_uint_op(pool.servers()[1]->failures_in_row, ==, 0);
+
+  // with every server out the one due back first is still asked
+  pool.answers[0] = pool.answers[1] = COVER_FETCH_FAILED;
+  for (unsigned int i = 0; i < 2 * CoverServerPool::c_EJECT_AFTER; i++)
+    pool.fetch("http://10.0.0.1/a.html", status);
+  tt_assert(pool.servers()[0]->ejected_until > pool.clock);
+  tt_assert(pool.servers()[1]->ejected_until > pool.clock);
+  pool.answers[1] = COVER_FETCH_OK;
+  pool.asked[0] = pool.asked[1] = 0;
+  first_due = pool.servers()[0]->ejected_until <= pool.servers()[1]->ejected_until;
+  cover = pool.fetch("http://10.0.0.1/a.html", status);
+  tt_uint_op(pool.asked[0] + pool.asked[1], ==, 1);
+  tt_uint_op(pool.asked[0], ==, first_due ? 1 : 0);
+
+ end:;
+}
+
+static void
+test_cover_source_pool_aside(void *)
+{
+  counting_source http, aside_http;
+  std::vector<string> hosts;
+  hosts.push_back("10.0.0.1");
+  hosts.push_back("10.0.0.2");
+  scripted_pool pool(hosts, &http);
+  CoverServerPool::Aside aside(pool, &aside_http);
+  CoverResponsePtr cover;
+  CoverFetchStatus status;
+  unsigned int i;
+
+  // a server failing is not asked again until the pool has a say,
+  // and the pool only hears of it once the fetches are done
+  pool.delays[1] = 100;
+  pool.fetch("http://10.0.0.1/a.html", status);
+  pool.fetch("http://10.0.0.1/a.html", status);
+  pool.answers[0] = COVER_FETCH_FAILED;
+  aside.start();
+  for (i = 0; i < 2 * CoverServerPool::c_EJECT_AFTER; i++) {
+    cover = aside.fetch("http://10.0.0.1/a.html", status);
+    tt_assert(cover);
+    tt_int_op(status, ==, COVER_FETCH_OK);
+  }
+  tt_uint_op(pool.asked[0], ==, 2);
+  tt_uint_op(pool.servers()[0]->failures, ==, 0);
+  aside.finish();
+  tt_uint_op(pool.servers()[0]->failures, ==, 1);
+  tt_uint_op(pool.servers()[1]->fetches, ==, 1 + 2 * CoverServerPool::c_EJECT_AFTER);
+
+  // nor is a server out of the pool
+  for (i = 0; i < CoverServerPool::c_EJECT_AFTER; i++)
+    pool.fetch("http://10.0.0.1/a.html", status);
+  tt_assert(pool.servers()[0]->ejected_until > pool.clock);
+  pool.asked[0] = 0;
+  aside.start();
+  aside.fetch("http://10.0.0.1/a.html", status);
+  tt_uint_op(pool.asked[0], ==, 0);
+  aside.finish();
+
+  // missing only if every server asked says so
+  pool.answers[0] = pool.answers[1] = COVER_FETCH_MISSING;
+  pool.clock = pool.servers()[0]->ejected_until;
+  aside.start();
+  tt_assert(!aside.fetch("http://10.0.0.1/a.html", status));
+  tt_int_op(status, ==, COVER_FETCH_MISSING);
+  pool.answers[1] = COVER_FETCH_FAILED;
+  tt_assert(!aside.fetch("http://10.0.0.1/b.html", status));
+  tt_int_op(status, ==, COVER_FETCH_FAILED);
+  aside.finish();
+
+  // other servers are left to the fallback
+  aside.fetch("http://10.0.0.3/a.html", status);
+  tt_uint_op(aside_http.fetches, ==, 1);
+  tt_uint_op(http.fetches, ==, 0);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_cover_source_##name, 0, 0, 0 }
+
+struct testcase_t cover_source_tests[] = {
+  T(map_file),
+  T(file),
+  T(names),
+  T(http_status),
+  T(pool_balance),
+  T(pool_eject),
+  T(pool_status),
+  T(pool_aside),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,85 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "latency.h"
+
+static void
+test_latency_buckets(void *)
+{
+  // small values get a bucket each
+  for (uint64_t v = 0; v < 16; v++) {
+    tt_uint_op(latency_histogram::bucket_index(v), ==, v);
+    tt_uint_op(latency_histogram::bucket_high(v), ==, v);
+  }
+
+  // every value falls in a bucket whose bounds contain it, the
+  // buckets are contiguous and at most 1/8th of their value wide
+  for (uint64_t v = 16; v < ((uint64_t)1 << 32); v += v / 7 + 1) {
+    unsigned int i = latency_histogram::bucket_index(v);
+    tt_uint_op(i, <, latency_histogram::c_N_BUCKETS);
+    tt_uint_op(latency_histogram::bucket_high(i - 1), <, v);
+    tt_uint_op(latency_histogram::bucket_high(i), >=, v);
+    tt_uint_op(latency_histogram::bucket_high(i) -
+               latency_histogram::bucket_high(i - 1), <=, v / 8 + 1);
+  }
+
+  // values beyond the range are clamped into the last bucket
+  tt_uint_op(latency_histogram::bucket_index((uint64_t)1 << 40), ==,
+             latency_histogram::c_N_BUCKETS - 1);
+  tt_uint_op(latency_histogram::bucket_high(latency_histogram::c_N_BUCKETS - 1),
+             ==, latency_histogram::c_MAX_VALUE);
+
+ end:;
+}
+
+static void
+test_latency_percentiles(void *)
+{
+  latency_histogram h;
+
+  tt_uint_op(h.count(), ==, 0);
+  tt_uint_op(h.value_at_percentile(50), ==, 0);
+
+  for (uint64_t v = 1; v <= 1000; v++)
+    h.record(v);
+
+  tt_uint_op(h.count(), ==, 1000);
+  tt_uint_op(h.min(), ==, 1);
+  tt_uint_op(h.max(), ==, 1000);
+  tt_assert(h.mean() > 500 && h.mean() < 501);
+
+  // reported percentiles are never below the true value and within
+  // the precision of the buckets
+  tt_uint_op(h.value_at_percentile(50), >=, 500);
+  tt_uint_op(h.value_at_percentile(50), <=, 500 + 500 / 8);
+  tt_uint_op(h.value_at_percentile(99), >=, 990);
+  tt_uint_op(h.value_at_percentile(99), <=, 1000);
+  tt_uint_op(h.value_at_percentile(100), ==, 1000);
+
+  {
+    latency_histogram other;
+    other.record(5000);
+    h.merge(other);
+    tt_uint_op(h.count(), ==, 1001);
+    tt_uint_op(h.max(), ==, 5000);
+    tt_uint_op(h.value_at_percentile(100), ==, 5000);
+  }
+
+  h.clear();
+  tt_uint_op(h.count(), ==, 0);
+  tt_uint_op(h.max(), ==, 0);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_latency_##name, 0, 0, 0 }
+
+struct testcase_t latency_tests[] = {
+  T(buckets),
+  T(percentiles),
+  END_OF_TESTCASES
+};
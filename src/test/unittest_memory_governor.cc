@@ -0,0 +1,84 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "connections.h"
+
+using std::vector;
+
+namespace {
+struct test_circuit_t : circuit_t
+{
+  bool is_idle;
+
+  test_circuit_t(size_t bytes, bool idle_circuit) : is_idle(idle_circuit)
+  {
+    memory.transmit_queue = bytes;
+  }
+
+  virtual void add_downstream(conn_t *) {}
+  virtual void drop_downstream(conn_t *) {}
+  virtual int send() { return 0; }
+  virtual int send_eof() { return 0; }
+  virtual bool idle() const { return is_idle; }
+};
+}
+
+static void
+test_memory_governor_within_budget(void *)
+{
+  test_circuit_t a(600, true), b(300, true);
+  vector<circuit_t *> candidates;
+  candidates.push_back(&a);
+  candidates.push_back(&b);
+
+  // nothing is shed under the budget or without one
+  tt_uint_op(memory_governor_pick_victims(candidates, NULL, 999, 1000).size(), ==, 0);
+  tt_uint_op(memory_governor_pick_victims(candidates, NULL, 1 << 30, 0).size(), ==, 0);
+
+ end:;
+}
+
+static void
+test_memory_governor_victims(void *)
+{
+  test_circuit_t small(100, true), large(500, true), busy(2000, false),
+    medium(300, true), spare(1000, true);
+  vector<circuit_t *> candidates, victims;
+  candidates.push_back(&small);
+  candidates.push_back(&large);
+  candidates.push_back(&busy);
+  candidates.push_back(&medium);
+  candidates.push_back(&spare);
+
+  // 1300 of 1000 in use: down to 750 takes the largest idle circuit
+  // other than the spare, 500 bytes, which is not quite enough, then
+  // the next largest one
+  victims = memory_governor_pick_victims(candidates, &spare, 1300, 1000);
+  tt_uint_op(victims.size(), ==, 2);
+  tt_ptr_op(victims[0], ==, &large);
+  tt_ptr_op(victims[1], ==, &medium);
+
+  // exactly at the budget, shedding the largest one is enough
+  victims = memory_governor_pick_victims(candidates, &spare, 1000, 1000);
+  tt_uint_op(victims.size(), ==, 1);
+  tt_ptr_op(victims[0], ==, &large);
+
+  // busy circuits are never shed, even if that leaves us over budget
+  victims = memory_governor_pick_victims(candidates, &spare, 100000, 1000);
+  tt_uint_op(victims.size(), ==, 3);
+  tt_ptr_op(victims[2], ==, &small);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_memory_governor_##name, 0, 0, 0 }
+
+struct testcase_t memory_governor_tests[] = {
+  T(within_budget),
+  T(victims),
+  END_OF_TESTCASES
+};
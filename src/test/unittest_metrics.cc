@@ -0,0 +1,134 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+
+using std::string;
+
+static bool
+has_line(const string &snapshot, const string &line)
+{
+  return ("\n" + snapshot).find("\n" + line + "\n") != string::npos;
+}
+
+static void
+test_metrics_snapshot(void *)
+{
+  string snapshot;
+  metrics_counters saved = metrics;
+
+  metrics.blocks_sent = 12345;
+  metrics.covers_served_warm = 3;
+  metrics.covers_served_fetched = 1;
+  metrics_snapshot(snapshot);
+
+  tt_assert(has_line(snapshot, "blocks_sent 12345"));
+  tt_assert(has_line(snapshot, "covers_served_warm_percent 75"));
+  // no circuits or connections before conn_global_init
+  tt_assert(has_line(snapshot, "circuits_active 0"));
+  tt_assert(has_line(snapshot, "connections_active 0"));
+
+  // no percentage of nothing
+  metrics.covers_served_warm = metrics.covers_served_fetched = 0;
+  snapshot.clear();
+  metrics_snapshot(snapshot);
+  tt_assert(snapshot.find("covers_served_warm_percent") == string::npos);
+
+ end:
+  metrics = saved;
+}
+
+static void
+test_metrics_steg(void *)
+{
+  string snapshot;
+  steg_metrics *counters = metrics_for_steg("unittest");
+
+  // looked up once, the counters stay where they are
+  tt_ptr_op(metrics_for_steg("unittest"), ==, counters);
+  tt_ptr_op(metrics_for_steg("unittest2"), !=, counters);
+  tt_ptr_op(metrics_for_steg("unittest"), ==, counters);
+
+  counters->data_bytes_sent = 42;
+  counters->cover_bytes_sent = 420;
+  metrics_snapshot(snapshot);
+  tt_assert(has_line(snapshot, "steg_data_bytes_sent{steg=\"unittest\"} 42"));
+  tt_assert(has_line(snapshot, "steg_cover_bytes_sent{steg=\"unittest\"} 420"));
+  tt_assert(has_line(snapshot, "steg_data_bytes_sent{steg=\"unittest2\"} 0"));
+
+ end:;
+}
+
+static void
+test_metrics_listener(void *)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char path[256];
+  struct event_base *base = event_base_new();
+  struct sockaddr_un sun;
+  int fd = -1;
+  string received;
+  metrics_counters saved = metrics;
+
+  xsnprintf(path, sizeof path, "%s/metrics%lu.sock",
+            tmpdir ? tmpdir : "/tmp", (unsigned long)getpid());
+  tt_assert(base);
+  tt_int_op(metrics_listener_open(base, string("unix:") + path), ==, 0);
+
+  memset(&sun, 0, sizeof sun);
+  sun.sun_family = AF_UNIX;
+  memcpy(sun.sun_path, path, strlen(path));
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  tt_assert(fd >= 0);
+  tt_int_op(connect(fd, (struct sockaddr *)&sun, sizeof sun), ==, 0);
+
+  // the snapshot is written and the connection closed from the loop
+  metrics.blocks_received = 777;
+  for (int rounds = 0; rounds < 1000; rounds++) {
+    char buf[4096];
+    event_base_loop(base, EVLOOP_NONBLOCK);
+    ssize_t got = recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+    if (got == 0)
+      break;
+    if (got > 0)
+      received.append(buf, got);
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
+      break;
+    else
+      usleep(1000);
+  }
+  tt_assert(has_line(received, "blocks_received 777"));
+
+  metrics_listener_close();
+  // the socket is gone with the listener
+  tt_int_op(access(path, F_OK), ==, -1);
+
+ end:
+  metrics = saved;
+  metrics_listener_close();
+  if (fd >= 0)
+    close(fd);
+  if (base)
+    event_base_free(base);
+}
+
+#define T(name) \
+  { #name, test_metrics_##name, 0, 0, 0 }
+
+struct testcase_t metrics_tests[] = {
+  T(snapshot),
+  T(steg),
+  T(listener),
+  END_OF_TESTCASES
+};
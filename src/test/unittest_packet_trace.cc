@@ -0,0 +1,155 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "packet_trace.h"
+
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+/* Read back the records of the trace file at PATH, checking its
+   header.  Returns false if the file is not a trace. */
+static bool
+read_trace(const char *path, vector<trace_record> &records)
+{
+  FILE *f = fopen(path, "rb");
+  trace_file_header hdr;
+  trace_record r;
+  bool ok = false;
+
+  records.clear();
+  if (!f)
+    return false;
+  if (fread(&hdr, sizeof hdr, 1, f) == 1 &&
+      !memcmp(hdr.magic, c_TRACE_MAGIC, sizeof hdr.magic) &&
+      hdr.version == c_TRACE_VERSION &&
+      hdr.record_size == sizeof(trace_record)) {
+    while (fread(&r, sizeof r, 1, f) == 1)
+      records.push_back(r);
+    ok = true;
+  }
+  fclose(f);
+  return ok;
+}
+
+static void
+trace_path(char *path, size_t len, const char *name)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  xsnprintf(path, len, "%s/%s%lu.trace",
+            tmpdir ? tmpdir : "/tmp", name, (unsigned long)getpid());
+}
+
+static void
+test_packet_trace_records(void *)
+{
+  char path[256];
+  vector<trace_record> records;
+  const uint8_t hdr[16] = { 0, 0, 1, 2, 0, 10, 0, 20, 7, 3,
+                            0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5 };
+
+  trace_path(path, sizeof path, "records");
+  packet_trace *t = packet_trace_open(path);
+  tt_assert(t);
+
+  for (unsigned int i = 0; i < 1000; i++)
+    packet_trace_block(t, TRACE_SEND, 5, 17, (size_t)-1, i,
+                       1000, 24, 2, 0);
+  packet_trace_bad_header(t, 5, 17, 0, hdr);
+  packet_trace_close(t);
+
+  // closing writes out everything in the ring
+  tt_assert(read_trace(path, records));
+  tt_uint_op(records.size(), ==, 1001);
+  for (unsigned int i = 0; i < 1000; i++) {
+    tt_uint_op(records[i].kind, ==, TRACE_SEND);
+    tt_uint_op(records[i].seqno, ==, i);
+  }
+  tt_uint_op(records[0].circuit, ==, 5);
+  tt_uint_op(records[0].window, ==, 17);
+  tt_uint_op(records[0].outq, ==, UINT32_MAX);
+  tt_uint_op(records[0].dlen, ==, 1000);
+  tt_uint_op(records[0].plen, ==, 24);
+  tt_uint_op(records[0].opcode, ==, 2);
+
+  tt_uint_op(records[1000].kind, ==, TRACE_RECV_ERROR);
+  tt_uint_op(records[1000].seqno, ==, 0x102);
+  tt_uint_op(records[1000].dlen, ==, 10);
+  tt_uint_op(records[1000].plen, ==, 20);
+  tt_uint_op(records[1000].opcode, ==, 7);
+  tt_uint_op(records[1000].rcount, ==, 3);
+  tt_mem_op(records[1000].check, ==, hdr + 10, 6);
+
+ end:
+  unlink(path);
+}
+
+static void
+test_packet_trace_shared(void *)
+{
+  char path[256], other_path[256];
+  vector<trace_record> records;
+  packet_trace *t = NULL, *t2 = NULL, *other = NULL;
+
+  trace_path(path, sizeof path, "shared");
+  trace_path(other_path, sizeof other_path, "other");
+
+  // the same path is one trace, another path another one
+  t = packet_trace_open(path);
+  t2 = packet_trace_open(path);
+  other = packet_trace_open(other_path);
+  tt_assert(t);
+  tt_ptr_op(t, ==, t2);
+  tt_assert(other);
+  tt_ptr_op(other, !=, t);
+
+  packet_trace_block(t, TRACE_SEND, 1, 0, 0, 0, 10, 0, 1, 0);
+  packet_trace_block(other, TRACE_RECV, 2, 0, 0, 0, 10, 0, 1, 0);
+
+  // the trace stays open until its last user closes it
+  packet_trace_close(t);
+  t = NULL;
+  packet_trace_block(t2, TRACE_SEND, 1, 0, 0, 1, 10, 0, 1, 0);
+  packet_trace_close(t2);
+  t2 = NULL;
+  packet_trace_close(other);
+  other = NULL;
+
+  tt_assert(read_trace(path, records));
+  tt_uint_op(records.size(), ==, 2);
+  tt_uint_op(records[1].seqno, ==, 1);
+  tt_assert(read_trace(other_path, records));
+  tt_uint_op(records.size(), ==, 1);
+  tt_uint_op(records[0].circuit, ==, 2);
+
+  // a closed path opens afresh
+  t = packet_trace_open(path);
+  tt_assert(t);
+  packet_trace_close(t);
+  t = NULL;
+  tt_assert(read_trace(path, records));
+  tt_uint_op(records.size(), ==, 0);
+
+ end:
+  packet_trace_close(t);
+  packet_trace_close(t2);
+  packet_trace_close(other);
+  unlink(path);
+  unlink(other_path);
+}
+
+#define T(name) \
+  { #name, test_packet_trace_##name, 0, 0, 0 }
+
+struct testcase_t packet_trace_tests[] = {
+  T(records),
+  T(shared),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,146 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "payload_server.h"
+#include "response_timing.h"
+
+#include <unistd.h>
+
+namespace {
+struct test_payload_server : PayloadServer
+{
+  test_payload_server() : PayloadServer(server_side) {}
+  virtual unsigned int find_client_payload(char*, int, int) { return 0; }
+  virtual int get_payload(int, int, char**, int*, double, std::string*)
+  { return 0; }
+};
+}
+
+/* Write LINES to a fresh file named after NAME; returns its path. */
+static std::string
+write_trace(const char *name, const char *lines)
+{
+  const char *tmpdir = getenv("TMPDIR");
+  char path[256];
+  xsnprintf(path, sizeof path, "%s/%s%lu.timing",
+            tmpdir ? tmpdir : "/tmp", name, (unsigned long)getpid());
+  FILE *f = fopen(path, "w");
+  if (f) {
+    fputs(lines, f);
+    fclose(f);
+  }
+  return path;
+}
+
+static void
+test_response_timing_builtin(void *)
+{
+  ResponseTiming timing;
+  tt_uint_op(timing.from_trace(), ==, false);
+
+  // the 5th percentile of the built-in html figures, and the median
+  tt_uint_op(timing.earliest(HTTP_CONTENT_HTML, 0), ==, 15);
+  tt_uint_op(timing.sample(HTTP_CONTENT_HTML, 0, 0.5), ==, 80);
+  // nothing below the earliest, nothing above the 95th percentile
+  tt_uint_op(timing.sample(HTTP_CONTENT_HTML, 0, 0.0), ==, 15);
+  tt_uint_op(timing.sample(HTTP_CONTENT_HTML, 0, 0.99), ==, 400);
+  // halfway between the 25th and the 50th percentile
+  tt_uint_op(timing.sample(HTTP_CONTENT_JPEG, 0, 0.375), ==, 18);
+
+  // bigger responses take longer to send
+  tt_uint_op(timing.earliest(HTTP_CONTENT_JPEG, 200000), ==, 5 + 100);
+
+  // unknown types are treated as html
+  tt_uint_op(timing.earliest(HTTP_CONTENT_RESERVED, 0), ==, 15);
+  tt_uint_op(timing.earliest(HTTP_CONTENT_ENCRYPTEDZIP, 0), ==, 15);
+
+  for (int i = 0; i < 1000; i++) {
+    unsigned int ms = timing.sample(HTTP_CONTENT_PDF, 0);
+    tt_uint_op(ms, >=, 10);
+    tt_uint_op(ms, <=, 300);
+  }
+
+ end:;
+}
+
+static void
+test_response_timing_trace(void *)
+{
+  ResponseTiming timing;
+
+  // small javascript responses took 1..9 ms, big ones 100..900 ms
+  for (int i = 1; i <= 9; i++) {
+    timing.add(HTTP_CONTENT_JAVASCRIPT, 1000, i);
+    timing.add(HTTP_CONTENT_JAVASCRIPT, 1000000, 100 * i);
+  }
+  // too few pdf samples for their size to count on their own
+  timing.add(HTTP_CONTENT_PDF, 5000, 40);
+  timing.add(HTTP_CONTENT_PDF, 5000, 60);
+  tt_uint_op(timing.from_trace(), ==, true);
+
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 1000, 0.5), ==, 5);
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 1000, 1.0), ==, 9);
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 1000000, 0.5), ==, 500);
+  tt_uint_op(timing.earliest(HTTP_CONTENT_JAVASCRIPT, 1000000), ==, 140);
+
+  // size not known: all the samples of the type
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 0, 0.0), ==, 1);
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 0, 1.0), ==, 900);
+  tt_uint_op(timing.sample(HTTP_CONTENT_PDF, 5000, 0.5), ==, 50);
+
+  // types missing from the trace keep the built-in figures
+  tt_uint_op(timing.earliest(HTTP_CONTENT_HTML, 0), ==, 15);
+
+ end:;
+}
+
+static void
+test_response_timing_load(void *)
+{
+  test_payload_server server;
+  ResponseTiming timing;
+  std::string good = write_trace("good",
+                                 "# name bytes ms\n"
+                                 "\n"
+                                 "a.js 1000 10\n"
+                                 "b.js 1000 30\n"
+                                 "c.unknown 1000 99\n");
+  std::string bad = write_trace("bad",
+                                "a.js 1000 500\n"
+                                "b.js 1000 700\n"
+                                "c.js 1000\n");
+
+  tt_assert(timing.load(good, &server));
+  tt_assert(timing.from_trace());
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 0, 0.5), ==, 20);
+
+  // a trace that goes wrong halfway leaves the model as it was
+  tt_assert(!timing.load(bad, &server));
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 0, 0.5), ==, 20);
+  tt_uint_op(timing.sample(HTTP_CONTENT_JAVASCRIPT, 0, 1.0), ==, 30);
+
+  {
+    ResponseTiming builtin;
+    tt_assert(!builtin.load(bad, &server));
+    tt_assert(!builtin.load(bad + ".missing", &server));
+    tt_assert(!builtin.from_trace());
+    tt_uint_op(builtin.earliest(HTTP_CONTENT_HTML, 0), ==, 15);
+  }
+
+ end:
+  unlink(good.c_str());
+  unlink(bad.c_str());
+}
+
+#define T(name) \
+  { #name, test_response_timing_##name, 0, 0, 0 }
+
+struct testcase_t response_timing_tests[] = {
+  T(builtin),
+  T(trace),
+  T(load),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,69 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "target_stats.h"
+
+using std::vector;
+
+static void
+test_target_stats_untried_first(void *)
+{
+  vector<target_stats> targets(3);
+
+  // every target is tried once before any is preferred
+  for (size_t expected = 0; expected < 3; expected++) {
+    size_t pick = target_select(targets);
+    tt_uint_op(pick, ==, expected);
+    targets[pick].connects++;
+  }
+  tt_uint_op(targets[0].selected, ==, 1);
+  tt_uint_op(targets[1].selected, ==, 1);
+  tt_uint_op(targets[2].selected, ==, 1);
+
+ end:;
+}
+
+static void
+test_target_stats_exploit(void *)
+{
+  // bytes per second each target's connections achieve; the last one
+  // never manages to connect
+  const double throughput[] = { 1000, 10000, 0 };
+  vector<target_stats> targets(3);
+
+  for (int round = 0; round < 300; round++) {
+    size_t pick = target_select(targets);
+    tt_uint_op(pick, <, 3);
+    target_stats &t = targets[pick];
+    t.connects++;
+    if (throughput[pick] == 0) {
+      t.connects--;  // failed() counts the attempt itself
+      t.failed();
+    } else {
+      t.throughput = throughput[pick];
+      t.samples++;
+    }
+  }
+
+  // the best target gets almost everything, the others are still
+  // looked at now and then
+  tt_uint_op(targets[1].selected, >, 250);
+  tt_uint_op(targets[0].selected, >, 1);
+  tt_uint_op(targets[2].selected, >, 1);
+  tt_uint_op(targets[2].selected, <, targets[0].selected);
+  tt_uint_op(targets[2].connect_failures, ==, targets[2].selected);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_target_stats_##name, 0, 0, 0 }
+
+struct testcase_t target_stats_tests[] = {
+  T(untried_first),
+  T(exploit),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,137 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "unittest.h"
+#include "timer_wheel.h"
+
+using std::vector;
+
+namespace {
+  struct fired_log {
+    timer_wheel *wheel;
+    vector<uint64_t> at;     /* tick each timer fired on */
+  };
+
+  struct test_timer {
+    wheel_timer timer;
+    fired_log *log;
+    unsigned long rearm_ms;  /* re-arm from the callback if nonzero */
+
+    test_timer(fired_log *log_)
+      : timer(fired_cb, this), log(log_), rearm_ms(0) {}
+
+    static void fired_cb(void *arg)
+    {
+      test_timer *t = static_cast<test_timer *>(arg);
+      t->log->at.push_back(t->log->wheel->now());
+      if (t->rearm_ms)
+        t->log->wheel->arm(&t->timer, t->rearm_ms);
+    }
+  };
+}
+
+static void
+test_timer_wheel_expiry(void *)
+{
+  // start away from zero so that slots wrap
+  timer_wheel wheel(1000003);
+  fired_log log;
+  log.wheel = &wheel;
+
+  // one delay for each level, plus one beyond the wheel's range
+  const unsigned long delays[] = {
+    5, 630, 641, 40950, 41000, 2621430, 2621450, 167772000,
+    1000000000
+  };
+  const size_t n = sizeof delays / sizeof delays[0];
+  vector<test_timer *> timers;
+  for (size_t i = 0; i < n; i++) {
+    timers.push_back(new test_timer(&log));
+    wheel.arm(&timers[i]->timer, delays[i]);
+  }
+  tt_uint_op(wheel.size(), ==, n);
+
+  for (size_t i = 0; i < n; i++) {
+    uint64_t due = std::min((uint64_t)(delays[i] + timer_wheel::TICK_MS - 1)
+                            / timer_wheel::TICK_MS,
+                            ((uint64_t)1 << 24) - 1);
+    tt_uint_op(wheel.advance(1000003 + due - 1), ==, 0);
+    tt_uint_op(timers[i]->timer.pending(), ==, true);
+    tt_uint_op(wheel.advance(1000003 + due), ==, 1);
+    tt_uint_op(timers[i]->timer.pending(), ==, false);
+    tt_uint_op(log.at.back(), ==, 1000003 + due);
+  }
+  tt_uint_op(wheel.size(), ==, 0);
+
+ end:
+  for (size_t i = 0; i < timers.size(); i++)
+    delete timers[i];
+}
+
+static void
+test_timer_wheel_disarm(void *)
+{
+  timer_wheel wheel(0);
+  fired_log log;
+  log.wheel = &wheel;
+  test_timer a(&log), b(&log);
+
+  wheel.arm(&a.timer, 100);
+  wheel.arm(&b.timer, 100);
+  wheel.disarm(&a.timer);
+  tt_uint_op(wheel.size(), ==, 1);
+
+  // re-arming moves the timer
+  wheel.arm(&b.timer, 50);
+  wheel.arm(&b.timer, 300);
+  tt_uint_op(wheel.size(), ==, 1);
+  tt_uint_op(wheel.advance(29), ==, 0);
+  tt_uint_op(wheel.advance(30), ==, 1);
+  tt_uint_op(log.at.size(), ==, 1);
+
+  // a destroyed timer takes itself off the wheel
+  {
+    test_timer c(&log);
+    wheel.arm(&c.timer, 10);
+    tt_uint_op(wheel.size(), ==, 1);
+  }
+  tt_uint_op(wheel.size(), ==, 0);
+  tt_uint_op(wheel.advance(100), ==, 0);
+
+ end:;
+}
+
+static void
+test_timer_wheel_rearm(void *)
+{
+  timer_wheel wheel(0);
+  fired_log log;
+  log.wheel = &wheel;
+  test_timer periodic(&log);
+  periodic.rearm_ms = 20;
+
+  wheel.arm(&periodic.timer, 20);
+  tt_uint_op(wheel.advance(100), ==, 50);
+  tt_uint_op(log.at.size(), ==, 50);
+  tt_uint_op(log.at[0], ==, 2);
+  tt_uint_op(log.at[49], ==, 100);
+  tt_uint_op(periodic.timer.pending(), ==, true);
+
+  wheel.clear();
+  tt_uint_op(periodic.timer.pending(), ==, false);
+  tt_uint_op(wheel.size(), ==, 0);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_timer_wheel_##name, 0, 0, 0 }
+
+struct testcase_t timer_wheel_tests[] = {
+  T(expiry),
+  T(disarm),
+  T(rearm),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,100 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include <string.h>
+
+#include "util.h"
+#include "unittest.h"
+#include "uri_dict.h"
+
+using std::string;
+
+static void
+test_uri_dict_find(void *)
+{
+  URIDict dict;
+  char url[32];
+
+  tt_uint_op(dict.find("a.js"), ==, URIDict::npos);
+
+  // enough to grow the table a few times
+  for (unsigned int i = 0; i < 1000; i++) {
+    xsnprintf(url, sizeof url, "dir/cover%u.html", i);
+    dict.append(url, strlen(url));
+  }
+  tt_uint_op(dict.size(), ==, 1000);
+
+  for (unsigned int i = 0; i < 1000; i += 37) {
+    xsnprintf(url, sizeof url, "dir/cover%u.html", i);
+    tt_uint_op(dict.find(url, strlen(url)), ==, i);
+    tt_assert(dict.url(i) == url);
+  }
+
+  // a prefix, or a url with more to it, is not the url
+  tt_uint_op(dict.find("dir/cover1", 10), ==, URIDict::npos);
+  tt_uint_op(dict.find("dir/cover1.html?q", 17), ==, URIDict::npos);
+  tt_uint_op(dict.find("", 0), ==, URIDict::npos);
+  tt_uint_op(dict.size(), ==, 1000);
+
+  // a duplicate takes an index but is found at its first one
+  dict.append("dir/cover7.html");
+  tt_uint_op(dict.size(), ==, 1001);
+  tt_uint_op(dict.find("dir/cover7.html"), ==, 7);
+  tt_assert(dict.url(1000) == "dir/cover7.html");
+
+  dict.clear();
+  tt_assert(dict.empty());
+  tt_uint_op(dict.find("dir/cover7.html"), ==, URIDict::npos);
+
+ end:;
+}
+
+static void
+test_uri_dict_mac(void *)
+{
+  URIDict dict, other;
+  uint8_t mac[SHA256_LEN], expected[SHA256_LEN];
+  string text("a.js\nb/c.html\n");
+
+  dict.append("a.js");
+  dict.append("b/c.html");
+  tt_assert(dict.text() == text);
+
+  // the mac is the hash of the dict as it is sent
+  dict.compute_mac(mac);
+  sha256((const uint8_t*)text.data(), text.size(), expected);
+  tt_mem_op(mac, ==, expected, SHA256_LEN);
+
+  // and it follows the urls appended after it was taken
+  dict.append("d.pdf");
+  text += "d.pdf\n";
+  dict.compute_mac(mac);
+  sha256((const uint8_t*)text.data(), text.size(), expected);
+  tt_mem_op(mac, ==, expected, SHA256_LEN);
+
+  // copies and swaps carry it along
+  other = dict;
+  dict.clear();
+  other.compute_mac(mac);
+  tt_mem_op(mac, ==, expected, SHA256_LEN);
+  dict.swap(other);
+  dict.compute_mac(mac);
+  tt_mem_op(mac, ==, expected, SHA256_LEN);
+  tt_uint_op(dict.find("d.pdf"), ==, 2);
+
+  other.compute_mac(mac);
+  sha256((const uint8_t*)"", 0, expected);
+  tt_mem_op(mac, ==, expected, SHA256_LEN);
+
+ end:;
+}
+
+#define T(name) \
+  { #name, test_uri_dict_##name, 0, 0, 0 }
+
+struct testcase_t uri_dict_tests[] = {
+  T(find),
+  T(mac),
+  END_OF_TESTCASES
+};
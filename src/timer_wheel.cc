@@ -0,0 +1,230 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#include "util.h"
+#include "latency.h"
+#include "timer_wheel.h"
+
+#include <event2/event.h>
+
+namespace {
+  struct timer_wheel_state {
+    struct event *tick;
+    bool running;
+    timer_wheel wheel;
+
+    timer_wheel_state(uint64_t now) : tick(NULL), running(false), wheel(now) {}
+  };
+}
+
+static timer_wheel_state *tws = NULL;
+
+static void
+timer_unlink(wheel_timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+  t->wheel = NULL;
+}
+
+static void
+make_empty(wheel_timer *head)
+{
+  head->next = head->prev = head;
+}
+
+wheel_timer::~wheel_timer()
+{
+  if (wheel)
+    wheel->disarm(this);
+}
+
+timer_wheel::timer_wheel(uint64_t now)
+  : current(now), count(0)
+{
+  for (unsigned int level = 0; level < LEVELS; level++)
+    for (unsigned int slot = 0; slot < SLOTS; slot++)
+      make_empty(&slots[level][slot]);
+}
+
+timer_wheel::~timer_wheel()
+{
+  clear();
+}
+
+void
+timer_wheel::insert(wheel_timer *t)
+{
+  const uint64_t range = (uint64_t)1 << (SLOT_BITS * LEVELS);
+  if (t->expires - current >= range)
+    t->expires = current + range - 1;
+
+  uint64_t delta = t->expires - current;
+  unsigned int level = 0;
+  while (level < LEVELS - 1 && delta >= (uint64_t)1 << (SLOT_BITS * (level + 1)))
+    level++;
+
+  wheel_timer *head =
+    &slots[level][(t->expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+  t->wheel = this;
+}
+
+void
+timer_wheel::arm(wheel_timer *t, unsigned long milliseconds)
+{
+  if (t->wheel)
+    t->wheel->disarm(t);
+
+  uint64_t ticks = (milliseconds + TICK_MS - 1) / TICK_MS;
+  t->expires = current + (ticks ? ticks : 1);
+  insert(t);
+  count++;
+}
+
+void
+timer_wheel::disarm(wheel_timer *t)
+{
+  log_assert(t->wheel == this);
+  timer_unlink(t);
+  count--;
+}
+
+/* Move the timers in the current slot of LEVEL down to where they
+   belong now. */
+void
+timer_wheel::cascade(unsigned int level)
+{
+  wheel_timer *head =
+    &slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+  while (head->next != head) {
+    wheel_timer *t = head->next;
+    timer_unlink(t);
+    insert(t);
+  }
+}
+
+unsigned long
+timer_wheel::advance(uint64_t now)
+{
+  unsigned long fired = 0;
+
+  while (current < now) {
+    if (count == 0) {
+      current = now;
+      break;
+    }
+    current++;
+
+    for (unsigned int level = 1; level < LEVELS; level++) {
+      if (current & (((uint64_t)1 << (SLOT_BITS * level)) - 1))
+        break;
+      cascade(level);
+    }
+
+    // Take the whole slot off the wheel first, so that callbacks
+    // re-arming timers for the same slot do not make us loop.
+    wheel_timer *head = &slots[0][current & (SLOTS - 1)];
+    if (head->next == head)
+      continue;
+    wheel_timer expiring;
+    expiring.next = head->next;
+    expiring.prev = head->prev;
+    expiring.next->prev = &expiring;
+    expiring.prev->next = &expiring;
+    make_empty(head);
+
+    while (expiring.next != &expiring) {
+      wheel_timer *t = expiring.next;
+      timer_unlink(t);
+      count--;
+      fired++;
+      t->cb(t->arg);
+    }
+  }
+  return fired;
+}
+
+void
+timer_wheel::clear()
+{
+  for (unsigned int level = 0; level < LEVELS; level++)
+    for (unsigned int slot = 0; slot < SLOTS; slot++) {
+      wheel_timer *head = &slots[level][slot];
+      while (head->next != head)
+        timer_unlink(head->next);
+    }
+  count = 0;
+}
+
+/* The process-wide wheel. */
+
+static uint64_t
+current_tick(void)
+{
+  return latency_now() / (1000 * timer_wheel::TICK_MS);
+}
+
+static void
+timer_wheel_tick_cb(evutil_socket_t, short, void *)
+{
+  tws->wheel.advance(current_tick());
+  if (tws->wheel.size() == 0 && tws->running) {
+    event_del(tws->tick);
+    tws->running = false;
+  }
+}
+
+void
+timer_wheel_start(struct event_base *base)
+{
+  if (tws)
+    return;
+
+  tws = new timer_wheel_state(current_tick());
+  tws->tick = event_new(base, -1, EV_PERSIST, timer_wheel_tick_cb, NULL);
+  if (!tws->tick)
+    log_abort("failed to create timer wheel event");
+}
+
+void
+timer_wheel_stop(void)
+{
+  if (!tws)
+    return;
+
+  event_free(tws->tick);
+  delete tws;
+  tws = NULL;
+}
+
+void
+wheel_timer_arm(wheel_timer *t, unsigned long milliseconds)
+{
+  log_assert(tws);
+
+  if (!tws->running) {
+    // nothing is armed, so this only moves the clock
+    tws->wheel.advance(current_tick());
+
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = timer_wheel::TICK_MS * 1000;
+    if (event_add(tws->tick, &tv))
+      log_abort("failed to schedule timer wheel");
+    tws->running = true;
+  }
+  tws->wheel.arm(t, milliseconds);
+}
+
+void
+wheel_timer_disarm(wheel_timer *t)
+{
+  if (t->wheel)
+    t->wheel->disarm(t);
+}
@@ -0,0 +1,99 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/* Coarse timers for circuits and connections.  Every circuit has a
+   flush and an axe timer and every chop connection a must-send timer,
+   and they are re-armed on nearly every send.  With tens of thousands
+   of circuits, giving each its own libevent timer means constant churn
+   in libevent's timer heap.  Instead they all live on one
+   hierarchical timing wheel (four levels of 64 slots, 10ms per tick,
+   so a little over 46 hours of range).  Arming and disarming is O(1),
+   and a single libevent timer drives the wheel, expiring a whole slot
+   at a time. */
+
+class timer_wheel;
+
+struct wheel_timer
+{
+  wheel_timer *next;
+  wheel_timer *prev;
+  timer_wheel *wheel;      /* NULL while not armed */
+  uint64_t expires;        /* tick */
+  void (*cb)(void *arg);
+  void *arg;
+
+  wheel_timer()
+    : next(0), prev(0), wheel(0), expires(0), cb(0), arg(0) {}
+  wheel_timer(void (*cb_)(void *), void *arg_)
+    : next(0), prev(0), wheel(0), expires(0), cb(cb_), arg(arg_) {}
+
+  /* disarms the timer */
+  ~wheel_timer();
+
+  bool pending() const { return wheel != 0; }
+
+private:
+  wheel_timer(const wheel_timer&) DELETE_METHOD;
+  wheel_timer& operator=(const wheel_timer&) DELETE_METHOD;
+};
+
+class timer_wheel
+{
+public:
+  static const unsigned int TICK_MS = 10;
+  static const unsigned int LEVELS = 4;
+  static const unsigned int SLOT_BITS = 6;
+  static const unsigned int SLOTS = 1 << SLOT_BITS;
+
+  /** A wheel whose clock reads NOW ticks. */
+  explicit timer_wheel(uint64_t now);
+  ~timer_wheel();
+
+  /** Arm T to fire MILLISECONDS from now (rounded up to whole ticks,
+      at least one).  T may already be armed. */
+  void arm(wheel_timer *t, unsigned long milliseconds);
+
+  /** Disarm T, which is armed on this wheel. */
+  void disarm(wheel_timer *t);
+
+  /** Move the clock forward to NOW ticks, firing every timer that
+      expires on the way.  Callbacks may arm and disarm any timer.
+      Returns the number of timers fired. */
+  unsigned long advance(uint64_t now);
+
+  /** Disarm every timer. */
+  void clear();
+
+  uint64_t now() const { return current; }
+  unsigned long size() const { return count; }
+
+private:
+  wheel_timer slots[LEVELS][SLOTS];   /* list heads */
+  uint64_t current;
+  unsigned long count;
+
+  void insert(wheel_timer *t);
+  void cascade(unsigned int level);
+
+  timer_wheel(const timer_wheel&) DELETE_METHOD;
+  timer_wheel& operator=(const timer_wheel&) DELETE_METHOD;
+};
+
+/* The process-wide wheel.  It is driven by one persistent libevent
+   timer on BASE, which only runs while some timer is armed. */
+void timer_wheel_start(struct event_base *base);
+void timer_wheel_stop(void);
+
+/** Arm or re-arm T on the process-wide wheel. */
+void wheel_timer_arm(wheel_timer *t, unsigned long milliseconds);
+
+/** Disarm T, if it is armed. */
+void wheel_timer_disarm(wheel_timer *t);
+
+#endif
@@ -0,0 +1,137 @@
+/* Copyright 2014 SRI International
+ * See LICENSE for other credits and copying information
+ */
+
+/* Decoder for the binary packet traces written by chop's
+   trace-packets option.  Prints them in the text format chop used to
+   print to stderr, or as CSV.
+
+   usage: trace_decode [--csv] <trace file> */
+
+#include "util.h"
+#include "crypt.h"
+#include "packet_trace.h"
+#include "protocol/chop_blk.h"
+
+#include <errno.h>
+
+using chop_blk::opname;
+
+static void ATTR_NORETURN
+usage(void)
+{
+  fprintf(stderr, "usage: trace_decode [--csv] <trace file>\n");
+  exit(1);
+}
+
+static void
+print_text(const trace_record &r)
+{
+  char fallbackbuf[4];
+
+  switch (r.kind) {
+  case TRACE_SEND:
+  case TRACE_RESEND:
+    printf("T:%.4f: ckt %u <ntp %u outq %lu>: %s %lu <d=%lu p=%lu f=%s>\n",
+           r.timestamp, r.circuit, r.window, (unsigned long)r.outq,
+           r.kind == TRACE_SEND ? "send" : "resend",
+           (unsigned long)r.seqno, (unsigned long)r.dlen,
+           (unsigned long)r.plen, opname(r.opcode, fallbackbuf));
+    break;
+
+  case TRACE_RECV:
+    printf("T:%.4f: ckt %u <ntp %u outq %lu>: "
+           "recv %lu <d=%lu p=%lu f=%s r=%u>\n",
+           r.timestamp, r.circuit, r.window, (unsigned long)r.outq,
+           (unsigned long)r.seqno, (unsigned long)r.dlen,
+           (unsigned long)r.plen, opname(r.opcode, fallbackbuf), r.rcount);
+    break;
+
+  case TRACE_RECV_ERROR:
+    printf("T:%.4f: ckt %u <ntp %u outq %lu>: recv-error "
+           "%08x <d=%04x p=%04x f=%s r=%02x "
+           "c=%02x%02x%02x%02x%02x%02x>\n",
+           r.timestamp, r.circuit, r.window, (unsigned long)r.outq,
+           r.seqno, r.dlen, r.plen, opname(r.opcode, fallbackbuf), r.rcount,
+           r.check[0], r.check[1], r.check[2],
+           r.check[3], r.check[4], r.check[5]);
+    break;
+
+  case TRACE_DROPPED:
+    printf("T:%.4f: %lu records dropped\n",
+           r.timestamp, (unsigned long)r.seqno);
+    break;
+
+  default:
+    printf("T:%.4f: unknown record kind %u\n", r.timestamp, r.kind);
+  }
+}
+
+static void
+print_csv(const trace_record &r)
+{
+  static const char *const kinds[] = {
+    "send", "resend", "recv", "recv-error", "dropped"
+  };
+  char fallbackbuf[4];
+
+  printf("%.6f,%s,%u,%u,%lu,%lu,%u,%u,%s,%u\n",
+         r.timestamp,
+         r.kind < sizeof kinds / sizeof kinds[0] ? kinds[r.kind] : "unknown",
+         r.circuit, r.window, (unsigned long)r.outq, (unsigned long)r.seqno,
+         r.dlen, r.plen, opname(r.opcode, fallbackbuf), r.rcount);
+}
+
+int
+main(int argc, char **argv)
+{
+  bool csv = false;
+  const char *path = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--csv"))
+      csv = true;
+    else if (argv[i][0] == '-' || path)
+      usage();
+    else
+      path = argv[i];
+  }
+  if (!path)
+    usage();
+
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  trace_file_header hdr;
+  if (fread(&hdr, sizeof hdr, 1, f) != 1 ||
+      memcmp(hdr.magic, c_TRACE_MAGIC, sizeof hdr.magic)) {
+    fprintf(stderr, "%s: not a stegotorus packet trace\n", path);
+    return 1;
+  }
+  if (hdr.version != c_TRACE_VERSION ||
+      hdr.record_size != sizeof(trace_record)) {
+    fprintf(stderr, "%s: unsupported trace version or byte order\n", path);
+    return 1;
+  }
+
+  if (csv)
+    printf("timestamp,kind,circuit,window,outq,seqno,dlen,plen,opcode,rcount\n");
+
+  trace_record r;
+  while (fread(&r, sizeof r, 1, f) == 1) {
+    if (csv)
+      print_csv(r);
+    else
+      print_text(r);
+  }
+
+  if (ferror(f)) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  fclose(f);
+  return 0;
+}
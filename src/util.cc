@@ -11,6 +11,12 @@
 #include "connections.h"
 #include "strncasestr.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -296,17 +302,18 @@ ascii_strlower(char *s)
    logging system, as they will recurse into the logging system and
    cause an infinite loop.  We use plain old abort(3) instead. */
 
-/* Size of maximum log entry, including newline and NULL byte. */
+/* Size of a log entry, including newline and NULL byte, that is
+   formatted on the stack; longer ones go to the heap. */
 #define MAX_LOG_ENTRY 1024
-/* String to append when a log entry doesn't fit in MAX_LOG_ENTRY. */
-#define TRUNCATED_STR "[...truncated]"
-/* strlen(TRUNCATED_STR) */
-#define TRUNCATED_STR_LEN 14
+/* Size of the ring of asynchronous log messages; a power of 2. */
+#define LOG_RING_SIZE (1 << 20)
 
 /* logging destination; NULL for no logging. */
 static FILE *log_dest;
 /* minimum logging severity */
 static int log_min_sev = LOG_SEV_INFO;
+/* what the log_* macros check; see log_update_active */
+std::atomic<int> log_active_sev(LOG_SEV_ERR + 1);
 /* whether timestamps are wanted */
 static bool log_timestamps = false;
 static struct timeval log_ts_base = { 0, 0 };
@@ -355,6 +362,176 @@ sev_is_valid(int severity)
           severity == LOG_SEV_DEBUG);
 }
 
+/* Asynchronous logging (log_start_async).  The event loop formats
+   each message and copies it into a ring buffer; a writer thread
+   writes out what is in the ring.  With a single producer and a single
+   consumer the ring needs no lock: only the producer moves 'head' and
+   only the writer moves 'tail', and each just reads the other's.  The
+   writer sleeps on 'wake' until there is something in the ring or it
+   is told to stop; the producer only takes the lock to wake it when it
+   has said it is going to sleep ('idle'), so while the writer keeps
+   up, queueing a message makes no system call.  If the ring is full,
+   messages are dropped and counted. */
+static struct log_async_state
+{
+  char *ring;                    // NULL unless asynchronous
+  std::atomic<size_t> head;      // bytes ever put in the ring
+  std::atomic<size_t> tail;      // bytes ever written out
+  std::atomic<unsigned long> dropped;
+  std::atomic<bool> idle;        // the writer is going to sleep
+  std::atomic<bool> stop;
+  std::thread::id producer;
+  std::thread writer;
+  std::mutex sleep_lock;
+  std::condition_variable wake;
+  bool stop_at_exit;
+} las;
+
+/** Helper: point log_active_sev at whatever is being logged now. */
+static void
+log_update_active()
+{
+  log_active_sev.store(log_dest ? log_min_sev : LOG_SEV_ERR + 1,
+                       std::memory_order_relaxed);
+}
+
+/** The writer thread: write out the ring until told to stop. */
+static void
+log_writer()
+{
+  for (;;) {
+    size_t tail = las.tail.load(std::memory_order_relaxed);
+    size_t head = las.head.load(std::memory_order_acquire);
+    if (head != tail) {
+      size_t off = tail & (LOG_RING_SIZE - 1);
+      size_t n = min(head - tail, (size_t)LOG_RING_SIZE - off);
+      fwrite(las.ring + off, 1, n, log_dest);
+      las.tail.store(tail + n, std::memory_order_release);
+      continue;
+    }
+
+    unsigned long dropped = las.dropped.exchange(0);
+    if (dropped)
+      fprintf(log_dest, "[warn] %lu log messages dropped\n", dropped);
+    if (las.stop.load())
+      return;
+
+    // 'idle' is set before the ring is looked at again, so a producer
+    // that filled it in between sees it and wakes us.
+    std::unique_lock<std::mutex> guard(las.sleep_lock);
+    las.idle.store(true);
+    while (!las.stop.load() && las.head.load() == las.tail.load())
+      las.wake.wait(guard);
+    las.idle.store(false);
+  }
+}
+
+/** Helper: wait until the writer thread has written out the ring.
+    Only the producer may call this. */
+static void
+log_flush_async()
+{
+  if (!las.ring)
+    return;
+  // the writer does not sleep while there is anything in the ring
+  while (las.tail.load(std::memory_order_acquire) !=
+         las.head.load(std::memory_order_relaxed))
+    std::this_thread::yield();
+}
+
+/** Helper: drain the ring and stop the writer thread.  Any thread may
+    call this (exit runs it on whichever thread exits), but the event
+    loop must not be logging any more by then. */
+static void
+log_stop_async()
+{
+  if (!las.ring)
+    return;
+  {
+    std::lock_guard<std::mutex> guard(las.sleep_lock);
+    las.stop.store(true);
+    las.wake.notify_one();
+  }
+  las.writer.join();
+  free(las.ring);
+  las.ring = NULL;
+}
+
+int
+log_start_async()
+{
+  if (las.ring || !log_dest)
+    return 0;
+
+  las.ring = (char *)xmalloc(LOG_RING_SIZE);
+  las.head.store(0);
+  las.tail.store(0);
+  las.dropped.store(0);
+  las.stop.store(false);
+  las.producer = std::this_thread::get_id();
+  try {
+    las.writer = std::thread(log_writer);
+  } catch (const std::system_error &) {
+    free(las.ring);
+    las.ring = NULL;
+    return -1;
+  }
+
+  // The writer thread must be gone before 'las' is destroyed.
+  if (!las.stop_at_exit) {
+    las.stop_at_exit = true;
+    atexit(log_stop_async);
+  }
+  return 0;
+}
+
+void
+log_flush_from_signal()
+{
+  if (!las.ring || !log_dest)
+    return;
+  size_t tail = las.tail.load();
+  size_t head = las.head.load();
+  while (head != tail) {
+    size_t off = tail & (LOG_RING_SIZE - 1);
+    size_t n = min(head - tail, (size_t)LOG_RING_SIZE - off);
+    if (write(fileno(log_dest), las.ring + off, n) <= 0)
+      return;
+    tail += n;
+  }
+}
+
+/** Helper: write out the log message BUF of LEN bytes, or queue it
+    for the writer thread.  Fatal errors are written out at once,
+    after everything before them. */
+static void
+log_emit(int severity, const char *buf, size_t len)
+{
+  if (las.ring && std::this_thread::get_id() == las.producer) {
+    if (severity == LOG_SEV_ERR) {
+      log_flush_async();
+    } else {
+      size_t head = las.head.load(std::memory_order_relaxed);
+      size_t tail = las.tail.load(std::memory_order_acquire);
+      if (LOG_RING_SIZE - (head - tail) < len) {
+        las.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      size_t off = head & (LOG_RING_SIZE - 1);
+      size_t first = min(len, (size_t)LOG_RING_SIZE - off);
+      memcpy(las.ring + off, buf, first);
+      memcpy(las.ring, buf + first, len - first);
+      las.head.store(head + len);
+      if (las.idle.load()) {
+        std::lock_guard<std::mutex> guard(las.sleep_lock);
+        las.wake.notify_one();
+      }
+      return;
+    }
+  }
+  fwrite(buf, 1, len, log_dest);
+}
+
 /**
    Helper: Opens 'filename' and sets it as the logfile.
    On success it returns 0, on fail it returns -1.
@@ -382,6 +559,7 @@ log_open(const char *filename)
 void
 log_close()
 {
+  log_stop_async();
   if (log_dest && log_dest != stderr)
     fclose(log_dest);
 }
@@ -396,22 +574,26 @@ log_set_method(int method, const char *filename)
 {
   log_close();
 
+  int rv = 0;
   switch (method) {
   case LOG_METHOD_NULL:
     log_dest = NULL;
-    return 0;
+    break;
 
   case LOG_METHOD_STDERR:
     setvbuf(stderr, 0, _IONBF, 0);
     log_dest = stderr;
-    return 0;
+    break;
 
   case LOG_METHOD_FILE:
-    return log_open(filename);
+    rv = log_open(filename);
+    break;
 
   default:
     abort();
   }
+  log_update_active();
+  return rv;
 }
 
 /**
@@ -427,6 +609,7 @@ log_set_min_severity(const char* sev_string)
     return -1;
   }
   log_min_sev = severity;
+  log_update_active();
   return 0;
 }
 
@@ -466,80 +649,111 @@ double log_get_abs_timestamp(){
   return now.tv_sec + double(now.tv_usec) / 1e6;
 }
 
-/** True if the minimum log severity is "debug".  Used in a few places
-    to avoid some expensive formatting work if we are going to ignore the
-    result. */
-int
-log_do_debug()
-{
-  return log_min_sev == LOG_SEV_DEBUG;
-}
-
 /**
-    Logging worker function.  Accepts a logging 'severity' and a
-    'format' string and logs the message in 'format' according to the
-    configured minimum logging severity and logging method.  */
+    Logging worker function.  Accepts a logging 'severity', the
+    message prefix in BUF (N bytes, from logpfx) and a 'format' string,
+    and logs the message in 'format' after the prefix, all in one
+    write.  */
 static void
-logv(int severity, const char *format, va_list ap) ATTR_VPRINTF_2;
+logv(int severity, char *buf, size_t n, const char *format, va_list ap)
+  ATTR_VPRINTF_4;
 static void
-logv(int severity, const char *format, va_list ap)
+logv(int severity, char *buf, size_t n, const char *format, va_list ap)
 {
-  if (!sev_is_valid(severity))
-    abort();
-
-  /* See if the user is interested in this log message. */
-  if (!log_dest || severity < log_min_sev)
+  va_list ap2;
+  va_copy(ap2, ap);
+  int len = vsnprintf(buf + n, MAX_LOG_ENTRY - n - 1, format, ap);
+  if (len < 0) {
+    va_end(ap2);
     return;
+  }
+
+  if (n + len + 1 < MAX_LOG_ENTRY) {
+    n += len;
+    buf[n++] = '\n';
+    log_emit(severity, buf, n);
+  } else {
+    char *big = (char *)xmalloc(n + len + 2);
+    memcpy(big, buf, n);
+    vsnprintf(big + n, len + 1, format, ap2);
+    n += len;
+    big[n++] = '\n';
+    log_emit(severity, big, n);
+    free(big);
+  }
+  va_end(ap2);
+}
 
-  vfprintf(log_dest, format, ap);
-  putc('\n', log_dest);
+/** Helper: append to the message in BUF, N bytes so far, and return
+    its new length. */
+static size_t
+logcat(char *buf, size_t n, const char *format, ...) ATTR_PRINTF_3;
+static size_t
+logcat(char *buf, size_t n, const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  int len = vsnprintf(buf + n, MAX_LOG_ENTRY - n, format, ap);
+  va_end(ap);
+  if (len < 0)
+    return n;
+  return min(n + len, (size_t)MAX_LOG_ENTRY - 1);
 }
 
-static bool
-logpfx(int severity, const char *fn)
+/** Helper: put the prefix of a message of 'severity' in BUF, and
+    return its length; or 0 if the message is not to be logged. */
+static size_t
+logpfx(char *buf, int severity, const char *fn)
 {
   if (!sev_is_valid(severity))
     abort();
 
   /* See if the user is interested in this log message. */
   if (!log_dest || severity < log_min_sev)
-    return false;
+    return 0;
 
+  size_t n = 0;
   if (log_timestamps)
-    fprintf(log_dest, "%.4f ", log_get_timestamp());
+    n = logcat(buf, n, "%.4f ", log_get_timestamp());
 
-  fprintf(log_dest, "[%s] ", sev_to_string(severity));
+  n = logcat(buf, n, "[%s] ", sev_to_string(severity));
   if (log_min_sev == LOG_SEV_DEBUG && fn)
-    fprintf(log_dest, "%s: ", fn);
-  return true;
+    n = logcat(buf, n, "%s: ", fn);
+  return n;
 }
 
-static void
-logpfx(int severity, const char *fn, circuit_t *ckt)
+static size_t
+logpfx(char *buf, int severity, const char *fn, circuit_t *ckt)
 {
-  if (logpfx(severity, fn))
-    if (ckt)
-      fprintf(log_dest, "<%u> ", ckt->serial);
+  size_t n = logpfx(buf, severity, fn);
+  if (n && ckt)
+    n = logcat(buf, n, "<%u> ", ckt->serial);
+  return n;
 }
 
-static void
-logpfx(int severity, const char *fn, conn_t *conn)
+static size_t
+logpfx(char *buf, int severity, const char *fn, conn_t *conn)
 {
-  if (logpfx(severity, fn))
-    if (conn) {
-      circuit_t *ckt = conn->circuit();
-      unsigned int ckt_serial = ckt ? ckt->serial : 0;
-      fprintf(log_dest, "<%u.%u> ", ckt_serial, conn->serial);
-    }
+  size_t n = logpfx(buf, severity, fn);
+  if (n && conn) {
+    circuit_t *ckt = conn->circuit();
+    unsigned int ckt_serial = ckt ? ckt->serial : 0;
+    n = logcat(buf, n, "<%u.%u> ", ckt_serial, conn->serial);
+  }
+  return n;
 }
 
 /**** Public logging API. ****/
 
-#define logfmt(sev_, fmt_) do {                 \
-    va_list ap_;                                \
-    va_start(ap_, fmt_);                        \
-    logv(sev_, fmt_, ap_);                      \
-    va_end(ap_);                                \
+#define logfmt(sev_, ...) do {                  \
+    char buf_[MAX_LOG_ENTRY];                   \
+    size_t n_ = logpfx(buf_, sev_, __VA_ARGS__); \
+    if (n_) {                                   \
+      va_list ap_;                              \
+      va_start(ap_, format);                    \
+      logv(sev_, buf_, n_, format, ap_);        \
+      va_end(ap_);                              \
+    }                                           \
   } while (0)
 
 #if __GNUC__ >= 3
@@ -553,88 +767,76 @@ logpfx(int severity, const char *fn, conn_t *conn)
 void
 (log_abort)(FNARG const char *format, ...)
 {
-  logpfx(LOG_SEV_ERR, FN);
-  logfmt(LOG_SEV_ERR, format);
+  logfmt(LOG_SEV_ERR, FN);
   exit(1);
 }
 
 void
 (log_abort)(FNARG circuit_t *ckt, const char *format, ...)
 {
-  logpfx(LOG_SEV_ERR, FN, ckt);
-  logfmt(LOG_SEV_ERR, format);
+  logfmt(LOG_SEV_ERR, FN, ckt);
   exit(1);
 }
 
 void
 (log_abort)(FNARG conn_t *conn, const char *format, ...)
 {
-  logpfx(LOG_SEV_ERR, FN, conn);
-  logfmt(LOG_SEV_ERR, format);
+  logfmt(LOG_SEV_ERR, FN, conn);
   exit(1);
 }
 
 void
 (log_warn)(FNARG const char *format, ...)
 {
-  logpfx(LOG_SEV_WARN, FN);
-  logfmt(LOG_SEV_WARN, format);
+  logfmt(LOG_SEV_WARN, FN);
 }
 
 void
 (log_warn)(FNARG circuit_t *ckt, const char *format, ...)
 {
-  logpfx(LOG_SEV_WARN, FN, ckt);
-  logfmt(LOG_SEV_WARN, format);
+  logfmt(LOG_SEV_WARN, FN, ckt);
 }
 
 void
 (log_warn)(FNARG conn_t *cn, const char *format, ...)
 {
-  logpfx(LOG_SEV_WARN, FN, cn);
-  logfmt(LOG_SEV_WARN, format);
+  logfmt(LOG_SEV_WARN, FN, cn);
 }
 
 void
 (log_info)(FNARG const char *format, ...)
 {
-  logpfx(LOG_SEV_INFO, FN);
-  logfmt(LOG_SEV_INFO, format);
+  logfmt(LOG_SEV_INFO, FN);
 }
 
 void
 (log_info)(FNARG circuit_t *ckt, const char *format, ...)
 {
-  logpfx(LOG_SEV_INFO, FN, ckt);
-  logfmt(LOG_SEV_INFO, format);
+  logfmt(LOG_SEV_INFO, FN, ckt);
 }
 
 void
 (log_info)(FNARG conn_t *cn, const char *format, ...)
 {
-  logpfx(LOG_SEV_INFO, FN, cn);
-  logfmt(LOG_SEV_INFO, format);
+  logfmt(LOG_SEV_INFO, FN, cn);
 }
 
 void
 (log_debug)(FNARG const char *format, ...)
 {
-  logpfx(LOG_SEV_DEBUG, FN);
-  logfmt(LOG_SEV_DEBUG, format);
+  logfmt(LOG_SEV_DEBUG, FN);
 }
 
 void
 (log_debug)(FNARG circuit_t *ckt, const char *format, ...)
 {
-  logpfx(LOG_SEV_DEBUG, FN, ckt);
-  logfmt(LOG_SEV_DEBUG, format);
+  logfmt(LOG_SEV_DEBUG, FN, ckt);
 }
 
 void
 (log_debug)(FNARG conn_t *cn, const char *format, ...)
 {
-  logpfx(LOG_SEV_DEBUG, FN, cn);
-  logfmt(LOG_SEV_DEBUG, format);
+  logfmt(LOG_SEV_DEBUG, FN, cn);
 }
 
 void  buf2hex(uint8_t* buf, size_t len, std::string& res)
@@ -29,6 +29,7 @@
 #include <assert.h>
 #include <inttypes.h>
 
+#include <atomic>
 #include <map>
 #include <vector>
 #include <string>
@@ -78,6 +79,7 @@ struct event_base;
 #define ATTR_VPRINTF_1 __attribute__((format(printf, 1, 0)))
 #define ATTR_VPRINTF_2 __attribute__((format(printf, 2, 0)))
 #define ATTR_VPRINTF_3 __attribute__((format(printf, 3, 0)))
+#define ATTR_VPRINTF_4 __attribute__((format(printf, 4, 0)))
 #define ATTR_PURE     __attribute__((pure))
 
 
@@ -239,10 +241,37 @@ double log_get_timestamp();
     You DO NOT have to call log_enable_timestamps to use this.  */
 double log_get_abs_timestamp();
 
+/** Messages below this severity are compiled out (configure
+    --with-log-floor). */
+#ifndef LOG_MIN_BUILD_SEVERITY
+#define LOG_MIN_BUILD_SEVERITY LOG_SEV_DEBUG
+#endif
+
+/** Messages below this severity are skipped at run time, before their
+    arguments are evaluated: the minimum severity, or above all of them
+    if there is nowhere to log to. */
+extern std::atomic<int> log_active_sev;
+
+#define log_enabled(sev_) \
+  ((sev_) >= LOG_MIN_BUILD_SEVERITY && \
+   (sev_) >= log_active_sev.load(std::memory_order_relaxed))
+
 /** True if debug messages are being logged. Guard expensive debugging
     checks with this, to avoid doing useless work when the messages are
     just going to be thrown away anyway. */
-int log_do_debug(void);
+inline int log_do_debug(void) { return log_enabled(LOG_SEV_DEBUG); }
+
+/** From now on, hand the log messages of the calling thread (the
+    event loop) to a background thread to write out, so that logging
+    never waits on the log file.  Messages of other threads, and
+    log_abort's, are still written directly.  Returns 0 on success,
+    -1 on failure. */
+int log_start_async(void);
+
+/** Write out the log messages still waiting for the background
+    thread.  Only for the handlers of fatal signals: it is
+    async-signal-safe, and messages may come out twice. */
+void log_flush_from_signal(void);
 
 /** Close the logfile if it's open.  Ignores errors. */
 void log_close(void);
@@ -292,10 +321,15 @@ void log_debug(const char *fn, circuit_t *ckt, const char *format, ...)
 void log_debug(const char *fn, conn_t *conn, const char *format, ...)
   ATTR_PRINTF_3 ATTR_NOTHROW;
 
+#define log_if_enabled_(sev_, fn_, ...) do {        \
+    if (log_enabled(sev_))                          \
+      fn_(__func__, __VA_ARGS__);                   \
+  } while (0)
+
 #define log_abort(...)     log_abort(__func__, __VA_ARGS__)
-#define log_warn(...)      log_warn(__func__, __VA_ARGS__)
-#define log_info(...)      log_info(__func__, __VA_ARGS__)
-#define log_debug(...)     log_debug(__func__, __VA_ARGS__)
+#define log_warn(...)      log_if_enabled_(LOG_SEV_WARN, log_warn, __VA_ARGS__)
+#define log_info(...)      log_if_enabled_(LOG_SEV_INFO, log_info, __VA_ARGS__)
+#define log_debug(...)     log_if_enabled_(LOG_SEV_DEBUG, log_debug, __VA_ARGS__)
 
 #else
 /** Fatal errors: the program cannot continue and will exit. */